@@ -0,0 +1,172 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace hv::bench {
+
+struct benchmark {
+  char const* name;
+  benchmark_function function;
+};
+
+// benchmarks are registered by static initializers, so the list can't
+// depend on anything that needs to be constructed itself
+static constexpr size_t max_benchmarks = 256;
+static benchmark benchmarks[max_benchmarks];
+static size_t benchmark_count = 0;
+
+static uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+registration::registration(char const* const name, benchmark_function const function) {
+  if (benchmark_count < max_benchmarks)
+    benchmarks[benchmark_count++] = { name, function };
+}
+
+state::state(uint64_t const iterations)
+  : iterations_(iterations), remaining_(iterations) {}
+
+bool state::keep_running() {
+  if (!started_) {
+    started_ = true;
+    start();
+  }
+
+  if (remaining_ > 0) {
+    --remaining_;
+    return true;
+  }
+
+  stop();
+  return false;
+}
+
+void state::pause_timing() {
+  stop();
+}
+
+void state::resume_timing() {
+  start();
+}
+
+void state::set_counter(char const* const name, double const value) {
+  for (size_t i = 0; i < counter_count_; ++i) {
+    if (strcmp(counters_[i].name, name) == 0) {
+      counters_[i].value = value;
+      return;
+    }
+  }
+
+  if (counter_count_ < max_counters)
+    counters_[counter_count_++] = { name, value };
+}
+
+void state::start() {
+  start_ns_  = now_ns();
+  start_tsc_ = rdtsc();
+}
+
+void state::stop() {
+  elapsed_tsc_ += rdtsc() - start_tsc_;
+  elapsed_ns_  += now_ns() - start_ns_;
+}
+
+// run a benchmark with more and more iterations until it takes long enough
+static state run_benchmark(benchmark const& b, uint64_t const min_time_ns) {
+  uint64_t iterations = 1;
+
+  while (true) {
+    state s(iterations);
+    b.function(s);
+
+    if (s.elapsed_ns() >= min_time_ns || iterations >= (1ull << 40))
+      return s;
+
+    // aim for 1.5x the minimum time, but never grow more than 10x at once
+    auto const elapsed = s.elapsed_ns() ? s.elapsed_ns() : 1;
+    auto next = iterations * min_time_ns * 3 / 2 / elapsed;
+
+    if (next > iterations * 10)
+      next = iterations * 10;
+    if (next <= iterations)
+      next = iterations + 1;
+
+    iterations = next;
+  }
+}
+
+static void print_usage(char const* const name) {
+  printf("usage: %s [--filter=<substring>] [--min-time=<ms>] [--csv]\n", name);
+}
+
+} // namespace hv::bench
+
+using namespace hv::bench;
+
+int main(int const argc, char** const argv) {
+  char const* filter = nullptr;
+  uint64_t min_time_ms = 200;
+  bool csv = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--filter=", 9) == 0)
+      filter = argv[i] + 9;
+    else if (strncmp(argv[i], "--min-time=", 11) == 0)
+      min_time_ms = strtoull(argv[i] + 11, nullptr, 10);
+    else if (strcmp(argv[i], "--csv") == 0)
+      csv = true;
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (csv)
+    printf("name,iterations,ns_per_iter,tsc_per_iter,items_per_second,counters\n");
+  else {
+    printf("%-40s %14s %12s %12s %14s\n",
+      "benchmark", "iterations", "ns/iter", "tsc/iter", "items/s");
+  }
+
+  for (size_t i = 0; i < benchmark_count; ++i) {
+    auto const& b = benchmarks[i];
+
+    if (filter && !strstr(b.name, filter))
+      continue;
+
+    auto const s = run_benchmark(b, min_time_ms * 1'000'000);
+
+    auto const ns_per_iter  = static_cast<double>(s.elapsed_ns()) / s.iterations();
+    auto const tsc_per_iter = static_cast<double>(s.elapsed_tsc()) / s.iterations();
+    auto const items_per_s  = (s.items_per_iteration() && s.elapsed_ns()) ?
+      s.items_per_iteration() * s.iterations() * 1e9 / s.elapsed_ns() : 0.0;
+
+    if (csv) {
+      printf("%s,%llu,%.2f,%.2f,%.0f,", b.name,
+        static_cast<unsigned long long>(s.iterations()),
+        ns_per_iter, tsc_per_iter, items_per_s);
+    }
+    else {
+      printf("%-40s %14llu %12.2f %12.2f %14.0f", b.name,
+        static_cast<unsigned long long>(s.iterations()),
+        ns_per_iter, tsc_per_iter, items_per_s);
+    }
+
+    // counters are separated by semicolons in the CSV output
+    for (size_t j = 0; j < s.counter_count(); ++j) {
+      auto const& c = s.get_counter(j);
+      auto const separator = csv ? (j ? ";" : "") : "  ";
+      printf("%s%s=%.2f", separator, c.name, c.value);
+    }
+
+    printf("\n");
+  }
+
+  return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a minimal benchmark harness that is loosely modeled after Google Benchmark:
+//
+//   static void bm_something(hv::bench::state& state) {
+//     setup();
+//     while (state.keep_running())
+//       hv::bench::do_not_optimize(something());
+//   }
+//   HV_BENCHMARK(bm_something);
+//
+// every benchmark is run with an increasing number of iterations until it
+// takes at least --min-time milliseconds, and the time per iteration is
+// reported in nanoseconds and in TSC ticks.
+
+namespace hv::bench {
+
+// number of custom counters that a single benchmark can report
+inline constexpr size_t max_counters = 4;
+
+struct counter {
+  char const* name;
+  double value;
+};
+
+class state {
+public:
+  explicit state(uint64_t iterations);
+
+  // returns false once the requested number of iterations have been run
+  bool keep_running();
+
+  // exclude setup work inside of the benchmark loop from the measurement
+  void pause_timing();
+  void resume_timing();
+
+  // number of items that are processed in a single iteration (reported as
+  // items per second, if set)
+  void set_items_per_iteration(uint64_t items) { items_per_iteration_ = items; }
+
+  // report an extra value next to the timing (e.g. VMCS accesses per
+  // iteration). setting a counter that already exists overwrites it.
+  void set_counter(char const* name, double value);
+
+  uint64_t iterations() const { return iterations_; }
+  uint64_t elapsed_ns() const { return elapsed_ns_; }
+  uint64_t elapsed_tsc() const { return elapsed_tsc_; }
+  uint64_t items_per_iteration() const { return items_per_iteration_; }
+  size_t counter_count() const { return counter_count_; }
+  counter const& get_counter(size_t i) const { return counters_[i]; }
+
+private:
+  void start();
+  void stop();
+
+  uint64_t iterations_;
+  uint64_t remaining_;
+  bool started_ = false;
+
+  uint64_t start_ns_ = 0, start_tsc_ = 0;
+  uint64_t elapsed_ns_ = 0, elapsed_tsc_ = 0;
+  uint64_t items_per_iteration_ = 0;
+
+  counter counters_[max_counters] = {};
+  size_t counter_count_ = 0;
+};
+
+using benchmark_function = void(*)(state&);
+
+// adds a benchmark to the global list (used by HV_BENCHMARK)
+struct registration {
+  registration(char const* name, benchmark_function function);
+};
+
+// prevent the compiler from optimizing away a value
+template <typename T>
+inline void do_not_optimize(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// prevent the compiler from caching memory across this point
+inline void clobber_memory() {
+  asm volatile("" : : : "memory");
+}
+
+// read the timestamp counter
+inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+} // namespace hv::bench
+
+#define HV_BENCHMARK_CONCAT_IMPL(a, b) a##b
+#define HV_BENCHMARK_CONCAT(a, b) HV_BENCHMARK_CONCAT_IMPL(a, b)
+
+#define HV_BENCHMARK(function)                         \
+  static ::hv::bench::registration HV_BENCHMARK_CONCAT( \
+    function##_registration_, __LINE__)(#function, function)
@@ -0,0 +1,406 @@
+#include "bench.h"
+
+#include "../hv/cr-validation.h"
+#include "../hv/ept.h"
+#include "../hv/mm.h"
+#include "../hv/mtrr.h"
+#include "../hv/page-tables.h"
+#include "../hv/segment.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// benchmarks for the portable core: MTRR typing, guest page walks on
+// synthetic page tables, EPT splitting and EPT hook lookup
+
+using namespace hv;
+using namespace hv::bench;
+
+// size of the simulated physical memory image
+static constexpr size_t physical_memory_size = 64 * 0x100000;
+
+// write a typical set of MTRRs: WB by default, with a few UC holes and a WC
+// framebuffer (similar to what firmware sets up on a desktop machine)
+static void setup_simulated_mtrrs() {
+  static constexpr struct {
+    uint64_t base;
+    uint64_t size;
+    uint8_t type;
+  } ranges[] = {
+    { 0x0000'0000, 0x8000'0000, MEMORY_TYPE_WRITE_BACK      },
+    { 0x8000'0000, 0x4000'0000, MEMORY_TYPE_WRITE_BACK      },
+    { 0xC000'0000, 0x4000'0000, MEMORY_TYPE_UNCACHEABLE     },
+    { 0xA000'0000, 0x1000'0000, MEMORY_TYPE_WRITE_COMBINING },
+    { 0x0FE0'0000, 0x0020'0000, MEMORY_TYPE_UNCACHEABLE     },
+    { 0x1000'0000, 0x0400'0000, MEMORY_TYPE_WRITE_THROUGH   },
+  };
+
+  static constexpr size_t range_count = sizeof(ranges) / sizeof(ranges[0]);
+
+  ia32_mtrr_capabilities_register cap;
+  cap.flags                 = 0;
+  cap.variable_range_count  = 10;
+  cap.fixed_range_supported = 1;
+  set_simulated_msr(IA32_MTRR_CAPABILITIES, cap.flags);
+
+  ia32_mtrr_def_type_register def_type;
+  def_type.flags                   = 0;
+  def_type.default_memory_type     = MEMORY_TYPE_UNCACHEABLE;
+  def_type.fixed_range_mtrr_enable = 1;
+  def_type.mtrr_enable             = 1;
+  set_simulated_msr(IA32_MTRR_DEF_TYPE, def_type.flags);
+
+  for (uint32_t i = 0; i < cap.variable_range_count; ++i) {
+    ia32_mtrr_physbase_register base;
+    ia32_mtrr_physmask_register mask;
+    base.flags = 0;
+    mask.flags = 0;
+
+    if (i < range_count) {
+      // 36-bit physical addresses
+      base.type              = ranges[i].type;
+      base.page_frame_number = ranges[i].base >> 12;
+      mask.valid             = 1;
+      mask.page_frame_number = (~(ranges[i].size - 1) & 0xF'FFFF'FFFF) >> 12;
+    }
+
+    set_simulated_msr(IA32_MTRR_PHYSBASE0 + i * 2, base.flags);
+    set_simulated_msr(IA32_MTRR_PHYSMASK0 + i * 2, mask.flags);
+  }
+}
+
+// the physical address of an address inside of the physical memory image
+static uint64_t physical_address(void* const address) {
+  return MmGetPhysicalAddress(address).QuadPart;
+}
+
+static void bm_calc_mtrr_mem_type_4kb(state& s) {
+  auto const mtrrs = read_mtrr_data();
+
+  uint64_t address = 0;
+  while (s.keep_running()) {
+    do_not_optimize(calc_mtrr_mem_type(mtrrs, address, 0x1000));
+    address = (address + 0x1000) & 0xFFFF'FFFF;
+  }
+}
+HV_BENCHMARK(bm_calc_mtrr_mem_type_4kb);
+
+static void bm_calc_mtrr_mem_type_2mb(state& s) {
+  auto const mtrrs = read_mtrr_data();
+
+  uint64_t address = 0;
+  while (s.keep_running()) {
+    do_not_optimize(calc_mtrr_mem_type(mtrrs, address, 0x200000));
+    address = (address + 0x200000) & 0xFFFF'FFFF;
+  }
+}
+HV_BENCHMARK(bm_calc_mtrr_mem_type_2mb);
+
+// (re)initialize the EPT paging structures, which are allocated inside of
+// the image once (benchmarks are run several times)
+static vcpu_ept_data* create_ept() {
+  static vcpu_ept_data* ept = nullptr;
+
+  if (!ept) {
+    ept = static_cast<vcpu_ept_data*>(
+      allocate_physical_pages((sizeof(vcpu_ept_data) + 0xFFF) / 0x1000));
+
+    if (!ept) {
+      fprintf(stderr, "physical memory image is too small\n");
+      exit(1);
+    }
+  }
+
+  prepare_ept(*ept);
+  return ept;
+}
+
+static void bm_prepare_ept(state& s) {
+  auto const ept = create_ept();
+
+  s.set_items_per_iteration(ept_pd_count * 512);
+  while (s.keep_running())
+    prepare_ept(*ept);
+}
+HV_BENCHMARK(bm_prepare_ept);
+
+static void bm_update_ept_memory_type(state& s) {
+  auto const ept = create_ept();
+
+  s.set_items_per_iteration(ept_pd_count * 512);
+  while (s.keep_running()) {
+    update_ept_memory_type(*ept);
+    clobber_memory();
+  }
+}
+HV_BENCHMARK(bm_update_ept_memory_type);
+
+static void bm_split_ept_pde(state& s) {
+  auto const ept = create_ept();
+
+  // the PDEs that are split in every iteration, so that they can be restored
+  ept_pde_2mb original[ept_free_page_count];
+  for (size_t i = 0; i < ept_free_page_count; ++i)
+    original[i] = ept->pds_2mb[0][i];
+
+  s.set_items_per_iteration(ept_free_page_count);
+  while (s.keep_running()) {
+    for (size_t i = 0; i < ept_free_page_count; ++i)
+      split_ept_pde(*ept, &ept->pds_2mb[0][i]);
+
+    s.pause_timing();
+    for (size_t i = 0; i < ept_free_page_count; ++i)
+      ept->pds_2mb[0][i] = original[i];
+    ept->num_used_free_pages = 0;
+    s.resume_timing();
+  }
+}
+HV_BENCHMARK(bm_split_ept_pde);
+
+static void bm_get_ept_pte(state& s) {
+  auto const ept = create_ept();
+
+  // every PTE in the first 2MB
+  get_ept_pte(*ept, 0, true);
+
+  uint64_t address = 0;
+  while (s.keep_running()) {
+    do_not_optimize(get_ept_pte(*ept, address));
+    address = (address + 0x1000) & 0x1F'FFFF;
+  }
+}
+HV_BENCHMARK(bm_get_ept_pte);
+
+// install every available EPT hook in the first 2MB of physical memory
+static vcpu_ept_data* create_hooked_ept() {
+  auto const ept = create_ept();
+
+  for (uint64_t pfn = 0; pfn < vcpu_ept_hooks::capacity; ++pfn)
+    install_ept_hook(*ept, pfn, 0x200 + pfn);
+
+  return ept;
+}
+
+static void bm_find_ept_hook_hit(state& s) {
+  auto const ept = create_hooked_ept();
+
+  uint64_t pfn = 0;
+  while (s.keep_running()) {
+    do_not_optimize(find_ept_hook(*ept, pfn));
+    pfn = (pfn + 1) % vcpu_ept_hooks::capacity;
+  }
+}
+HV_BENCHMARK(bm_find_ept_hook_hit);
+
+static void bm_find_ept_hook_miss(state& s) {
+  auto const ept = create_hooked_ept();
+
+  while (s.keep_running())
+    do_not_optimize(find_ept_hook(*ept, 0x1000));
+}
+HV_BENCHMARK(bm_find_ept_hook_miss);
+
+static void bm_install_remove_ept_hook(state& s) {
+  auto const ept = create_ept();
+
+  // keep half of the hooks installed so that removal has to search
+  for (uint64_t pfn = 0; pfn < vcpu_ept_hooks::capacity / 2; ++pfn)
+    install_ept_hook(*ept, pfn, 0x200 + pfn);
+
+  while (s.keep_running()) {
+    install_ept_hook(*ept, 0x100, 0x300);
+    remove_ept_hook(*ept, 0x100);
+  }
+}
+HV_BENCHMARK(bm_install_remove_ept_hook);
+
+// guest virtual addresses that are mapped by build_guest_page_tables()
+static constexpr uint64_t gva_1gb = 0x0000'0000'1234'5678;
+static constexpr uint64_t gva_2mb = 0x0000'0000'4001'2345;
+static constexpr uint64_t gva_4kb = 0x0000'0000'4020'5678;
+
+// build a 4-level guest address space with a 1GB, a 2MB and 512 4KB pages:
+//   [0,          1GB)       -> 1GB page at physical address 0
+//   [1GB,        1GB + 2MB) -> 2MB page at physical address 0
+//   [1GB + 2MB,  1GB + 4MB) -> 4KB pages at physical address 0
+static cr3 build_guest_page_tables() {
+  static cr3 guest_cr3 = {};
+
+  // the page tables only need to be built once
+  if (guest_cr3.flags)
+    return guest_cr3;
+
+  auto const pml4 = static_cast<pml4e_64*>(allocate_physical_pages(1));
+  auto const pdpt = static_cast<pdpte_64*>(allocate_physical_pages(1));
+  auto const pd   = static_cast<pde_64*>(allocate_physical_pages(1));
+  auto const pt   = static_cast<pte_64*>(allocate_physical_pages(1));
+
+  pml4[0].present           = 1;
+  pml4[0].write             = 1;
+  pml4[0].page_frame_number = physical_address(pdpt) >> 12;
+
+  pdpte_1gb_64 pdpte_1gb;
+  pdpte_1gb.flags             = 0;
+  pdpte_1gb.present           = 1;
+  pdpte_1gb.write             = 1;
+  pdpte_1gb.large_page        = 1;
+  pdpte_1gb.page_frame_number = 0;
+  pdpt[0].flags = pdpte_1gb.flags;
+
+  pdpt[1].present           = 1;
+  pdpt[1].write             = 1;
+  pdpt[1].page_frame_number = physical_address(pd) >> 12;
+
+  pde_2mb_64 pde_2mb;
+  pde_2mb.flags             = 0;
+  pde_2mb.present           = 1;
+  pde_2mb.write             = 1;
+  pde_2mb.large_page        = 1;
+  pde_2mb.page_frame_number = 0;
+  pd[0].flags = pde_2mb.flags;
+
+  pd[1].present           = 1;
+  pd[1].write             = 1;
+  pd[1].page_frame_number = physical_address(pt) >> 12;
+
+  for (uint64_t i = 0; i < 512; ++i) {
+    pt[i].present           = 1;
+    pt[i].write             = 1;
+    pt[i].page_frame_number = i;
+  }
+
+  guest_cr3.address_of_page_directory = physical_address(pml4) >> 12;
+
+  return guest_cr3;
+}
+
+template <uint64_t GuestVirtualAddress>
+static void bm_gva2hva(state& s) {
+  auto const guest_cr3 = build_guest_page_tables();
+
+  while (s.keep_running()) {
+    size_t offset_to_next_page;
+    do_not_optimize(gva2hva(guest_cr3,
+      reinterpret_cast<void*>(GuestVirtualAddress), &offset_to_next_page));
+  }
+}
+
+static void bm_gva2hva_1gb(state& s) { bm_gva2hva<gva_1gb>(s); }
+static void bm_gva2hva_2mb(state& s) { bm_gva2hva<gva_2mb>(s); }
+static void bm_gva2hva_4kb(state& s) { bm_gva2hva<gva_4kb>(s); }
+HV_BENCHMARK(bm_gva2hva_1gb);
+HV_BENCHMARK(bm_gva2hva_2mb);
+HV_BENCHMARK(bm_gva2hva_4kb);
+
+static void bm_gva2hva_not_present(state& s) {
+  auto const guest_cr3 = build_guest_page_tables();
+
+  while (s.keep_running())
+    do_not_optimize(gva2hva(guest_cr3, reinterpret_cast<void*>(0x8000'0000'0000)));
+}
+HV_BENCHMARK(bm_gva2hva_not_present);
+
+// a GDT with a 64-bit code segment, a data segment and a 64-bit TSS
+static uint64_t guest_gdt[6] = {
+  0,
+  0x00AF'9B00'0000'FFFF,
+  0x00CF'9300'0000'FFFF,
+  0x1200'8B34'5000'0067, // TSS at 0xFFFFF80012345000
+  0x0000'0000'FFFF'F800,
+  0
+};
+
+static segment_descriptor_register_64 guest_gdtr() {
+  segment_descriptor_register_64 gdtr;
+  gdtr.base_address = reinterpret_cast<uint64_t>(&guest_gdt);
+  gdtr.limit        = sizeof(guest_gdt) - 1;
+  return gdtr;
+}
+
+static void bm_segment_base(state& s) {
+  auto const gdtr = guest_gdtr();
+
+  uint16_t selector = 0x08;
+  while (s.keep_running()) {
+    do_not_optimize(segment_base(gdtr, selector));
+    selector = (selector == 0x18) ? 0x08 : selector + 0x08;
+  }
+}
+HV_BENCHMARK(bm_segment_base);
+
+static void bm_segment_access(state& s) {
+  auto const gdtr = guest_gdtr();
+
+  uint16_t selector = 0x08;
+  while (s.keep_running()) {
+    do_not_optimize(segment_access(gdtr, selector));
+    selector = (selector == 0x18) ? 0x08 : selector + 0x08;
+  }
+}
+HV_BENCHMARK(bm_segment_access);
+
+static void bm_is_valid_xcr_write(state& s) {
+  // x87 | SSE | AVX, and x87 | AVX (invalid)
+  xcr0 values[2];
+  values[0].flags = 0b111;
+  values[1].flags = 0b101;
+
+  uint32_t i = 0;
+  while (s.keep_running()) {
+    do_not_optimize(is_valid_xcr_write(0, values[i], ~0x2FFull));
+    i ^= 1;
+  }
+}
+HV_BENCHMARK(bm_is_valid_xcr_write);
+
+static void bm_is_valid_cr0_write(state& s) {
+  cr4 curr_cr4;
+  curr_cr4.flags = 0x3506F8;
+
+  // PG | WP | NE | ET | MP | PE, and the same value with CD and NW
+  cr0 values[2];
+  values[0].flags = 0x8001'0033;
+  values[1].flags = 0xE001'0033;
+
+  uint32_t i = 0;
+  while (s.keep_running()) {
+    do_not_optimize(is_valid_cr0_write(values[i], curr_cr4));
+    i ^= 1;
+  }
+}
+HV_BENCHMARK(bm_is_valid_cr0_write);
+
+static void bm_is_valid_cr4_write(state& s) {
+  cr0 curr_cr0;
+  curr_cr0.flags = 0x8005'0033;
+
+  cr3 curr_cr3;
+  curr_cr3.flags = 0x1AD000;
+
+  cr4 curr_cr4;
+  curr_cr4.flags = 0x3506F8;
+
+  // toggle CR4.PGE
+  cr4 values[2];
+  values[0].flags = curr_cr4.flags;
+  values[1].flags = curr_cr4.flags & ~CR4_PAGE_GLOBAL_ENABLE_FLAG;
+
+  uint32_t i = 0;
+  while (s.keep_running()) {
+    do_not_optimize(is_valid_cr4_write(values[i], curr_cr0, curr_cr4, curr_cr3, false));
+    i ^= 1;
+  }
+}
+HV_BENCHMARK(bm_is_valid_cr4_write);
+
+// set up the simulated machine before any benchmark runs
+static struct core_bench_setup {
+  core_bench_setup() {
+    if (!create_physical_memory_image(physical_memory_size)) {
+      fprintf(stderr, "failed to allocate the physical memory image\n");
+      exit(1);
+    }
+
+    setup_simulated_mtrrs();
+  }
+} setup;
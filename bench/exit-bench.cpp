@@ -0,0 +1,390 @@
+#include "bench.h"
+
+#include "../hv/hv.h"
+#include "../hv/hypercalls.h"
+#include "../hv/page-tables.h"
+#include "../hv/simulator.h"
+#include "../hv/vcpu.h"
+#include "../hv/vmx-sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// benchmarks for the vm-exit handlers: every benchmark causes the same
+// vm-exit over and over on the simulated machine, and reports the number
+// of VMREADs and VMWRITEs that handle_vm_exit() needed per exit
+
+using namespace hv;
+using namespace hv::bench;
+
+// start the simulated hypervisor once for every benchmark
+static struct simulated_machine {
+  simulated_machine() {
+    // the handlers log to the debugger, which would dominate the timing
+    enable_debug_print(false);
+
+    if (!start_simulated_hypervisor()) {
+      fprintf(stderr, "failed to start the simulated hypervisor\n");
+      exit(1);
+    }
+  }
+
+  ~simulated_machine() {
+    stop_simulated_hypervisor();
+  }
+} machine;
+
+// the physical address of an address inside of the physical memory image
+static uint64_t physical_address(void* const address) {
+  return MmGetPhysicalAddress(address).QuadPart;
+}
+
+// cause the same vm-exit for every iteration and report VMCS accesses
+static void run_exits(state& s, simulated_vm_exit const& exit,
+    void (*setup)(guest_context&) = nullptr) {
+  auto& ctx = simulated_guest_context();
+
+  reset_simulated_vmx_counters();
+
+  while (s.keep_running()) {
+    if (setup)
+      setup(ctx);
+
+    if (!simulate_vm_exit(exit)) {
+      fprintf(stderr, "the simulated processor was devirtualized\n");
+      abort();
+    }
+  }
+
+  auto const& counters = read_simulated_vmx_counters();
+  auto const iterations = static_cast<double>(s.iterations());
+
+  s.set_counter("vmreads", counters.vmreads / iterations);
+  s.set_counter("vmwrites", counters.vmwrites / iterations);
+}
+
+// an instruction exit with no qualification
+static simulated_vm_exit instruction_exit(uint16_t const reason,
+    uint32_t const length) {
+  simulated_vm_exit exit = {};
+  exit.reason             = reason;
+  exit.instruction_length = length;
+  return exit;
+}
+
+static void bm_exit_cpuid_leaf_0(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2),
+    [](guest_context& ctx) { ctx.rax = 0; ctx.rcx = 0; });
+}
+HV_BENCHMARK(bm_exit_cpuid_leaf_0);
+
+static void bm_exit_cpuid_leaf_1(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2),
+    [](guest_context& ctx) { ctx.rax = 1; ctx.rcx = 0; });
+}
+HV_BENCHMARK(bm_exit_cpuid_leaf_1);
+
+static void bm_exit_rdmsr_passthrough(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_RDMSR, 2),
+    [](guest_context& ctx) { ctx.rcx = IA32_LSTAR; });
+}
+HV_BENCHMARK(bm_exit_rdmsr_passthrough);
+
+static void bm_exit_rdmsr_feature_control(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_RDMSR, 2),
+    [](guest_context& ctx) { ctx.rcx = IA32_FEATURE_CONTROL; });
+}
+HV_BENCHMARK(bm_exit_rdmsr_feature_control);
+
+static void bm_exit_wrmsr_passthrough(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_WRMSR, 2),
+    [](guest_context& ctx) { ctx.rcx = IA32_LSTAR; ctx.rax = 0; ctx.rdx = 0; });
+}
+HV_BENCHMARK(bm_exit_wrmsr_passthrough);
+
+static void bm_exit_xsetbv(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_XSETBV, 3),
+    [](guest_context& ctx) { ctx.rcx = 0; ctx.rax = 0b11; ctx.rdx = 0; });
+}
+HV_BENCHMARK(bm_exit_xsetbv);
+
+// MOV to CRn from RAX
+static simulated_vm_exit mov_to_cr_exit(uint64_t const cr) {
+  vmx_exit_qualification_mov_cr qualification;
+  qualification.flags                    = 0;
+  qualification.control_register         = cr;
+  qualification.access_type              = VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR;
+  qualification.general_purpose_register = 0;
+
+  auto exit = instruction_exit(VMX_EXIT_REASON_MOV_CR, 3);
+  exit.qualification = qualification.flags;
+  return exit;
+}
+
+static void bm_exit_mov_to_cr0(state& s) {
+  run_exits(s, mov_to_cr_exit(VMX_EXIT_QUALIFICATION_REGISTER_CR0),
+    [](guest_context& ctx) { ctx.rax = simulated_cpu.cr0; });
+}
+HV_BENCHMARK(bm_exit_mov_to_cr0);
+
+static void bm_exit_mov_to_cr3(state& s) {
+  run_exits(s, mov_to_cr_exit(VMX_EXIT_QUALIFICATION_REGISTER_CR3),
+    [](guest_context& ctx) { ctx.rax = ghv.system_cr3.flags; });
+}
+HV_BENCHMARK(bm_exit_mov_to_cr3);
+
+static void bm_exit_mov_to_cr4(state& s) {
+  run_exits(s, mov_to_cr_exit(VMX_EXIT_QUALIFICATION_REGISTER_CR4),
+    [](guest_context& ctx) {
+      ctx.rax = vmx_vmread(VMCS_CTRL_CR4_READ_SHADOW);
+    });
+}
+HV_BENCHMARK(bm_exit_mov_to_cr4);
+
+// a hypercall that is issued directly as a vm-exit
+static void setup_hypercall(guest_context& ctx, hypercall_code const code) {
+  ctx.rax = code | (hypercall_key << 8);
+}
+
+static void bm_exit_vmcall_ping(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3),
+    [](guest_context& ctx) { setup_hypercall(ctx, hypercall_ping); });
+}
+HV_BENCHMARK(bm_exit_vmcall_ping);
+
+// copy a single page of physical memory into a guest buffer
+static void bm_exit_vmcall_read_phys_mem_4kb(state& s) {
+  static uint64_t buffer_pa, source_pa;
+
+  // only allocate the pages once, since runs are repeated
+  if (!buffer_pa) {
+    buffer_pa = physical_address(allocate_physical_pages(1));
+    source_pa = physical_address(allocate_physical_pages(1));
+  }
+
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3),
+    [](guest_context& ctx) {
+      setup_hypercall(ctx, hypercall_read_phys_mem);
+
+      // the guest identity-maps physical memory
+      ctx.rcx = buffer_pa;
+      ctx.rdx = source_pa;
+      ctx.r8  = 0x1000;
+    });
+
+  s.set_items_per_iteration(0x1000);
+}
+HV_BENCHMARK(bm_exit_vmcall_read_phys_mem_4kb);
+
+// an EPT hook that flips between the original and the executable page
+static void bm_exit_ept_violation_hook(state& s) {
+  static uint64_t orig_pa;
+  static bool execute;
+
+  auto const cpu = simulated_vcpu();
+
+  // only install the hook once, since runs are repeated with more iterations
+  if (!orig_pa) {
+    orig_pa = physical_address(allocate_physical_pages(1));
+    auto const exec_pa = physical_address(allocate_physical_pages(1));
+
+    if (!install_ept_hook(cpu->ept, orig_pa >> 12, exec_pa >> 12)) {
+      fprintf(stderr, "failed to install the EPT hook\n");
+      abort();
+    }
+  }
+
+  // alternate between instruction fetches and data reads
+  vmx_exit_qualification_ept_violation fetch, read;
+  fetch.flags                 = 0;
+  fetch.execute_access        = 1;
+  fetch.caused_by_translation = 1;
+  read.flags                  = 0;
+  read.read_access            = 1;
+  read.caused_by_translation  = 1;
+
+  simulated_vm_exit exit = {};
+  exit.reason                 = VMX_EXIT_REASON_EPT_VIOLATION;
+  exit.guest_physical_address = orig_pa;
+
+  reset_simulated_vmx_counters();
+
+  while (s.keep_running()) {
+    exit.qualification = (execute = !execute) ? fetch.flags : read.flags;
+
+    if (!simulate_vm_exit(exit) || last_injected_event().valid) {
+      fprintf(stderr, "the EPT violation wasn't handled\n");
+      abort();
+    }
+  }
+
+  auto const& counters = read_simulated_vmx_counters();
+  auto const iterations = static_cast<double>(s.iterations());
+
+  s.set_counter("vmreads", counters.vmreads / iterations);
+  s.set_counter("vmwrites", counters.vmwrites / iterations);
+  s.set_counter("invepts", counters.invepts / iterations);
+}
+HV_BENCHMARK(bm_exit_ept_violation_hook);
+
+// a traced syscall: the VMCALL that replaced the SWAPGS at the entry point
+static void bm_exit_syscall_entry(state& s) {
+  static uint64_t entry;
+
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  // only hook the entry point once, since runs are repeated with more
+  // iterations
+  if (!entry) {
+    auto const page = static_cast<uint8_t*>(allocate_physical_pages(1));
+    page[0] = 0x0F;
+    page[1] = 0x01;
+    page[2] = 0xF8;
+
+    entry = physical_address(page);
+    set_simulated_msr(IA32_LSTAR, entry);
+
+    if (!enable_syscall_tracing(cpu)) {
+      fprintf(stderr, "failed to enable syscall tracing\n");
+      abort();
+    }
+  }
+
+  auto& ring = *cpu->syscall_trace.ring;
+
+  simulated_vm_exit exit = {};
+  exit.reason             = VMX_EXIT_REASON_EXECUTE_VMCALL;
+  exit.instruction_length = 3;
+
+  reset_simulated_vmx_counters();
+
+  while (s.keep_running()) {
+    write_simulated_vmcs(VMCS_GUEST_RIP, entry);
+    ctx.rax = 0x55;
+
+    if (!simulate_vm_exit(exit) || last_injected_event().valid) {
+      fprintf(stderr, "the syscall wasn't traced\n");
+      abort();
+    }
+
+    // the consumer (a single store)
+    ring.tail = ring.head;
+  }
+
+  auto const& counters = read_simulated_vmx_counters();
+  auto const iterations = static_cast<double>(s.iterations());
+
+  s.set_counter("vmreads", counters.vmreads / iterations);
+  s.set_counter("vmwrites", counters.vmwrites / iterations);
+  s.set_counter("dropped", static_cast<double>(ring.dropped));
+}
+HV_BENCHMARK(bm_exit_syscall_entry);
+
+// VMX instructions are reflected back into the guest as #UD
+static void bm_exit_vmxon_ud(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_VMXON, 4));
+}
+HV_BENCHMARK(bm_exit_vmxon_ud);
+
+static void bm_exit_invd_gp(state& s) {
+  run_exits(s, instruction_exit(VMX_EXIT_REASON_EXECUTE_INVD, 2));
+}
+HV_BENCHMARK(bm_exit_invd_gp);
+
+// deliver a host NMI (a PMI, for example) to the guest once per iteration.
+// the NMI is injected on the same vm-exit if the guest can receive it, or
+// on the following NMI-window vm-exit if the guest is blocking by STI. the
+// time per iteration is the root-mode cost of a single PMI (at 10k PMIs/s,
+// the guest loses 10000 times that much every second).
+static void run_nmis(state& s, bool const blocked) {
+  vmexit_interrupt_information nmi_info;
+  nmi_info.flags             = 0;
+  nmi_info.vector            = nmi;
+  nmi_info.interruption_type = non_maskable_interrupt;
+  nmi_info.valid             = 1;
+
+  auto nmi_exit = instruction_exit(VMX_EXIT_REASON_EXCEPTION_OR_NMI, 0);
+  nmi_exit.interruption_info = nmi_info.flags;
+
+  auto const window_exit = instruction_exit(VMX_EXIT_REASON_NMI_WINDOW, 0);
+
+  vmx_interruptibility_state blocking_by_sti;
+  blocking_by_sti.flags           = 0;
+  blocking_by_sti.blocking_by_sti = 1;
+
+  uint64_t exits = 0, injected = 0;
+
+  reset_simulated_vmx_counters();
+
+  while (s.keep_running()) {
+    write_simulated_vmcs(VMCS_GUEST_INTERRUPTIBILITY_STATE,
+      blocked ? blocking_by_sti.flags : 0);
+
+    if (!simulate_vm_exit(nmi_exit)) {
+      fprintf(stderr, "the simulated processor was devirtualized\n");
+      abort();
+    }
+
+    ++exits;
+
+    if (blocked) {
+      write_simulated_vmcs(VMCS_GUEST_INTERRUPTIBILITY_STATE, 0);
+      simulate_vm_exit(window_exit);
+      ++exits;
+    }
+
+    if (last_injected_event().valid && last_injected_event().vector == nmi)
+      ++injected;
+  }
+
+  auto const& counters = read_simulated_vmx_counters();
+  auto const iterations = static_cast<double>(s.iterations());
+
+  s.set_counter("vmreads", counters.vmreads / iterations);
+  s.set_counter("vmwrites", counters.vmwrites / iterations);
+  s.set_counter("exits_per_nmi", exits / static_cast<double>(injected));
+}
+
+static void bm_exit_nmi_inject(state& s) {
+  run_nmis(s, false);
+}
+HV_BENCHMARK(bm_exit_nmi_inject);
+
+static void bm_exit_nmi_window(state& s) {
+  run_nmis(s, true);
+}
+HV_BENCHMARK(bm_exit_nmi_window);
+
+// the cost that the trace module adds to every vm-exit, with a consumer
+// that keeps up (a full ring only counts a dropped record)
+static void bm_exit_trace_record(state& s) {
+  auto const cpu = simulated_vcpu();
+  auto& trace = *cpu->exit_trace;
+
+  set_exit_tracing(cpu, true);
+
+  vmx_vmexit_reason reason;
+  reason.flags             = 0;
+  reason.basic_exit_reason = VMX_EXIT_REASON_EXECUTE_CPUID;
+
+  reset_simulated_vmx_counters();
+
+  while (s.keep_running()) {
+    exit_trace_module::on_vm_exit(cpu, reason);
+    exit_trace_module::on_vm_exit_handled(cpu, reason);
+
+    // the consumer (a single store)
+    trace.tail = trace.head;
+  }
+
+  auto const& counters = read_simulated_vmx_counters();
+  auto const iterations = static_cast<double>(s.iterations());
+
+  s.set_counter("vmreads", counters.vmreads / iterations);
+  s.set_counter("dropped", static_cast<double>(trace.dropped));
+
+  // the other benchmarks run with the default
+  set_exit_tracing(cpu, exit_tracing_default);
+}
+HV_BENCHMARK(bm_exit_trace_record);
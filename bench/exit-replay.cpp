@@ -0,0 +1,385 @@
+#include "../hv/exit-capture.h"
+#include "../hv/exit-dispatch.h"
+#include "../hv/hypercalls.h"
+#include "../hv/page-tables.h"
+#include "../hv/platform.h"
+#include "../hv/simulator.h"
+#include "../hv/vmx-sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// replay vm-exits that were captured on real hardware (see exit-capture.h)
+// through the exit handlers on the simulated machine, and report the
+// handler latency distribution of every exit reason:
+//
+//   hv-exit-replay capture.bin [--repeat=<n>] [--csv]
+//
+// the captured guest pages are loaded at their original physical addresses,
+// so the simulated machine is made large enough to hold all of them (the
+// image is sparse, so this only costs the pages that are actually used).
+
+using namespace hv;
+
+// VCPU indices in a capture need to be below this
+static constexpr size_t max_replay_vcpus = 1024;
+
+// every VCPU's records are delta-encoded separately
+static exit_capture_decoder decoders[max_replay_vcpus];
+
+// latencies of every replayed exit with the same exit reason
+struct reason_samples {
+  uint64_t* replay_tsc;
+  uint64_t* target_tsc;
+  size_t count;
+  size_t capacity;
+};
+
+static reason_samples samples[vm_exit_reason_count];
+
+static struct {
+  uint64_t page_records;
+  uint64_t exit_records;
+  uint64_t skipped_exits;
+  uint64_t missing_pages;
+  uint64_t dropped;
+} totals;
+
+static char const* exit_reason_name(uint32_t const reason) {
+  switch (reason) {
+  case VMX_EXIT_REASON_EXCEPTION_OR_NMI:             return "exception_or_nmi";
+  case VMX_EXIT_REASON_INTERRUPT_WINDOW:             return "interrupt_window";
+  case VMX_EXIT_REASON_NMI_WINDOW:                   return "nmi_window";
+  case VMX_EXIT_REASON_EXECUTE_CPUID:                return "cpuid";
+  case VMX_EXIT_REASON_EXECUTE_GETSEC:               return "getsec";
+  case VMX_EXIT_REASON_EXECUTE_INVD:                 return "invd";
+  case VMX_EXIT_REASON_EXECUTE_VMCALL:               return "vmcall";
+  case VMX_EXIT_REASON_EXECUTE_VMXON:                return "vmxon";
+  case VMX_EXIT_REASON_MOV_CR:                       return "mov_cr";
+  case VMX_EXIT_REASON_EXECUTE_RDMSR:                return "rdmsr";
+  case VMX_EXIT_REASON_EXECUTE_WRMSR:                return "wrmsr";
+  case VMX_EXIT_REASON_MONITOR_TRAP_FLAG:            return "monitor_trap_flag";
+  case VMX_EXIT_REASON_EPT_VIOLATION:                return "ept_violation";
+  case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED: return "preemption_timer";
+  case VMX_EXIT_REASON_EXECUTE_XSETBV:               return "xsetbv";
+  default:                                           return nullptr;
+  }
+}
+
+static uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+static void add_sample(uint32_t const reason, uint64_t const replay_tsc,
+    uint64_t const target_tsc) {
+  auto& s = samples[reason];
+
+  if (s.count == s.capacity) {
+    s.capacity   = s.capacity ? s.capacity * 2 : 1024;
+    s.replay_tsc = static_cast<uint64_t*>(realloc(s.replay_tsc, s.capacity * sizeof(uint64_t)));
+    s.target_tsc = static_cast<uint64_t*>(realloc(s.target_tsc, s.capacity * sizeof(uint64_t)));
+
+    if (!s.replay_tsc || !s.target_tsc) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  s.replay_tsc[s.count] = replay_tsc;
+  s.target_tsc[s.count] = target_tsc;
+  ++s.count;
+}
+
+static int compare_u64(void const* const a, void const* const b) {
+  auto const x = *static_cast<uint64_t const*>(a);
+  auto const y = *static_cast<uint64_t const*>(b);
+  return (x > y) - (x < y);
+}
+
+// the value at the specified percentile of a sorted array
+static uint64_t percentile(uint64_t const* const sorted, size_t const count,
+    unsigned const p) {
+  return sorted[(count - 1) * p / 100];
+}
+
+// read an entire file into memory
+static uint8_t* read_file(char const* const path, size_t& size) {
+  auto const file = fopen(path, "rb");
+  if (!file)
+    return nullptr;
+
+  fseek(file, 0, SEEK_END);
+  size = static_cast<size_t>(ftell(file));
+  fseek(file, 0, SEEK_SET);
+
+  auto const data = static_cast<uint8_t*>(malloc(size ? size : 1));
+
+  if (data && fread(data, 1, size, file) != size) {
+    free(data);
+    fclose(file);
+    return nullptr;
+  }
+
+  fclose(file);
+  return data;
+}
+
+// call the visitor for every record in the capture. returns false if the
+// capture is malformed.
+template <typename Visitor>
+static bool for_each_record(uint8_t const* const data, size_t const size,
+    Visitor&& visitor) {
+  memset(decoders, 0, sizeof(decoders));
+
+  size_t offset = 0;
+
+  while (offset < size) {
+    exit_capture_chunk_header header;
+
+    if (size - offset < sizeof(header)) {
+      fprintf(stderr, "truncated chunk header at offset 0x%zX\n", offset);
+      return false;
+    }
+
+    memcpy(&header, data + offset, sizeof(header));
+    offset += sizeof(header);
+
+    if (header.magic != exit_capture_file_magic ||
+        header.version != exit_capture_file_version ||
+        header.vcpu_index >= max_replay_vcpus ||
+        size - offset < header.size) {
+      fprintf(stderr, "invalid chunk at offset 0x%zX\n", offset - sizeof(header));
+      return false;
+    }
+
+    auto& decoder = decoders[header.vcpu_index];
+    auto in  = data + offset;
+    auto end = in + header.size;
+
+    while (in < end) {
+      exit_capture_record record;
+
+      if (!read_exit_capture_record(decoder, in, end, record)) {
+        fprintf(stderr, "invalid record at offset 0x%zX\n",
+          static_cast<size_t>(in - data));
+        return false;
+      }
+
+      visitor(header, record);
+    }
+
+    offset += header.size;
+  }
+
+  return true;
+}
+
+// load the captured state into the simulated machine and cause the vm-exit
+static bool replay_exit(exit_capture_record const& record, uint64_t& latency) {
+  auto& ctx = simulated_guest_context();
+  memcpy(ctx.gpr, record.fields, sizeof(ctx.gpr));
+
+  simulated_vm_exit exit = {};
+  exit.reason = record.reason;
+
+  for (size_t i = 0; i < sizeof(exit_capture_fields) / sizeof(exit_capture_fields[0]); ++i) {
+    auto const field = exit_capture_fields[i];
+    auto const value = record.fields[exit_capture_gpr_count + i];
+
+    switch (field) {
+    case VMCS_EXIT_QUALIFICATION:
+      exit.qualification = value; break;
+    case VMCS_EXIT_GUEST_LINEAR_ADDRESS:
+      exit.guest_linear_address = value; break;
+    case VMCS_GUEST_PHYSICAL_ADDRESS:
+      exit.guest_physical_address = value; break;
+    case VMCS_VMEXIT_INSTRUCTION_LENGTH:
+      exit.instruction_length = static_cast<uint32_t>(value); break;
+    case VMCS_VMEXIT_INSTRUCTION_INFO:
+      exit.instruction_info = static_cast<uint32_t>(value); break;
+    case VMCS_VMEXIT_INTERRUPTION_INFORMATION:
+      exit.interruption_info = static_cast<uint32_t>(value); break;
+    case VMCS_VMEXIT_INTERRUPTION_ERROR_CODE:
+      exit.interruption_error_code = static_cast<uint32_t>(value); break;
+    default:
+      write_simulated_vmcs(field, value); break;
+    }
+  }
+
+  auto const start = __rdtsc();
+  auto const virtualized = simulate_vm_exit(exit);
+  latency = __rdtsc() - start;
+
+  return virtualized;
+}
+
+static void print_usage(char const* const name) {
+  printf("usage: %s <capture file> [--repeat=<n>] [--csv]\n", name);
+}
+
+int main(int const argc, char** const argv) {
+  char const* path = nullptr;
+  uint64_t repeat = 1;
+  bool csv = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--repeat=", 9) == 0)
+      repeat = strtoull(argv[i] + 9, nullptr, 10);
+    else if (strcmp(argv[i], "--csv") == 0)
+      csv = true;
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!path || !repeat) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  size_t size = 0;
+  auto const data = read_file(path, size);
+
+  if (!data) {
+    fprintf(stderr, "failed to read %s\n", path);
+    return 1;
+  }
+
+  // find the highest captured page, so that every page fits into the image
+  uint64_t max_pfn = 0;
+
+  auto const valid = for_each_record(data, size,
+    [&](exit_capture_chunk_header const&, exit_capture_record const& record) {
+      if (record.type == exit_capture_page_record && record.pfn > max_pfn)
+        max_pfn = record.pfn;
+    });
+
+  if (!valid)
+    return 1;
+
+  // the hypervisor itself is allocated at the end of the image
+  auto const memory_size = ((((max_pfn + 1) << 12) + 0x1F'FFFF) & ~0x1F'FFFFull)
+    + simulated_physical_memory_size;
+
+  // the handlers log to the debugger, which would dominate the timing
+  enable_debug_print(false);
+
+  if (!start_simulated_hypervisor(memory_size)) {
+    fprintf(stderr, "failed to start the simulated hypervisor\n");
+    return 1;
+  }
+
+  uint64_t dropped[max_replay_vcpus] = {};
+  uint64_t replay_tsc_total = 0;
+  auto const start_ns  = now_ns();
+  auto const start_tsc = __rdtsc();
+
+  for (uint64_t i = 0; i < repeat; ++i) {
+    auto const ok = for_each_record(data, size,
+      [&](exit_capture_chunk_header const& header, exit_capture_record const& record) {
+        dropped[header.vcpu_index] = header.dropped;
+
+        if (record.type == exit_capture_page_record) {
+          memcpy(host_physical_memory_base + (record.pfn << 12), record.page, 0x1000);
+          ++totals.page_records;
+          return;
+        }
+
+        ++totals.exit_records;
+
+        // unloading would devirtualize the simulated processor
+        if (record.reason >= vm_exit_reason_count ||
+            (record.reason == VMX_EXIT_REASON_EXECUTE_VMCALL &&
+             (record.fields[0] & 0xFF) == hypercall_unload)) {
+          ++totals.skipped_exits;
+          return;
+        }
+
+        if (record.flags & exit_capture_pages_missing_flag)
+          ++totals.missing_pages;
+
+        uint64_t latency = 0;
+
+        if (!replay_exit(record, latency)) {
+          fprintf(stderr, "the simulated processor was devirtualized\n");
+          exit(1);
+        }
+
+        replay_tsc_total += latency;
+        add_sample(record.reason, latency, record.handler_cycles);
+      });
+
+    if (!ok)
+      return 1;
+  }
+
+  // TSC ticks per nanosecond on this machine
+  auto const elapsed_ns = now_ns() - start_ns;
+  auto const tsc_per_ns = elapsed_ns
+    ? static_cast<double>(__rdtsc() - start_tsc) / elapsed_ns : 1.0;
+
+  stop_simulated_hypervisor();
+
+  for (auto const d : dropped)
+    totals.dropped += d;
+
+  if (csv)
+    printf("reason,name,count,p50_ns,p90_ns,p99_ns,max_ns,target_p50_tsc,target_p99_tsc\n");
+  else {
+    printf("%-20s %10s %10s %10s %10s %10s %14s %14s\n", "reason", "count",
+      "p50_ns", "p90_ns", "p99_ns", "max_ns", "target_p50_tsc", "target_p99_tsc");
+  }
+
+  for (uint32_t reason = 0; reason < vm_exit_reason_count; ++reason) {
+    auto& s = samples[reason];
+
+    if (!s.count)
+      continue;
+
+    qsort(s.replay_tsc, s.count, sizeof(uint64_t), compare_u64);
+    qsort(s.target_tsc, s.count, sizeof(uint64_t), compare_u64);
+
+    auto const ns = [&](unsigned const p) {
+      return static_cast<uint64_t>(percentile(s.replay_tsc, s.count, p) / tsc_per_ns);
+    };
+
+    char name[32];
+    if (auto const known = exit_reason_name(reason))
+      snprintf(name, sizeof(name), "%s", known);
+    else
+      snprintf(name, sizeof(name), "reason_%u", reason);
+
+    if (csv) {
+      printf("%u,%s,%zu,%llu,%llu,%llu,%llu,%llu,%llu\n", reason, name, s.count,
+        (unsigned long long)ns(50), (unsigned long long)ns(90),
+        (unsigned long long)ns(99), (unsigned long long)ns(100),
+        (unsigned long long)percentile(s.target_tsc, s.count, 50),
+        (unsigned long long)percentile(s.target_tsc, s.count, 99));
+    }
+    else {
+      printf("%-20s %10zu %10llu %10llu %10llu %10llu %14llu %14llu\n", name, s.count,
+        (unsigned long long)ns(50), (unsigned long long)ns(90),
+        (unsigned long long)ns(99), (unsigned long long)ns(100),
+        (unsigned long long)percentile(s.target_tsc, s.count, 50),
+        (unsigned long long)percentile(s.target_tsc, s.count, 99));
+    }
+  }
+
+  // keep stdout parseable in CSV mode
+  fprintf(csv ? stderr : stdout, "\n%llu exits (%llu skipped, %llu with missing pages), "
+    "%llu pages, %llu dropped on target, %.1f ns total in handlers\n",
+    (unsigned long long)totals.exit_records, (unsigned long long)totals.skipped_exits,
+    (unsigned long long)totals.missing_pages, (unsigned long long)totals.page_records,
+    (unsigned long long)totals.dropped, replay_tsc_total / tsc_per_ns);
+
+  free(data);
+
+  return 0;
+}
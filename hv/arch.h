@@ -1,6 +1,6 @@
 #pragma once
 
-#include <intrin.h>
+#include "platform.h"
 #include <ia32.hpp>
 
 extern "C" {
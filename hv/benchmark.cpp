@@ -0,0 +1,457 @@
+#include "benchmark.h"
+#include "hv.h"
+#include "timing.h"
+
+#include <ntstrsafe.h>
+
+namespace hv {
+
+// resources that are shared by every benchmark (these are allocated before
+// anything is measured)
+struct benchmark_context {
+  // hooked page, and the page that is executed in its place (both of
+  // them are filled with RETs)
+  uint8_t* hook_orig_page;
+  uint8_t* hook_exec_page;
+
+  // memory that is read by the memory benchmarks. the source doesn't
+  // cross a 2MB boundary, so that it can be mapped with a single large page.
+  uint8_t* copy_src;
+  uint8_t* copy_dst;
+  uint64_t copy_src_pa;
+
+  // private page tables (PML4, PDPT, PD, PT) that map the source memory
+  // with 4KB, 2MB, and 1GB pages
+  uint64_t* page_tables;
+  cr3 private_cr3;
+
+  // the source memory in the private address space
+  uint64_t src_4kb;
+  uint64_t src_2mb;
+  uint64_t src_1gb;
+
+  // value that is written to IA32_MTRR_DEF_TYPE
+  uint64_t mtrr_def_type;
+};
+
+// samples of the benchmark that is currently running (the processors are
+// benchmarked one after another)
+static uint64_t samples[benchmark_samples];
+
+static uint64_t vmcall(hypercall_code const code,
+    uint64_t const arg0 = 0, uint64_t const arg1 = 0,
+    uint64_t const arg2 = 0, uint64_t const arg3 = 0) {
+  hypercall_input input;
+  input.code    = code;
+  input.key     = hypercall_key;
+  input.args[0] = arg0;
+  input.args[1] = arg1;
+  input.args[2] = arg2;
+  input.args[3] = arg3;
+  return vmx_vmcall(input);
+}
+
+// instructions and hypercalls that are benchmarked
+static void execute_vmcall(benchmark_context&) {
+  vmcall(hypercall_ping);
+}
+static void execute_cpuid(benchmark_context&) {
+  int regs[4];
+  __cpuid(regs, 0);
+}
+static void execute_rdmsr(benchmark_context&) {
+  // this is intercepted by every exit profile (see msr-policy.cpp)
+  __readmsr(IA32_FEATURE_CONTROL);
+}
+static void execute_xsetbv(benchmark_context&) {
+  _xsetbv(0, _xgetbv(0));
+}
+static void execute_hooked_page(benchmark_context& ctx) {
+  reinterpret_cast<void(*)()>(ctx.hook_orig_page)();
+}
+static void read_hooked_page(benchmark_context& ctx) {
+  *static_cast<uint8_t volatile*>(ctx.hook_orig_page);
+}
+static void execute_read_phys_mem(benchmark_context& ctx) {
+  vmcall(hypercall_read_phys_mem, reinterpret_cast<uint64_t>(ctx.copy_dst),
+    ctx.copy_src_pa, benchmark_copy_size);
+}
+static void execute_read_virt_mem_4kb(benchmark_context& ctx) {
+  vmcall(hypercall_read_virt_mem, ctx.private_cr3.flags,
+    reinterpret_cast<uint64_t>(ctx.copy_dst), ctx.src_4kb, benchmark_copy_size);
+}
+static void execute_read_virt_mem_2mb(benchmark_context& ctx) {
+  vmcall(hypercall_read_virt_mem, ctx.private_cr3.flags,
+    reinterpret_cast<uint64_t>(ctx.copy_dst), ctx.src_2mb, benchmark_copy_size);
+}
+static void execute_read_virt_mem_1gb(benchmark_context& ctx) {
+  vmcall(hypercall_read_virt_mem, ctx.private_cr3.flags,
+    reinterpret_cast<uint64_t>(ctx.copy_dst), ctx.src_1gb, benchmark_copy_size);
+}
+static void execute_mtrr_write(benchmark_context& ctx) {
+  // every MTRR write rebuilds the EPT memory types (see msr-policy.cpp)
+  __writemsr(IA32_MTRR_DEF_TYPE, ctx.mtrr_def_type);
+}
+static void no_setup(benchmark_context&) {}
+
+// take every sample of a benchmark. Setup is called before every sample,
+// but it isn't measured. interrupts must be disabled.
+template <void(*Setup)(benchmark_context&), void(*Execute)(benchmark_context&)>
+static void take_samples(benchmark_context& ctx) {
+  for (auto& sample : samples) {
+    Setup(ctx);
+
+    _mm_lfence();
+    auto start = __rdtsc();
+    _mm_lfence();
+
+    _mm_lfence();
+    auto end = __rdtsc();
+    _mm_lfence();
+
+    auto const timing_overhead = (end - start);
+
+    _mm_lfence();
+    start = __rdtsc();
+    _mm_lfence();
+
+    Execute(ctx);
+
+    _mm_lfence();
+    end = __rdtsc();
+    _mm_lfence();
+
+    sample = (end - start > timing_overhead) ? (end - start - timing_overhead) : 0;
+  }
+}
+
+// benchmarks are skipped on processors that can't run them
+enum benchmark_requirement : uint8_t {
+  benchmark_requires_nothing = 0,
+
+  // XSETBV causes a #UD if CR4.OSXSAVE is clear
+  benchmark_requires_xsave,
+
+  // the EPT hook was installed on the current VCPU
+  benchmark_requires_ept_hook
+};
+
+struct benchmark {
+  char const* name;
+
+  // number of bytes that are copied by every sample
+  size_t bytes;
+
+  benchmark_requirement requirement;
+
+  void(*take_samples)(benchmark_context& ctx);
+};
+
+// every benchmark, in the order that they're run in
+static constexpr benchmark benchmarks[] = {
+  { "vmcall_ping",           0, benchmark_requires_nothing,
+    take_samples<no_setup, execute_vmcall> },
+  { "cpuid_leaf_0",          0, benchmark_requires_nothing,
+    take_samples<no_setup, execute_cpuid> },
+  { "rdmsr_feature_control", 0, benchmark_requires_nothing,
+    take_samples<no_setup, execute_rdmsr> },
+  { "xsetbv",                0, benchmark_requires_xsave,
+    take_samples<no_setup, execute_xsetbv> },
+
+  // every access alternates between the two views of the hooked page,
+  // so every single one of them causes an EPT violation
+  { "ept_hook_execute", 0, benchmark_requires_ept_hook,
+    take_samples<read_hooked_page, execute_hooked_page> },
+  { "ept_hook_read",    0, benchmark_requires_ept_hook,
+    take_samples<execute_hooked_page, read_hooked_page> },
+
+  { "read_phys_mem",     benchmark_copy_size, benchmark_requires_nothing,
+    take_samples<no_setup, execute_read_phys_mem> },
+  { "read_virt_mem_4kb", benchmark_copy_size, benchmark_requires_nothing,
+    take_samples<no_setup, execute_read_virt_mem_4kb> },
+  { "read_virt_mem_2mb", benchmark_copy_size, benchmark_requires_nothing,
+    take_samples<no_setup, execute_read_virt_mem_2mb> },
+  { "read_virt_mem_1gb", benchmark_copy_size, benchmark_requires_nothing,
+    take_samples<no_setup, execute_read_virt_mem_1gb> },
+
+  { "mtrr_def_type_write", 0, benchmark_requires_nothing,
+    take_samples<no_setup, execute_mtrr_write> }
+};
+
+static constexpr size_t benchmark_count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+// build the private page tables that map the source memory
+static void prepare_private_page_tables(benchmark_context& ctx) {
+  auto const pml4 = reinterpret_cast<pml4e_64*>(ctx.page_tables);
+  auto const pdpt = reinterpret_cast<pdpte_64*>(ctx.page_tables + 512);
+  auto const pd   = reinterpret_cast<pde_64*>(ctx.page_tables + 512 * 2);
+  auto const pt   = reinterpret_cast<pte_64*>(ctx.page_tables + 512 * 3);
+
+  auto const src_pa = ctx.copy_src_pa;
+
+  pml4[0].flags             = 0;
+  pml4[0].present           = 1;
+  pml4[0].write             = 1;
+  pml4[0].page_frame_number = MmGetPhysicalAddress(pdpt).QuadPart >> 12;
+
+  // 0x00000000: the 1GB page that contains the source memory
+  pdpte_1gb_64 pdpte_1gb;
+  pdpte_1gb.flags             = 0;
+  pdpte_1gb.present           = 1;
+  pdpte_1gb.write             = 1;
+  pdpte_1gb.large_page        = 1;
+  pdpte_1gb.page_frame_number = src_pa >> 30;
+  pdpt[0].flags = pdpte_1gb.flags;
+
+  pdpt[1].flags             = 0;
+  pdpt[1].present           = 1;
+  pdpt[1].write             = 1;
+  pdpt[1].page_frame_number = MmGetPhysicalAddress(pd).QuadPart >> 12;
+
+  // 0x40000000: the 2MB page that contains the source memory
+  pde_2mb_64 pde_2mb;
+  pde_2mb.flags             = 0;
+  pde_2mb.present           = 1;
+  pde_2mb.write             = 1;
+  pde_2mb.large_page        = 1;
+  pde_2mb.page_frame_number = src_pa >> 21;
+  pd[0].flags = pde_2mb.flags;
+
+  pd[1].flags             = 0;
+  pd[1].present           = 1;
+  pd[1].write             = 1;
+  pd[1].page_frame_number = MmGetPhysicalAddress(pt).QuadPart >> 12;
+
+  // 0x40200000: the source memory, one 4KB page at a time
+  for (size_t i = 0; i < benchmark_copy_size / 0x1000; ++i) {
+    pt[i].flags             = 0;
+    pt[i].present           = 1;
+    pt[i].write             = 1;
+    pt[i].page_frame_number = (src_pa >> 12) + i;
+  }
+
+  ctx.private_cr3.flags = 0;
+  ctx.private_cr3.address_of_page_directory =
+    MmGetPhysicalAddress(pml4).QuadPart >> 12;
+
+  ctx.src_1gb = src_pa & 0x3FFF'FFFF;
+  ctx.src_2mb = 0x4000'0000 + (src_pa & 0x1F'FFFF);
+  ctx.src_4kb = 0x4020'0000;
+}
+
+// free the benchmark resources (this is safe to call on a partially
+// allocated context)
+static void free_benchmark_context(benchmark_context& ctx) {
+  if (ctx.hook_orig_page)
+    ExFreePoolWithTag(ctx.hook_orig_page, 'fr0g');
+  if (ctx.hook_exec_page)
+    ExFreePoolWithTag(ctx.hook_exec_page, 'fr0g');
+  if (ctx.copy_src)
+    MmFreeContiguousMemory(ctx.copy_src);
+  if (ctx.copy_dst)
+    ExFreePoolWithTag(ctx.copy_dst, 'fr0g');
+  if (ctx.page_tables)
+    MmFreeContiguousMemory(ctx.page_tables);
+}
+
+// allocate the benchmark resources
+static bool create_benchmark_context(benchmark_context& ctx) {
+  memset(&ctx, 0, sizeof(ctx));
+
+  PHYSICAL_ADDRESS lowest, highest, boundary;
+  lowest.QuadPart   = 0;
+  highest.QuadPart  = ~0ll;
+  boundary.QuadPart = 0;
+
+  // the hooked page needs to be executable in the guest page tables
+  ctx.hook_orig_page = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolExecute, 0x1000, 'fr0g'));
+  ctx.hook_exec_page = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, 0x1000, 'fr0g'));
+  ctx.copy_dst = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, benchmark_copy_size, 'fr0g'));
+  ctx.page_tables = static_cast<uint64_t*>(MmAllocateContiguousMemorySpecifyCache(
+    0x1000 * 4, lowest, highest, boundary, MmCached));
+
+  boundary.QuadPart = 0x20'0000;
+  ctx.copy_src = static_cast<uint8_t*>(MmAllocateContiguousMemorySpecifyCache(
+    benchmark_copy_size, lowest, highest, boundary, MmCached));
+
+  if (!ctx.hook_orig_page || !ctx.hook_exec_page || !ctx.copy_dst ||
+      !ctx.page_tables || !ctx.copy_src) {
+    free_benchmark_context(ctx);
+    return false;
+  }
+
+  // RET
+  memset(ctx.hook_orig_page, 0xC3, 0x1000);
+  memset(ctx.hook_exec_page, 0xC3, 0x1000);
+
+  memset(ctx.copy_src, 0xAB, benchmark_copy_size);
+  memset(ctx.page_tables, 0, 0x1000 * 4);
+
+  ctx.copy_src_pa = MmGetPhysicalAddress(ctx.copy_src).QuadPart;
+
+  prepare_private_page_tables(ctx);
+
+  return true;
+}
+
+// run every benchmark on the current processor. returns the number of
+// results that were written.
+static size_t run_cpu_benchmarks(benchmark_context& ctx,
+    benchmark_result (&results)[benchmark_count]) {
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+
+  auto const orig_pa = MmGetPhysicalAddress(ctx.hook_orig_page).QuadPart;
+  auto const exec_pa = MmGetPhysicalAddress(ctx.hook_exec_page).QuadPart;
+
+  // EPT hooks only apply to the current VCPU
+  auto const hooked = vmcall(hypercall_install_ept_hook, orig_pa, exec_pa) != 0;
+
+  ctx.mtrr_def_type = __readmsr(IA32_MTRR_DEF_TYPE);
+
+  // measure the real overhead of every vm-exit
+  vmcall(hypercall_set_overhead_calibration, 1);
+
+  size_t count = 0;
+
+  for (auto const& b : benchmarks) {
+    if (b.requirement == benchmark_requires_xsave && !curr_cr4.os_xsave)
+      continue;
+    if (b.requirement == benchmark_requires_ept_hook && !hooked)
+      continue;
+
+    _disable();
+    b.take_samples(ctx);
+    _enable();
+
+    sort_timing_samples(samples, benchmark_samples);
+
+    auto& r = results[count++];
+    r.name  = b.name;
+    r.bytes = b.bytes;
+    r.min   = samples[0];
+    r.p50   = samples[benchmark_samples * 50 / 100];
+    r.p90   = samples[benchmark_samples * 90 / 100];
+    r.p99   = samples[benchmark_samples * 99 / 100];
+    r.max   = samples[benchmark_samples - 1];
+  }
+
+  vmcall(hypercall_set_overhead_calibration, 0);
+
+  if (hooked)
+    vmcall(hypercall_remove_ept_hook, orig_pa);
+
+  return count;
+}
+
+// write a line to a report (and to the debugger)
+static bool write_line(HANDLE const file, char const* const line) {
+  DbgPrint("%s", line);
+
+  size_t length = 0;
+  if (!NT_SUCCESS(RtlStringCbLengthA(line, 256, &length)))
+    return false;
+
+  IO_STATUS_BLOCK io_status;
+  return NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+    const_cast<char*>(line), static_cast<ULONG>(length), nullptr, nullptr));
+}
+
+// create a report file (or overwrite an existing one) and write the CSV
+// header. returns null if the file couldn't be written.
+void* open_benchmark_report(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, GENERIC_WRITE | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the benchmark report.\n");
+    return nullptr;
+  }
+
+  if (!write_line(file, "benchmark,cpu,samples,bytes,min,p50,p90,p99,max\n")) {
+    ZwClose(file);
+    return nullptr;
+  }
+
+  return file;
+}
+
+// append the result of a benchmark on a single processor to a report
+bool write_benchmark_result(void* const report, benchmark_result const& result,
+    unsigned long const cpu, size_t const sample_count) {
+  char line[256];
+  RtlStringCbPrintfA(line, sizeof(line), "%s,%lu,%zu,%zu,%lld,%lld,%lld,%lld,%lld\n",
+    result.name, cpu, sample_count, result.bytes,
+    result.min, result.p50, result.p90, result.p99, result.max);
+
+  return write_line(report, line);
+}
+
+// close a report that was opened with open_benchmark_report()
+void close_benchmark_report(void* const report) {
+  ZwClose(report);
+}
+
+// run every benchmark on every processor and write the results to a file
+// (the hypervisor must be running). returns false if the results couldn't
+// be written.
+bool run_benchmarks(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  benchmark_context ctx;
+  if (!create_benchmark_context(ctx)) {
+    DbgPrint("[hv] Failed to allocate the benchmark resources.\n");
+    return false;
+  }
+
+  auto const report = open_benchmark_report(path);
+  if (!report) {
+    free_benchmark_context(ctx);
+    return false;
+  }
+
+  auto success = true;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count && success; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    // keep the calibration thread from running in between the benchmarks
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    benchmark_result results[benchmark_count];
+    auto const count = run_cpu_benchmarks(ctx, results);
+
+    KeLowerIrql(irql);
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+
+    for (size_t j = 0; j < count && success; ++j)
+      success = write_benchmark_result(report, results[j], i, benchmark_samples);
+  }
+
+  close_benchmark_report(report);
+  free_benchmark_context(ctx);
+
+  if (!success)
+    DbgPrint("[hv] Failed to write the benchmark results.\n");
+
+  return success;
+}
+
+} // namespace hv
+
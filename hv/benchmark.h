@@ -0,0 +1,63 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// On-target benchmarks of the hypervisor itself (as opposed to the portable
+// benchmarks in bench/, which run the handlers on the simulated machine).
+// Every benchmark is run on every processor with vm-exit overhead
+// compensation disabled, so the numbers are the real cost as seen by the
+// guest. The results are written as CSV (in TSC ticks):
+//
+//   benchmark,cpu,samples,bytes,min,p50,p90,p99,max
+//
+// bytes is the number of bytes that were copied by every sample (0 for
+// benchmarks that don't copy anything). tools/bench-diff.py compares two
+// of these files.
+//
+
+namespace hv {
+
+// run the benchmarks from driver_entry instead of the usual checks
+inline constexpr bool benchmark_mode_enabled = false;
+
+// file that the benchmark results are written to
+inline constexpr wchar_t const* benchmark_results_path =
+  L"\\SystemRoot\\hv-benchmark.csv";
+
+// number of samples that are taken for every benchmark on every processor
+inline constexpr size_t benchmark_samples = 512;
+
+// number of bytes that are copied by every memory benchmark sample
+inline constexpr size_t benchmark_copy_size = 0x10000;
+
+// a single row of a report
+struct benchmark_result {
+  char const* name;
+  size_t bytes;
+
+  int64_t min;
+  int64_t p50;
+  int64_t p90;
+  int64_t p99;
+  int64_t max;
+};
+
+// create a report file (or overwrite an existing one) and write the CSV
+// header. returns null if the file couldn't be written.
+void* open_benchmark_report(wchar_t const* path);
+
+// append the result of a benchmark on a single processor to a report
+bool write_benchmark_result(void* report, benchmark_result const& result,
+  unsigned long cpu, size_t sample_count);
+
+// close a report that was opened with open_benchmark_report()
+void close_benchmark_report(void* report);
+
+// run every benchmark on every processor and write the results to a file
+// (the hypervisor must be running). returns false if the results couldn't
+// be written.
+bool run_benchmarks(wchar_t const* path);
+
+} // namespace hv
+
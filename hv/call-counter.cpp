@@ -0,0 +1,293 @@
+#include "call-counter.h"
+#include "hv.h"
+#include "mm.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// start counting calls to a function (the address is translated with the
+// current guest CR3). returns null if the function can't be counted.
+counted_function* add_counted_function(vcpu* const cpu,
+    uint64_t const address, bool const capture_args) {
+  auto& cc = cpu->call_counter;
+
+  if (cc.function_count >= max_counted_functions)
+    return nullptr;
+
+  auto const hva = static_cast<uint8_t*>(gva2hva(
+    reinterpret_cast<void*>(address), nullptr, &cpu->exit_capture));
+  if (!hva)
+    return nullptr;
+
+  auto const physical_address = static_cast<uint64_t>(hva - host_physical_memory_base);
+
+  // the page is already being used for an EPT hook
+  if (find_ept_hook(cpu->ept, physical_address >> 12))
+    return nullptr;
+
+  // get the EPT PTE, and possibly split an existing PDE if needed
+  auto const pte = get_ept_pte(cpu->ept, physical_address, true);
+  if (!pte)
+    return nullptr;
+
+  auto& fn = cc.functions[cc.function_count++];
+  fn.address          = address;
+  fn.physical_address = physical_address;
+  fn.count            = 0;
+  fn.overhead_cycles  = 0;
+  fn.capture_args     = capture_args;
+  fn.on_call          = nullptr;
+  memset(fn.args, 0, sizeof(fn.args));
+
+  // instruction fetches from this page will now cause an ept-violation
+  pte->execute_access = 0;
+
+  vmx_invept(invept_all_context, {});
+
+  return &fn;
+}
+
+// stop counting calls to a single function
+void remove_counted_function(vcpu* const cpu, uint64_t const address) {
+  auto& cc = cpu->call_counter;
+
+  finish_call_counter_step(cpu);
+
+  for (uint32_t i = 0; i < cc.function_count; ++i) {
+    if (cc.functions[i].address != address)
+      continue;
+
+    auto const pfn = cc.functions[i].physical_address >> 12;
+
+    // keep the remaining functions in order (query_call_counts() relies on
+    // every VCPU having the same order)
+    for (uint32_t j = i + 1; j < cc.function_count; ++j)
+      cc.functions[j - 1] = cc.functions[j];
+
+    --cc.function_count;
+
+    // the page might still contain other counted functions
+    for (uint32_t j = 0; j < cc.function_count; ++j) {
+      if ((cc.functions[j].physical_address >> 12) == pfn)
+        return;
+    }
+
+    get_ept_pte(cpu->ept, pfn << 12)->execute_access = 1;
+    vmx_invept(invept_all_context, {});
+
+    return;
+  }
+}
+
+// stop counting calls to every function
+void clear_counted_functions(vcpu* const cpu) {
+  auto& cc = cpu->call_counter;
+
+  finish_call_counter_step(cpu);
+
+  for (uint32_t i = 0; i < cc.function_count; ++i)
+    get_ept_pte(cpu->ept, cc.functions[i].physical_address)->execute_access = 1;
+
+  cc.function_count = 0;
+  cc.other_exits    = 0;
+
+  vmx_invept(invept_all_context, {});
+}
+
+// whether a guest page contains counted functions (the call counter owns
+// the execute access of these pages, so they can't be EPT hooked)
+bool page_has_counted_functions(vcpu* const cpu, uint64_t const pfn) {
+  auto const& cc = cpu->call_counter;
+
+  for (uint32_t i = 0; i < cc.function_count; ++i) {
+    if ((cc.functions[i].physical_address >> 12) == pfn)
+      return true;
+  }
+
+  return false;
+}
+
+// handle an execute ept-violation on a page that contains counted functions
+// (returns false if the page doesn't contain any counted functions)
+bool handle_call_counter_violation(vcpu* const cpu, uint64_t const physical_address) {
+  auto const start_tsc = __rdtsc();
+  auto& cc = cpu->call_counter;
+
+  bool counted_page = false;
+  counted_function* entry = nullptr;
+
+  auto const rip = vmx_vmread(VMCS_GUEST_RIP);
+
+  for (uint32_t i = 0; i < cc.function_count; ++i) {
+    auto& fn = cc.functions[i];
+
+    if ((fn.physical_address >> 12) != (physical_address >> 12))
+      continue;
+
+    counted_page = true;
+
+    if (fn.physical_address == physical_address && fn.address == rip) {
+      entry = &fn;
+      break;
+    }
+  }
+
+  if (!counted_page)
+    return false;
+
+  if (entry) {
+    ++entry->count;
+
+    if (entry->capture_args) {
+      entry->args[0] = cpu->ctx->rcx;
+      entry->args[1] = cpu->ctx->rdx;
+      entry->args[2] = cpu->ctx->r8;
+      entry->args[3] = cpu->ctx->r9;
+    }
+
+    if (entry->on_call)
+      entry->on_call(cpu);
+  }
+  else
+    ++cc.other_exits;
+
+  // let the guest execute a single instruction on this page
+  auto const pte = get_ept_pte(cpu->ept, physical_address);
+  pte->execute_access = 1;
+
+  cc.stepping_pte      = pte;
+  cc.stepping_function = entry;
+  cc.step_start_tsc    = start_tsc;
+
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.monitor_trap_flag = 1;
+  write_ctrl_proc_based(ctrl);
+
+  // an interrupt that is delivered before the instruction retires would
+  // cause the entry to be executed (and counted) twice. STI-blocking can
+  // only be used if RFLAGS.IF is set, but interrupts are blocked otherwise.
+  rflags guest_rflags;
+  guest_rflags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+
+  if (guest_rflags.interrupt_enable_flag) {
+    auto state = read_interruptibility_state();
+
+    if (!state.blocking_by_mov_ss) {
+      state.blocking_by_sti = 1;
+      write_interruptibility_state(state);
+    }
+  }
+
+  return true;
+}
+
+// revoke execute access from the page that was single-stepped
+void finish_call_counter_step(vcpu* const cpu) {
+  auto& cc = cpu->call_counter;
+
+  if (!cc.stepping_pte)
+    return;
+
+  cc.stepping_pte->execute_access = 0;
+  cc.stepping_pte = nullptr;
+
+  vmx_invept(invept_all_context, {});
+
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.monitor_trap_flag = 0;
+  write_ctrl_proc_based(ctrl);
+
+  if (cc.stepping_function)
+    cc.stepping_function->overhead_cycles += __rdtsc() - cc.step_start_tsc;
+}
+
+// start counting calls to a function on every VCPU
+bool count_function_calls(void const* const address, bool const capture_args) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  bool success = true;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_add_counted_function;
+    input.key     = hypercall_key;
+    input.args[0] = reinterpret_cast<uint64_t>(address);
+    input.args[1] = capture_args;
+    success &= (vmx_vmcall(input) != 0);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+
+  return success;
+}
+
+// stop counting function calls on every VCPU
+void stop_counting_function_calls() {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code = hypercall_clear_counted_functions;
+    input.key  = hypercall_key;
+    vmx_vmcall(input);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+}
+
+// get the call counts of every counted function, summed across every VCPU.
+// returns the number of counted functions (which can be larger than count).
+uint32_t query_call_counts(call_count_entry* const entries, uint32_t const count) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  call_count_entry vcpu_entries[max_counted_functions];
+  uint32_t function_count = 0;
+
+  memset(entries, 0, sizeof(call_count_entry) * count);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_query_call_counts;
+    input.key     = hypercall_key;
+    input.args[0] = reinterpret_cast<uint64_t>(vcpu_entries);
+    input.args[1] = max_counted_functions;
+    auto const vcpu_function_count = static_cast<uint32_t>(vmx_vmcall(input));
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+
+    function_count = max(function_count, vcpu_function_count);
+
+    // every VCPU counts the same functions in the same order
+    for (uint32_t j = 0; j < min(vcpu_function_count, count); ++j) {
+      auto& e = entries[j];
+      e.address          = vcpu_entries[j].address;
+      e.count           += vcpu_entries[j].count;
+      e.overhead_cycles += vcpu_entries[j].overhead_cycles;
+
+      // keep the arguments of any VCPU that captured them
+      if (vcpu_entries[j].count)
+        memcpy(e.args, vcpu_entries[j].args, sizeof(e.args));
+    }
+  }
+
+  return function_count;
+}
+
+} // namespace hv
+
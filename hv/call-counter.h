@@ -0,0 +1,98 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Exact call counting: the pages that contain the counted functions are made
+// non-executable in the EPT. Instruction fetches on these pages cause an
+// ept-violation, where the guest RIP is compared against the function entries.
+// Execute access is then temporarily restored for a single instruction, and
+// revoked again on the following monitor trap flag vm-exit.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// maximum number of functions that can be counted per VCPU
+inline constexpr uint32_t max_counted_functions = 32;
+
+struct counted_function {
+  // guest virtual address of the function entry
+  uint64_t address;
+
+  // guest physical address of the function entry
+  uint64_t physical_address;
+
+  // number of times that the function was called
+  uint64_t count;
+
+  // root-mode TSC ticks spent on counting calls (from the ept-violation to
+  // the monitor trap flag vm-exit)
+  uint64_t overhead_cycles;
+
+  // whether the arguments of every call are captured
+  bool capture_args;
+
+  // RCX, RDX, R8, and R9 of the most recent call
+  uint64_t args[4];
+
+  // called in root-mode on every call (can be null)
+  void (*on_call)(vcpu* cpu);
+};
+
+// the format that call counts are returned in by hypercall_query_call_counts
+struct call_count_entry {
+  uint64_t address;
+  uint64_t count;
+  uint64_t overhead_cycles;
+  uint64_t args[4];
+};
+
+struct vcpu_call_counter_data {
+  counted_function functions[max_counted_functions];
+  uint32_t function_count;
+
+  // ept-violations on counted pages that weren't caused by a function entry
+  uint64_t other_exits;
+
+  // the EPT PTE that execute access is revoked from on the next monitor
+  // trap flag vm-exit (or null if no instruction is being single-stepped)
+  ept_pte* stepping_pte;
+  counted_function* stepping_function;
+  uint64_t step_start_tsc;
+};
+
+// start counting calls to a function (the address is translated with the
+// current guest CR3). returns null if the function can't be counted.
+counted_function* add_counted_function(vcpu* cpu, uint64_t address, bool capture_args);
+
+// stop counting calls to a single function
+void remove_counted_function(vcpu* cpu, uint64_t address);
+
+// stop counting calls to every function
+void clear_counted_functions(vcpu* cpu);
+
+// whether a guest page contains counted functions (the call counter owns
+// the execute access of these pages, so they can't be EPT hooked)
+bool page_has_counted_functions(vcpu* cpu, uint64_t pfn);
+
+// handle an execute ept-violation on a page that contains counted functions
+// (returns false if the page doesn't contain any counted functions)
+bool handle_call_counter_violation(vcpu* cpu, uint64_t physical_address);
+
+// revoke execute access from the page that was single-stepped
+void finish_call_counter_step(vcpu* cpu);
+
+// start counting calls to a function on every VCPU
+bool count_function_calls(void const* address, bool capture_args);
+
+// stop counting function calls on every VCPU
+void stop_counting_function_calls();
+
+// get the call counts of every counted function, summed across every VCPU.
+// returns the number of counted functions (which can be larger than count).
+uint32_t query_call_counts(call_count_entry* entries, uint32_t count);
+
+} // namespace hv
+
@@ -0,0 +1,113 @@
+#include "cr-validation.h"
+
+namespace hv {
+
+// check whether the guest is allowed to load an extended control register
+// with XSETBV (a #GP(0) should be injected otherwise). CR4.OSXSAVE must
+// already have been checked by the caller, since it causes a #UD instead.
+bool is_valid_xcr_write(uint32_t const index,
+    xcr0 const value, uint64_t const unsupported_mask) {
+  // 3.2.6
+
+  // only XCR0 is supported
+  if (index != 0)
+    return false;
+
+  // #GP(0) if trying to set an unsupported bit
+  if (value.flags & unsupported_mask)
+    return false;
+
+  // #GP(0) if clearing XCR0.X87
+  if (!value.x87)
+    return false;
+
+  // #GP(0) if XCR0.AVX is 1 while XCRO.SSE is cleared
+  if (value.avx && !value.sse)
+    return false;
+
+  // #GP(0) if XCR0.AVX is clear and XCR0.opmask, XCR0.ZMM_Hi256, or XCR0.Hi16_ZMM is set
+  if (!value.avx && (value.opmask || value.zmm_hi256 || value.zmm_hi16))
+    return false;
+
+  // #GP(0) if setting XCR0.BNDREG or XCR0.BNDCSR while not setting the other
+  if (value.bndreg != value.bndcsr)
+    return false;
+
+  // #GP(0) if setting XCR0.opmask, XCR0.ZMM_Hi256, or XCR0.Hi16_ZMM while not setting all of them
+  if (value.opmask != value.zmm_hi256 || value.zmm_hi256 != value.zmm_hi16)
+    return false;
+
+  return true;
+}
+
+// check whether the guest is allowed to load CR0 with MOV to CR0 (a #GP(0)
+// should be injected otherwise). the bits that are fixed to 0 or 1 must
+// already be fixed up in the new value.
+bool is_valid_cr0_write(cr0 const value, cr4 const curr_cr4) {
+  // 2.4.3
+  // 3.2.5
+  // 3.4.10.1
+  // 3.26.3.2.1
+
+  // #GP(0) if setting any reserved bits in CR0[63:32]
+  if (value.reserved4)
+    return false;
+
+  // #GP(0) if setting CR0.PG while CR0.PE is clear
+  if (value.paging_enable && !value.protection_enable)
+    return false;
+
+  // #GP(0) if invalid bit combination
+  if (!value.cache_disable && value.not_write_through)
+    return false;
+
+  // #GP(0) if an attempt is made to clear CR0.PG
+  if (!value.paging_enable)
+    return false;
+
+  // #GP(0) if an attempt is made to clear CR0.WP while CR4.CET is set
+  if (!value.write_protect && curr_cr4.control_flow_enforcement_enable)
+    return false;
+
+  return true;
+}
+
+// check whether the guest is allowed to load CR4 with MOV to CR4 (a #GP(0)
+// should be injected otherwise)
+bool is_valid_cr4_write(cr4 const value, cr0 const curr_cr0,
+    cr4 const curr_cr4, cr3 const curr_cr3, bool const smx_supported) {
+  // 2.4.3
+  // 2.6.2.1
+  // 3.2.5
+  // 3.4.10.1
+  // 3.4.10.4.1
+
+  // #GP(0) if an attempt is made to set CR4.SMXE when SMX is not supported
+  if (!smx_supported && value.smx_enable)
+    return false;
+
+  // #GP(0) if an attempt is made to write a 1 to any reserved bits
+  if (value.reserved1 || value.reserved2)
+    return false;
+
+  // #GP(0) if an attempt is made to change CR4.PCIDE from 0 to 1 while CR3[11:0] != 000H
+  if ((value.pcid_enable && !curr_cr4.pcid_enable) && (curr_cr3.flags & 0xFFF))
+    return false;
+
+  // #GP(0) if CR4.PAE is cleared
+  if (!value.physical_address_extension)
+    return false;
+
+  // #GP(0) if CR4.LA57 is enabled
+  if (value.linear_addresses_57_bit)
+    return false;
+
+  // #GP(0) if CR4.CET == 1 and CR0.WP == 0
+  if (value.control_flow_enforcement_enable && !curr_cr0.write_protect)
+    return false;
+
+  return true;
+}
+
+} // namespace hv
+
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+// check whether the guest is allowed to load an extended control register
+// with XSETBV (a #GP(0) should be injected otherwise). CR4.OSXSAVE must
+// already have been checked by the caller, since it causes a #UD instead.
+bool is_valid_xcr_write(uint32_t index, xcr0 value, uint64_t unsupported_mask);
+
+// check whether the guest is allowed to load CR0 with MOV to CR0 (a #GP(0)
+// should be injected otherwise). the bits that are fixed to 0 or 1 must
+// already be fixed up in the new value.
+bool is_valid_cr0_write(cr0 value, cr4 curr_cr4);
+
+// check whether the guest is allowed to load CR4 with MOV to CR4 (a #GP(0)
+// should be injected otherwise)
+bool is_valid_cr4_write(cr4 value, cr0 curr_cr0,
+  cr4 curr_cr4, cr3 curr_cr3, bool smx_supported);
+
+} // namespace hv
+
@@ -0,0 +1,82 @@
+#include "cr3-telemetry.h"
+
+namespace hv {
+
+// count a load of the specified CR3 value. this is the space-saving
+// algorithm: an untracked value replaces the least frequent candidate and
+// inherits its count, which overestimates it by at most that count.
+void count_cr3_load(vcpu_cr3_telemetry_data& telemetry, uint64_t const cr3) {
+  auto min_entry = &telemetry.candidates[0];
+
+  for (auto& entry : telemetry.candidates) {
+    if (entry.cr3 == cr3) {
+      ++entry.count;
+      return;
+    }
+
+    if (entry.count < min_entry->count)
+      min_entry = &entry;
+  }
+
+  min_entry->cr3 = cr3;
+  ++min_entry->count;
+}
+
+// pick (at most max_targets of) the most frequently loaded CR3 values as
+// the new CR3-target list, and age the counts
+void update_cr3_hot_set(vcpu_cr3_telemetry_data& telemetry, uint32_t const max_targets) {
+  bool selected[cr3_hot_set_candidate_count] = {};
+  telemetry.target_count = 0;
+
+  while (telemetry.target_count < max_targets) {
+    int best = -1;
+
+    for (uint32_t i = 0; i < cr3_hot_set_candidate_count; ++i) {
+      auto const& entry = telemetry.candidates[i];
+
+      if (selected[i] || !entry.count)
+        continue;
+
+      if (best < 0 || entry.count > telemetry.candidates[best].count)
+        best = i;
+    }
+
+    if (best < 0)
+      break;
+
+    selected[best] = true;
+    telemetry.targets[telemetry.target_count++] = telemetry.candidates[best].cr3;
+  }
+
+  // age the counts so that the hot set follows changes in the workload
+  for (auto& entry : telemetry.candidates)
+    entry.count /= 2;
+}
+
+// count a MOV to CR3 from old_cr3 (the guest CR3 at the time of the
+// vm-exit) to new_cr3. returns the flags of its record.
+uint32_t track_cr3_load(vcpu_cr3_telemetry_data& telemetry,
+    uint64_t const old_cr3, uint64_t const new_cr3) {
+  uint32_t flags = 0;
+
+  // the guest switched to old_cr3 without a vm-exit, which only happens
+  // for CR3-target values. count it so that it stays in the hot set.
+  if ((old_cr3 & ~(1ull << 63)) != (telemetry.last_cr3 & ~(1ull << 63))) {
+    flags |= cr3_load_hidden_switch_flag;
+
+    for (uint32_t i = 0; i < telemetry.target_count; ++i) {
+      if ((telemetry.targets[i] & ~(1ull << 63)) == old_cr3) {
+        count_cr3_load(telemetry, telemetry.targets[i]);
+        break;
+      }
+    }
+  }
+
+  telemetry.last_cr3 = new_cr3;
+  count_cr3_load(telemetry, new_cr3);
+
+  return flags;
+}
+
+} // namespace hv
+
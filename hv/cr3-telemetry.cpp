@@ -0,0 +1,168 @@
+#include "cr3-telemetry.h"
+#include "hv.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// enable or disable CR3-load telemetry on the current VCPU
+void set_cr3_telemetry(vcpu* const cpu, bool const enabled) {
+  auto& telemetry = cpu->cr3_telemetry;
+
+  telemetry.enabled            = enabled;
+  telemetry.last_cr3           = vmx_vmread(VMCS_GUEST_CR3);
+  telemetry.loads_since_update = 0;
+  telemetry.target_count       = 0;
+  memset(telemetry.candidates, 0, sizeof(telemetry.candidates));
+
+  // CR3-load exiting and the CR3-target list are part of the exit profile
+  apply_exit_profile(cpu, cpu->current_exit_profile);
+}
+
+// write the CR3-target list that is chosen by the hot-set algorithm
+void write_cr3_telemetry_targets(vcpu* const cpu) {
+  auto const& telemetry = cpu->cr3_telemetry;
+
+  static constexpr uint64_t target_fields[max_cr3_target_count] = {
+    VMCS_CTRL_CR3_TARGET_VALUE_0,
+    VMCS_CTRL_CR3_TARGET_VALUE_1,
+    VMCS_CTRL_CR3_TARGET_VALUE_2,
+    VMCS_CTRL_CR3_TARGET_VALUE_3
+  };
+
+  // 3.24.6.7
+  vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT, telemetry.target_count);
+
+  for (uint32_t i = 0; i < telemetry.target_count; ++i)
+    vmx_vmwrite(target_fields[i], telemetry.targets[i]);
+}
+
+// record a MOV to CR3 (called before the new value is written)
+void record_cr3_load(vcpu* const cpu, uint64_t const new_cr3) {
+  auto& telemetry = cpu->cr3_telemetry;
+
+  if (!telemetry.enabled)
+    return;
+
+  auto const old_cr3 = vmx_vmread(VMCS_GUEST_CR3);
+  auto const flags   = track_cr3_load(telemetry, old_cr3, new_cr3);
+
+  if (++telemetry.loads_since_update >= cr3_hot_set_update_interval) {
+    telemetry.loads_since_update = 0;
+
+    update_cr3_hot_set(telemetry, min(max_cr3_target_count,
+      static_cast<uint32_t>(cpu->cached.vmx_misc.cr3_target_count)));
+    write_cr3_telemetry_targets(cpu);
+  }
+
+  auto& ring = *telemetry.ring;
+
+  if (ring.head - ring.tail >= cr3_ring_record_count) {
+    ++ring.dropped;
+    return;
+  }
+
+  auto& record = ring.records[ring.head & (cr3_ring_record_count - 1)];
+  record.tsc        = __rdtsc();
+  record.old_cr3    = old_cr3;
+  record.new_cr3    = new_cr3;
+  record.vcpu_index = static_cast<uint16_t>(cpu - ghv.vcpus);
+  record.flags      = flags;
+
+  // the record needs to be visible before the consumer sees the new head
+  _WriteBarrier();
+  ring.head = ring.head + 1;
+
+  auto const fill = ring.head - ring.tail;
+  check_ring_watermark(cpu, fill - 1, fill, cr3_ring_record_count);
+}
+
+// read the next record from a CR3-load ring (returns false if it is empty)
+bool read_cr3_load_record(vcpu_cr3_ring& ring, cr3_load_record& record) {
+  auto const tail = ring.tail;
+
+  if (tail == ring.head)
+    return false;
+
+  // make sure the record isn't read before the head
+  _ReadBarrier();
+
+  record = ring.records[tail & (cr3_ring_record_count - 1)];
+
+  // the producer can reuse the record once it has been copied
+  _ReadWriteBarrier();
+  ring.tail = tail + 1;
+
+  return true;
+}
+
+// enable or disable CR3-load telemetry on every VCPU
+void set_cr3_telemetry(bool const enabled) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_set_cr3_telemetry;
+    input.key     = hypercall_key;
+    input.args[0] = enabled;
+    vmx_vmcall(input);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+}
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's CR3-load ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of records written.
+uint64_t write_cr3_loads(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!ghv.cr3_rings)
+    return 0;
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, FILE_APPEND_DATA | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the CR3-load file.\n");
+    return 0;
+  }
+
+  uint64_t count = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    cr3_load_record record;
+
+    while (read_cr3_load_record(ghv.cr3_rings[i], record)) {
+      if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+          &record, sizeof(record), nullptr, nullptr)))
+        break;
+
+      ++count;
+    }
+  }
+
+  ZwClose(file);
+
+  return count;
+}
+
+#endif
+
+} // namespace hv
+
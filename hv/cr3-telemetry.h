@@ -0,0 +1,129 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Opt-in CR3-load telemetry. Every MOV to CR3 that causes a vm-exit is
+// recorded into a per-VCPU ring. To keep the overhead down, the most
+// frequently loaded values are put into the CR3-target list, which means
+// that loads of these values no longer cause vm-exits. Such a hidden load
+// still shows up in the stream: the next recorded load has an old CR3 that
+// doesn't match the previously recorded new CR3, and is flagged with
+// cr3_load_hidden_switch_flag. The exact time of the hidden load is lost,
+// but it is bounded by the TSC values of the two surrounding records.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// number of records in a CR3-load ring (must be a power of two)
+inline constexpr uint32_t cr3_ring_record_count = 2048;
+
+static_assert((cr3_ring_record_count & (cr3_ring_record_count - 1)) == 0);
+
+// maximum number of CR3-target values (3.24.6.7)
+inline constexpr uint32_t max_cr3_target_count = 4;
+
+// number of CR3 values whose load frequency is tracked
+inline constexpr uint32_t cr3_hot_set_candidate_count = 16;
+
+// number of recorded CR3 loads between CR3-target list updates
+inline constexpr uint32_t cr3_hot_set_update_interval = 4096;
+
+// the old CR3 was loaded without a vm-exit (it is a CR3-target value)
+inline constexpr uint32_t cr3_load_hidden_switch_flag = 1 << 0;
+
+// file that the CR3-load records are written to by the device
+inline constexpr wchar_t const* cr3_load_path =
+  L"\\SystemRoot\\hv-cr3-loads.bin";
+
+struct cr3_load_record {
+  uint64_t tsc;
+  uint64_t old_cr3;
+
+  // the MOV to CR3 source operand (bit 63 is the PCID no-flush bit)
+  uint64_t new_cr3;
+
+  uint16_t vcpu_index;
+  uint16_t _reserved;
+  uint32_t flags;
+};
+
+static_assert(sizeof(cr3_load_record) == 32);
+
+// single-producer (the VCPU in root mode), single-consumer CR3-load ring
+struct vcpu_cr3_ring {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of records that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  alignas(64) cr3_load_record records[cr3_ring_record_count];
+};
+
+struct cr3_hot_set_entry {
+  uint64_t cr3;
+  uint64_t count;
+};
+
+struct vcpu_cr3_telemetry_data {
+  // CR3-load ring (this lives in ghv.cr3_rings)
+  vcpu_cr3_ring* ring;
+
+  bool enabled;
+
+  // the new CR3 of the most recently recorded load
+  uint64_t last_cr3;
+
+  // approximate load frequencies (space-saving algorithm)
+  cr3_hot_set_entry candidates[cr3_hot_set_candidate_count];
+  uint32_t loads_since_update;
+
+  // the current CR3-target values
+  uint64_t targets[max_cr3_target_count];
+  uint32_t target_count;
+};
+
+// count a load of the specified CR3 value (cr3-hot-set.cpp, which doesn't
+// touch hardware and is also built into hv-core)
+void count_cr3_load(vcpu_cr3_telemetry_data& telemetry, uint64_t cr3);
+
+// pick (at most max_targets of) the most frequently loaded CR3 values as
+// the new CR3-target list, and age the counts
+void update_cr3_hot_set(vcpu_cr3_telemetry_data& telemetry, uint32_t max_targets);
+
+// count a MOV to CR3 from old_cr3 (the guest CR3 at the time of the
+// vm-exit) to new_cr3. returns the flags of its record.
+uint32_t track_cr3_load(vcpu_cr3_telemetry_data& telemetry,
+  uint64_t old_cr3, uint64_t new_cr3);
+
+// enable or disable CR3-load telemetry on the current VCPU
+void set_cr3_telemetry(vcpu* cpu, bool enabled);
+
+// write the CR3-target list that is chosen by the hot-set algorithm
+void write_cr3_telemetry_targets(vcpu* cpu);
+
+// record a MOV to CR3 (called before the new value is written)
+void record_cr3_load(vcpu* cpu, uint64_t new_cr3);
+
+// read the next record from a CR3-load ring (returns false if it is empty)
+bool read_cr3_load_record(vcpu_cr3_ring& ring, cr3_load_record& record);
+
+// enable or disable CR3-load telemetry on every VCPU
+void set_cr3_telemetry(bool enabled);
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's CR3-load ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of records written.
+uint64_t write_cr3_loads(wchar_t const* path);
+
+#endif
+
+} // namespace hv
+
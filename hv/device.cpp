@@ -0,0 +1,216 @@
+#include "device.h"
+#include "hv.h"
+
+#include <ntddk.h>
+#include <wdmsec.h>
+
+namespace hv {
+
+static PDEVICE_OBJECT device;
+
+// {0AFE66DE-228C-44CE-B74A-2A0E834B61F5} (the device class, which allows an
+// administrator to override the security descriptor in the registry)
+static GUID const device_class = { 0x0AFE66DE, 0x228C, 0x44CE,
+  { 0xB7, 0x4A, 0x2A, 0x0E, 0x83, 0x4B, 0x61, 0xF5 } };
+
+static UNICODE_STRING device_name = RTL_CONSTANT_STRING(L"\\Device\\hv");
+static UNICODE_STRING link_name   = RTL_CONSTANT_STRING(L"\\DosDevices\\hv");
+
+static NTSTATUS complete_irp(PIRP const irp,
+    NTSTATUS const status, ULONG_PTR const information = 0) {
+  irp->IoStatus.Status      = status;
+  irp->IoStatus.Information = information;
+  IoCompleteRequest(irp, IO_NO_INCREMENT);
+  return status;
+}
+
+// IRP_MJ_CREATE and IRP_MJ_CLOSE
+static NTSTATUS dispatch_create_close(PDEVICE_OBJECT, PIRP const irp) {
+  return complete_irp(irp, STATUS_SUCCESS);
+}
+
+// IRP_MJ_CLEANUP is sent (in the context of the client) when the client
+// closes its last handle, which also happens when the client exits
+static NTSTATUS dispatch_cleanup(PDEVICE_OBJECT, PIRP const irp) {
+  unmap_process_exit_stats();
+  return complete_irp(irp, STATUS_SUCCESS);
+}
+
+// IRP_MJ_DEVICE_CONTROL (we're the top-level driver, so this is called in
+// the context of the client)
+static NTSTATUS dispatch_device_control(PDEVICE_OBJECT, PIRP const irp) {
+  auto const stack  = IoGetCurrentIrpStackLocation(irp);
+  auto const& args  = stack->Parameters.DeviceIoControl;
+  auto const buffer = static_cast<exit_stats_view*>(irp->AssociatedIrp.SystemBuffer);
+
+  switch (args.IoControlCode) {
+  case ioctl_map_exit_stats: {
+    if (args.OutputBufferLength < sizeof(exit_stats_view))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    auto const address = map_exit_stats();
+    if (!address)
+      return complete_irp(irp, STATUS_INSUFFICIENT_RESOURCES);
+
+    buffer->address    = reinterpret_cast<uint64_t>(address);
+    buffer->vcpu_count = ghv.vcpu_count;
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(exit_stats_view));
+  }
+  case ioctl_unmap_exit_stats: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    if (!unmap_exit_stats(reinterpret_cast<void*>(buffer->address)))
+      return complete_irp(irp, STATUS_INVALID_PARAMETER);
+
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_write_exit_trace: {
+    if (args.OutputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    *static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) =
+      write_exit_trace(exit_trace_path);
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(uint64_t));
+  }
+  case ioctl_write_profiler_samples: {
+    if (args.OutputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    *static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) =
+      write_profiler_samples(profiler_sample_path);
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(uint64_t));
+  }
+  case ioctl_set_syscall_tracing: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    if (!*static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer)) {
+      stop_syscall_tracing();
+      return complete_irp(irp, STATUS_SUCCESS);
+    }
+
+    // the entry point doesn't start with SWAPGS, or the page is in use
+    if (!start_syscall_tracing()) {
+      stop_syscall_tracing();
+      return complete_irp(irp, STATUS_NOT_SUPPORTED);
+    }
+
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_write_syscall_trace: {
+    if (args.OutputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    *static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) =
+      write_syscall_trace(syscall_trace_path);
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(uint64_t));
+  }
+  case ioctl_set_syscall_sample_rate: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    set_syscall_sample_rate(*static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer));
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_set_syscall_cr3_filter: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    set_syscall_cr3_filter(*static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer));
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_set_syscall_filter: {
+    if (args.InputBufferLength < sizeof(syscall_filter_entry))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    auto const entry = static_cast<syscall_filter_entry*>(irp->AssociatedIrp.SystemBuffer);
+    if (entry->number >= syscall_filter_size)
+      return complete_irp(irp, STATUS_INVALID_PARAMETER);
+
+    set_syscall_filter(entry->number, entry->record != 0);
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_clear_syscall_filter:
+    clear_syscall_filter();
+    return complete_irp(irp, STATUS_SUCCESS);
+  case ioctl_set_cr3_telemetry: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    set_cr3_telemetry(*static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) != 0);
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_write_cr3_loads: {
+    if (args.OutputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    *static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) =
+      write_cr3_loads(cr3_load_path);
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(uint64_t));
+  }
+  case ioctl_set_exit_capture: {
+    if (args.InputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    set_exit_capture(*static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) != 0);
+    return complete_irp(irp, STATUS_SUCCESS);
+  }
+  case ioctl_write_exit_capture: {
+    if (args.OutputBufferLength < sizeof(uint64_t))
+      return complete_irp(irp, STATUS_BUFFER_TOO_SMALL);
+
+    *static_cast<uint64_t*>(irp->AssociatedIrp.SystemBuffer) =
+      write_exit_capture(exit_capture_path);
+    return complete_irp(irp, STATUS_SUCCESS, sizeof(uint64_t));
+  }
+  }
+
+  return complete_irp(irp, STATUS_INVALID_DEVICE_REQUEST);
+}
+
+// create the device and its symbolic link. the exit statistics contain guest
+// kernel addresses, and some IOCTLs write files as the driver, so the device
+// is restricted to SYSTEM and administrators.
+bool create_device(PDRIVER_OBJECT const driver) {
+  auto status = IoCreateDeviceSecure(driver, 0, &device_name, FILE_DEVICE_UNKNOWN,
+    FILE_DEVICE_SECURE_OPEN, FALSE, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL, &device_class, &device);
+
+  if (!NT_SUCCESS(status)) {
+    DbgPrint("[hv] Failed to create device (0x%X).\n", status);
+    device = nullptr;
+    return false;
+  }
+
+  status = IoCreateSymbolicLink(&link_name, &device_name);
+
+  if (!NT_SUCCESS(status)) {
+    DbgPrint("[hv] Failed to create symbolic link (0x%X).\n", status);
+    IoDeleteDevice(device);
+    device = nullptr;
+    return false;
+  }
+
+  driver->MajorFunction[IRP_MJ_CREATE]         = dispatch_create_close;
+  driver->MajorFunction[IRP_MJ_CLOSE]          = dispatch_create_close;
+  driver->MajorFunction[IRP_MJ_CLEANUP]        = dispatch_cleanup;
+  driver->MajorFunction[IRP_MJ_DEVICE_CONTROL] = dispatch_device_control;
+
+  device->Flags |= DO_BUFFERED_IO;
+  device->Flags &= ~DO_DEVICE_INITIALIZING;
+
+  return true;
+}
+
+// delete the device that was created with create_device()
+void delete_device() {
+  if (!device)
+    return;
+
+  IoDeleteSymbolicLink(&link_name);
+  IoDeleteDevice(device);
+  device = nullptr;
+}
+
+} // namespace hv
+
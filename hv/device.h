@@ -0,0 +1,89 @@
+#pragma once
+
+#include <ntddk.h>
+#include <ia32.hpp>
+
+//
+// The \\.\hv device that clients use for things that can't be done with a
+// hypercall (mapping memory into the client, for example). Only SYSTEM and
+// administrators can open the device. Every IOCTL is METHOD_BUFFERED, and
+// needs FILE_READ_DATA (reading hypervisor state) or FILE_WRITE_DATA
+// (changing hypervisor state, or writing files as the driver).
+//
+
+namespace hv {
+
+// CTL_CODE(FILE_DEVICE_UNKNOWN, function, METHOD_BUFFERED, access)
+inline constexpr uint32_t ioctl_code(uint32_t const function, uint32_t const access) {
+  return (0x22 << 16) | (access << 14) | (function << 2);
+}
+
+// map the vm-exit statistics into the client (output: exit_stats_view)
+inline constexpr uint32_t ioctl_map_exit_stats = ioctl_code(0x800, FILE_READ_DATA);
+
+// unmap the vm-exit statistics (input: exit_stats_view::address)
+inline constexpr uint32_t ioctl_unmap_exit_stats = ioctl_code(0x801, FILE_READ_DATA);
+
+// drain the vm-exit trace rings into exit_trace_path (output: the number
+// of records that were written as a uint64_t)
+inline constexpr uint32_t ioctl_write_exit_trace = ioctl_code(0x802, FILE_WRITE_DATA);
+
+// drain the profiler sample rings into profiler_sample_path (output: the
+// number of samples that were written as a uint64_t)
+inline constexpr uint32_t ioctl_write_profiler_samples = ioctl_code(0x803, FILE_WRITE_DATA);
+
+// start (1) or stop (0) tracing syscalls on every VCPU (input: uint64_t)
+inline constexpr uint32_t ioctl_set_syscall_tracing = ioctl_code(0x804, FILE_WRITE_DATA);
+
+// drain the syscall rings into syscall_trace_path (output: the number of
+// records that were written as a uint64_t)
+inline constexpr uint32_t ioctl_write_syscall_trace = ioctl_code(0x805, FILE_WRITE_DATA);
+
+// only record one out of every rate syscalls (input: uint64_t)
+inline constexpr uint32_t ioctl_set_syscall_sample_rate = ioctl_code(0x806, FILE_WRITE_DATA);
+
+// only record syscalls that are made by an address space, or 0 for every
+// address space (input: uint64_t)
+inline constexpr uint32_t ioctl_set_syscall_cr3_filter = ioctl_code(0x807, FILE_WRITE_DATA);
+
+// record or ignore a syscall number (input: syscall_filter_entry)
+inline constexpr uint32_t ioctl_set_syscall_filter = ioctl_code(0x808, FILE_WRITE_DATA);
+
+// record every syscall number again
+inline constexpr uint32_t ioctl_clear_syscall_filter = ioctl_code(0x809, FILE_WRITE_DATA);
+
+// enable (1) or disable (0) CR3-load telemetry on every VCPU (input: uint64_t)
+inline constexpr uint32_t ioctl_set_cr3_telemetry = ioctl_code(0x80A, FILE_WRITE_DATA);
+
+// drain the CR3-load rings into cr3_load_path (output: the number of
+// records that were written as a uint64_t)
+inline constexpr uint32_t ioctl_write_cr3_loads = ioctl_code(0x80B, FILE_WRITE_DATA);
+
+// start (1) or stop (0) vm-exit capture on every VCPU (input: uint64_t)
+inline constexpr uint32_t ioctl_set_exit_capture = ioctl_code(0x80C, FILE_WRITE_DATA);
+
+// drain the capture rings into exit_capture_path (output: the number of
+// bytes that were written as a uint64_t)
+inline constexpr uint32_t ioctl_write_exit_capture = ioctl_code(0x80D, FILE_WRITE_DATA);
+
+// vm-exit statistics that were mapped into the client
+struct exit_stats_view {
+  // an array of vcpu_count vcpu_exit_stats structures
+  uint64_t address;
+  uint64_t vcpu_count;
+};
+
+// a syscall number that should be recorded or ignored
+struct syscall_filter_entry {
+  uint32_t number;
+  uint32_t record;
+};
+
+// create the device and its symbolic link
+bool create_device(PDRIVER_OBJECT driver);
+
+// delete the device that was created with create_device()
+void delete_device();
+
+} // namespace hv
+
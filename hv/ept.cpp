@@ -1,8 +1,9 @@
 #include "ept.h"
 #include "arch.h"
-#include "vcpu.h"
 #include "mtrr.h"
 #include "mm.h"
+#include "page-tables.h"
+#include "vmx.h"
 
 namespace hv {
 
@@ -187,16 +188,14 @@ void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
   if (!pde_2mb->large_page)
     return;
 
+  // allocate a free page for the PT
+  uint64_t pt_pfn = 0;
+  auto const pt = reinterpret_cast<ept_pte*>(allocate_ept_free_page(ept, &pt_pfn));
+
   // no available free pages
-  if (ept.num_used_free_pages >= ept_free_page_count)
+  if (!pt)
     return;
 
-  // allocate a free page for the PT
-  auto const pt_pfn = ept.free_page_pfns[ept.num_used_free_pages];
-  auto const pt = reinterpret_cast<ept_pte*>(
-    &ept.free_pages[ept.num_used_free_pages]);
-  ++ept.num_used_free_pages;
-
   for (size_t i = 0; i < 512; ++i) {
     auto& pte = pt[i];
     pte.flags = 0;
@@ -226,6 +225,16 @@ void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
   pde->page_frame_number = pt_pfn;
 }
 
+// take a page from the free page array (returns null if there are none
+// left). free pages are never given back.
+uint8_t* allocate_ept_free_page(vcpu_ept_data& ept, uint64_t* const pfn) {
+  if (ept.num_used_free_pages >= ept_free_page_count)
+    return nullptr;
+
+  *pfn = ept.free_page_pfns[ept.num_used_free_pages];
+  return ept.free_pages[ept.num_used_free_pages++];
+}
+
 // memory read/written will use the original page while code
 // being executed will use the executable page instead
 bool install_ept_hook(vcpu_ept_data& ept,
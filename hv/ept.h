@@ -82,6 +82,10 @@ ept_pte* get_ept_pte(vcpu_ept_data& ept,
 // split a 2MB EPT PDE so that it points to an EPT PT
 void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* pde_2mb);
 
+// take a page from the free page array (returns null if there are none
+// left). free pages are never given back.
+uint8_t* allocate_ept_free_page(vcpu_ept_data& ept, uint64_t* pfn);
+
 // memory read/written will use the original page while code
 // being executed will use the executable page instead
 bool install_ept_hook(vcpu_ept_data& ept,
@@ -0,0 +1,363 @@
+#include "exit-capture.h"
+#include "hv.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// whether a captured field has changed since the previous record
+static uint64_t changed_fields_mask(vcpu_exit_capture_data const& capture) {
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < exit_capture_field_count; ++i) {
+    if (capture.fields[i] != capture.prev_fields[i])
+      mask |= 1ull << i;
+  }
+
+  return mask;
+}
+
+// only write-back memory is captured, since reading MMIO can have side
+// effects (the EPT memory types are derived from the MTRRs)
+static bool is_capturable_page(vcpu* const cpu, uint64_t const pfn) {
+  auto const pde_2mb = reinterpret_cast<ept_pde_2mb*>(
+    get_ept_pde(cpu->ept, pfn << 12));
+
+  if (!pde_2mb)
+    return false;
+
+  if (pde_2mb->large_page)
+    return pde_2mb->memory_type == MEMORY_TYPE_WRITE_BACK;
+
+  auto const pte = get_ept_pte(cpu->ept, pfn << 12);
+  return pte && pte->memory_type == MEMORY_TYPE_WRITE_BACK;
+}
+
+// copy a record into the ring (it might wrap around the end)
+static void write_capture_bytes(vcpu_exit_capture_ring& ring,
+    uint64_t const offset, uint8_t const* const data, size_t const size) {
+  auto const start = static_cast<size_t>((ring.head + offset) & (exit_capture_ring_size - 1));
+  auto const first = min(size, exit_capture_ring_size - start);
+
+  memcpy(ring.data + start, data, first);
+  memcpy(ring.data, data + first, size - first);
+}
+
+// write a page record for every page that wasn't captured yet. returns the
+// number of bytes that were written past the head, or -1 if the ring is full.
+static int64_t write_page_records(vcpu* const cpu, uint64_t const space) {
+  auto& capture = cpu->exit_capture;
+  auto& ring    = *capture.ring;
+
+  uint64_t size = 0;
+
+  for (uint32_t i = 0; i < capture.page_count; ++i) {
+    auto const pfn = capture.pages[i];
+    auto& entry    = capture.captured_pages[pfn & (exit_capture_page_set_size - 1)];
+
+    if (entry == pfn + 1)
+      continue;
+
+    if (!is_capturable_page(cpu, pfn)) {
+      capture.pages_missing = true;
+      continue;
+    }
+
+    if (space - size < max_exit_capture_page_record_size + max_exit_capture_record_size)
+      return -1;
+
+    uint8_t header[1 + 10];
+    header[0] = exit_capture_page_record;
+    auto const header_size = static_cast<size_t>(write_varint(header + 1, pfn) - header);
+
+    write_capture_bytes(ring, size, header, header_size);
+    write_capture_bytes(ring, size + header_size,
+      host_physical_memory_base + (pfn << 12), 0x1000);
+
+    size  += header_size + 0x1000;
+    entry  = pfn + 1;
+  }
+
+  return static_cast<int64_t>(size);
+}
+
+void exit_capture_module::on_vm_exit(vcpu* const cpu, vmx_vmexit_reason) {
+  auto& capture = cpu->exit_capture;
+
+  if (!capture.enabled)
+    return;
+
+  capture.active        = true;
+  capture.pages_missing = false;
+  capture.page_count    = 0;
+
+  memcpy(capture.fields, cpu->ctx->gpr, sizeof(cpu->ctx->gpr));
+
+  for (size_t i = 0; i < sizeof(exit_capture_fields) / sizeof(exit_capture_fields[0]); ++i)
+    capture.fields[exit_capture_gpr_count + i] = vmx_vmread(exit_capture_fields[i]);
+
+  capture.handler_tsc = __rdtsc();
+}
+
+void exit_capture_module::on_vm_exit_handled(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto& capture = cpu->exit_capture;
+
+  if (!capture.active)
+    return;
+
+  auto const handler_cycles = __rdtsc() - capture.handler_tsc;
+
+  capture.active = false;
+
+  auto& ring = *capture.ring;
+
+  // every page needs to be captured again once in a while, since the guest
+  // keeps modifying memory between vm-exits
+  if (++capture.exits_since_refresh >= exit_capture_page_refresh_interval) {
+    capture.exits_since_refresh = 0;
+    capture.sync                = true;
+  }
+
+  if (capture.sync)
+    memset(capture.captured_pages, 0, sizeof(capture.captured_pages));
+
+  auto const space = exit_capture_ring_size - (ring.head - ring.tail);
+
+  // not enough space for a record of the maximum size
+  auto const pages_size = (space < max_exit_capture_record_size)
+    ? -1 : write_page_records(cpu, space);
+
+  if (pages_size < 0) {
+    ++ring.dropped;
+    capture.sync = true;
+    return;
+  }
+
+  uint8_t flags = 0;
+
+  if (capture.sync) {
+    flags |= exit_capture_sync_flag;
+    capture.sync = false;
+  }
+
+  if (capture.pages_missing)
+    flags |= exit_capture_pages_missing_flag;
+
+  auto const mask = (flags & exit_capture_sync_flag)
+    ? (~0ull >> (64 - exit_capture_field_count)) : changed_fields_mask(capture);
+
+  uint8_t record[max_exit_capture_record_size];
+  auto out = record;
+
+  *out++ = exit_capture_exit_record;
+  *out++ = flags;
+  out = write_varint(out, reason.basic_exit_reason);
+  out = write_varint(out, mask);
+
+  for (size_t i = 0; i < exit_capture_field_count; ++i) {
+    if (mask & (1ull << i))
+      out = write_varint(out, capture.fields[i]);
+  }
+
+  out = write_varint(out, handler_cycles);
+
+  memcpy(capture.prev_fields, capture.fields, sizeof(capture.fields));
+
+  auto const size = pages_size + static_cast<uint64_t>(out - record);
+  write_capture_bytes(ring, pages_size, record, static_cast<size_t>(out - record));
+
+  // the records need to be visible before the consumer sees the new head
+  _WriteBarrier();
+  ring.head += size;
+
+  auto const fill = ring.head - ring.tail;
+  check_ring_watermark(cpu, fill - size, fill, exit_capture_ring_size);
+}
+
+// enable or disable vm-exit capture on the current VCPU
+void set_exit_capture(vcpu* const cpu, bool const enabled) {
+  auto& capture = cpu->exit_capture;
+
+  // the first record is always a sync record
+  capture.enabled             = enabled;
+  capture.active              = false;
+  capture.sync                = true;
+  capture.exits_since_refresh = 0;
+}
+
+// read an unsigned LEB128 varint without reading past the end
+static bool read_bounded_varint(uint8_t const*& in,
+    uint8_t const* const end, uint64_t& value) {
+  value = 0;
+
+  for (int shift = 0; shift < 64 && in < end; shift += 7) {
+    auto const byte = *in++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80))
+      return true;
+  }
+
+  return false;
+}
+
+// decode the next record (returns false if the data is truncated or invalid)
+bool read_exit_capture_record(exit_capture_decoder& decoder,
+    uint8_t const*& in, uint8_t const* const end, exit_capture_record& record) {
+  if (in >= end)
+    return false;
+
+  record.type = *in++;
+
+  if (record.type == exit_capture_page_record) {
+    if (!read_bounded_varint(in, end, record.pfn) || end - in < 0x1000)
+      return false;
+
+    record.page = in;
+    in += 0x1000;
+
+    return true;
+  }
+
+  if (record.type != exit_capture_exit_record || in >= end)
+    return false;
+
+  record.flags = *in++;
+
+  uint64_t reason, mask;
+  if (!read_bounded_varint(in, end, reason) || !read_bounded_varint(in, end, mask))
+    return false;
+
+  record.reason = static_cast<uint16_t>(reason);
+
+  // a sync record contains every field
+  if (record.flags & exit_capture_sync_flag)
+    memset(decoder.prev_fields, 0, sizeof(decoder.prev_fields));
+
+  for (size_t i = 0; i < exit_capture_field_count; ++i) {
+    if (!(mask & (1ull << i)))
+      record.fields[i] = decoder.prev_fields[i];
+    else if (!read_bounded_varint(in, end, record.fields[i]))
+      return false;
+  }
+
+  if (!read_bounded_varint(in, end, record.handler_cycles))
+    return false;
+
+  memcpy(decoder.prev_fields, record.fields, sizeof(record.fields));
+
+  return true;
+}
+
+// enable or disable vm-exit capture on every VCPU
+void set_exit_capture(bool const enabled) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_set_exit_capture;
+    input.key     = hypercall_key;
+    input.args[0] = enabled;
+    vmx_vmcall(input);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+}
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's capture ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of bytes written.
+uint64_t write_exit_capture(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!ghv.exit_capture_rings)
+    return 0;
+
+  // records are copied out of the ring first, so that the producer can
+  // reuse the space while the file is being written
+  auto const buffer = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, exit_capture_ring_size, 'fr0g'));
+
+  if (!buffer) {
+    DbgPrint("[hv] Failed to allocate the exit capture buffer.\n");
+    return 0;
+  }
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, FILE_APPEND_DATA | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the exit capture file.\n");
+    ExFreePoolWithTag(buffer, 'fr0g');
+    return 0;
+  }
+
+  uint64_t written = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto& ring = ghv.exit_capture_rings[i];
+
+    auto const tail = ring.tail;
+    auto const head = ring.head;
+
+    if (tail == head)
+      continue;
+
+    // make sure the record data isn't read before the head
+    _ReadBarrier();
+
+    auto const size  = static_cast<size_t>(head - tail);
+    auto const start = static_cast<size_t>(tail & (exit_capture_ring_size - 1));
+    auto const first = min(size, exit_capture_ring_size - start);
+
+    memcpy(buffer, ring.data + start, first);
+    memcpy(buffer + first, ring.data, size - first);
+
+    // the producer can reuse the space once the data has been copied
+    _ReadWriteBarrier();
+    ring.tail = head;
+
+    exit_capture_chunk_header header;
+    header.magic      = exit_capture_file_magic;
+    header.version    = exit_capture_file_version;
+    header.vcpu_index = static_cast<uint16_t>(i);
+    header.size       = static_cast<uint32_t>(size);
+    header._reserved  = 0;
+    header.dropped    = ring.dropped;
+
+    if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+        &header, sizeof(header), nullptr, nullptr)))
+      break;
+
+    if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+        buffer, static_cast<ULONG>(size), nullptr, nullptr)))
+      break;
+
+    written += sizeof(header) + size;
+  }
+
+  ZwClose(file);
+  ExFreePoolWithTag(buffer, 'fr0g');
+
+  return written;
+}
+
+#endif
+
+} // namespace hv
+
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Opt-in vm-exit capture for offline replay (see bench/exit-replay.cpp).
+// Unlike the exit trace, this records everything that a handler needs in
+// order to run again on the simulated machine: the guest GPRs and the VMCS
+// fields in exit_capture_fields, plus the guest pages that the handler
+// accessed.
+// Records are variable-length:
+//
+//   page record:
+//     uint8_t  exit_capture_page_record
+//     varint   guest PFN
+//     uint8_t  page contents[0x1000]
+//
+//   exit record:
+//     uint8_t  exit_capture_exit_record
+//     uint8_t  flags (exit_capture_*_flag)
+//     varint   basic exit reason
+//     varint   bitmask of the fields that changed since the previous record
+//     varint   value of every field that changed (in exit_capture_fields order)
+//     varint   handler cycles
+//
+// A page is only captured the first time that it is accessed since the
+// last sync record, or since the last refresh. Pages are captured after
+// the handler has run, so they include any changes that the handler made.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// size of the per-VCPU capture ring in bytes (must be a power of two)
+inline constexpr size_t exit_capture_ring_size = 0x100000;
+
+static_assert((exit_capture_ring_size & (exit_capture_ring_size - 1)) == 0);
+
+// maximum number of guest pages that are captured for a single vm-exit
+inline constexpr size_t max_exit_capture_pages = 16;
+
+// number of entries in the set of pages that were already captured
+inline constexpr size_t exit_capture_page_set_size = 1024;
+
+// number of captured vm-exits after which every page is captured again
+// (the guest keeps modifying its memory between vm-exits)
+inline constexpr uint32_t exit_capture_page_refresh_interval = 4096;
+
+// number of guest GPRs at the start of a record's fields (guest_context::gpr)
+inline constexpr size_t exit_capture_gpr_count = 16;
+
+// VMCS fields that are captured for every vm-exit (after the GPRs)
+inline constexpr uint64_t exit_capture_fields[] = {
+  // vm-exit information (28.2)
+  VMCS_EXIT_QUALIFICATION,
+  VMCS_EXIT_GUEST_LINEAR_ADDRESS,
+  VMCS_GUEST_PHYSICAL_ADDRESS,
+  VMCS_VMEXIT_INSTRUCTION_LENGTH,
+  VMCS_VMEXIT_INSTRUCTION_INFO,
+  VMCS_VMEXIT_INTERRUPTION_INFORMATION,
+  VMCS_VMEXIT_INTERRUPTION_ERROR_CODE,
+  VMCS_IDT_VECTORING_INFORMATION,
+  VMCS_IDT_VECTORING_ERROR_CODE,
+
+  // guest state that the handlers read
+  VMCS_GUEST_RIP,
+  VMCS_GUEST_RSP,
+  VMCS_GUEST_RFLAGS,
+  VMCS_GUEST_CR0,
+  VMCS_GUEST_CR3,
+  VMCS_GUEST_CR4,
+  VMCS_CTRL_CR0_READ_SHADOW,
+  VMCS_CTRL_CR4_READ_SHADOW,
+  VMCS_GUEST_DR7,
+  VMCS_GUEST_EFER,
+  VMCS_GUEST_CS_SELECTOR,
+  VMCS_GUEST_CS_ACCESS_RIGHTS,
+  VMCS_GUEST_SS_ACCESS_RIGHTS,
+  VMCS_GUEST_FS_BASE,
+  VMCS_GUEST_GS_BASE,
+  VMCS_GUEST_INTERRUPTIBILITY_STATE
+};
+
+// number of values in an exit record (GPRs followed by VMCS fields)
+inline constexpr size_t exit_capture_field_count =
+  exit_capture_gpr_count + sizeof(exit_capture_fields) / sizeof(exit_capture_fields[0]);
+
+static_assert(exit_capture_field_count <= 64);
+
+// record types
+inline constexpr uint8_t exit_capture_exit_record = 1;
+inline constexpr uint8_t exit_capture_page_record = 2;
+
+// every field is present, and the decoder should forget the previous record
+// (written first, after every dropped record, and after every refresh)
+inline constexpr uint8_t exit_capture_sync_flag = 1 << 0;
+
+// the handler accessed more than max_exit_capture_pages pages, or pages
+// that aren't write-back memory (which are never captured)
+inline constexpr uint8_t exit_capture_pages_missing_flag = 1 << 1;
+
+// maximum size of an encoded record
+inline constexpr size_t max_exit_capture_record_size =
+  2 + 10 * (exit_capture_field_count + 3);
+inline constexpr size_t max_exit_capture_page_record_size = 1 + 10 + 0x1000;
+
+// captures are written to a file as a sequence of chunks, each of which
+// contains the records that were drained from a single VCPU's ring
+inline constexpr uint32_t exit_capture_file_magic   = 0x68767863; // 'hvxc'
+inline constexpr uint16_t exit_capture_file_version = 1;
+
+// file that the capture is drained into by the driver's device
+inline constexpr wchar_t const* exit_capture_path =
+  L"\\SystemRoot\\hv-exit-capture.bin";
+
+struct exit_capture_chunk_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t vcpu_index;
+
+  // number of bytes of records that follow this header
+  uint32_t size;
+  uint32_t _reserved;
+
+  // total number of records that this VCPU dropped so far
+  uint64_t dropped;
+};
+
+static_assert(sizeof(exit_capture_chunk_header) == 24);
+
+// single-producer (the VCPU in root mode), single-consumer byte ring. the
+// head only ever covers complete records.
+struct vcpu_exit_capture_ring {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of exit records that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  alignas(64) uint8_t data[exit_capture_ring_size];
+};
+
+struct vcpu_exit_capture_data {
+  // capture ring (this lives in ghv.exit_capture_rings)
+  vcpu_exit_capture_ring* ring;
+
+  bool enabled;
+
+  // the current vm-exit is being captured
+  bool active;
+
+  // the next exit record needs to be a sync record
+  bool sync;
+
+  // set if a page couldn't be logged for the current vm-exit
+  bool pages_missing;
+
+  // TSC when the handler was called
+  uint64_t handler_tsc;
+
+  // guest pages that were accessed by the current vm-exit
+  uint32_t page_count;
+  uint64_t pages[max_exit_capture_pages];
+
+  // field values before the handler was called, and the values that were
+  // written in the previous record
+  uint64_t fields[exit_capture_field_count];
+  uint64_t prev_fields[exit_capture_field_count];
+
+  // PFN + 1 of the pages that were already captured (direct-mapped)
+  uint64_t captured_pages[exit_capture_page_set_size];
+  uint32_t exits_since_refresh;
+};
+
+// vm-exit module that captures every vm-exit while capture is enabled
+struct exit_capture_module {
+  static constexpr bool enabled = true;
+
+  static void on_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+  static void on_vm_exit_handled(vcpu* cpu, vmx_vmexit_reason reason);
+};
+
+// log a guest page that the handler of the current vm-exit accessed
+inline void record_exit_capture_page(vcpu_exit_capture_data& capture, uint64_t const pfn) {
+  if (!capture.active)
+    return;
+
+  // page-table pages are accessed over and over
+  for (uint32_t i = 0; i < capture.page_count; ++i) {
+    if (capture.pages[i] == pfn)
+      return;
+  }
+
+  if (capture.page_count >= max_exit_capture_pages) {
+    capture.pages_missing = true;
+    return;
+  }
+
+  capture.pages[capture.page_count++] = pfn;
+}
+
+// log a range of guest physical memory that the current vm-exit accessed
+inline void record_exit_capture_range(vcpu_exit_capture_data& capture,
+    uint64_t const physical_address, uint64_t const size) {
+  if (!capture.active || !size)
+    return;
+
+  auto const last = (physical_address + size - 1) >> 12;
+
+  for (auto pfn = physical_address >> 12; pfn <= last && !capture.pages_missing; ++pfn)
+    record_exit_capture_page(capture, pfn);
+}
+
+// enable or disable vm-exit capture on the current VCPU
+void set_exit_capture(vcpu* cpu, bool enabled);
+
+// a decoded capture record
+struct exit_capture_record {
+  uint8_t type;
+
+  // exit records
+  uint8_t flags;
+  uint16_t reason;
+  uint64_t fields[exit_capture_field_count];
+  uint64_t handler_cycles;
+
+  // page records
+  uint64_t pfn;
+  uint8_t const* page;
+};
+
+// decoder state of a single VCPU's records
+struct exit_capture_decoder {
+  uint64_t prev_fields[exit_capture_field_count];
+};
+
+// decode the next record (returns false if the data is truncated or invalid)
+bool read_exit_capture_record(exit_capture_decoder& decoder,
+  uint8_t const*& in, uint8_t const* end, exit_capture_record& record);
+
+// enable or disable vm-exit capture on every VCPU
+void set_exit_capture(bool enabled);
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's capture ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of bytes written.
+uint64_t write_exit_capture(wchar_t const* path);
+
+#endif
+
+} // namespace hv
+
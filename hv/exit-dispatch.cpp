@@ -0,0 +1,212 @@
+#include "exit-dispatch.h"
+#include "exit-capture.h"
+#include "exit-handlers.h"
+#include "exit-sites.h"
+#include "exit-trace.h"
+#include "extended-state.h"
+#include "hypercalls.h"
+#include "nested.h"
+#include "vcpu.h"
+
+namespace hv {
+
+// optional modules are registered here
+using vm_exit_modules = vm_exit_module_list<
+  exit_site_module,
+  exit_trace_module,
+  exit_capture_module>;
+
+// every vm-exit that has a handler. vm-exits that aren't in
+// this table are simply ignored. handlers that use vector registers
+// need to set the extended_state flag (the third field).
+static constexpr vm_exit_handler_entry vm_exit_handlers[] = {
+  { VMX_EXIT_REASON_EXCEPTION_OR_NMI,             handle_exception_or_nmi },
+  { VMX_EXIT_REASON_EXECUTE_GETSEC,               emulate_getsec          },
+  { VMX_EXIT_REASON_EXECUTE_INVD,                 emulate_invd            },
+  { VMX_EXIT_REASON_INTERRUPT_WINDOW,             handle_interrupt_window },
+  { VMX_EXIT_REASON_NMI_WINDOW,                   handle_nmi_window       },
+  { VMX_EXIT_REASON_EXECUTE_CPUID,                emulate_cpuid           },
+  { VMX_EXIT_REASON_MOV_CR,                       handle_mov_cr           },
+  { VMX_EXIT_REASON_EXECUTE_RDMSR,                emulate_rdmsr           },
+  { VMX_EXIT_REASON_EXECUTE_WRMSR,                emulate_wrmsr           },
+  { VMX_EXIT_REASON_EXECUTE_XSETBV,               emulate_xsetbv          },
+  { VMX_EXIT_REASON_EXECUTE_VMCALL,               emulate_vmcall          },
+  { VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, handle_vmx_preemption   },
+  { VMX_EXIT_REASON_EPT_VIOLATION,                handle_ept_violation    },
+  { VMX_EXIT_REASON_MONITOR_TRAP_FLAG,            handle_monitor_trap_flag },
+
+  // VMX instructions (emulated if nested VMX is enabled)
+  { VMX_EXIT_REASON_EXECUTE_VMXON, nested_vmx_enabled ?
+    emulate_nested_vmxon : emulate_vmxon },
+  { VMX_EXIT_REASON_EXECUTE_INVEPT, nested_vmx_enabled ?
+    emulate_nested_invept : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_INVVPID, nested_vmx_enabled ?
+    emulate_nested_invvpid : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMCLEAR, nested_vmx_enabled ?
+    emulate_nested_vmclear : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMLAUNCH, nested_vmx_enabled ?
+    emulate_nested_vmlaunch : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMPTRLD, nested_vmx_enabled ?
+    emulate_nested_vmptrld : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMPTRST, nested_vmx_enabled ?
+    emulate_nested_vmptrst : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMREAD, nested_vmx_enabled ?
+    emulate_nested_vmread : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMRESUME, nested_vmx_enabled ?
+    emulate_nested_vmresume : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMWRITE, nested_vmx_enabled ?
+    emulate_nested_vmwrite : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMXOFF, nested_vmx_enabled ?
+    emulate_nested_vmxoff : handle_vmx_instruction },
+  { VMX_EXIT_REASON_EXECUTE_VMFUNC,               handle_vmx_instruction  },
+};
+
+// every hypercall that has a handler
+static constexpr hypercall_handler_entry hypercall_handlers[] = {
+  { hypercall_ping,                         hc::ping                         },
+  { hypercall_test,                         hc::test                         },
+  { hypercall_unload,                       hc::unload                       },
+  { hypercall_read_phys_mem,                hc::read_phys_mem                },
+  { hypercall_write_phys_mem,               hc::write_phys_mem               },
+  { hypercall_read_virt_mem,                hc::read_virt_mem                },
+  { hypercall_write_virt_mem,               hc::write_virt_mem               },
+  { hypercall_query_process_cr3,            hc::query_process_cr3            },
+  { hypercall_install_ept_hook,             hc::install_ept_hook             },
+  { hypercall_remove_ept_hook,              hc::remove_ept_hook              },
+  { hypercall_set_exit_profile,             hc::set_exit_profile             },
+  { hypercall_query_exit_profile_stats,     hc::query_exit_profile_stats     },
+  { hypercall_set_overhead_calibration,     hc::set_overhead_calibration     },
+  { hypercall_set_vm_exit_overhead,         hc::set_vm_exit_overhead         },
+  { hypercall_add_counted_function,         hc::add_counted_function         },
+  { hypercall_clear_counted_functions,      hc::clear_counted_functions      },
+  { hypercall_query_call_counts,            hc::query_call_counts            },
+  { hypercall_set_syscall_tracing,          hc::set_syscall_tracing          },
+  { hypercall_set_cr3_telemetry,            hc::set_cr3_telemetry            },
+  { hypercall_set_exit_pmc_profiling,       hc::set_exit_pmc_profiling       },
+  { hypercall_query_exit_sites,             hc::query_exit_sites             },
+  { hypercall_set_exit_capture,             hc::set_exit_capture             },
+  { hypercall_set_exit_tracing,             hc::set_exit_tracing             },
+  { hypercall_set_sampling_interval,        hc::set_sampling_interval        },
+  { hypercall_register_notification_vector, hc::register_notification_vector },
+};
+
+// flat lookup tables that are indexed directly by exit reason/hypercall code
+struct vm_exit_table {
+  vm_exit_handler handlers[vm_exit_reason_count];
+  bool extended_state[vm_exit_reason_count];
+
+  // whether any handler in the table uses vector registers
+  bool any_extended_state;
+
+  // false if an entry in vm_exit_handlers is invalid
+  bool valid;
+};
+
+struct hypercall_table {
+  vm_exit_handler handlers[hypercall_code_count];
+  bool extended_state[hypercall_code_count];
+  bool any_extended_state;
+  bool valid;
+};
+
+// build the vm-exit lookup table (or an empty table if an entry is invalid)
+static constexpr vm_exit_table compile_vm_exit_table() {
+  vm_exit_table table = {};
+
+  for (auto const& e : vm_exit_handlers) {
+    // out-of-range or duplicate exit reason
+    if (e.reason >= vm_exit_reason_count || table.handlers[e.reason])
+      return {};
+
+    table.handlers[e.reason]       = e.handler;
+    table.extended_state[e.reason] = e.extended_state;
+    table.any_extended_state      |= e.extended_state;
+  }
+
+  table.valid = true;
+  return table;
+}
+
+// build the hypercall lookup table (or an empty table if an entry is invalid)
+static constexpr hypercall_table compile_hypercall_table() {
+  hypercall_table table = {};
+
+  for (auto const& e : hypercall_handlers) {
+    // out-of-range or duplicate hypercall code
+    if (e.code >= hypercall_code_count || table.handlers[e.code])
+      return {};
+
+    table.handlers[e.code]       = e.handler;
+    table.extended_state[e.code] = e.extended_state;
+    table.any_extended_state    |= e.extended_state;
+  }
+
+  table.valid = true;
+  return table;
+}
+
+static constexpr auto vm_exit_lookup   = compile_vm_exit_table();
+static constexpr auto hypercall_lookup = compile_hypercall_table();
+
+static_assert(vm_exit_lookup.valid, "Invalid vm-exit handler table.");
+static_assert(hypercall_lookup.valid, "Invalid hypercall handler table.");
+
+// call the handler for the specified vm-exit
+void dispatch_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto const index = reason.basic_exit_reason;
+
+  if (index >= vm_exit_reason_count)
+    return;
+
+  ++cpu->exit_stats->counters.exits[index];
+
+  vm_exit_modules::on_vm_exit(cpu, reason);
+
+  auto const handler = vm_exit_lookup.handlers[index];
+
+  // this compiles away completely if no handler uses vector registers
+  if constexpr (vm_exit_lookup.any_extended_state) {
+    if (handler && vm_exit_lookup.extended_state[index]) {
+      save_guest_extended_state(cpu);
+      handler(cpu);
+      restore_guest_extended_state(cpu);
+    }
+    else if (handler)
+      handler(cpu);
+  }
+  else if (handler)
+    handler(cpu);
+
+  vm_exit_modules::on_vm_exit_handled(cpu, reason);
+}
+
+// call the handler for the specified hypercall, or return false
+// if the hypercall code is invalid
+bool dispatch_hypercall(vcpu* const cpu, uint64_t const code) {
+  if (code >= hypercall_code_count || !hypercall_lookup.handlers[code])
+    return false;
+
+  ++cpu->exit_stats->counters.hypercalls[code];
+
+  if constexpr (hypercall_lookup.any_extended_state) {
+    if (hypercall_lookup.extended_state[code]) {
+      save_guest_extended_state(cpu);
+      hypercall_lookup.handlers[code](cpu);
+      restore_guest_extended_state(cpu);
+      return true;
+    }
+  }
+
+  hypercall_lookup.handlers[code](cpu);
+
+  return true;
+}
+
+// whether any vm-exit or hypercall handler uses vector registers (the
+// guest extended state is never saved otherwise)
+bool handlers_use_extended_state() {
+  return vm_exit_lookup.any_extended_state || hypercall_lookup.any_extended_state;
+}
+
+} // namespace hv
+
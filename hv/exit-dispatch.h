@@ -0,0 +1,87 @@
+#pragma once
+
+#include "hypercalls.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// every basic exit reason is smaller than this (Appendix C)
+inline constexpr size_t vm_exit_reason_count = 76;
+
+using vm_exit_handler = void(*)(vcpu* cpu);
+
+// maps a basic exit reason to a handler
+struct vm_exit_handler_entry {
+  uint16_t        reason;
+  vm_exit_handler handler;
+
+  // whether the handler uses vector registers (the guest extended
+  // state is saved before the handler is called and restored after)
+  bool            extended_state = false;
+};
+
+// maps a hypercall code to a handler
+struct hypercall_handler_entry {
+  hypercall_code  code;
+  vm_exit_handler handler;
+
+  // whether the handler uses vector registers
+  bool            extended_state = false;
+};
+
+// per-VCPU counters that are automatically updated for every handler
+struct vm_exit_counters {
+  uint64_t exits[vm_exit_reason_count];
+  uint64_t hypercalls[hypercall_code_count];
+};
+
+// optional modules (tracing, profiling, etc) that hook every vm-exit.
+// a module is a struct with the following static members:
+//
+//   static constexpr bool enabled;
+//   static void on_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+//   static void on_vm_exit_handled(vcpu* cpu, vmx_vmexit_reason reason);
+//
+// disabled modules are discarded at compile-time.
+template <typename... Modules>
+struct vm_exit_module_list {
+  // called before the vm-exit handler
+  static void on_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
+    (call_on_vm_exit<Modules>(cpu, reason), ...);
+  }
+
+  // called after the vm-exit handler
+  static void on_vm_exit_handled(vcpu* const cpu, vmx_vmexit_reason const reason) {
+    (call_on_vm_exit_handled<Modules>(cpu, reason), ...);
+  }
+
+private:
+  template <typename Module>
+  static void call_on_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
+    if constexpr (Module::enabled)
+      Module::on_vm_exit(cpu, reason);
+  }
+
+  template <typename Module>
+  static void call_on_vm_exit_handled(vcpu* const cpu, vmx_vmexit_reason const reason) {
+    if constexpr (Module::enabled)
+      Module::on_vm_exit_handled(cpu, reason);
+  }
+};
+
+// call the handler for the specified vm-exit
+void dispatch_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+
+// call the handler for the specified hypercall, or return false
+// if the hypercall code is invalid
+bool dispatch_hypercall(vcpu* cpu, uint64_t code);
+
+// whether any vm-exit or hypercall handler uses vector registers (the
+// guest extended state is never saved otherwise)
+bool handlers_use_extended_state();
+
+} // namespace hv
+
@@ -1,6 +1,9 @@
 #include "exit-handlers.h"
+#include "cr-validation.h"
 #include "guest-context.h"
 #include "exception-routines.h"
+#include "exit-dispatch.h"
+#include "msr-policy.h"
 #include "hypercalls.h"
 #include "vcpu.h"
 #include "vmx.h"
@@ -23,26 +26,29 @@ void emulate_cpuid(vcpu* const cpu) {
 }
 
 void emulate_rdmsr(vcpu* const cpu) {
-  if (cpu->ctx->ecx == IA32_FEATURE_CONTROL) {
-    // return the fake guest FEATURE_CONTROL MSR
-    cpu->ctx->rax = cpu->cached.guest_feature_control.flags & 0xFFFF'FFFF;
-    cpu->ctx->rdx = cpu->cached.guest_feature_control.flags >> 32;
+  auto const msr = cpu->ctx->ecx;
+  uint64_t msr_value = 0;
 
-    cpu->hide_vm_exit_overhead = true;
-    skip_instruction();
-    return;
-  }
+  auto const policy = find_msr_policy(msr, msr_access_read);
 
-  host_exception_info e;
+  // shadowed or emulated MSR
+  if (policy && policy->read) {
+    if (!policy->read(cpu, msr, msr_value)) {
+      inject_hw_exception(general_protection, 0);
+      return;
+    }
+  } else {
+    host_exception_info e;
 
-  // the guest could be reading from MSRs that are outside of the MSR bitmap
-  // range. refer to https://www.unknowncheats.me/forum/3425463-post15.html
-  auto const msr_value = rdmsr_safe(e, cpu->ctx->ecx);
+    // the guest could be reading from MSRs that are outside of the MSR bitmap
+    // range. refer to https://www.unknowncheats.me/forum/3425463-post15.html
+    msr_value = rdmsr_safe(e, msr);
 
-  if (e.exception_occurred) {
-    // reflect the exception back into the guest
-    inject_hw_exception(general_protection, 0);
-    return;
+    if (e.exception_occurred) {
+      // reflect the exception back into the guest
+      inject_hw_exception(general_protection, 0);
+      return;
+    }
   }
 
   cpu->ctx->rax = msr_value & 0xFFFF'FFFF;
@@ -56,31 +62,27 @@ void emulate_wrmsr(vcpu* const cpu) {
   auto const msr = cpu->ctx->ecx;
   auto const value = (cpu->ctx->rdx << 32) | cpu->ctx->eax;
 
-  // let the guest write to the MSRs
-  host_exception_info e;
-  wrmsr_safe(e, msr, value);
+  auto const policy = find_msr_policy(msr, msr_access_write);
 
-  if (e.exception_occurred) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // we need to make sure to update EPT memory types if the guest
-  // modifies any of the MTRR registers
-  if (msr == IA32_MTRR_DEF_TYPE     || msr == IA32_MTRR_FIX64K_00000 ||
-      msr == IA32_MTRR_FIX16K_80000 || msr == IA32_MTRR_FIX16K_A0000 ||
-     (msr >= IA32_MTRR_FIX4K_C0000  && msr <= IA32_MTRR_FIX4K_F8000) ||
-     (msr >= IA32_MTRR_PHYSBASE0    && msr <= IA32_MTRR_PHYSBASE0 + 511)) {
-    // update EPT memory types
-    if (!read_effective_guest_cr0().cache_disable)
-      update_ept_memory_type(cpu->ept);
+  // shadowed or emulated MSR
+  if (policy && policy->write) {
+    if (!policy->write(cpu, msr, value)) {
+      inject_hw_exception(general_protection, 0);
+      return;
+    }
+  } else {
+    // let the guest write to the MSRs
+    host_exception_info e;
+    wrmsr_safe(e, msr, value);
 
-    vmx_invept(invept_all_context, {});
+    if (e.exception_occurred) {
+      inject_hw_exception(general_protection, 0);
+      return;
+    }
   }
 
   cpu->hide_vm_exit_overhead = true;
   skip_instruction();
-  return;
 }
 
 void emulate_getsec(vcpu*) {
@@ -106,44 +108,8 @@ void emulate_xsetbv(vcpu* const cpu) {
   xcr0 new_xcr0;
   new_xcr0.flags = (cpu->ctx->rdx << 32) | cpu->ctx->eax;
 
-  // only XCR0 is supported
-  if (cpu->ctx->ecx != 0) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if trying to set an unsupported bit
-  if (new_xcr0.flags & cpu->cached.xcr0_unsupported_mask) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if clearing XCR0.X87
-  if (!new_xcr0.x87) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if XCR0.AVX is 1 while XCRO.SSE is cleared
-  if (new_xcr0.avx && !new_xcr0.sse) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if XCR0.AVX is clear and XCR0.opmask, XCR0.ZMM_Hi256, or XCR0.Hi16_ZMM is set
-  if (!new_xcr0.avx && (new_xcr0.opmask || new_xcr0.zmm_hi256 || new_xcr0.zmm_hi16)) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if setting XCR0.BNDREG or XCR0.BNDCSR while not setting the other
-  if (new_xcr0.bndreg != new_xcr0.bndcsr) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if setting XCR0.opmask, XCR0.ZMM_Hi256, or XCR0.Hi16_ZMM while not setting all of them
-  if (new_xcr0.opmask != new_xcr0.zmm_hi256 || new_xcr0.zmm_hi256 != new_xcr0.zmm_hi16) {
+  if (!is_valid_xcr_write(cpu->ctx->ecx, new_xcr0,
+      cpu->cached.xcr0_unsupported_mask)) {
     inject_hw_exception(general_protection, 0);
     return;
   }
@@ -176,6 +142,11 @@ void emulate_vmxon(vcpu*) {
 }
 
 void emulate_vmcall(vcpu* const cpu) {
+  // the syscall entry point is replaced with a VMCALL while syscalls are
+  // being traced
+  if (handle_syscall_entry(cpu))
+    return;
+
   auto const code = cpu->ctx->rax & 0xFF;
   auto const key  = cpu->ctx->rax >> 8;
 
@@ -186,24 +157,20 @@ void emulate_vmcall(vcpu* const cpu) {
   }
 
   // handle the hypercall
-  switch (code) {
-  case hypercall_ping:              hc::ping(cpu);              return;
-  case hypercall_test:              hc::test(cpu);              return;
-  case hypercall_unload:            hc::unload(cpu);            return;
-  case hypercall_read_phys_mem:     hc::read_phys_mem(cpu);     return;
-  case hypercall_write_phys_mem:    hc::write_phys_mem(cpu);    return;
-  case hypercall_read_virt_mem:     hc::read_virt_mem(cpu);     return;
-  case hypercall_write_virt_mem:    hc::write_virt_mem(cpu);    return;
-  case hypercall_query_process_cr3: hc::query_process_cr3(cpu); return;
-  case hypercall_install_ept_hook:  hc::install_ept_hook(cpu);  return;
-  case hypercall_remove_ept_hook:   hc::remove_ept_hook(cpu);   return;
-  }
+  if (!dispatch_hypercall(cpu, code))
+    inject_hw_exception(invalid_opcode);
+}
 
-  inject_hw_exception(invalid_opcode);
+void handle_vmx_preemption(vcpu* const cpu) {
+  // hide_vm_exit_overhead() resyncs the TSC
+  ++cpu->profile_stats[cpu->current_exit_profile].preemption_exits;
+
+  take_profiler_sample(cpu);
 }
 
-void handle_vmx_preemption(vcpu*) {
-  // do nothing.
+void handle_monitor_trap_flag(vcpu* const cpu) {
+  // the only thing that uses MTF is call counting
+  finish_call_counter_step(cpu);
 }
 
 void emulate_mov_to_cr0(vcpu* const cpu, uint64_t const gpr) {
@@ -230,32 +197,7 @@ void emulate_mov_to_cr0(vcpu* const cpu, uint64_t const gpr) {
   // CR0.ET is always 1
   new_cr0.extension_type = 1;
 
-  // #GP(0) if setting any reserved bits in CR0[63:32]
-  if (new_cr0.reserved4) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if setting CR0.PG while CR0.PE is clear
-  if (new_cr0.paging_enable && !new_cr0.protection_enable) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if invalid bit combination
-  if (!new_cr0.cache_disable && new_cr0.not_write_through) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if an attempt is made to clear CR0.PG
-  if (!new_cr0.paging_enable) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if an attempt is made to clear CR0.WP while CR4.CET is set
-  if (!new_cr0.write_protect && curr_cr4.control_flow_enforcement_enable) {
+  if (!is_valid_cr0_write(new_cr0, curr_cr4)) {
     inject_hw_exception(general_protection, 0);
     return;
   }
@@ -317,6 +259,8 @@ void emulate_mov_to_cr3(vcpu* const cpu, uint64_t const gpr) {
     vmx_invvpid(invvpid_single_context_retaining_globals, desc);
   }
 
+  record_cr3_load(cpu, read_guest_gpr(cpu->ctx, gpr));
+
   // it is now safe to write the new guest cr3
   vmx_vmwrite(VMCS_GUEST_CR3, new_cr3.flags);
 
@@ -340,39 +284,8 @@ void emulate_mov_to_cr4(vcpu* const cpu, uint64_t const gpr) {
   auto const curr_cr0 = read_effective_guest_cr0();
   auto const curr_cr4 = read_effective_guest_cr4();
 
-  // #GP(0) if an attempt is made to set CR4.SMXE when SMX is not supported
-  if (!cpu->cached.cpuid_01.cpuid_feature_information_ecx.safer_mode_extensions
-      && new_cr4.smx_enable) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if an attempt is made to write a 1 to any reserved bits
-  if (new_cr4.reserved1 || new_cr4.reserved2) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if an attempt is made to change CR4.PCIDE from 0 to 1 while CR3[11:0] != 000H
-  if ((new_cr4.pcid_enable && !curr_cr4.pcid_enable) && (curr_cr3.flags & 0xFFF)) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if CR4.PAE is cleared
-  if (!new_cr4.physical_address_extension) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if CR4.LA57 is enabled
-  if (new_cr4.linear_addresses_57_bit) {
-    inject_hw_exception(general_protection, 0);
-    return;
-  }
-
-  // #GP(0) if CR4.CET == 1 and CR0.WP == 0
-  if (new_cr4.control_flow_enforcement_enable && !curr_cr0.write_protect) {
+  if (!is_valid_cr4_write(new_cr4, curr_cr0, curr_cr4, curr_cr3,
+      cpu->cached.cpuid_01.cpuid_feature_information_ecx.safer_mode_extensions)) {
     inject_hw_exception(general_protection, 0);
     return;
   }
@@ -401,6 +314,24 @@ void emulate_mov_to_cr4(vcpu* const cpu, uint64_t const gpr) {
   skip_instruction();
 }
 
+// MOV to CR8 only causes a vm-exit while a notification is being held
+// back by the guest's TPR (see deliver_notification())
+void emulate_mov_to_cr8(vcpu* const cpu, uint64_t const gpr) {
+  auto const new_cr8 = read_guest_gpr(cpu->ctx, gpr);
+
+  // bits 63:4 are reserved
+  if (new_cr8 & ~0xFull) {
+    inject_hw_exception(general_protection, 0);
+    return;
+  }
+
+  // CR8 isn't switched on vm-exits, so the guest's TPR is the real one
+  __writecr8(new_cr8);
+
+  cpu->hide_vm_exit_overhead = true;
+  skip_instruction();
+}
+
 void emulate_mov_from_cr3(vcpu* const cpu, uint64_t const gpr) {
   write_guest_gpr(cpu->ctx, gpr, vmx_vmread(VMCS_GUEST_CR3));
 
@@ -469,6 +400,9 @@ void handle_mov_cr(vcpu* const cpu) {
     case VMX_EXIT_QUALIFICATION_REGISTER_CR4:
       emulate_mov_to_cr4(cpu, qualification.general_purpose_register);
       break;
+    case VMX_EXIT_QUALIFICATION_REGISTER_CR8:
+      emulate_mov_to_cr8(cpu, qualification.general_purpose_register);
+      break;
     }
     break;
   // MOV XXX, CRn
@@ -487,35 +421,104 @@ void handle_mov_cr(vcpu* const cpu) {
   }
 }
 
-void handle_nmi_window(vcpu* const cpu) {
-  --cpu->queued_nmis;
+void handle_interrupt_window(vcpu*) {
+  // the pending notification is injected by deliver_notification()
+  // right before the upcoming vm-entry.
+}
 
-  // inject the NMI into the guest
-  inject_nmi();
+void handle_nmi_window(vcpu*) {
+  // the queued NMI is injected by deliver_queued_nmis()
+  // right before the upcoming vm-entry (or by handle_l2_vm_exit()
+  // while L2 is running).
+}
 
-  if (cpu->queued_nmis == 0) {
-    // disable NMI-window exiting since we have no more NMIs to inject
+void handle_exception_or_nmi(vcpu* const cpu) {
+  // enqueue an NMI to be injected into the guest. deliver_queued_nmis()
+  // will try to inject it on this vm-entry, and will only fall back to
+  // NMI-window exiting if the guest is currently blocking NMIs.
+  ++cpu->queued_nmis;
+}
+
+// request an NMI-window vm-exit. NMI passthrough is suspended until the
+// NMI queue is drained, since NMI-window exiting requires virtual NMIs.
+void request_nmi_window(vcpu* const cpu) {
+  if (cpu->nmi_passthrough && !cpu->nmi_passthrough_suspended) {
+    auto pin_ctrl = read_ctrl_pin_based();
+    pin_ctrl.nmi_exiting = 1;
+    pin_ctrl.virtual_nmi = 1;
+    write_ctrl_pin_based(pin_ctrl);
+
+    cpu->nmi_passthrough_suspended = true;
+  }
+
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.nmi_window_exiting = 1;
+  write_ctrl_proc_based(ctrl);
+}
+
+// inject a queued NMI on the upcoming vm-entry if the guest is able to
+// receive it. this should be called right before every vm-entry.
+void deliver_queued_nmis(vcpu* const cpu) {
+  if (cpu->queued_nmis == 0)
+    return;
+
+  // the NMI would be delivered before the single-stepped instruction, and
+  // an NMI-window vm-exit would happen before it as well (over and over).
+  // the monitor trap flag vm-exit comes right after the instruction, and
+  // the NMI is delivered (or a window requested) on that vm-entry instead.
+  if (cpu->call_counter.stepping_pte) {
     auto ctrl = read_ctrl_proc_based();
     ctrl.nmi_window_exiting = 0;
     write_ctrl_proc_based(ctrl);
+    return;
   }
-  
-  // there is the possibility that a host NMI occurred right before we
-  // disabled NMI-window exiting. make sure to re-enable it if this is the case.
-  if (cpu->queued_nmis > 0) {
-    auto ctrl = read_ctrl_proc_based();
-    ctrl.nmi_window_exiting = 1;
-    write_ctrl_proc_based(ctrl);
+
+  vmentry_interrupt_information pending_event;
+  pending_event.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
+
+  vmexit_interrupt_information idt_vectoring;
+  idt_vectoring.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_IDT_VECTORING_INFORMATION));
+
+  auto const state = read_interruptibility_state();
+
+  // 3.26.3.1.5
+  // we can only inject the NMI if there isn't another event being injected
+  // and if the guest isn't currently blocking NMIs
+  if (!pending_event.valid          &&
+      !idt_vectoring.valid          &&
+      !state.blocking_by_nmi        &&
+      !state.blocking_by_mov_ss     &&
+      !state.blocking_by_sti) {
+    --cpu->queued_nmis;
+    inject_nmi();
   }
-}
 
-void handle_exception_or_nmi(vcpu* const cpu) {
-  // enqueue an NMI to be injected into the guest later on
-  ++cpu->queued_nmis;
+  if (cpu->queued_nmis > 0) {
+    request_nmi_window(cpu);
+    return;
+  }
 
+  // disable NMI-window exiting since we have no more NMIs to inject
   auto ctrl = read_ctrl_proc_based();
-  ctrl.nmi_window_exiting = 1;
+  ctrl.nmi_window_exiting = 0;
   write_ctrl_proc_based(ctrl);
+
+  // go back to passing NMIs directly to the guest
+  if (cpu->nmi_passthrough_suspended) {
+    auto pin_ctrl = read_ctrl_pin_based();
+    pin_ctrl.nmi_exiting = 0;
+    pin_ctrl.virtual_nmi = 0;
+    write_ctrl_pin_based(pin_ctrl);
+
+    cpu->nmi_passthrough_suspended = false;
+  }
+
+  // there is the possibility that a host NMI occurred right before we
+  // disabled NMI-window exiting. make sure to re-enable it if this is the case.
+  if (cpu->queued_nmis > 0)
+    request_nmi_window(cpu);
 }
 
 void handle_vmx_instruction(vcpu*) {
@@ -532,9 +535,15 @@ void handle_ept_violation(vcpu* const cpu) {
   auto const physical_address = vmx_vmread(qualification.caused_by_translation ?
     VMCS_GUEST_PHYSICAL_ADDRESS : VMCS_EXIT_GUEST_LINEAR_ADDRESS);
 
+  // instruction fetch from a page that contains counted functions
+  if (qualification.execute_access &&
+      handle_call_counter_violation(cpu, physical_address))
+    return;
+
   if (qualification.execute_access &&
      (qualification.write_access || qualification.read_access)) {
-    // TODO: assert
+    log_error(cpu, "Unexpected EPT violation (GPA=%llX, qualification=%llX).",
+      physical_address, qualification.flags);
     inject_hw_exception(machine_check);
     return;
   }
@@ -542,7 +551,8 @@ void handle_ept_violation(vcpu* const cpu) {
   auto const hook = find_ept_hook(cpu->ept, physical_address >> 12);
 
   if (!hook) {
-    // TODO: assert
+    log_error(cpu, "EPT violation on a page without a hook (GPA=%llX).",
+      physical_address);
     inject_hw_exception(machine_check);
     return;
   }
@@ -24,12 +24,16 @@ void emulate_vmcall(vcpu* cpu);
 
 void handle_vmx_preemption(vcpu* cpu);
 
+void handle_monitor_trap_flag(vcpu* cpu);
+
 void emulate_mov_to_cr0(vcpu* cpu, uint64_t gpr);
 
 void emulate_mov_to_cr3(vcpu* cpu, uint64_t gpr);
 
 void emulate_mov_to_cr4(vcpu* cpu, uint64_t gpr);
 
+void emulate_mov_to_cr8(vcpu* cpu, uint64_t gpr);
+
 void emulate_mov_from_cr3(vcpu* cpu, uint64_t gpr);
 
 void emulate_clts(vcpu* cpu);
@@ -38,10 +42,16 @@ void emulate_lmsw(vcpu* cpu, uint16_t value);
 
 void handle_mov_cr(vcpu* cpu);
 
+void handle_interrupt_window(vcpu* cpu);
+
 void handle_nmi_window(vcpu* cpu);
 
 void handle_exception_or_nmi(vcpu* cpu);
 
+void request_nmi_window(vcpu* cpu);
+
+void deliver_queued_nmis(vcpu* cpu);
+
 void handle_vmx_instruction(vcpu* cpu);
 
 void handle_ept_violation(vcpu* cpu);
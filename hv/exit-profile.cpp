@@ -0,0 +1,148 @@
+#include "exit-profile.h"
+#include "msr-policy.h"
+#include "vcpu.h"
+#include "vmx.h"
+#include "hv.h"
+
+namespace hv {
+
+struct exit_profile_desc {
+  // vm-exit on every MOV to/from CR3
+  bool cr3_exiting;
+
+  // vm-exit on every CR0/CR4 modification (instead of only reserved bits)
+  bool full_cr_masks;
+
+  // number of CR3-target values to use (the System CR3 is the only target)
+  uint8_t cr3_target_count;
+
+  // don't vm-exit on NMIs unless the hypervisor has NMIs to inject
+  bool nmi_passthrough;
+
+  // hide vm-exit overhead from the guest (requires MSR store/load lists)
+  bool conceal_timing;
+};
+
+static constexpr exit_profile_desc exit_profiles[exit_profile_count] = {
+  // exit_profile_minimal
+  { false, false, 1, false, true  },
+
+  // exit_profile_hardened
+  { true,  true,  1, false, true  },
+
+  // exit_profile_tracing
+  { true,  true,  0, false, true  },
+
+  // exit_profile_low_latency
+  { false, false, 1, true,  false }
+};
+
+// configure the vm-exit MSR store area for the specified profile
+static void prepare_msr_exit_store(vcpu* const cpu, exit_profile_desc const& desc) {
+  auto const prev_count = cpu->msr_exit_store_count;
+
+  auto exit_ctrl = read_ctrl_exit();
+  exit_ctrl.flags &= ~vmx_exit_ctrl_save_ia32_perf_global_ctrl;
+
+  if (desc.conceal_timing) {
+    // store PERF_GLOBAL_CTRL, APERF, and MPERF on every vm-exit
+    cpu->msr_exit_store_count = sizeof(cpu->msr_exit_store) / 16;
+  } else if (cpu->cached.vmx_exit_ctrl_allowed1 & vmx_exit_ctrl_save_ia32_perf_global_ctrl) {
+    // use the dedicated vm-exit control instead of the MSR store area
+    exit_ctrl.flags |= vmx_exit_ctrl_save_ia32_perf_global_ctrl;
+    cpu->msr_exit_store_count = 0;
+  } else {
+    // only store PERF_GLOBAL_CTRL (which is the first entry)
+    cpu->msr_exit_store_count = 1;
+  }
+
+  write_ctrl_exit_safe(exit_ctrl);
+  vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_COUNT, cpu->msr_exit_store_count);
+
+  // the guest PERF_GLOBAL_CTRL for the current vm-exit was stored in the
+  // MSR store area, but the new profile expects it in the VMCS (or vice versa)
+  if (prev_count > 0)
+    vmx_vmwrite(VMCS_GUEST_PERF_GLOBAL_CTRL, cpu->msr_exit_store.perf_global_ctrl.msr_data);
+  else
+    cpu->msr_exit_store.perf_global_ctrl.msr_data = vmx_vmread(VMCS_GUEST_PERF_GLOBAL_CTRL);
+
+  // APERF/MPERF weren't stored on the current vm-exit, so use the live
+  // values instead (this is equivalent to not hiding this vm-exit)
+  if (prev_count < cpu->msr_exit_store_count && cpu->msr_exit_store_count > 1) {
+    cpu->msr_exit_store.aperf.msr_data = __readmsr(IA32_APERF);
+    cpu->msr_exit_store.mperf.msr_data = __readmsr(IA32_MPERF);
+  }
+}
+
+// switch the current VCPU to the specified exit profile. the VMCS
+// control, host, and guest fields must already be initialized.
+void apply_exit_profile(vcpu* const cpu, exit_profile const profile) {
+  auto const& desc = exit_profiles[profile];
+
+  // account for the time spent in the previous profile
+  auto const tsc = __rdtsc();
+  cpu->profile_stats[cpu->current_exit_profile].tsc_ticks +=
+    tsc - cpu->exit_profile_start_tsc;
+  cpu->exit_profile_start_tsc = tsc;
+  cpu->current_exit_profile   = profile;
+
+  cpu->conceal_timing = desc.conceal_timing;
+
+  // the counter configuration isn't intercepted while timing isn't concealed
+  if (cpu->conceal_timing)
+    refresh_pmu_config(cpu);
+  prepare_msr_exit_store(cpu, desc);
+
+  // the MSR bitmap is only accessed by the CPU while in VMX non-root
+  // operation on this VCPU, so it is safe to rebuild it in-place
+  prepare_msr_bitmap(cpu->msr_bitmap, profile);
+
+  // NMI passthrough stays suspended until every queued NMI has been
+  // injected, since NMI-window exiting requires virtual NMIs
+  cpu->nmi_passthrough           = desc.nmi_passthrough;
+  cpu->nmi_passthrough_suspended = desc.nmi_passthrough && cpu->queued_nmis > 0;
+
+  auto pin_based_ctrl = read_ctrl_pin_based();
+  pin_based_ctrl.nmi_exiting = !cpu->nmi_passthrough || cpu->nmi_passthrough_suspended;
+  pin_based_ctrl.virtual_nmi = pin_based_ctrl.nmi_exiting;
+  write_ctrl_pin_based_safe(pin_based_ctrl);
+
+  auto proc_based_ctrl = read_ctrl_proc_based();
+  proc_based_ctrl.cr3_load_exiting  = desc.cr3_exiting || cpu->cr3_telemetry.enabled;
+  proc_based_ctrl.cr3_store_exiting = desc.cr3_exiting;
+  write_ctrl_proc_based_safe(proc_based_ctrl);
+
+  // the values that the guest currently sees need to be read BEFORE
+  // the guest/host masks are changed
+  auto const guest_cr0 = read_effective_guest_cr0();
+  auto const guest_cr4 = read_effective_guest_cr4();
+
+  if (desc.full_cr_masks) {
+    // vm-exit on every CR0/CR4 modification
+    vmx_vmwrite(VMCS_CTRL_CR0_GUEST_HOST_MASK, 0xFFFFFFFF'FFFFFFFF);
+    vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK, 0xFFFFFFFF'FFFFFFFF);
+  } else {
+    // only vm-exit when guest tries to change a reserved bit
+    vmx_vmwrite(VMCS_CTRL_CR0_GUEST_HOST_MASK,
+      cpu->cached.vmx_cr0_fixed0 | ~cpu->cached.vmx_cr0_fixed1);
+    vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK,
+      cpu->cached.vmx_cr4_fixed0 | ~cpu->cached.vmx_cr4_fixed1);
+  }
+
+  // make sure the guest still sees the same values with the new masks
+  vmx_vmwrite(VMCS_CTRL_CR0_READ_SHADOW, guest_cr0.flags);
+  vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, guest_cr4.flags);
+
+  // CR3-load telemetry picks its own CR3-target values
+  if (cpu->cr3_telemetry.enabled) {
+    write_cr3_telemetry_targets(cpu);
+    return;
+  }
+
+  // 3.24.6.7
+  vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT,   desc.cr3_target_count);
+  vmx_vmwrite(VMCS_CTRL_CR3_TARGET_VALUE_0, ghv.system_cr3.flags);
+}
+
+} // namespace hv
+
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// named sets of vm-exit controls that can be switched at runtime
+enum exit_profile : uint8_t {
+  // only vm-exit when it is required for correct operation
+  exit_profile_minimal = 0,
+
+  // vm-exit on every CR0/CR4 modification and every CR3 access
+  exit_profile_hardened,
+
+  // hardened + no CR3-target list and extra MSR exits
+  exit_profile_tracing,
+
+  // minimal + NMIs are passed directly to the guest and vm-exit
+  // overhead isn't concealed (no MSR store/load lists)
+  exit_profile_low_latency,
+
+  exit_profile_count
+};
+
+// the profile that is used when the hypervisor is first started
+#ifdef NDEBUG
+inline constexpr exit_profile default_exit_profile = exit_profile_minimal;
+#else
+inline constexpr exit_profile default_exit_profile = exit_profile_hardened;
+#endif
+
+// per-VCPU statistics that are tracked for every exit profile
+struct exit_profile_stats {
+  // number of vm-exits that occurred while the profile was active
+  uint64_t exits;
+
+  // number of TSC ticks that the profile was active for
+  uint64_t tsc_ticks;
+
+  // number of vm-exits that were caused by the VMX preemption timer
+  uint64_t preemption_exits;
+
+  // number of hidden vm-exits that didn't arm the preemption timer (each
+  // of these would most likely have caused a preemption timer vm-exit)
+  uint64_t preemption_exits_avoided;
+};
+
+// switch the current VCPU to the specified exit profile. the VMCS
+// control, host, and guest fields must already be initialized.
+void apply_exit_profile(vcpu* cpu, exit_profile profile);
+
+} // namespace hv
+
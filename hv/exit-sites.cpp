@@ -0,0 +1,96 @@
+#include "exit-sites.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// hash of an exit site (Fibonacci hashing, which takes the top bits)
+static uint32_t hash_exit_site(uint64_t const rip, uint32_t const reason) {
+  auto const key = rip ^ (static_cast<uint64_t>(reason) << 56);
+  return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> (64 - exit_site_table_bits));
+}
+
+void exit_site_module::on_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto& table = cpu->exit_sites;
+
+  auto const rip    = vmx_vmread(VMCS_GUEST_RIP);
+  auto const hash   = hash_exit_site(rip, reason.basic_exit_reason);
+  exit_site* victim = nullptr;
+
+  for (uint32_t i = 0; i < exit_site_max_probes; ++i) {
+    auto& site = table.sites[(hash + i) & (exit_site_table_size - 1)];
+
+    if (site.count && site.rip == rip && site.reason == reason.basic_exit_reason) {
+      // saturating increment
+      if (site.count != 0xFFFFFFFF)
+        ++site.count;
+      return;
+    }
+
+    // empty slot
+    if (!site.count) {
+      site.rip    = rip;
+      site.reason = reason.basic_exit_reason;
+      site.count  = 1;
+      return;
+    }
+
+    if (!victim || site.count < victim->count)
+      victim = &site;
+  }
+
+  // every probed slot is occupied. instead of evicting the least frequent
+  // site immediately, it is decremented and only replaced once its count
+  // drops to zero--so a burst of one-off sites can't flush out hot ones.
+  if (--victim->count == 0) {
+    victim->rip    = rip;
+    victim->reason = reason.basic_exit_reason;
+    victim->count  = 1;
+    return;
+  }
+
+  ++table.unattributed;
+}
+
+// copy the N most frequent exit sites of a table into an array (sorted by
+// count, in descending order). returns the number of sites that were copied.
+uint32_t get_top_exit_sites(vcpu_exit_site_table const& table,
+    exit_site* const sites, uint32_t const count) {
+  // the previously selected site (sites are ordered by count and then index)
+  uint64_t prev_count = ~0ull;
+  uint32_t prev_index = 0;
+
+  uint32_t copied = 0;
+
+  for (; copied < count; ++copied) {
+    int best = -1;
+
+    for (uint32_t i = 0; i < exit_site_table_size; ++i) {
+      auto const c = table.sites[i].count;
+
+      // only consider sites that come after the previous one
+      if (!c || c > prev_count || (c == prev_count && i <= prev_index))
+        continue;
+
+      if (best < 0 || c > table.sites[best].count)
+        best = i;
+    }
+
+    if (best < 0)
+      break;
+
+    sites[copied] = table.sites[best];
+    prev_count    = table.sites[best].count;
+    prev_index    = best;
+  }
+
+  return copied;
+}
+
+// reset the exit-site table of the current VCPU
+void reset_exit_sites(vcpu_exit_site_table& table) {
+  memset(&table, 0, sizeof(table));
+}
+
+} // namespace hv
+
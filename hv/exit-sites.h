@@ -0,0 +1,60 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// attribute every vm-exit to the guest RIP that caused it
+inline constexpr bool exit_site_tracking_enabled = true;
+
+// log2 of the number of entries in a per-VCPU exit-site table
+inline constexpr uint32_t exit_site_table_bits = 10;
+
+// number of entries in a per-VCPU exit-site table
+inline constexpr uint32_t exit_site_table_size = 1u << exit_site_table_bits;
+
+// maximum number of slots that are probed for a single exit site
+inline constexpr uint32_t exit_site_max_probes = 8;
+
+// maximum number of sites that can be dumped with a single hypercall
+inline constexpr uint32_t max_exit_site_dump_count = 64;
+
+// the guest code that caused a vm-exit
+struct exit_site {
+  uint64_t rip;
+  uint32_t reason;
+
+  // number of vm-exits (saturates at 0xFFFFFFFF). a count of 0 marks an
+  // empty slot.
+  uint32_t count;
+};
+
+// open-addressed hash table that is keyed by (reason, RIP)
+struct vcpu_exit_site_table {
+  exit_site sites[exit_site_table_size];
+
+  // number of vm-exits that weren't attributed because every probed slot
+  // was occupied, and the least frequent site wasn't replaced
+  uint64_t unattributed;
+};
+
+// vm-exit module that counts the vm-exits of every exit site
+struct exit_site_module {
+  static constexpr bool enabled = exit_site_tracking_enabled;
+
+  static void on_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+  static void on_vm_exit_handled(vcpu*, vmx_vmexit_reason) {}
+};
+
+// copy the N most frequent exit sites of a table into an array (sorted by
+// count, in descending order). returns the number of sites that were copied.
+uint32_t get_top_exit_sites(vcpu_exit_site_table const& table,
+  exit_site* sites, uint32_t count);
+
+// reset the exit-site table of the current VCPU
+void reset_exit_sites(vcpu_exit_site_table& table);
+
+} // namespace hv
+
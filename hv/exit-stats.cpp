@@ -0,0 +1,50 @@
+#include "exit-stats.h"
+#include "vcpu.h"
+#include "vmx.h"
+#include "hv.h"
+
+namespace hv {
+
+// get the histogram bucket for the specified latency
+static size_t get_latency_bucket(uint64_t const latency) {
+  unsigned long index = 0;
+  if (!_BitScanReverse64(&index, latency))
+    return 0;
+
+  return min(index, latency_histogram_bucket_count - 1);
+}
+
+// update the latency statistics at the end of a vm-exit
+void record_vm_exit_latency(vcpu* const cpu,
+    vmx_vmexit_reason const reason, uint64_t const start_tsc) {
+  auto const index = reason.basic_exit_reason;
+  if (index >= vm_exit_reason_count)
+    return;
+
+  auto const latency = __rdtsc() - start_tsc;
+  auto& stats = *cpu->exit_stats;
+
+  ++stats.sequence;
+  _WriteBarrier();
+
+  stats.latency_sum[index] += latency;
+  stats.latency_max[index]  = max(stats.latency_max[index], latency);
+  ++stats.latency_histogram[index][get_latency_bucket(latency)];
+
+  if (latency > ghv.tail_latency_budget) {
+    auto& record = stats.tail_latency[stats.tail_latency_count % tail_latency_record_count];
+    record.tsc       = start_tsc;
+    record.latency   = latency;
+    record.rip       = vmx_vmread(VMCS_GUEST_RIP);
+    record.reason    = reason.flags;
+    record._reserved = 0;
+
+    ++stats.tail_latency_count;
+  }
+
+  _WriteBarrier();
+  ++stats.sequence;
+}
+
+} // namespace hv
+
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "exit-dispatch.h"
+#include "pmu.h"
+#include "timing.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// number of buckets in a latency histogram. bucket N counts the vm-exits
+// that took [2^N, 2^(N+1)) TSC ticks (the last bucket counts everything
+// that took longer).
+inline constexpr size_t latency_histogram_bucket_count = 32;
+
+// number of tail-latency records that are kept for every VCPU
+inline constexpr size_t tail_latency_record_count = 64;
+
+// vm-exits that take longer than this (in TSC ticks) are recorded by default
+inline constexpr uint64_t default_tail_latency_budget = 20000;
+
+// a single vm-exit that went over the latency budget
+struct tail_latency_record {
+  // TSC at the start of the vm-exit
+  uint64_t tsc;
+
+  // number of TSC ticks that handle_vm_exit() took
+  uint64_t latency;
+
+  // guest RIP after the vm-exit was handled
+  uint64_t rip;
+
+  uint32_t reason;
+  uint32_t _reserved;
+};
+
+// per-VCPU statistics that are mapped read-only into clients. every VCPU is
+// the only writer of its own statistics, so no locks are needed. the
+// sequence number is odd while the latency fields are being updated--readers
+// that need a consistent snapshot should retry if it changed.
+struct vcpu_exit_stats {
+  uint64_t volatile sequence;
+
+  // number of times that each vm-exit/hypercall handler was called
+  vm_exit_counters counters;
+
+  // sum and maximum of the handle_vm_exit() latency for every exit reason
+  uint64_t latency_sum[vm_exit_reason_count];
+  uint64_t latency_max[vm_exit_reason_count];
+
+  // log2-bucketed latency histograms for every exit reason
+  uint64_t latency_histogram[vm_exit_reason_count][latency_histogram_bucket_count];
+
+  // host PMC deltas across handle_vm_exit() for every exit reason (only
+  // collected while vm-exit PMC profiling is enabled)
+  uint64_t pmc_samples[vm_exit_reason_count];
+  uint64_t pmc_sum[vm_exit_reason_count][exit_pmc_count];
+
+  // the calibrated vm-exit overhead of this VCPU
+  vm_exit_overhead exit_overhead[overhead_class_count];
+
+  // total number of tail-latency records (the ring only holds the newest ones)
+  uint64_t tail_latency_count;
+  tail_latency_record tail_latency[tail_latency_record_count];
+};
+
+// update the latency statistics at the end of a vm-exit
+void record_vm_exit_latency(vcpu* cpu, vmx_vmexit_reason reason, uint64_t start_tsc);
+
+} // namespace hv
+
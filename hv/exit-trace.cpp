@@ -0,0 +1,270 @@
+#include "exit-trace.h"
+#include "hv.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+void exit_trace_module::on_vm_exit(vcpu* const cpu, vmx_vmexit_reason) {
+  auto& trace = *cpu->exit_trace;
+
+  if (!trace.enabled)
+    return;
+
+  trace.active      = true;
+  trace.handler_tsc = __rdtsc();
+}
+
+void exit_trace_module::on_vm_exit_handled(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto& trace = *cpu->exit_trace;
+
+  if (!trace.active)
+    return;
+
+  auto const handler_cycles = __rdtsc() - trace.handler_tsc;
+
+  trace.active = false;
+
+  // not enough space for a record of the maximum size
+  if (exit_trace_ring_size - (trace.head - trace.tail) < max_exit_trace_record_size) {
+    ++trace.dropped;
+    trace.sync = true;
+    return;
+  }
+
+  auto const rip = vmx_vmread(VMCS_GUEST_RIP);
+  auto const cr3 = vmx_vmread(VMCS_GUEST_CR3);
+
+  uint8_t flags = 0;
+
+  if (trace.sync) {
+    flags         |= exit_trace_sync_flag;
+    trace.prev_tsc = 0;
+    trace.prev_rip = 0;
+    trace.sync     = false;
+  }
+
+  if (flags & exit_trace_sync_flag || cr3 != trace.prev_cr3)
+    flags |= exit_trace_cr3_flag;
+
+  // zigzag encoding, so that small negative deltas stay small
+  auto const rip_delta = static_cast<int64_t>(rip - trace.prev_rip);
+
+  uint8_t record[max_exit_trace_record_size];
+  auto out = record;
+
+  *out++ = static_cast<uint8_t>(reason.basic_exit_reason);
+  *out++ = flags;
+  out = write_varint(out, trace.handler_tsc - trace.prev_tsc);
+  out = write_varint(out, (static_cast<uint64_t>(rip_delta) << 1) ^ (rip_delta >> 63));
+
+  if (flags & exit_trace_cr3_flag)
+    out = write_varint(out, cr3);
+
+  out = write_varint(out, vmx_vmread(VMCS_EXIT_QUALIFICATION));
+  out = write_varint(out, handler_cycles);
+
+  trace.prev_tsc = trace.handler_tsc;
+  trace.prev_rip = rip;
+  trace.prev_cr3 = cr3;
+
+  auto const size = static_cast<size_t>(out - record);
+
+  // the record might wrap around the end of the ring
+  for (size_t i = 0; i < size; ++i)
+    trace.data[(trace.head + i) & (exit_trace_ring_size - 1)] = record[i];
+
+  // the record needs to be visible before the consumer sees the new head
+  _WriteBarrier();
+  trace.head += size;
+
+  auto const fill = trace.head - trace.tail;
+  check_ring_watermark(cpu, fill - size, fill, exit_trace_ring_size);
+}
+
+// enable or disable vm-exit tracing on the current VCPU
+void set_exit_tracing(vcpu* const cpu, bool const enabled) {
+  auto& trace = *cpu->exit_trace;
+
+  // records might have been missed while tracing was disabled
+  trace.enabled = enabled;
+  trace.active  = false;
+  trace.sync    = true;
+}
+
+// initialize a trace reader for the specified ring
+void init_exit_trace_reader(exit_trace_reader& reader, vcpu_exit_trace* const trace) {
+  reader.trace    = trace;
+  reader.sizes[0] = 0;
+  reader.sizes[1] = 0;
+  reader.front    = 0;
+  reader.position = 0;
+  reader.prev_tsc = 0;
+  reader.prev_rip = 0;
+  reader.prev_cr3 = 0;
+}
+
+// drain the ring into the back buffer and make it the front buffer. returns
+// the number of bytes that are available to decode.
+size_t swap_exit_trace_buffers(exit_trace_reader& reader) {
+  auto& trace = *reader.trace;
+  auto const back = reader.front ^ 1;
+
+  auto const tail = trace.tail;
+  auto const head = trace.head;
+
+  // make sure the record data isn't read before the head
+  _ReadBarrier();
+
+  auto const size  = static_cast<size_t>(head - tail);
+  auto const start = static_cast<size_t>(tail & (exit_trace_ring_size - 1));
+  auto const first = min(size, exit_trace_ring_size - start);
+
+  memcpy(reader.buffers[back], trace.data + start, first);
+  memcpy(reader.buffers[back] + first, trace.data, size - first);
+
+  // the producer can reuse the space once the data has been copied
+  _ReadWriteBarrier();
+  trace.tail = head;
+
+  reader.sizes[back] = size;
+  reader.front       = back;
+  reader.position    = 0;
+
+  return size;
+}
+
+// decode the next record in the front buffer (returns false if there are
+// no more records)
+bool read_exit_trace_record(exit_trace_reader& reader, exit_trace_record& record) {
+  if (reader.position >= reader.sizes[reader.front])
+    return false;
+
+  uint8_t const* in = reader.buffers[reader.front] + reader.position;
+
+  record.reason = *in++;
+  auto const flags = *in++;
+
+  if (flags & exit_trace_sync_flag) {
+    reader.prev_tsc = 0;
+    reader.prev_rip = 0;
+  }
+
+  // the TSC delta comes before the RIP delta
+  record.tsc = reader.prev_tsc + read_varint(in);
+
+  auto const rip_delta = read_varint(in);
+  record.rip = reader.prev_rip + ((rip_delta >> 1) ^ (0 - (rip_delta & 1)));
+  record.cr3 = (flags & exit_trace_cr3_flag) ? read_varint(in) : reader.prev_cr3;
+  record.qualification  = read_varint(in);
+  record.handler_cycles = read_varint(in);
+
+  reader.prev_tsc = record.tsc;
+  reader.prev_rip = record.rip;
+  reader.prev_cr3 = record.cr3;
+  reader.position = static_cast<size_t>(in - reader.buffers[reader.front]);
+
+  return true;
+}
+
+// enable or disable vm-exit tracing on every VCPU
+void set_exit_tracing(bool const enabled) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_set_exit_tracing;
+    input.key     = hypercall_key;
+    input.args[0] = enabled;
+    vmx_vmcall(input);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+}
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's trace ring with its reader in ghv.exit_trace_readers
+// and append the decoded records to a file (which is created if it doesn't
+// exist). returns the number of records written.
+uint64_t write_exit_trace(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!ghv.exit_trace_readers)
+    return 0;
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, FILE_APPEND_DATA | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the exit trace file.\n");
+    return 0;
+  }
+
+  // the readers can only be used by one drain at a time
+  ExAcquireFastMutex(&ghv.exit_trace_lock);
+
+  // records are written in batches instead of one write per record
+  exit_trace_record records[32];
+  size_t batch = 0;
+
+  uint64_t count = 0;
+  bool failed = false;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count && !failed; ++i) {
+    auto& reader = ghv.exit_trace_readers[i];
+
+    // only drain the ring once, since the VCPU keeps producing records
+    swap_exit_trace_buffers(reader);
+
+    while (read_exit_trace_record(reader, records[batch])) {
+      // the rest of the buffer is still decoded after a failed write, since
+      // the next drain continues from the last record
+      if (failed)
+        continue;
+
+      records[batch].vcpu = i;
+
+      if (++batch < sizeof(records) / sizeof(records[0]))
+        continue;
+
+      if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+          records, sizeof(records), nullptr, nullptr))) {
+        failed = true;
+        continue;
+      }
+
+      count += batch;
+      batch = 0;
+    }
+  }
+
+  if (!failed && batch > 0 && NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr,
+      nullptr, &io_status, records, static_cast<ULONG>(batch * sizeof(records[0])),
+      nullptr, nullptr)))
+    count += batch;
+
+  ExReleaseFastMutex(&ghv.exit_trace_lock);
+  ZwClose(file);
+
+  return count;
+}
+
+#endif
+
+} // namespace hv
+
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Every vm-exit is recorded into a per-VCPU ring that a guest driver drains.
+// Records are variable-length and delta-encoded against the previous record:
+//
+//   uint8_t  basic exit reason
+//   uint8_t  flags (exit_trace_*_flag)
+//   varint   TSC delta (the TSC is taken when the handler is called)
+//   varint   RIP delta (zigzag-encoded)
+//   varint   CR3 (only present if exit_trace_cr3_flag is set)
+//   varint   exit qualification
+//   varint   handler cycles
+//
+// varints are unsigned LEB128. A sync record (exit_trace_sync_flag) is
+// encoded relative to zero--one is written first and after every dropped
+// record, so the consumer can always resync.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// vm-exit tracing starts out enabled in debug builds. release builds need
+// to enable it with set_exit_tracing().
+#ifdef NDEBUG
+inline constexpr bool exit_tracing_default = false;
+#else
+inline constexpr bool exit_tracing_default = true;
+#endif
+
+// file that the decoded trace records are written to by the device
+inline constexpr wchar_t const* exit_trace_path =
+  L"\\SystemRoot\\hv-exit-trace.bin";
+
+// size of the per-VCPU trace ring in bytes (must be a power of two)
+inline constexpr size_t exit_trace_ring_size = 0x10000;
+
+static_assert((exit_trace_ring_size & (exit_trace_ring_size - 1)) == 0);
+
+// maximum size of an encoded record
+inline constexpr size_t max_exit_trace_record_size = 2 + 5 * 10;
+
+// the record is encoded relative to zero instead of the previous record
+inline constexpr uint8_t exit_trace_sync_flag = 1 << 0;
+
+// the record contains CR3 (it changed since the previous record)
+inline constexpr uint8_t exit_trace_cr3_flag = 1 << 1;
+
+// single-producer (the VCPU in root mode), single-consumer (a guest driver)
+// byte ring. the head only ever covers complete records.
+struct vcpu_exit_trace {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of records that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // producer state
+  bool enabled;
+
+  // the current vm-exit is being traced
+  bool active;
+
+  uint64_t handler_tsc;
+  uint64_t prev_tsc;
+  uint64_t prev_rip;
+  uint64_t prev_cr3;
+  bool sync;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  alignas(64) uint8_t data[exit_trace_ring_size];
+};
+
+// write an unsigned LEB128 varint
+inline uint8_t* write_varint(uint8_t* out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+// read an unsigned LEB128 varint
+inline uint64_t read_varint(uint8_t const*& in) {
+  uint64_t value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    auto const byte = *in++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80))
+      break;
+  }
+
+  return value;
+}
+
+// vm-exit module that records every vm-exit into the trace ring while
+// tracing is enabled
+struct exit_trace_module {
+  static constexpr bool enabled = true;
+
+  static void on_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+  static void on_vm_exit_handled(vcpu* cpu, vmx_vmexit_reason reason);
+};
+
+// enable or disable vm-exit tracing on the current VCPU
+void set_exit_tracing(vcpu* cpu, bool enabled);
+
+// a decoded trace record
+struct exit_trace_record {
+  uint32_t reason;
+
+  // index of the VCPU (only filled in by write_exit_trace())
+  uint32_t vcpu;
+
+  uint64_t tsc;
+  uint64_t rip;
+  uint64_t cr3;
+  uint64_t qualification;
+  uint64_t handler_cycles;
+};
+
+// guest-side consumer that drains a trace ring into one buffer while the
+// records in the other buffer are being processed. records are encoded
+// against the previous record, so a ring needs to be drained with the same
+// reader every time (see ghv.exit_trace_readers).
+struct exit_trace_reader {
+  vcpu_exit_trace* trace;
+
+  uint8_t buffers[2][exit_trace_ring_size];
+  size_t sizes[2];
+
+  // the buffer that is currently being processed
+  int front;
+
+  // decoder state
+  size_t position;
+  uint64_t prev_tsc;
+  uint64_t prev_rip;
+  uint64_t prev_cr3;
+};
+
+// initialize a trace reader for the specified ring
+void init_exit_trace_reader(exit_trace_reader& reader, vcpu_exit_trace* trace);
+
+// drain the ring into the back buffer and make it the front buffer. returns
+// the number of bytes that are available to decode.
+size_t swap_exit_trace_buffers(exit_trace_reader& reader);
+
+// decode the next record in the front buffer (returns false if there are
+// no more records)
+bool read_exit_trace_record(exit_trace_reader& reader, exit_trace_record& record);
+
+// enable or disable vm-exit tracing on every VCPU
+void set_exit_tracing(bool enabled);
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's trace ring with its reader in ghv.exit_trace_readers
+// and append the decoded records to a file (which is created if it doesn't
+// exist). returns the number of records written.
+uint64_t write_exit_trace(wchar_t const* path);
+
+#endif
+
+} // namespace hv
+
@@ -0,0 +1,30 @@
+#include "extended-state.h"
+#include "vcpu.h"
+
+namespace hv {
+
+// MXCSR value after reset (all exceptions masked)
+inline constexpr uint32_t default_mxcsr = 0x1F80;
+
+// save the guest extended state (x87, SSE, AVX, etc) so that the
+// host is free to use vector registers
+void save_guest_extended_state(vcpu* const cpu) {
+  // XCR0 isn't switched on vm-exit, so this saves every state
+  // component that the guest has currently enabled. handlers that
+  // modify XCR0 should NOT use vector registers.
+  if (cpu->cached.xsaveopt_supported)
+    _xsaveopt64(cpu->guest_xsave_area, ~0ull);
+  else
+    _xsave64(cpu->guest_xsave_area, ~0ull);
+
+  // the guest might have unmasked floating-point exceptions
+  _mm_setcsr(default_mxcsr);
+}
+
+// restore the guest extended state that was previously saved
+void restore_guest_extended_state(vcpu* const cpu) {
+  _xrstor64(cpu->guest_xsave_area, ~0ull);
+}
+
+} // namespace hv
+
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// save the guest extended state (x87, SSE, AVX, etc) so that the
+// host is free to use vector registers
+void save_guest_extended_state(vcpu* cpu);
+
+// restore the guest extended state that was previously saved
+void restore_guest_extended_state(vcpu* cpu);
+
+} // namespace hv
+
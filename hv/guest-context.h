@@ -119,7 +119,12 @@ struct alignas(16) guest_context {
   uint64_t dr3;
   uint64_t dr6;
 
-  // TODO: SSE registers...
+  // set by handle_vm_exit() when the current VMCS has to be entered
+  // with VMLAUNCH instead of VMRESUME (a freshly cleared vmcs02)
+  uint64_t vmlaunch;
+
+  // extended state (SSE, AVX, etc) is only saved for handlers
+  // that need it (see extended-state.h)
 };
 
 // remember to update this value in vm-exit.asm
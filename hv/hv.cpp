@@ -93,8 +93,154 @@ static bool create() {
   // zero-initialize the vcpu array
   memset(ghv.vcpus, 0, arr_size);
 
+  ghv.current_exit_profile = default_exit_profile;
+
   DbgPrint("[hv] Allocated %u VCPUs (0x%zX bytes).\n", ghv.vcpu_count, arr_size);
 
+  auto const stats_size = sizeof(vcpu_exit_stats) * ghv.vcpu_count;
+
+  // the statistics are kept separate from the vcpus since they get
+  // mapped into clients
+  ghv.exit_stats = static_cast<vcpu_exit_stats*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, stats_size, 'fr0g'));
+
+  if (!ghv.exit_stats) {
+    DbgPrint("[hv] Failed to allocate VM-exit statistics.\n");
+    return false;
+  }
+
+  memset(ghv.exit_stats, 0, stats_size);
+
+  ghv.exit_stats_mdl = IoAllocateMdl(ghv.exit_stats,
+    static_cast<unsigned long>(stats_size), FALSE, FALSE, nullptr);
+
+  if (!ghv.exit_stats_mdl) {
+    DbgPrint("[hv] Failed to allocate VM-exit statistics MDL.\n");
+    return false;
+  }
+
+  MmBuildMdlForNonPagedPool(ghv.exit_stats_mdl);
+
+  ExInitializeFastMutex(&ghv.exit_stats_mapping_lock);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].exit_stats = &ghv.exit_stats[i];
+
+  ghv.tail_latency_budget = default_tail_latency_budget;
+
+  auto const log_rings_size = sizeof(vcpu_log_ring) * ghv.vcpu_count;
+
+  ghv.log_rings = static_cast<vcpu_log_ring*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, log_rings_size, 'fr0g'));
+
+  if (!ghv.log_rings) {
+    DbgPrint("[hv] Failed to allocate log rings.\n");
+    return false;
+  }
+
+  memset(ghv.log_rings, 0, log_rings_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].log_ring = &ghv.log_rings[i];
+
+  ghv.runtime_log_level = default_log_level;
+
+  auto const sample_rings_size = sizeof(vcpu_sample_ring) * ghv.vcpu_count;
+
+  ghv.sample_rings = static_cast<vcpu_sample_ring*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sample_rings_size, 'fr0g'));
+
+  if (!ghv.sample_rings) {
+    DbgPrint("[hv] Failed to allocate profiler sample rings.\n");
+    return false;
+  }
+
+  memset(ghv.sample_rings, 0, sample_rings_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].profiler.ring = &ghv.sample_rings[i];
+
+  ghv.sampling_interval = default_sampling_interval;
+
+  auto const syscall_rings_size = sizeof(vcpu_syscall_ring) * ghv.vcpu_count;
+
+  ghv.syscall_rings = static_cast<vcpu_syscall_ring*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, syscall_rings_size, 'fr0g'));
+
+  if (!ghv.syscall_rings) {
+    DbgPrint("[hv] Failed to allocate syscall rings.\n");
+    return false;
+  }
+
+  memset(ghv.syscall_rings, 0, syscall_rings_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].syscall_trace.ring = &ghv.syscall_rings[i];
+
+  memset(&ghv.syscall_trace, 0, sizeof(ghv.syscall_trace));
+
+  auto const cr3_rings_size = sizeof(vcpu_cr3_ring) * ghv.vcpu_count;
+
+  ghv.cr3_rings = static_cast<vcpu_cr3_ring*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, cr3_rings_size, 'fr0g'));
+
+  if (!ghv.cr3_rings) {
+    DbgPrint("[hv] Failed to allocate CR3-load rings.\n");
+    return false;
+  }
+
+  memset(ghv.cr3_rings, 0, cr3_rings_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].cr3_telemetry.ring = &ghv.cr3_rings[i];
+
+  auto const capture_rings_size = sizeof(vcpu_exit_capture_ring) * ghv.vcpu_count;
+
+  ghv.exit_capture_rings = static_cast<vcpu_exit_capture_ring*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, capture_rings_size, 'fr0g'));
+
+  if (!ghv.exit_capture_rings) {
+    DbgPrint("[hv] Failed to allocate VM-exit capture rings.\n");
+    return false;
+  }
+
+  memset(ghv.exit_capture_rings, 0, capture_rings_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    ghv.vcpus[i].exit_capture.ring = &ghv.exit_capture_rings[i];
+
+  auto const traces_size = sizeof(vcpu_exit_trace) * ghv.vcpu_count;
+
+  ghv.exit_traces = static_cast<vcpu_exit_trace*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, traces_size, 'fr0g'));
+
+  if (!ghv.exit_traces) {
+    DbgPrint("[hv] Failed to allocate VM-exit trace rings.\n");
+    return false;
+  }
+
+  memset(ghv.exit_traces, 0, traces_size);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // the first record is always a sync record
+    ghv.exit_traces[i].enabled = exit_tracing_default;
+    ghv.exit_traces[i].sync    = true;
+    ghv.vcpus[i].exit_trace    = &ghv.exit_traces[i];
+  }
+
+  ghv.exit_trace_readers = static_cast<exit_trace_reader*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(exit_trace_reader) * ghv.vcpu_count, 'fr0g'));
+
+  if (!ghv.exit_trace_readers) {
+    DbgPrint("[hv] Failed to allocate VM-exit trace readers.\n");
+    return false;
+  }
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    init_exit_trace_reader(ghv.exit_trace_readers[i], &ghv.exit_traces[i]);
+
+  ExInitializeFastMutex(&ghv.exit_trace_lock);
+
   if (!find_offsets()) {
     DbgPrint("[hv] Failed to find offsets.\n");
     return false;
@@ -108,6 +254,28 @@ static bool create() {
   return true;
 }
 
+// periodically recalibrate the vm-exit overhead, since it can change with
+// the processor frequency, microcode updates, or cache pressure
+static void calibration_thread(void*) {
+  LARGE_INTEGER timeout;
+  timeout.QuadPart = -log_flush_interval * 10'000'000;
+
+  int64_t elapsed = 0;
+
+  while (KeWaitForSingleObject(&ghv.calibration_stop_event,
+      Executive, KernelMode, FALSE, &timeout) == STATUS_TIMEOUT) {
+    flush_logs();
+
+    elapsed += log_flush_interval;
+    if (elapsed >= overhead_recalibration_interval) {
+      recalibrate_vm_exit_overhead();
+      elapsed = 0;
+    }
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
 // virtualize the current system
 bool start() {
   if (!create())
@@ -133,15 +301,62 @@ bool start() {
 
   ExFreePoolWithTag(ghv.vcpus, 'fr0g');
 
+  KeInitializeEvent(&ghv.calibration_stop_event, NotificationEvent, FALSE);
+
+  HANDLE thread = nullptr;
+  if (NT_SUCCESS(PsCreateSystemThread(&thread, THREAD_ALL_ACCESS,
+      nullptr, nullptr, nullptr, calibration_thread, nullptr))) {
+    ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, *PsThreadType,
+      KernelMode, reinterpret_cast<void**>(&ghv.calibration_thread), nullptr);
+    ZwClose(thread);
+  } else
+    DbgPrint("[hv] Failed to create the calibration thread.\n");
+
   return true;
 }
 
+// unmap every mapping of the vm-exit statistics, no matter which process
+// it belongs to
+static void unmap_all_exit_stats() {
+  ExAcquireFastMutex(&ghv.exit_stats_mapping_lock);
+
+  for (auto& mapping : ghv.exit_stats_mappings) {
+    if (!mapping.address)
+      continue;
+
+    // user-mode mappings need to be unmapped in the address space that
+    // they were mapped into
+    KAPC_STATE apc_state;
+    KeStackAttachProcess(mapping.process, &apc_state);
+    MmUnmapLockedPages(mapping.address, ghv.exit_stats_mdl);
+    KeUnstackDetachProcess(&apc_state);
+
+    ObDereferenceObject(mapping.process);
+    mapping.process = nullptr;
+    mapping.address = nullptr;
+  }
+
+  ExReleaseFastMutex(&ghv.exit_stats_mapping_lock);
+}
+
 // devirtualize the current system
 void stop() {
   // we need to be running at an IRQL below DISPATCH_LEVEL so
   // that KeSetSystemAffinityThreadEx takes effect immediately
   NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
+  // clients shouldn't be left with a mapping of freed memory
+  if (ghv.exit_stats_mdl)
+    unmap_all_exit_stats();
+
+  // the calibration thread uses hypercalls, so it needs to be stopped first
+  if (ghv.calibration_thread) {
+    KeSetEvent(&ghv.calibration_stop_event, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(ghv.calibration_thread, Executive, KernelMode, FALSE, nullptr);
+    ObDereferenceObject(ghv.calibration_thread);
+    ghv.calibration_thread = nullptr;
+  }
+
   // virtualize every cpu
   for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
     // restrict execution to the specified cpu
@@ -160,6 +375,162 @@ void stop() {
 
     KeRevertToUserAffinityThreadEx(orig_affinity);
   }
+
+  // print whatever was logged since the last flush
+  flush_logs();
+}
+
+// switch every VCPU to the specified exit profile
+void set_exit_profile(exit_profile const profile) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  // every VCPU will eventually switch to the new profile on its next
+  // vm-exit, but we want the switch to happen immediately
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_set_exit_profile;
+    input.key     = hv::hypercall_key;
+    input.args[0] = profile;
+    vmx_vmcall(input);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+}
+
+// map the vm-exit statistics of every VCPU (an array of ghv.vcpu_count
+// vcpu_exit_stats structures) read-only into the current process
+void* map_exit_stats() {
+  if (!ghv.exit_stats_mdl)
+    return nullptr;
+
+  void* address = nullptr;
+
+  ExAcquireFastMutex(&ghv.exit_stats_mapping_lock);
+
+  for (auto& mapping : ghv.exit_stats_mappings) {
+    if (mapping.address)
+      continue;
+
+    // MmMapLockedPagesSpecifyCache() raises an exception for user-mode mappings
+    __try {
+      address = MmMapLockedPagesSpecifyCache(ghv.exit_stats_mdl, UserMode, MmCached,
+        nullptr, FALSE, NormalPagePriority | MdlMappingNoExecute | MdlMappingNoWrite);
+    }
+    __except (1) {
+      address = nullptr;
+    }
+
+    if (address) {
+      mapping.process = PsGetCurrentProcess();
+      mapping.address = address;
+      ObReferenceObject(mapping.process);
+    }
+
+    break;
+  }
+
+  ExReleaseFastMutex(&ghv.exit_stats_mapping_lock);
+
+  return address;
+}
+
+// unmap vm-exit statistics that were mapped into the current process with
+// map_exit_stats()
+bool unmap_exit_stats(void* const address) {
+  auto const process = PsGetCurrentProcess();
+  bool found = false;
+
+  ExAcquireFastMutex(&ghv.exit_stats_mapping_lock);
+
+  for (auto& mapping : ghv.exit_stats_mappings) {
+    if (!address || mapping.address != address || mapping.process != process)
+      continue;
+
+    MmUnmapLockedPages(mapping.address, ghv.exit_stats_mdl);
+
+    ObDereferenceObject(mapping.process);
+    mapping.process = nullptr;
+    mapping.address = nullptr;
+
+    found = true;
+    break;
+  }
+
+  ExReleaseFastMutex(&ghv.exit_stats_mapping_lock);
+
+  return found;
+}
+
+// unmap every mapping of the vm-exit statistics in the current process
+void unmap_process_exit_stats() {
+  auto const process = PsGetCurrentProcess();
+
+  ExAcquireFastMutex(&ghv.exit_stats_mapping_lock);
+
+  for (auto& mapping : ghv.exit_stats_mappings) {
+    if (!mapping.address || mapping.process != process)
+      continue;
+
+    MmUnmapLockedPages(mapping.address, ghv.exit_stats_mdl);
+
+    ObDereferenceObject(mapping.process);
+    mapping.process = nullptr;
+    mapping.address = nullptr;
+  }
+
+  ExReleaseFastMutex(&ghv.exit_stats_mapping_lock);
+}
+
+// set the latency (in TSC ticks) that vm-exits need to exceed in order
+// to be recorded as tail-latency records
+void set_tail_latency_budget(uint64_t const budget) {
+  ghv.tail_latency_budget = budget;
+}
+
+// count host instructions, LLC misses, and dTLB misses across every vm-exit
+// on every VCPU (the results are exported in the vm-exit statistics)
+bool set_exit_pmc_profiling(bool const enabled) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  bool success = true;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hv::hypercall_input input;
+    input.code    = hv::hypercall_set_exit_pmc_profiling;
+    input.key     = hv::hypercall_key;
+    input.args[0] = enabled;
+    success &= (vmx_vmcall(input) != 0);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+
+  return success;
+}
+
+// measure the vm-exit overhead of every VCPU again
+void recalibrate_vm_exit_overhead() {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    calibrate_vm_exit_overhead();
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
 }
 
 } // namespace hv
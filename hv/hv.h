@@ -1,16 +1,39 @@
 #pragma once
 
 #include "page-tables.h"
+#include "cr3-telemetry.h"
+#include "exit-capture.h"
+#include "exit-profile.h"
+#include "exit-stats.h"
+#include "exit-trace.h"
 #include "hypercalls.h"
+#include "logger.h"
+#include "notify.h"
+#include "profiler.h"
+#include "syscall-trace.h"
+#include "platform.h"
 #include "vmx.h"
 
-#include <ntddk.h>
-
 namespace hv {
 
 // signature that is returned by the ping hypercall
 inline constexpr uint64_t hypervisor_signature = 'fr0g';
 
+// number of seconds between vm-exit overhead recalibrations
+inline constexpr int64_t overhead_recalibration_interval = 60;
+
+// number of seconds between log flushes
+inline constexpr int64_t log_flush_interval = 1;
+
+// maximum number of times that the vm-exit statistics can be mapped at once
+inline constexpr size_t max_exit_stats_mappings = 16;
+
+// vm-exit statistics that were mapped into a client process
+struct exit_stats_mapping {
+  PEPROCESS process;
+  void* address;
+};
+
 struct hypervisor {
   // host page tables that are shared between vcpus
   host_page_tables host_page_tables;
@@ -25,6 +48,63 @@ struct hypervisor {
   // kernel CR3 value of the System process
   cr3 system_cr3;
 
+  // the exit profile that every VCPU should be using
+  exit_profile volatile current_exit_profile;
+
+  // vm-exit statistics for every VCPU (non-paged, so that they can be
+  // mapped into clients with exit_stats_mdl)
+  vcpu_exit_stats* exit_stats;
+  PMDL exit_stats_mdl;
+
+  // every mapping of the vm-exit statistics (so that they can be unmapped
+  // when the client exits or the driver is unloaded)
+  FAST_MUTEX exit_stats_mapping_lock;
+  exit_stats_mapping exit_stats_mappings[max_exit_stats_mappings];
+
+  // vm-exits that take longer than this many TSC ticks are recorded
+  uint64_t volatile tail_latency_budget;
+
+  // vm-exit trace ring for every VCPU
+  vcpu_exit_trace* exit_traces;
+
+  // trace reader for every VCPU. the decoder state carries over from one
+  // drain to the next, so the readers are only used with exit_trace_lock.
+  exit_trace_reader* exit_trace_readers;
+  FAST_MUTEX exit_trace_lock;
+
+  // root-mode log ring for every VCPU
+  vcpu_log_ring* log_rings;
+
+  // messages above this level are discarded
+  log_level volatile runtime_log_level;
+
+  // profiler sample ring for every VCPU
+  vcpu_sample_ring* sample_rings;
+
+  // number of TSC ticks between profiler samples (0 if disabled)
+  uint64_t volatile sampling_interval;
+
+  // syscall ring for every VCPU
+  vcpu_syscall_ring* syscall_rings;
+
+  // syscall sampling and filters
+  syscall_trace_config syscall_trace;
+
+  // CR3-load ring for every VCPU
+  vcpu_cr3_ring* cr3_rings;
+
+  // vm-exit capture ring for every VCPU
+  vcpu_exit_capture_ring* exit_capture_rings;
+
+  // the vector that is injected when a ring reaches its watermark (0 if
+  // nobody is listening)
+  uint8_t volatile notification_vector;
+
+  // system thread that periodically recalibrates the vm-exit overhead
+  // and flushes the logs
+  PETHREAD calibration_thread;
+  KEVENT calibration_stop_event;
+
   // windows specific offsets D:
   uint64_t kprocess_directory_table_base_offset;
   uint64_t eprocess_unique_process_id_offset;
@@ -43,5 +123,30 @@ bool start();
 // devirtualize the current system
 void stop();
 
+// switch every VCPU to the specified exit profile
+void set_exit_profile(exit_profile profile);
+
+// measure the vm-exit overhead of every VCPU again
+void recalibrate_vm_exit_overhead();
+
+// count host instructions, LLC misses, and dTLB misses across every vm-exit
+// on every VCPU (the results are exported in the vm-exit statistics)
+bool set_exit_pmc_profiling(bool enabled);
+
+// map the vm-exit statistics of every VCPU (an array of ghv.vcpu_count
+// vcpu_exit_stats structures) read-only into the current process
+void* map_exit_stats();
+
+// unmap vm-exit statistics that were mapped into the current process with
+// map_exit_stats()
+bool unmap_exit_stats(void* address);
+
+// unmap every mapping of the vm-exit statistics in the current process
+void unmap_process_exit_stats();
+
+// set the latency (in TSC ticks) that vm-exits need to exceed in order
+// to be recorded as tail-latency records
+void set_tail_latency_budget(uint64_t budget);
+
 } // namespace hv
 
@@ -7,6 +7,48 @@
 
 namespace hv::hc {
 
+// copy a hypervisor buffer into guest virtual memory (in the current address
+// space). a #PF is injected into the guest if this fails.
+static bool write_guest_buffer(vcpu* const cpu, uint8_t* const dst,
+    void const* const src, size_t const size) {
+  size_t bytes_written = 0;
+
+  while (bytes_written < size) {
+    size_t dst_remaining = 0;
+
+    // translate the guest buffer into hypervisor space
+    auto const curr_dst = gva2hva(dst + bytes_written, &dst_remaining, &cpu->exit_capture);
+
+    if (!curr_dst) {
+      // guest virtual address that caused the fault
+      cpu->ctx->cr2 = reinterpret_cast<uint64_t>(dst + bytes_written);
+
+      page_fault_exception error;
+      error.flags            = 0;
+      error.present          = 0;
+      error.write            = 1;
+      error.user_mode_access = (current_guest_cpl() == 3);
+
+      inject_hw_exception(page_fault, error.flags);
+      return false;
+    }
+
+    auto const curr_size = min(dst_remaining, size - bytes_written);
+
+    host_exception_info e;
+    memcpy_safe(e, curr_dst, static_cast<uint8_t const*>(src) + bytes_written, curr_size);
+
+    if (e.exception_occurred) {
+      inject_hw_exception(general_protection, 0);
+      return false;
+    }
+
+    bytes_written += curr_size;
+  }
+
+  return true;
+}
+
 // ping the hypervisor to make sure it is running
 void ping(vcpu* const cpu) {
   cpu->ctx->rax = hypervisor_signature;
@@ -40,7 +82,7 @@ void read_phys_mem(vcpu* const cpu) {
     size_t dst_remaining = 0;
 
     // translate the guest buffer into hypervisor space
-    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining);
+    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining, &cpu->exit_capture);
 
     if (!curr_dst) {
       // guest virtual address that caused the fault
@@ -58,6 +100,8 @@ void read_phys_mem(vcpu* const cpu) {
 
     auto const curr_size = min(dst_remaining, size - bytes_read);
 
+    record_exit_capture_range(cpu->exit_capture, ctx->rdx + bytes_read, curr_size);
+
     host_exception_info e;
     memcpy_safe(e, curr_dst, src + bytes_read, curr_size);
 
@@ -88,7 +132,7 @@ void write_phys_mem(vcpu* const cpu) {
     size_t src_remaining = 0;
 
     // translate the guest buffer into hypervisor space
-    auto const curr_src = gva2hva(src + bytes_read, &src_remaining);
+    auto const curr_src = gva2hva(src + bytes_read, &src_remaining, &cpu->exit_capture);
 
     if (!curr_src) {
       // guest virtual address that caused the fault
@@ -106,6 +150,8 @@ void write_phys_mem(vcpu* const cpu) {
 
     auto const curr_size = min(size - bytes_read, src_remaining);
 
+    record_exit_capture_range(cpu->exit_capture, ctx->rcx + bytes_read, curr_size);
+
     host_exception_info e;
     memcpy_safe(e, dst + bytes_read, curr_src, curr_size);
 
@@ -139,8 +185,9 @@ void read_virt_mem(vcpu* const cpu) {
 
     // translate the guest virtual addresses into host virtual addresses.
     // this has to be done 1 page at a time. :(
-    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining);
-    auto const curr_src = gva2hva(guest_cr3, src + bytes_read, &src_remaining);
+    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining, &cpu->exit_capture);
+    auto const curr_src = gva2hva(guest_cr3,
+      src + bytes_read, &src_remaining, &cpu->exit_capture);
 
     if (!curr_dst) {
       // guest virtual address that caused the fault
@@ -198,8 +245,9 @@ void write_virt_mem(vcpu* const cpu) {
 
     // translate the guest virtual addresses into host virtual addresses.
     // this has to be done 1 page at a time. :(
-    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining);
-    auto const curr_src = gva2hva(guest_cr3, src + bytes_read, &src_remaining);
+    auto const curr_dst = gva2hva(dst + bytes_read, &dst_remaining, &cpu->exit_capture);
+    auto const curr_src = gva2hva(guest_cr3,
+      src + bytes_read, &src_remaining, &cpu->exit_capture);
 
     if (!curr_src) {
       // guest virtual address that caused the fault
@@ -287,7 +335,11 @@ void install_ept_hook(vcpu* const cpu) {
   auto const orig_page = cpu->ctx->rcx;
   auto const exec_page = cpu->ctx->rdx;
 
-  cpu->ctx->rax = install_ept_hook(cpu->ept, orig_page >> 12, exec_page >> 12);
+  // the call counter also changes the execute access of its pages
+  if (page_has_counted_functions(cpu, orig_page >> 12))
+    cpu->ctx->rax = false;
+  else
+    cpu->ctx->rax = install_ept_hook(cpu->ept, orig_page >> 12, exec_page >> 12);
 
   skip_instruction();
 }
@@ -302,5 +354,221 @@ void remove_ept_hook(vcpu* const cpu) {
   skip_instruction();
 }
 
+// switch the CURRENT VCPU to the specified exit profile (other
+// VCPUs will switch lazily on their next vm-exit)
+void set_exit_profile(vcpu* const cpu) {
+  // arguments
+  auto const profile = cpu->ctx->rcx;
+
+  if (profile >= exit_profile_count) {
+    inject_hw_exception(invalid_opcode);
+    return;
+  }
+
+  ghv.current_exit_profile = static_cast<exit_profile>(profile);
+  apply_exit_profile(cpu, ghv.current_exit_profile);
+
+  skip_instruction();
+}
+
+// copy the exit profile statistics of the CURRENT VCPU into a guest buffer
+void query_exit_profile_stats(vcpu* const cpu) {
+  // arguments
+  auto const dst = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+
+  exit_profile_stats stats[exit_profile_count];
+  memcpy(stats, cpu->profile_stats, sizeof(stats));
+
+  // account for the time spent in the current profile
+  stats[cpu->current_exit_profile].tsc_ticks += __rdtsc() - cpu->exit_profile_start_tsc;
+
+  if (!write_guest_buffer(cpu, dst, stats, sizeof(stats)))
+    return;
+
+  cpu->ctx->rax = exit_profile_count;
+  skip_instruction();
+}
+
+// start or finish calibrating the vm-exit overhead of the CURRENT VCPU
+void set_overhead_calibration(vcpu* const cpu) {
+  // arguments
+  cpu->calibrating_overhead = (cpu->ctx->rcx != 0);
+
+  skip_instruction();
+}
+
+// the part of a virtualized measurement that was spent in root-mode
+static uint64_t root_mode_overhead(uint64_t const virtualized, uint64_t const native) {
+  return virtualized > native ? virtualized - native : 0;
+}
+
+// set the calibrated overhead of an exit type for the CURRENT VCPU
+void set_vm_exit_overhead(vcpu* const cpu) {
+  // arguments
+  auto const overhead_class = cpu->ctx->rcx;
+
+  if (overhead_class >= overhead_class_count) {
+    inject_hw_exception(invalid_opcode);
+    return;
+  }
+
+  // the guest still expects the exiting instruction to take as long
+  // as it would natively, so only the root-mode time is compensated
+  auto const& native = cpu->native_overhead[overhead_class];
+
+  auto& overhead = cpu->exit_overhead[overhead_class];
+  overhead.tsc          = root_mode_overhead(cpu->ctx->rdx, native.tsc);
+  overhead.mperf        = root_mode_overhead(cpu->ctx->r8,  native.mperf);
+  overhead.instructions = root_mode_overhead(cpu->ctx->r9,  native.instructions);
+  overhead.core_cycles  = root_mode_overhead(cpu->ctx->r10, native.core_cycles);
+  overhead.ref_tsc      = root_mode_overhead(cpu->ctx->r11, native.ref_tsc);
+
+  // exported alongside the vm-exit statistics
+  cpu->exit_stats->exit_overhead[overhead_class] = overhead;
+
+  skip_instruction();
+}
+
+// start counting calls to a function on the CURRENT VCPU
+void add_counted_function(vcpu* const cpu) {
+  // arguments
+  auto const address      = cpu->ctx->rcx;
+  auto const capture_args = cpu->ctx->rdx != 0;
+
+  cpu->ctx->rax = (hv::add_counted_function(cpu, address, capture_args) != nullptr);
+
+  skip_instruction();
+}
+
+// stop counting function calls on the CURRENT VCPU
+void clear_counted_functions(vcpu* const cpu) {
+  hv::clear_counted_functions(cpu);
+
+  skip_instruction();
+}
+
+// enable or disable syscall tracing on the CURRENT VCPU
+void set_syscall_tracing(vcpu* const cpu) {
+  // arguments
+  auto const enabled = cpu->ctx->rcx != 0;
+
+  if (enabled)
+    cpu->ctx->rax = enable_syscall_tracing(cpu);
+  else {
+    disable_syscall_tracing(cpu);
+    cpu->ctx->rax = 1;
+  }
+
+  skip_instruction();
+}
+
+// copy the most frequent exit sites of the CURRENT VCPU into a guest buffer
+void query_exit_sites(vcpu* const cpu) {
+  // arguments
+  auto const dst   = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+  auto const count = min(cpu->ctx->rdx, max_exit_site_dump_count);
+  auto const reset = cpu->ctx->r8 != 0;
+
+  exit_site sites[max_exit_site_dump_count];
+  auto const copied = get_top_exit_sites(cpu->exit_sites,
+    sites, static_cast<uint32_t>(count));
+
+  if (!write_guest_buffer(cpu, dst, sites, copied * sizeof(exit_site)))
+    return;
+
+  if (reset)
+    reset_exit_sites(cpu->exit_sites);
+
+  cpu->ctx->rax = copied;
+  skip_instruction();
+}
+
+// enable or disable vm-exit PMC profiling on the CURRENT VCPU
+void set_exit_pmc_profiling(vcpu* const cpu) {
+  // arguments
+  auto const enabled = cpu->ctx->rcx != 0;
+
+  cpu->ctx->rax = hv::set_exit_pmc_profiling(cpu, enabled);
+
+  skip_instruction();
+}
+
+// enable or disable CR3-load telemetry on the CURRENT VCPU
+void set_cr3_telemetry(vcpu* const cpu) {
+  // arguments
+  auto const enabled = cpu->ctx->rcx != 0;
+
+  hv::set_cr3_telemetry(cpu, enabled);
+
+  skip_instruction();
+}
+
+// enable or disable vm-exit capture on the CURRENT VCPU
+void set_exit_capture(vcpu* const cpu) {
+  // arguments
+  auto const enabled = cpu->ctx->rcx != 0;
+
+  hv::set_exit_capture(cpu, enabled);
+
+  skip_instruction();
+}
+
+// enable or disable vm-exit tracing on the CURRENT VCPU
+void set_exit_tracing(vcpu* const cpu) {
+  // arguments
+  auto const enabled = cpu->ctx->rcx != 0;
+
+  hv::set_exit_tracing(cpu, enabled);
+
+  skip_instruction();
+}
+
+// set the profiler sampling interval of EVERY VCPU
+void set_sampling_interval(vcpu* const cpu) {
+  // arguments
+  auto const interval = cpu->ctx->rcx;
+
+  hv::set_sampling_interval(interval);
+
+  skip_instruction();
+}
+
+// set the vector that is injected into EVERY VCPU when a ring reaches its
+// watermark (0 disables notifications)
+void register_notification_vector(vcpu* const cpu) {
+  // arguments
+  auto const vector = cpu->ctx->rcx;
+
+  cpu->ctx->rax = vector <= 0xFF &&
+    hv::register_notification_vector(static_cast<uint8_t>(vector));
+
+  skip_instruction();
+}
+
+// copy the call counts of the CURRENT VCPU into a guest buffer
+void query_call_counts(vcpu* const cpu) {
+  // arguments
+  auto const dst   = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+  auto const count = cpu->ctx->rdx;
+
+  auto const& cc = cpu->call_counter;
+
+  for (uint32_t i = 0; i < min(cc.function_count, count); ++i) {
+    auto const& fn = cc.functions[i];
+
+    call_count_entry entry;
+    entry.address         = fn.address;
+    entry.count           = fn.count;
+    entry.overhead_cycles = fn.overhead_cycles;
+    memcpy(entry.args, fn.args, sizeof(entry.args));
+
+    if (!write_guest_buffer(cpu, dst + i * sizeof(entry), &entry, sizeof(entry)))
+      return;
+  }
+
+  cpu->ctx->rax = cc.function_count;
+  skip_instruction();
+}
+
 } // namespace hv::hc
 
@@ -21,7 +21,25 @@ enum hypercall_code : uint64_t {
   hypercall_write_virt_mem,
   hypercall_query_process_cr3,
   hypercall_install_ept_hook,
-  hypercall_remove_ept_hook
+  hypercall_remove_ept_hook,
+  hypercall_set_exit_profile,
+  hypercall_query_exit_profile_stats,
+  hypercall_set_overhead_calibration,
+  hypercall_set_vm_exit_overhead,
+  hypercall_add_counted_function,
+  hypercall_clear_counted_functions,
+  hypercall_query_call_counts,
+  hypercall_set_syscall_tracing,
+  hypercall_set_cr3_telemetry,
+  hypercall_set_exit_pmc_profiling,
+  hypercall_query_exit_sites,
+  hypercall_set_exit_capture,
+  hypercall_set_exit_tracing,
+  hypercall_set_sampling_interval,
+  hypercall_register_notification_vector,
+
+  // number of hypercall codes (not a hypercall)
+  hypercall_code_count
 };
 
 // hypercall input
@@ -68,6 +86,53 @@ void install_ept_hook(vcpu* cpu);
 // remove a previously installed EPT hook
 void remove_ept_hook(vcpu* cpu);
 
+// switch the CURRENT VCPU to the specified exit profile (other
+// VCPUs will switch lazily on their next vm-exit)
+void set_exit_profile(vcpu* cpu);
+
+// copy the exit profile statistics of the CURRENT VCPU into a guest buffer
+void query_exit_profile_stats(vcpu* cpu);
+
+// start or finish calibrating the vm-exit overhead of the CURRENT VCPU
+void set_overhead_calibration(vcpu* cpu);
+
+// set the calibrated overhead of an exit type for the CURRENT VCPU
+void set_vm_exit_overhead(vcpu* cpu);
+
+// start counting calls to a function on the CURRENT VCPU
+void add_counted_function(vcpu* cpu);
+
+// stop counting function calls on the CURRENT VCPU
+void clear_counted_functions(vcpu* cpu);
+
+// copy the call counts of the CURRENT VCPU into a guest buffer
+void query_call_counts(vcpu* cpu);
+
+// enable or disable syscall tracing on the CURRENT VCPU
+void set_syscall_tracing(vcpu* cpu);
+
+// enable or disable CR3-load telemetry on the CURRENT VCPU
+void set_cr3_telemetry(vcpu* cpu);
+
+// enable or disable vm-exit PMC profiling on the CURRENT VCPU
+void set_exit_pmc_profiling(vcpu* cpu);
+
+// copy the most frequent exit sites of the CURRENT VCPU into a guest buffer
+void query_exit_sites(vcpu* cpu);
+
+// enable or disable vm-exit capture on the CURRENT VCPU
+void set_exit_capture(vcpu* cpu);
+
+// enable or disable vm-exit tracing on the CURRENT VCPU
+void set_exit_tracing(vcpu* cpu);
+
+// set the profiler sampling interval of EVERY VCPU
+void set_sampling_interval(vcpu* cpu);
+
+// set the vector that is injected into EVERY VCPU when a ring reaches its
+// watermark (0 disables notifications)
+void register_notification_vector(vcpu* cpu);
+
 } // namespace hc
 
 } // namespace hv
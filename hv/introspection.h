@@ -1,9 +1,8 @@
 #pragma once
 
+#include "platform.h"
 #include "vmx.h"
 
-#include <ntddk.h>
-
 namespace hv {
 
 // get the KPCR of the current guest (the pointer should stay constant per-vcpu)
@@ -0,0 +1,100 @@
+#include "logger.h"
+#include "hv.h"
+#include "vcpu.h"
+
+#ifndef HV_PORTABLE
+#include <ntstrsafe.h>
+#endif
+
+namespace hv {
+
+// write a record to the current VCPU's log ring
+void write_log_record(vcpu* const cpu, log_level const level,
+    char const* const format, uint64_t const* const args, uint32_t const arg_count) {
+  if (level > ghv.runtime_log_level)
+    return;
+
+  auto& ring = *cpu->log_ring;
+
+  if (ring.head - ring.tail >= log_ring_record_count) {
+    ++ring.dropped;
+    return;
+  }
+
+  auto& record = ring.records[ring.head & (log_ring_record_count - 1)];
+  record.tsc       = __rdtsc();
+  record.format    = format;
+  record.level     = level;
+  record.arg_count = static_cast<uint8_t>(arg_count);
+
+  for (uint32_t i = 0; i < arg_count; ++i)
+    record.args[i] = args[i];
+
+  // the record needs to be visible before the consumer sees the new head
+  _WriteBarrier();
+  ring.head = ring.head + 1;
+
+  auto const fill = ring.head - ring.tail;
+  check_ring_watermark(cpu, fill - 1, fill, log_ring_record_count);
+}
+
+// read the next record from a log ring (returns false if it is empty)
+bool read_log_record(vcpu_log_ring& ring, log_record& record) {
+  auto const tail = ring.tail;
+
+  if (tail == ring.head)
+    return false;
+
+  // make sure the record isn't read before the head
+  _ReadBarrier();
+
+  record = ring.records[tail & (log_ring_record_count - 1)];
+
+  // the producer can reuse the record once it has been copied
+  _ReadWriteBarrier();
+  ring.tail = tail + 1;
+
+  return true;
+}
+
+// format and print every record in every VCPU's log ring with DbgPrint()
+void flush_logs() {
+  if (!ghv.log_rings)
+    return;
+
+  static constexpr char const* level_names[log_level_count] = {
+    "ERROR", "WARNING", "INFO", "DEBUG"
+  };
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto& ring = ghv.log_rings[i];
+
+    log_record record;
+    while (read_log_record(ring, record)) {
+      char message[256];
+
+      // unused arguments are simply ignored
+      RtlStringCbPrintfA(message, sizeof(message), record.format,
+        record.args[0], record.args[1], record.args[2], record.args[3], record.args[4]);
+
+      DbgPrint("[hv] [%s] VCPU#%lu (TSC=%llu): %s\n",
+        level_names[record.level], i, record.tsc, message);
+    }
+
+    auto const dropped = ring.dropped;
+
+    if (dropped != ring.reported_dropped) {
+      DbgPrint("[hv] VCPU#%lu dropped %llu log records.\n",
+        i, dropped - ring.reported_dropped);
+      ring.reported_dropped = dropped;
+    }
+  }
+}
+
+// discard messages above the specified level
+void set_log_level(log_level const level) {
+  ghv.runtime_log_level = level;
+}
+
+} // namespace hv
+
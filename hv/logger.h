@@ -0,0 +1,130 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Root-mode logging. Formatting is deferred: only the address of the format
+// string and the raw arguments are written to a per-VCPU ring, and the
+// messages are formatted and printed later, outside of VMX root operation.
+//
+
+namespace hv {
+
+struct vcpu;
+
+enum log_level : uint8_t {
+  log_level_error = 0,
+  log_level_warning,
+  log_level_info,
+  log_level_debug,
+
+  log_level_count
+};
+
+// messages above this level are compiled out completely
+#ifdef NDEBUG
+inline constexpr log_level max_compiled_log_level = log_level_info;
+#else
+inline constexpr log_level max_compiled_log_level = log_level_debug;
+#endif
+
+// messages above this level are discarded at runtime (see set_log_level())
+inline constexpr log_level default_log_level = log_level_info;
+
+// maximum number of arguments in a single message
+inline constexpr uint32_t max_log_args = 5;
+
+// number of records in a log ring (must be a power of two)
+inline constexpr uint32_t log_ring_record_count = 512;
+
+static_assert((log_ring_record_count & (log_ring_record_count - 1)) == 0);
+
+struct log_record {
+  uint64_t tsc;
+
+  // the format string also serves as its own ID: it lives in the driver
+  // image, so the code that flushes the log can use it directly. only
+  // integer and pointer arguments are supported (%s needs a static string).
+  char const* format;
+
+  log_level level;
+  uint8_t arg_count;
+
+  uint64_t args[max_log_args];
+};
+
+static_assert(sizeof(log_record) == 64);
+
+// single-producer (the VCPU in root mode), single-consumer log ring
+struct vcpu_log_ring {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of records that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  // number of dropped records that have already been reported
+  uint64_t reported_dropped;
+
+  alignas(64) log_record records[log_ring_record_count];
+};
+
+// write a record to the current VCPU's log ring
+void write_log_record(vcpu* cpu, log_level level,
+  char const* format, uint64_t const* args, uint32_t arg_count);
+
+template <typename T>
+uint64_t to_log_arg(T* const value) {
+  return reinterpret_cast<uint64_t>(value);
+}
+
+template <typename T>
+uint64_t to_log_arg(T const value) {
+  return static_cast<uint64_t>(value);
+}
+
+// log a message (this is safe to call in root-mode)
+template <log_level Level, typename... Args>
+void write_log(vcpu* const cpu, char const* const format, Args const... args) {
+  static_assert(sizeof...(Args) <= max_log_args, "Too many log arguments.");
+
+  if constexpr (Level <= max_compiled_log_level) {
+    uint64_t const values[max_log_args + 1] = { to_log_arg(args)... };
+    write_log_record(cpu, Level, format, values, sizeof...(Args));
+  }
+}
+
+template <typename... Args>
+void log_error(vcpu* const cpu, char const* const format, Args const... args) {
+  write_log<log_level_error>(cpu, format, args...);
+}
+
+template <typename... Args>
+void log_warning(vcpu* const cpu, char const* const format, Args const... args) {
+  write_log<log_level_warning>(cpu, format, args...);
+}
+
+template <typename... Args>
+void log_info(vcpu* const cpu, char const* const format, Args const... args) {
+  write_log<log_level_info>(cpu, format, args...);
+}
+
+template <typename... Args>
+void log_debug(vcpu* const cpu, char const* const format, Args const... args) {
+  write_log<log_level_debug>(cpu, format, args...);
+}
+
+// read the next record from a log ring (returns false if it is empty)
+bool read_log_record(vcpu_log_ring& ring, log_record& record);
+
+// format and print every record in every VCPU's log ring with DbgPrint()
+void flush_logs();
+
+// discard messages above the specified level
+void set_log_level(log_level level);
+
+} // namespace hv
+
@@ -1,4 +1,8 @@
 #include "hv.h"
+#include "device.h"
+#include "benchmark.h"
+#include "timing.h"
+#include "timing-leaks.h"
 
 #include <ntddk.h>
 #include <ia32.hpp>
@@ -64,6 +68,9 @@ static cr3 query_process_cr3(uint64_t const pid) {
 }
 
 void driver_unload(PDRIVER_OBJECT) {
+  // no new clients after this point (stop() unmaps whatever is still mapped)
+  hv::delete_device();
+
   hv::stop();
 
   DbgPrint("[hv] Devirtualized the system.\n");
@@ -76,11 +83,31 @@ NTSTATUS driver_entry(PDRIVER_OBJECT const driver, PUNICODE_STRING) {
   if (driver)
     driver->DriverUnload = driver_unload;
 
+  // the timing leak probes are compared against the native timings
+  if constexpr (hv::timing_leak_probes_enabled) {
+    if (!hv::measure_native_timings())
+      return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
   if (!hv::start()) {
     DbgPrint("[hv] Failed to virtualize system.\n");
     return STATUS_HV_OPERATION_FAILED;
   }
 
+  // the device is only needed by clients, so the hypervisor keeps running
+  // without it (there's no driver object when the driver is manually mapped)
+  if (driver && !hv::create_device(driver))
+    DbgPrint("[hv] Failed to create the client device.\n");
+
+  if constexpr (hv::timing_leak_probes_enabled)
+    hv::run_timing_leak_probes(hv::timing_leak_results_path);
+
+  // benchmark the hypervisor instead of running the usual checks
+  if constexpr (hv::benchmark_mode_enabled) {
+    hv::run_benchmarks(hv::benchmark_results_path);
+    return STATUS_SUCCESS;
+  }
+
   if (ping() == hv::hypervisor_signature)
     DbgPrint("[client] Hypervisor signature matches.\n");
 
@@ -128,6 +155,15 @@ NTSTATUS driver_entry(PDRIVER_OBJECT const driver, PUNICODE_STRING) {
   DbgPrint("[client] Wrote %zu bytes to virtual memory.\n", bytes_copied);
   DbgPrint("[client] target_int = %d (should be 420).\n", target_int);
 
+  // measure how many cycles are saved by dropping the MSR store/load lists
+  auto const default_overhead = hv::measure_vm_exit_tsc_overhead();
+  hv::set_exit_profile(hv::exit_profile_low_latency);
+  auto const low_latency_overhead = hv::measure_vm_exit_tsc_overhead();
+  hv::set_exit_profile(hv::default_exit_profile);
+
+  DbgPrint("[client] VM-exit overhead: %zu TSC ticks (default), %zu TSC ticks (low latency).\n",
+    default_overhead, low_latency_overhead);
+
   return STATUS_SUCCESS;
 }
 
@@ -1,5 +1,6 @@
 #include "mm.h"
 #include "arch.h"
+#include "exit-capture.h"
 #include "page-tables.h"
 #include "vmx.h"
 
@@ -7,13 +8,19 @@ namespace hv {
 
 // translate a GVA to an HVA. offset_to_next_page is the number of bytes to
 // the next page (i.e. the number of bytes that can be safely accessed through
-// the HVA in order to modify the GVA.
-void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* const offset_to_next_page) {
+// the HVA in order to modify the GVA. every guest page that is accessed is
+// recorded in capture, if it isn't null (see exit-capture.h).
+void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address,
+    size_t* const offset_to_next_page, vcpu_exit_capture_data* const capture) {
   if (offset_to_next_page)
     *offset_to_next_page = 0;
 
   pml4_virtual_address const vaddr = { guest_virtual_address };
 
+  // every page that is walked is needed in order to replay the vm-exit
+  if (capture)
+    record_exit_capture_page(*capture, guest_cr3.address_of_page_directory);
+
   // guest PML4
   auto const pml4 = reinterpret_cast<pml4e_64*>(host_physical_memory_base
     + (guest_cr3.address_of_page_directory << 12));
@@ -22,6 +29,9 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
   if (!pml4e.present)
     return nullptr;
 
+  if (capture)
+    record_exit_capture_page(*capture, pml4e.page_frame_number);
+
   // guest PDPT
   auto const pdpt = reinterpret_cast<pdpte_64*>(host_physical_memory_base
     + (pml4e.page_frame_number << 12));
@@ -34,7 +44,11 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
     pdpte_1gb_64 pdpte_1gb;
     pdpte_1gb.flags = pdpte.flags;
 
-    auto const offset = (vaddr.pd_idx << 18) + (vaddr.pt_idx << 9) + vaddr.offset;
+    auto const offset = (vaddr.pd_idx << 21) + (vaddr.pt_idx << 12) + vaddr.offset;
+
+    if (capture)
+      record_exit_capture_page(*capture, (pdpte_1gb.page_frame_number << 18)
+        + (vaddr.pd_idx << 9) + vaddr.pt_idx);
 
     // 1GB
     if (offset_to_next_page)
@@ -43,6 +57,9 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
     return host_physical_memory_base + (pdpte_1gb.page_frame_number << 30) + offset;
   }
 
+  if (capture)
+    record_exit_capture_page(*capture, pdpte.page_frame_number);
+
   // guest PD
   auto const pd = reinterpret_cast<pde_64*>(host_physical_memory_base
     + (pdpte.page_frame_number << 12));
@@ -55,7 +72,10 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
     pde_2mb_64 pde_2mb;
     pde_2mb.flags = pde.flags;
 
-    auto const offset = (vaddr.pt_idx << 9) + vaddr.offset;
+    auto const offset = (vaddr.pt_idx << 12) + vaddr.offset;
+
+    if (capture)
+      record_exit_capture_page(*capture, (pde_2mb.page_frame_number << 9) + vaddr.pt_idx);
 
     // 2MB page
     if (offset_to_next_page)
@@ -64,6 +84,9 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
     return host_physical_memory_base + (pde_2mb.page_frame_number << 21) + offset;
   }
 
+  if (capture)
+    record_exit_capture_page(*capture, pde.page_frame_number);
+
   // guest PT
   auto const pt = reinterpret_cast<pte_64*>(host_physical_memory_base
     + (pde.page_frame_number << 12));
@@ -72,6 +95,9 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
   if (!pte.present)
     return nullptr;
 
+  if (capture)
+    record_exit_capture_page(*capture, pte.page_frame_number);
+
   // 4KB page
   if (offset_to_next_page)
     *offset_to_next_page = 0x1000 - vaddr.offset;
@@ -81,11 +107,13 @@ void* gva2hva(cr3 const guest_cr3, void* const guest_virtual_address, size_t* co
 
 // translate a GVA to an HVA. offset_to_next_page is the number of bytes to
 // the next page (i.e. the number of bytes that can be safely accessed through
-// the HVA in order to modify the GVA.
-void* gva2hva(void* const guest_virtual_address, size_t* const offset_to_next_page) {
+// the HVA in order to modify the GVA. every guest page that is accessed is
+// recorded in capture, if it isn't null (see exit-capture.h).
+void* gva2hva(void* const guest_virtual_address,
+    size_t* const offset_to_next_page, vcpu_exit_capture_data* const capture) {
   cr3 guest_cr3;
   guest_cr3.flags = vmx_vmread(VMCS_GUEST_CR3);
-  return gva2hva(guest_cr3, guest_virtual_address, offset_to_next_page);
+  return gva2hva(guest_cr3, guest_virtual_address, offset_to_next_page, capture);
 }
 
 } // namespace hv
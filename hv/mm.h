@@ -1,10 +1,12 @@
 #pragma once
 
-#include <ntddk.h>
+#include "platform.h"
 #include <ia32.hpp>
 
 namespace hv {
 
+struct vcpu_exit_capture_data;
+
 // represents a 4-level virtual address
 union pml4_virtual_address {
   void const* address;
@@ -19,13 +21,17 @@ union pml4_virtual_address {
 
 // translate a GVA to an HVA. offset_to_next_page is the number of bytes to
 // the next page (i.e. the number of bytes that can be safely accessed through
-// the HVA in order to modify the GVA.
-void* gva2hva(cr3 guest_cr3, void* guest_virtual_address, size_t* offset_to_next_page = nullptr);
+// the HVA in order to modify the GVA. every guest page that is accessed is
+// recorded in capture, if it isn't null (see exit-capture.h).
+void* gva2hva(cr3 guest_cr3, void* guest_virtual_address,
+  size_t* offset_to_next_page = nullptr, vcpu_exit_capture_data* capture = nullptr);
 
 // translate a GVA to an HVA. offset_to_next_page is the number of bytes to
 // the next page (i.e. the number of bytes that can be safely accessed through
-// the HVA in order to modify the GVA.
-void* gva2hva(void* guest_virtual_address, size_t* offset_to_next_page = nullptr);
+// the HVA in order to modify the GVA. every guest page that is accessed is
+// recorded in capture, if it isn't null (see exit-capture.h).
+void* gva2hva(void* guest_virtual_address,
+  size_t* offset_to_next_page = nullptr, vcpu_exit_capture_data* capture = nullptr);
 
 } // namespace hv
 
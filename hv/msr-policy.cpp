@@ -0,0 +1,236 @@
+#include "msr-policy.h"
+#include "exception-routines.h"
+#include "logger.h"
+#include "nested.h"
+#include "pmu.h"
+#include "vcpu.h"
+#include "vmx.h"
+#include "ept.h"
+
+namespace hv {
+
+// return the fake guest FEATURE_CONTROL MSR
+static bool read_feature_control(vcpu* const cpu, uint32_t, uint64_t& value) {
+  value = cpu->cached.guest_feature_control.flags;
+  return true;
+}
+
+// let the guest write to the MTRRs, and make sure to update
+// EPT memory types to reflect the new values
+static bool write_mtrr(vcpu* const cpu, uint32_t const msr, uint64_t const value) {
+  host_exception_info e;
+  wrmsr_safe(e, msr, value);
+
+  if (e.exception_occurred)
+    return false;
+
+  // update EPT memory types
+  if (!read_effective_guest_cr0().cache_disable)
+    update_ept_memory_type(cpu->ept);
+
+  vmx_invept(invept_all_context, {});
+
+  return true;
+}
+
+// log a write to a monitored MSR and let it go through to the real MSR
+static bool log_msr_write(vcpu* const cpu, uint32_t const msr, uint64_t const value) {
+  log_info(cpu, "MSR %X written (value=%llX, RIP=%llX).",
+    msr, value, vmx_vmread(VMCS_GUEST_RIP));
+
+  host_exception_info e;
+  wrmsr_safe(e, msr, value);
+
+  return !e.exception_occurred;
+}
+
+// exit profile masks for MSR policies
+inline constexpr uint8_t all_exit_profiles = (1 << exit_profile_count) - 1;
+inline constexpr uint8_t hardened_exit_profiles =
+  (1 << exit_profile_hardened) | (1 << exit_profile_tracing);
+inline constexpr uint8_t tracing_exit_profiles = (1 << exit_profile_tracing);
+inline constexpr uint8_t concealing_exit_profiles =
+  all_exit_profiles & ~(1 << exit_profile_low_latency);
+
+// every MSR that should cause a vm-exit. this table MUST be sorted by MSR
+// and ranges can't overlap. MSRs that aren't in this table are never
+// intercepted (unless they're outside of the MSR bitmap range).
+static constexpr msr_policy msr_policies[] = {
+  { IA32_FEATURE_CONTROL,   IA32_FEATURE_CONTROL,       msr_access_read,
+    msr_action_shadow,      all_exit_profiles,
+    read_feature_control,   nullptr    },
+
+  // performance counter configuration (cached for vm-exit compensation)
+  { IA32_PERFEVTSEL0,       IA32_PERFEVTSEL0 + max_gp_counters - 1, msr_access_write,
+    msr_action_emulate,     concealing_exit_profiles,
+    nullptr,                write_pmu_config },
+
+  // variable-range MTRRs (unsupported pairs are trimmed at runtime)
+  { IA32_MTRR_PHYSBASE0,    IA32_MTRR_FIX64K_00000 - 1, msr_access_write,
+    msr_action_emulate,     all_exit_profiles,
+    nullptr,                write_mtrr },
+
+  // fixed-range MTRRs
+  { IA32_MTRR_FIX64K_00000, IA32_MTRR_FIX64K_00000,     msr_access_write,
+    msr_action_emulate,     all_exit_profiles,
+    nullptr,                write_mtrr },
+  { IA32_MTRR_FIX16K_80000, IA32_MTRR_FIX16K_A0000,     msr_access_write,
+    msr_action_emulate,     all_exit_profiles,
+    nullptr,                write_mtrr },
+  { IA32_MTRR_FIX4K_C0000,  IA32_MTRR_FIX4K_F8000,      msr_access_write,
+    msr_action_emulate,     all_exit_profiles,
+    nullptr,                write_mtrr },
+
+  { IA32_MTRR_DEF_TYPE,     IA32_MTRR_DEF_TYPE,         msr_access_write,
+    msr_action_emulate,     all_exit_profiles,
+    nullptr,                write_mtrr },
+
+  { IA32_FIXED_CTR_CTRL,    IA32_FIXED_CTR_CTRL,        msr_access_write,
+    msr_action_emulate,     concealing_exit_profiles,
+    nullptr,                write_pmu_config },
+
+  // VMX capability MSRs (filtered for nested VMX)
+  { IA32_VMX_BASIC,         IA32_VMX_VMFUNC,            msr_access_read,
+    msr_action_shadow,      nested_vmx_enabled ? all_exit_profiles : 0,
+    read_nested_vmx_msr,    nullptr    },
+
+  // IA32_STAR, IA32_LSTAR, IA32_CSTAR, and IA32_FMASK
+  { IA32_STAR,              IA32_FMASK,                 msr_access_write,
+    msr_action_log,         hardened_exit_profiles,
+    nullptr,                log_msr_write },
+
+  { IA32_KERNEL_GS_BASE,    IA32_KERNEL_GS_BASE,        msr_access_write,
+    msr_action_log,         tracing_exit_profiles,
+    nullptr,                log_msr_write },
+};
+
+inline constexpr size_t msr_policy_count =
+  sizeof(msr_policies) / sizeof(msr_policies[0]);
+
+// make sure that the policy table is sorted and well-formed
+static constexpr bool validate_msr_policies() {
+  for (size_t i = 0; i < msr_policy_count; ++i) {
+    auto const& p = msr_policies[i];
+
+    if (p.first > p.last)
+      return false;
+
+    // ranges need to fit inside of either the low or high MSR range
+    if (p.first <= MSR_ID_LOW_MAX && p.last > MSR_ID_LOW_MAX)
+      return false;
+    if (p.first > MSR_ID_LOW_MAX && (p.first < MSR_ID_HIGH_MIN || p.last > MSR_ID_HIGH_MAX))
+      return false;
+
+    // sorted and non-overlapping
+    if (i > 0 && msr_policies[i - 1].last >= p.first)
+      return false;
+
+    // the profile mask can't reference non-existent profiles
+    if (p.profiles & ~all_exit_profiles)
+      return false;
+
+    // shadowed MSRs should never reach the real MSR, and logged MSRs
+    // need a handler that logs them
+    if ((p.action == msr_action_shadow || p.action == msr_action_log) &&
+       (((p.access & msr_access_read)  && !p.read) ||
+        ((p.access & msr_access_write) && !p.write)))
+      return false;
+  }
+
+  return true;
+}
+
+static_assert(validate_msr_policies(), "Invalid MSR policy table.");
+
+// compile-time image of the MSR bitmap (same layout as vmx_msr_bitmap)
+struct msr_bitmap_image {
+  uint8_t rdmsr_low[1024];
+  uint8_t rdmsr_high[1024];
+  uint8_t wrmsr_low[1024];
+  uint8_t wrmsr_high[1024];
+};
+
+static_assert(sizeof(msr_bitmap_image) == sizeof(vmx_msr_bitmap));
+
+// set the exiting bit for an MSR in a compile-time bitmap
+static constexpr void set_msr_bit(uint8_t (&low)[1024],
+    uint8_t (&high)[1024], uint32_t const msr) {
+  if (msr <= MSR_ID_LOW_MAX)
+    low[msr / 8] |= static_cast<uint8_t>(1 << (msr & 0b0111));
+  else
+    high[(msr - MSR_ID_HIGH_MIN) / 8] |= static_cast<uint8_t>(1 << (msr & 0b0111));
+}
+
+// compile the policy table into an MSR bitmap for the specified profile
+static constexpr msr_bitmap_image compile_msr_bitmap(exit_profile const profile) {
+  msr_bitmap_image image = {};
+
+  for (auto const& p : msr_policies) {
+    if (p.action == msr_action_pass || !(p.profiles & (1 << profile)))
+      continue;
+
+    for (uint64_t msr = p.first; msr <= p.last; ++msr) {
+      if (p.access & msr_access_read)
+        set_msr_bit(image.rdmsr_low, image.rdmsr_high, static_cast<uint32_t>(msr));
+      if (p.access & msr_access_write)
+        set_msr_bit(image.wrmsr_low, image.wrmsr_high, static_cast<uint32_t>(msr));
+    }
+  }
+
+  return image;
+}
+
+// an MSR bitmap for every exit profile
+static constexpr msr_bitmap_image msr_bitmap_templates[exit_profile_count] = {
+  compile_msr_bitmap(exit_profile_minimal),
+  compile_msr_bitmap(exit_profile_hardened),
+  compile_msr_bitmap(exit_profile_tracing),
+  compile_msr_bitmap(exit_profile_low_latency)
+};
+
+// compile the MSR policy table into the specified MSR bitmap
+void prepare_msr_bitmap(vmx_msr_bitmap& bitmap, exit_profile const profile) {
+  memcpy(&bitmap, &msr_bitmap_templates[profile], sizeof(bitmap));
+
+  ia32_mtrr_capabilities_register mtrr_cap;
+  mtrr_cap.flags = __readmsr(IA32_MTRR_CAPABILITIES);
+
+  // the number of variable-range MTRRs isn't known at compile-time
+  for (auto msr = static_cast<uint32_t>(IA32_MTRR_PHYSBASE0
+      + mtrr_cap.variable_range_count * 2); msr < IA32_MTRR_FIX64K_00000; ++msr)
+    enable_exit_for_msr_write(bitmap, msr, false);
+
+  // don't bother exiting on fixed-range MTRRs if they don't exist
+  if (!mtrr_cap.fixed_range_supported) {
+    enable_exit_for_msr_write(bitmap, IA32_MTRR_FIX64K_00000, false);
+    enable_exit_for_msr_write(bitmap, IA32_MTRR_FIX16K_80000, false);
+    enable_exit_for_msr_write(bitmap, IA32_MTRR_FIX16K_A0000, false);
+
+    for (uint32_t i = 0; i < 8; ++i)
+      enable_exit_for_msr_write(bitmap, IA32_MTRR_FIX4K_C0000 + i, false);
+  }
+}
+
+// find the MSR policy that applies to the specified access (or null
+// if the access should be forwarded to the real MSR)
+msr_policy const* find_msr_policy(uint32_t const msr, msr_access const access) {
+  size_t low = 0, high = msr_policy_count;
+
+  // binary search through the sorted policy table
+  while (low < high) {
+    auto const mid = (low + high) / 2;
+    auto const& p  = msr_policies[mid];
+
+    if (msr < p.first)
+      high = mid;
+    else if (msr > p.last)
+      low = mid + 1;
+    else
+      return (p.access & access) ? &p : nullptr;
+  }
+
+  return nullptr;
+}
+
+} // namespace hv
+
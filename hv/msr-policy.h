@@ -0,0 +1,64 @@
+#pragma once
+
+#include "exit-profile.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// what should happen when the guest accesses an MSR
+enum msr_action : uint8_t {
+  // don't intercept accesses to the MSR at all
+  msr_action_pass = 0,
+
+  // the MSR is backed by a hypervisor-maintained value instead of the real MSR
+  msr_action_shadow,
+
+  // the MSR access is emulated by the registered handler
+  msr_action_emulate,
+
+  // intercept the access and log it (from the registered handler), but let
+  // it go through to the real MSR
+  msr_action_log
+};
+
+// which kind of accesses an MSR policy applies to
+enum msr_access : uint8_t {
+  msr_access_read  = 1 << 0,
+  msr_access_write = 1 << 1,
+  msr_access_rw    = msr_access_read | msr_access_write
+};
+
+// handlers return false if a #GP(0) should be injected into the guest
+using msr_read_handler  = bool(*)(vcpu* cpu, uint32_t msr, uint64_t& value);
+using msr_write_handler = bool(*)(vcpu* cpu, uint32_t msr, uint64_t value);
+
+// maps a range of MSRs to an action
+struct msr_policy {
+  // inclusive MSR range
+  uint32_t first;
+  uint32_t last;
+
+  msr_access access;
+  msr_action action;
+
+  // mask of exit profiles that this policy is active in
+  uint8_t profiles;
+
+  // handlers for shadowed/emulated MSRs. a null handler means that the
+  // access is forwarded to the real MSR (after being intercepted).
+  msr_read_handler  read;
+  msr_write_handler write;
+};
+
+// compile the MSR policy table into the specified MSR bitmap
+void prepare_msr_bitmap(vmx_msr_bitmap& bitmap, exit_profile profile);
+
+// find the MSR policy that applies to the specified access (or null
+// if the access should be forwarded to the real MSR)
+msr_policy const* find_msr_policy(uint32_t msr, msr_access access);
+
+} // namespace hv
+
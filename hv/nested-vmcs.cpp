@@ -0,0 +1,1028 @@
+#include "nested-vmcs.h"
+
+namespace hv {
+
+constexpr uint32_t vmcs12_fields[vmcs12_field_count] = {
+  // 16-bit control fields
+  VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER,
+
+  // 16-bit guest-state fields
+  VMCS_GUEST_ES_SELECTOR,
+  VMCS_GUEST_CS_SELECTOR,
+  VMCS_GUEST_SS_SELECTOR,
+  VMCS_GUEST_DS_SELECTOR,
+  VMCS_GUEST_FS_SELECTOR,
+  VMCS_GUEST_GS_SELECTOR,
+  VMCS_GUEST_LDTR_SELECTOR,
+  VMCS_GUEST_TR_SELECTOR,
+
+  // 16-bit host-state fields
+  VMCS_HOST_ES_SELECTOR,
+  VMCS_HOST_CS_SELECTOR,
+  VMCS_HOST_SS_SELECTOR,
+  VMCS_HOST_DS_SELECTOR,
+  VMCS_HOST_FS_SELECTOR,
+  VMCS_HOST_GS_SELECTOR,
+  VMCS_HOST_TR_SELECTOR,
+
+  // 64-bit control fields
+  VMCS_CTRL_IO_BITMAP_A_ADDRESS,
+  VMCS_CTRL_IO_BITMAP_B_ADDRESS,
+  VMCS_CTRL_MSR_BITMAP_ADDRESS,
+  VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS,
+  VMCS_CTRL_VMEXIT_MSR_LOAD_ADDRESS,
+  VMCS_CTRL_VMENTRY_MSR_LOAD_ADDRESS,
+  VMCS_CTRL_TSC_OFFSET,
+  VMCS_CTRL_VIRTUAL_APIC_ADDRESS,
+  VMCS_CTRL_EPT_POINTER,
+
+  // 64-bit read-only data fields
+  VMCS_GUEST_PHYSICAL_ADDRESS,
+
+  // 64-bit guest-state fields
+  VMCS_GUEST_VMCS_LINK_POINTER,
+  VMCS_GUEST_DEBUGCTL,
+  VMCS_GUEST_PAT,
+  VMCS_GUEST_EFER,
+  VMCS_GUEST_PERF_GLOBAL_CTRL,
+  VMCS_GUEST_PDPTE0,
+  VMCS_GUEST_PDPTE1,
+  VMCS_GUEST_PDPTE2,
+  VMCS_GUEST_PDPTE3,
+
+  // 64-bit host-state fields
+  VMCS_HOST_PAT,
+  VMCS_HOST_EFER,
+  VMCS_HOST_PERF_GLOBAL_CTRL,
+
+  // 32-bit control fields
+  VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS,
+  VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
+  VMCS_CTRL_EXCEPTION_BITMAP,
+  VMCS_CTRL_PAGEFAULT_ERROR_CODE_MASK,
+  VMCS_CTRL_PAGEFAULT_ERROR_CODE_MATCH,
+  VMCS_CTRL_CR3_TARGET_COUNT,
+  VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS,
+  VMCS_CTRL_VMEXIT_MSR_STORE_COUNT,
+  VMCS_CTRL_VMEXIT_MSR_LOAD_COUNT,
+  VMCS_CTRL_VMENTRY_CONTROLS,
+  VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT,
+  VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD,
+  VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE,
+  VMCS_CTRL_VMENTRY_INSTRUCTION_LENGTH,
+  VMCS_CTRL_TPR_THRESHOLD,
+  VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
+  VMCS_CTRL_PLE_GAP,
+  VMCS_CTRL_PLE_WINDOW,
+
+  // 32-bit read-only data fields
+  VMCS_VM_INSTRUCTION_ERROR,
+  VMCS_EXIT_REASON,
+  VMCS_VMEXIT_INTERRUPTION_INFORMATION,
+  VMCS_VMEXIT_INTERRUPTION_ERROR_CODE,
+  VMCS_IDT_VECTORING_INFORMATION,
+  VMCS_IDT_VECTORING_ERROR_CODE,
+  VMCS_VMEXIT_INSTRUCTION_LENGTH,
+  VMCS_VMEXIT_INSTRUCTION_INFO,
+
+  // 32-bit guest-state fields
+  VMCS_GUEST_ES_LIMIT,
+  VMCS_GUEST_CS_LIMIT,
+  VMCS_GUEST_SS_LIMIT,
+  VMCS_GUEST_DS_LIMIT,
+  VMCS_GUEST_FS_LIMIT,
+  VMCS_GUEST_GS_LIMIT,
+  VMCS_GUEST_LDTR_LIMIT,
+  VMCS_GUEST_TR_LIMIT,
+  VMCS_GUEST_GDTR_LIMIT,
+  VMCS_GUEST_IDTR_LIMIT,
+  VMCS_GUEST_ES_ACCESS_RIGHTS,
+  VMCS_GUEST_CS_ACCESS_RIGHTS,
+  VMCS_GUEST_SS_ACCESS_RIGHTS,
+  VMCS_GUEST_DS_ACCESS_RIGHTS,
+  VMCS_GUEST_FS_ACCESS_RIGHTS,
+  VMCS_GUEST_GS_ACCESS_RIGHTS,
+  VMCS_GUEST_LDTR_ACCESS_RIGHTS,
+  VMCS_GUEST_TR_ACCESS_RIGHTS,
+  VMCS_GUEST_INTERRUPTIBILITY_STATE,
+  VMCS_GUEST_ACTIVITY_STATE,
+  VMCS_GUEST_SYSENTER_CS,
+
+  // 32-bit host-state fields
+  VMCS_HOST_SYSENTER_CS,
+
+  // natural-width control fields
+  VMCS_CTRL_CR0_GUEST_HOST_MASK,
+  VMCS_CTRL_CR4_GUEST_HOST_MASK,
+  VMCS_CTRL_CR0_READ_SHADOW,
+  VMCS_CTRL_CR4_READ_SHADOW,
+  VMCS_CTRL_CR3_TARGET_VALUE_0,
+  VMCS_CTRL_CR3_TARGET_VALUE_1,
+  VMCS_CTRL_CR3_TARGET_VALUE_2,
+  VMCS_CTRL_CR3_TARGET_VALUE_3,
+
+  // natural-width read-only data fields
+  VMCS_EXIT_QUALIFICATION,
+  VMCS_IO_RCX,
+  VMCS_IO_RSI,
+  VMCS_IO_RDI,
+  VMCS_IO_RIP,
+  VMCS_EXIT_GUEST_LINEAR_ADDRESS,
+
+  // natural-width guest-state fields
+  VMCS_GUEST_CR0,
+  VMCS_GUEST_CR3,
+  VMCS_GUEST_CR4,
+  VMCS_GUEST_ES_BASE,
+  VMCS_GUEST_CS_BASE,
+  VMCS_GUEST_SS_BASE,
+  VMCS_GUEST_DS_BASE,
+  VMCS_GUEST_FS_BASE,
+  VMCS_GUEST_GS_BASE,
+  VMCS_GUEST_LDTR_BASE,
+  VMCS_GUEST_TR_BASE,
+  VMCS_GUEST_GDTR_BASE,
+  VMCS_GUEST_IDTR_BASE,
+  VMCS_GUEST_DR7,
+  VMCS_GUEST_RSP,
+  VMCS_GUEST_RIP,
+  VMCS_GUEST_RFLAGS,
+  VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS,
+  VMCS_GUEST_SYSENTER_ESP,
+  VMCS_GUEST_SYSENTER_EIP,
+
+  // natural-width host-state fields
+  VMCS_HOST_CR0,
+  VMCS_HOST_CR3,
+  VMCS_HOST_CR4,
+  VMCS_HOST_FS_BASE,
+  VMCS_HOST_GS_BASE,
+  VMCS_HOST_TR_BASE,
+  VMCS_HOST_GDTR_BASE,
+  VMCS_HOST_IDTR_BASE,
+  VMCS_HOST_SYSENTER_ESP,
+  VMCS_HOST_SYSENTER_EIP,
+  VMCS_HOST_RSP,
+  VMCS_HOST_RIP
+};
+
+// find_vmcs12_field() does a binary search, so the table needs to be sorted
+// (this also catches a field count that doesn't match the table)
+static constexpr bool vmcs12_fields_sorted() {
+  for (size_t i = 1; i < vmcs12_field_count; ++i) {
+    if (vmcs12_fields[i - 1] >= vmcs12_fields[i])
+      return false;
+  }
+
+  return true;
+}
+
+static_assert(vmcs12_fields_sorted(), "vmcs12_fields must be sorted.");
+
+// guest-state fields that need to be copied back into vmcs12 on a nested
+// vm-exit (in addition to the read-only exit information fields)
+constexpr uint32_t vmcs02_exit_fields[] = {
+  VMCS_GUEST_ES_SELECTOR,
+  VMCS_GUEST_CS_SELECTOR,
+  VMCS_GUEST_SS_SELECTOR,
+  VMCS_GUEST_DS_SELECTOR,
+  VMCS_GUEST_FS_SELECTOR,
+  VMCS_GUEST_GS_SELECTOR,
+  VMCS_GUEST_LDTR_SELECTOR,
+  VMCS_GUEST_TR_SELECTOR,
+  VMCS_GUEST_PHYSICAL_ADDRESS,
+  VMCS_GUEST_DEBUGCTL,
+  VMCS_GUEST_PAT,
+  VMCS_GUEST_EFER,
+  VMCS_GUEST_PDPTE0,
+  VMCS_GUEST_PDPTE1,
+  VMCS_GUEST_PDPTE2,
+  VMCS_GUEST_PDPTE3,
+  VMCS_EXIT_REASON,
+  VMCS_VMEXIT_INTERRUPTION_INFORMATION,
+  VMCS_VMEXIT_INTERRUPTION_ERROR_CODE,
+  VMCS_IDT_VECTORING_INFORMATION,
+  VMCS_IDT_VECTORING_ERROR_CODE,
+  VMCS_VMEXIT_INSTRUCTION_LENGTH,
+  VMCS_VMEXIT_INSTRUCTION_INFO,
+  VMCS_GUEST_ES_LIMIT,
+  VMCS_GUEST_CS_LIMIT,
+  VMCS_GUEST_SS_LIMIT,
+  VMCS_GUEST_DS_LIMIT,
+  VMCS_GUEST_FS_LIMIT,
+  VMCS_GUEST_GS_LIMIT,
+  VMCS_GUEST_LDTR_LIMIT,
+  VMCS_GUEST_TR_LIMIT,
+  VMCS_GUEST_GDTR_LIMIT,
+  VMCS_GUEST_IDTR_LIMIT,
+  VMCS_GUEST_ES_ACCESS_RIGHTS,
+  VMCS_GUEST_CS_ACCESS_RIGHTS,
+  VMCS_GUEST_SS_ACCESS_RIGHTS,
+  VMCS_GUEST_DS_ACCESS_RIGHTS,
+  VMCS_GUEST_FS_ACCESS_RIGHTS,
+  VMCS_GUEST_GS_ACCESS_RIGHTS,
+  VMCS_GUEST_LDTR_ACCESS_RIGHTS,
+  VMCS_GUEST_TR_ACCESS_RIGHTS,
+  VMCS_GUEST_INTERRUPTIBILITY_STATE,
+  VMCS_GUEST_ACTIVITY_STATE,
+  VMCS_GUEST_SYSENTER_CS,
+  VMCS_EXIT_QUALIFICATION,
+  VMCS_IO_RCX,
+  VMCS_IO_RSI,
+  VMCS_IO_RDI,
+  VMCS_IO_RIP,
+  VMCS_EXIT_GUEST_LINEAR_ADDRESS,
+  VMCS_GUEST_CR0,
+  VMCS_GUEST_CR3,
+  VMCS_GUEST_CR4,
+  VMCS_GUEST_ES_BASE,
+  VMCS_GUEST_CS_BASE,
+  VMCS_GUEST_SS_BASE,
+  VMCS_GUEST_DS_BASE,
+  VMCS_GUEST_FS_BASE,
+  VMCS_GUEST_GS_BASE,
+  VMCS_GUEST_LDTR_BASE,
+  VMCS_GUEST_TR_BASE,
+  VMCS_GUEST_GDTR_BASE,
+  VMCS_GUEST_IDTR_BASE,
+  VMCS_GUEST_DR7,
+  VMCS_GUEST_RSP,
+  VMCS_GUEST_RIP,
+  VMCS_GUEST_RFLAGS,
+  VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS,
+  VMCS_GUEST_SYSENTER_ESP,
+  VMCS_GUEST_SYSENTER_EIP,
+
+  // needed to reconstruct the L2 CR0/CR4 values (not copied into vmcs12)
+  VMCS_CTRL_CR0_READ_SHADOW,
+  VMCS_CTRL_CR4_READ_SHADOW
+};
+
+constexpr size_t vmcs02_exit_field_count =
+  sizeof(vmcs02_exit_fields) / sizeof(vmcs02_exit_fields[0]);
+
+// get the index of a field in vmcs12::fields, or -1 if the field isn't supported
+int find_vmcs12_field(uint64_t const field) {
+  // the upper 32 bits must be 0 (3.24.11.2)
+  if (field >> 32)
+    return -1;
+
+  size_t lo = 0, hi = vmcs12_field_count;
+
+  while (lo < hi) {
+    auto const mid = (lo + hi) / 2;
+
+    if (vmcs12_fields[mid] == field)
+      return static_cast<int>(mid);
+
+    if (vmcs12_fields[mid] < field)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return -1;
+}
+
+// truncate a value to the width of the specified field
+static uint64_t truncate_vmcs_field(uint64_t const field, uint64_t const value) {
+  switch (get_vmcs_field_width(field)) {
+  case vmcs_field_width_16: return value & 0xFFFF;
+  case vmcs_field_width_32: return value & 0xFFFFFFFF;
+  default:                  return value;
+  }
+}
+
+// read a vmcs12 field (returns false if the field isn't supported)
+bool vmcs12_read(vmcs12 const& vmcs, uint64_t const field, uint64_t& value) {
+  auto const idx = find_vmcs12_field(field);
+  if (idx < 0)
+    return false;
+
+  value = vmcs.fields[idx];
+  return true;
+}
+
+// write to a vmcs12 field (returns false if the field isn't supported).
+// this doesn't check whether the field is read-only.
+bool vmcs12_write(vmcs12& vmcs, uint64_t const field, uint64_t const value) {
+  auto const idx = find_vmcs12_field(field);
+  if (idx < 0)
+    return false;
+
+  vmcs.fields[idx] = truncate_vmcs_field(field, value);
+  return true;
+}
+
+// read a vmcs12 field that is known to be supported
+uint64_t vmcs12_get(vmcs12 const& vmcs, uint64_t const field) {
+  uint64_t value = 0;
+  vmcs12_read(vmcs, field, value);
+  return value;
+}
+
+// write to a vmcs12 field that is known to be supported
+void vmcs12_set(vmcs12& vmcs, uint64_t const field, uint64_t const value) {
+  vmcs12_write(vmcs, field, value);
+}
+
+// TODO: move to ia32?
+// IA32_VMX_BASIC[49] (dual-monitor treatment of SMIs and SMM)
+static constexpr uint64_t vmx_basic_smm_dual_monitor_support = 1ull << 49;
+
+// TODO: move to ia32?
+// IA32_VMX_MISC[6:8] (activity states), IA32_VMX_MISC[15] (RDMSR of
+// IA32_SMBASE in SMM), IA32_VMX_MISC[28] (SMM_MONITOR_CTL[2]), and
+// IA32_VMX_MISC[29] (VMWRITE to vm-exit information fields)
+static constexpr uint64_t vmx_misc_unsupported_mask =
+  (0b111ull << 6) | (1ull << 15) | (1ull << 28) | (1ull << 29);
+
+// pin-based controls that can be used by L1
+static uint32_t nested_pin_based_whitelist() {
+  ia32_vmx_pinbased_ctls_register ctrl;
+  ctrl.flags                      = 0;
+  ctrl.external_interrupt_exiting = 1;
+  ctrl.nmi_exiting                = 1;
+  ctrl.virtual_nmi                = 1;
+  return static_cast<uint32_t>(ctrl.flags);
+}
+
+// processor-based controls that can be used by L1
+static uint32_t nested_proc_based_whitelist() {
+  ia32_vmx_procbased_ctls_register ctrl;
+  ctrl.flags                       = 0;
+  ctrl.interrupt_window_exiting    = 1;
+  ctrl.use_tsc_offsetting          = 1;
+  ctrl.hlt_exiting                 = 1;
+  ctrl.invlpg_exiting              = 1;
+  ctrl.mwait_exiting               = 1;
+  ctrl.rdpmc_exiting               = 1;
+  ctrl.rdtsc_exiting               = 1;
+  ctrl.cr3_load_exiting            = 1;
+  ctrl.cr3_store_exiting           = 1;
+  ctrl.cr8_load_exiting            = 1;
+  ctrl.cr8_store_exiting           = 1;
+  ctrl.use_tpr_shadow              = 1;
+  ctrl.nmi_window_exiting          = 1;
+  ctrl.mov_dr_exiting              = 1;
+  ctrl.unconditional_io_exiting    = 1;
+  ctrl.use_io_bitmaps              = 1;
+  ctrl.use_msr_bitmaps             = 1;
+  ctrl.monitor_exiting             = 1;
+  ctrl.pause_exiting               = 1;
+  ctrl.activate_secondary_controls = 1;
+  return static_cast<uint32_t>(ctrl.flags);
+}
+
+// secondary processor-based controls that can be used by L1. EPT (and
+// unrestricted guest, which needs it) isn't exposed: EPT12 would have to
+// be merged with EPT01 into a shadow EPT, or L1 could map any host page
+// into L2 and bypass our EPT hooks and protections.
+static uint32_t nested_proc_based2_whitelist() {
+  ia32_vmx_procbased_ctls2_register ctrl;
+  ctrl.flags                    = 0;
+  ctrl.descriptor_table_exiting = 1;
+  ctrl.enable_rdtscp            = 1;
+  ctrl.enable_vpid              = 1;
+  ctrl.wbinvd_exiting           = 1;
+  ctrl.pause_loop_exiting       = 1;
+  ctrl.rdrand_exiting           = 1;
+  ctrl.enable_invpcid           = 1;
+  ctrl.rdseed_exiting           = 1;
+  ctrl.enable_xsaves            = 1;
+  ctrl.enable_user_wait_pause   = 1;
+  return static_cast<uint32_t>(ctrl.flags);
+}
+
+// vm-exit controls that can be used by L1
+static uint32_t nested_exit_whitelist() {
+  ia32_vmx_exit_ctls_register ctrl;
+  ctrl.flags                         = 0;
+  ctrl.save_debug_controls           = 1;
+  ctrl.host_address_space_size       = 1;
+  ctrl.load_ia32_perf_global_ctrl    = 1;
+  ctrl.acknowledge_interrupt_on_exit = 1;
+  ctrl.save_ia32_pat                 = 1;
+  ctrl.load_ia32_pat                 = 1;
+  ctrl.save_ia32_efer                = 1;
+  ctrl.load_ia32_efer                = 1;
+  return static_cast<uint32_t>(ctrl.flags);
+}
+
+// vm-entry controls that can be used by L1
+static uint32_t nested_entry_whitelist() {
+  ia32_vmx_entry_ctls_register ctrl;
+  ctrl.flags                      = 0;
+  ctrl.load_debug_controls        = 1;
+  ctrl.ia32e_mode_guest           = 1;
+  ctrl.load_ia32_perf_global_ctrl = 1;
+  ctrl.load_ia32_pat              = 1;
+  ctrl.load_ia32_efer             = 1;
+  return static_cast<uint32_t>(ctrl.flags);
+}
+
+// remove every allowed 1-setting that isn't in the whitelist (bits
+// that are required to be 1 are obviously left alone)
+static uint64_t filter_ctrl_msr(uint64_t const value, uint32_t const whitelist) {
+  auto const allowed0 = static_cast<uint32_t>(value);
+  auto const allowed1 = static_cast<uint32_t>(value >> 32) & (whitelist | allowed0);
+  return (static_cast<uint64_t>(allowed1) << 32) | allowed0;
+}
+
+// filter a VMX capability MSR so that L1 only sees the features that
+// nested VMX can actually emulate
+uint64_t filter_nested_vmx_msr(uint32_t const msr, uint64_t const value) {
+  switch (msr) {
+  case IA32_VMX_BASIC: {
+    // dual-monitor treatment of SMIs isn't supported
+    return value & ~vmx_basic_smm_dual_monitor_support;
+  }
+  case IA32_VMX_PINBASED_CTLS:
+  case IA32_VMX_TRUE_PINBASED_CTLS:
+    return filter_ctrl_msr(value, nested_pin_based_whitelist());
+  case IA32_VMX_PROCBASED_CTLS:
+  case IA32_VMX_TRUE_PROCBASED_CTLS:
+    return filter_ctrl_msr(value, nested_proc_based_whitelist());
+  case IA32_VMX_PROCBASED_CTLS2:
+    return filter_ctrl_msr(value, nested_proc_based2_whitelist());
+  case IA32_VMX_EXIT_CTLS:
+  case IA32_VMX_TRUE_EXIT_CTLS:
+    return filter_ctrl_msr(value, nested_exit_whitelist());
+  case IA32_VMX_ENTRY_CTLS:
+  case IA32_VMX_TRUE_ENTRY_CTLS:
+    return filter_ctrl_msr(value, nested_entry_whitelist());
+  case IA32_VMX_MISC:
+    // we don't support VMWRITE to read-only fields, SMM, or any
+    // activity state other than active
+    return value & ~vmx_misc_unsupported_mask;
+  case IA32_VMX_VMCS_ENUM:
+    // highest index value that is used in a field encoding (bits 9:1)
+    return ((vmcs12_fields[vmcs12_field_count - 1] >> 1) & 0x1FF) << 1;
+  case IA32_VMX_EPT_VPID_CAP:
+    // EPT isn't exposed to L1, only the INVVPID capabilities (bits 63:32)
+    return value & ~0xFFFF'FFFFull;
+  case IA32_VMX_VMFUNC:
+    return 0;
+  default:
+    return value;
+  }
+}
+
+// check whether a control value is valid according to a capability MSR
+static bool check_ctrl(uint64_t const value, uint64_t const cap) {
+  auto const allowed0 = static_cast<uint32_t>(cap);
+  auto const allowed1 = static_cast<uint32_t>(cap >> 32);
+  return (value & allowed0) == allowed0 && (value & ~allowed1) == 0;
+}
+
+// check whether a physical address is aligned and within MAXPHYSADDR
+static bool check_phys_addr(uint64_t const address,
+    uint64_t const alignment, uint64_t const max_phys_addr) {
+  return (address & (alignment - 1)) == 0 && (address >> max_phys_addr) == 0;
+}
+
+// check the vmcs12 controls and host-state area before a nested vm-entry.
+// returns the VM-instruction error, or vm_instruction_error_none.
+vm_instruction_error check_vmcs12(vmcs12 const& vmcs, nested_l0_state const& l0) {
+  // 3.26.2.1.1
+  ia32_vmx_pinbased_ctls_register pin;
+  pin.flags = vmcs12_get(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS);
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags = vmcs12_get(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  ia32_vmx_procbased_ctls2_register proc2;
+  proc2.flags = proc.activate_secondary_controls ?
+    vmcs12_get(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS) : 0;
+
+  ia32_vmx_exit_ctls_register exit;
+  exit.flags = vmcs12_get(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+
+  ia32_vmx_entry_ctls_register entry;
+  entry.flags = vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_CONTROLS);
+
+  if (!check_ctrl(pin.flags,   l0.pin_based_cap)   ||
+      !check_ctrl(proc.flags,  l0.proc_based_cap)  ||
+      !check_ctrl(proc2.flags, l0.proc_based2_cap) ||
+      !check_ctrl(exit.flags,  l0.exit_cap)        ||
+      !check_ctrl(entry.flags, l0.entry_cap))
+    return vm_instruction_error_entry_invalid_control;
+
+  if (vmcs12_get(vmcs, VMCS_CTRL_CR3_TARGET_COUNT) > 4)
+    return vm_instruction_error_entry_invalid_control;
+
+  if (pin.virtual_nmi && !pin.nmi_exiting)
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc.nmi_window_exiting && !pin.virtual_nmi)
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc.use_io_bitmaps && (
+      !check_phys_addr(vmcs12_get(vmcs, VMCS_CTRL_IO_BITMAP_A_ADDRESS), 0x1000, l0.max_phys_addr) ||
+      !check_phys_addr(vmcs12_get(vmcs, VMCS_CTRL_IO_BITMAP_B_ADDRESS), 0x1000, l0.max_phys_addr)))
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc.use_msr_bitmaps && !check_phys_addr(
+      vmcs12_get(vmcs, VMCS_CTRL_MSR_BITMAP_ADDRESS), 0x1000, l0.max_phys_addr))
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc.use_tpr_shadow && !check_phys_addr(
+      vmcs12_get(vmcs, VMCS_CTRL_VIRTUAL_APIC_ADDRESS), 0x1000, l0.max_phys_addr))
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc2.enable_ept) {
+    ept_pointer eptp;
+    eptp.flags = vmcs12_get(vmcs, VMCS_CTRL_EPT_POINTER);
+
+    if ((eptp.memory_type != MEMORY_TYPE_UNCACHEABLE &&
+         eptp.memory_type != MEMORY_TYPE_WRITE_BACK) ||
+        eptp.page_walk_length != 3 ||
+        !check_phys_addr(eptp.flags & ~0xFFFull, 0x1000, l0.max_phys_addr))
+      return vm_instruction_error_entry_invalid_control;
+  }
+
+  if (proc2.unrestricted_guest && !proc2.enable_ept)
+    return vm_instruction_error_entry_invalid_control;
+
+  if (proc2.enable_vpid && vmcs12_get(vmcs, VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER) == 0)
+    return vm_instruction_error_entry_invalid_control;
+
+  // 3.26.2.1.2, 3.26.2.1.3
+  if (vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_STORE_COUNT) > 512 ||
+      vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_LOAD_COUNT)  > 512 ||
+      vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT) > 512)
+    return vm_instruction_error_entry_invalid_control;
+
+  if (!check_phys_addr(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS), 0x10, l0.max_phys_addr) ||
+      !check_phys_addr(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_LOAD_ADDRESS),  0x10, l0.max_phys_addr) ||
+      !check_phys_addr(vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_MSR_LOAD_ADDRESS), 0x10, l0.max_phys_addr))
+    return vm_instruction_error_entry_invalid_control;
+
+  // 3.26.2.2 (L1 is always a 64-bit hypervisor)
+  if (!exit.host_address_space_size)
+    return vm_instruction_error_entry_invalid_host_state;
+
+  auto const host_cr0 = vmcs12_get(vmcs, VMCS_HOST_CR0);
+  auto const host_cr4 = vmcs12_get(vmcs, VMCS_HOST_CR4);
+
+  if ((host_cr0 & l0.cr0_fixed0) != l0.cr0_fixed0 || (host_cr0 & ~l0.cr0_fixed1) ||
+      (host_cr4 & l0.cr4_fixed0) != l0.cr4_fixed0 || (host_cr4 & ~l0.cr4_fixed1))
+    return vm_instruction_error_entry_invalid_host_state;
+
+  // 3.26.2.3
+  segment_selector cs, tr;
+  cs.flags = static_cast<uint16_t>(vmcs12_get(vmcs, VMCS_HOST_CS_SELECTOR));
+  tr.flags = static_cast<uint16_t>(vmcs12_get(vmcs, VMCS_HOST_TR_SELECTOR));
+
+  if (cs.index == 0 || tr.index == 0)
+    return vm_instruction_error_entry_invalid_host_state;
+
+  uint64_t const host_selectors[] = {
+    VMCS_HOST_ES_SELECTOR, VMCS_HOST_CS_SELECTOR, VMCS_HOST_SS_SELECTOR,
+    VMCS_HOST_DS_SELECTOR, VMCS_HOST_FS_SELECTOR, VMCS_HOST_GS_SELECTOR,
+    VMCS_HOST_TR_SELECTOR
+  };
+
+  // RPL and TI must be 0
+  for (auto const field : host_selectors) {
+    if (vmcs12_get(vmcs, field) & 0b111)
+      return vm_instruction_error_entry_invalid_host_state;
+  }
+
+  return vm_instruction_error_none;
+}
+
+static void append_write(vmcs_write_list& out,
+    uint64_t const field, uint64_t const value) {
+  if (out.count < max_vmcs_writes)
+    out.writes[out.count++] = { static_cast<uint32_t>(field), value };
+}
+
+// copy a field from vmcs12 into the write list
+static void append_copy(vmcs_write_list& out,
+    vmcs12 const& vmcs, uint64_t const field) {
+  append_write(out, field, vmcs12_get(vmcs, field));
+}
+
+// adjust a control value according to a capability MSR
+static uint64_t adjust_ctrl(uint64_t value, uint64_t const cap) {
+  value |= static_cast<uint32_t>(cap);
+  value &= static_cast<uint32_t>(cap >> 32);
+  return value;
+}
+
+// build the field writes for vmcs02 (controls and guest state)
+void merge_vmcs02(vmcs12 const& vmcs, nested_l0_state const& l0, vmcs_write_list& out) {
+  out.count = 0;
+
+  // guest-state area (everything in vmcs12 that is in the guest-state area
+  // and isn't overridden below is copied as-is)
+  for (auto const field : vmcs12_fields) {
+    if (get_vmcs_field_type(field) == vmcs_field_type_guest)
+      append_copy(out, vmcs, field);
+  }
+
+  ia32_vmx_procbased_ctls_register proc12;
+  proc12.flags = vmcs12_get(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  ia32_vmx_procbased_ctls2_register proc2_12;
+  proc2_12.flags = proc12.activate_secondary_controls ?
+    vmcs12_get(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS) : 0;
+
+  ia32_vmx_exit_ctls_register exit12;
+  exit12.flags = vmcs12_get(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+
+  ia32_vmx_entry_ctls_register entry12;
+  entry12.flags = vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_CONTROLS);
+
+  // vmcs02 always loads these, so use the current L1 value if L1 doesn't
+  append_write(out, VMCS_GUEST_VMCS_LINK_POINTER, ~0ull);
+  append_write(out, VMCS_GUEST_EFER, entry12.load_ia32_efer ?
+    vmcs12_get(vmcs, VMCS_GUEST_EFER) : l0.efer);
+  append_write(out, VMCS_GUEST_PAT, entry12.load_ia32_pat ?
+    vmcs12_get(vmcs, VMCS_GUEST_PAT) : l0.pat);
+  append_write(out, VMCS_GUEST_DEBUGCTL, entry12.load_debug_controls ?
+    vmcs12_get(vmcs, VMCS_GUEST_DEBUGCTL) : l0.debugctl);
+  append_write(out, VMCS_GUEST_DR7, entry12.load_debug_controls ?
+    vmcs12_get(vmcs, VMCS_GUEST_DR7) : l0.dr7);
+  append_write(out, VMCS_GUEST_PERF_GLOBAL_CTRL, entry12.load_ia32_perf_global_ctrl ?
+    vmcs12_get(vmcs, VMCS_GUEST_PERF_GLOBAL_CTRL) : l0.perf_global_ctrl);
+
+  // pin-based controls are used as-is (the preemption timer isn't exposed
+  // to L1, and we don't use it while L2 is running)
+  append_write(out, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, adjust_ctrl(
+    vmcs12_get(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS), l0.pin_based_cap));
+
+  auto proc02 = proc12;
+  proc02.use_tsc_offsetting          = 1;
+  proc02.use_msr_bitmaps             = 1;
+  proc02.activate_secondary_controls = 1;
+  append_write(out, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
+    adjust_ctrl(proc02.flags, l0.proc_based_cap));
+
+  // EPT and VPIDs are always ours (vmcs01 uses both), and they aren't
+  // necessarily in the controls that L1 is allowed to use
+  ia32_vmx_procbased_ctls2_register proc2_02;
+  proc2_02.flags       = adjust_ctrl(proc2_12.flags, l0.proc_based2_cap);
+  proc2_02.enable_ept  = 1;
+  proc2_02.enable_vpid = 1;
+  append_write(out, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
+    proc2_02.flags);
+
+  // vm-exits from L2 always return to us, so the exit controls need to
+  // restore our own host state (L1 host state is loaded in software)
+  auto exit02 = exit12;
+  exit02.host_address_space_size    = 1;
+  exit02.save_debug_controls        = 1;
+  exit02.save_ia32_pat              = 1;
+  exit02.load_ia32_pat              = 1;
+  exit02.save_ia32_efer             = 1;
+  exit02.load_ia32_efer             = 1;
+  exit02.load_ia32_perf_global_ctrl = 1;
+  append_write(out, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS,
+    adjust_ctrl(exit02.flags, l0.exit_cap));
+
+  auto entry02 = entry12;
+  entry02.load_debug_controls        = 1;
+  entry02.load_ia32_pat              = 1;
+  entry02.load_ia32_efer             = 1;
+  entry02.load_ia32_perf_global_ctrl = 1;
+  append_write(out, VMCS_CTRL_VMENTRY_CONTROLS,
+    adjust_ctrl(entry02.flags, l0.entry_cap));
+
+  // TSC offsets are additive
+  append_write(out, VMCS_CTRL_TSC_OFFSET, l0.tsc_offset + (proc12.use_tsc_offsetting ?
+    vmcs12_get(vmcs, VMCS_CTRL_TSC_OFFSET) : 0));
+
+  // L2 runs on EPT01 (with our hooks), since L1 can't use EPT
+  append_write(out, VMCS_CTRL_EPT_POINTER, l0.eptp);
+  append_write(out, VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER, l0.vpid);
+  append_write(out, VMCS_CTRL_MSR_BITMAP_ADDRESS, l0.msr_bitmap);
+
+  // L1 physical addresses are host physical addresses
+  if (proc12.use_io_bitmaps) {
+    append_copy(out, vmcs, VMCS_CTRL_IO_BITMAP_A_ADDRESS);
+    append_copy(out, vmcs, VMCS_CTRL_IO_BITMAP_B_ADDRESS);
+  }
+
+  if (proc12.use_tpr_shadow) {
+    append_copy(out, vmcs, VMCS_CTRL_VIRTUAL_APIC_ADDRESS);
+    append_copy(out, vmcs, VMCS_CTRL_TPR_THRESHOLD);
+  }
+
+  if (proc2_12.pause_loop_exiting) {
+    append_copy(out, vmcs, VMCS_CTRL_PLE_GAP);
+    append_copy(out, vmcs, VMCS_CTRL_PLE_WINDOW);
+  }
+
+  // CR0/CR4 bits are owned by L1 if L1 owns them, and by us if
+  // they are reserved. the read shadows contain the value that L2 sees.
+  auto const cr0_mask = vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK) |
+    l0.cr0_fixed0 | ~l0.cr0_fixed1;
+  auto const cr4_mask = vmcs12_get(vmcs, VMCS_CTRL_CR4_GUEST_HOST_MASK) |
+    l0.cr4_fixed0 | ~l0.cr4_fixed1;
+
+  auto const cr0_mask12 = vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK);
+  auto const cr4_mask12 = vmcs12_get(vmcs, VMCS_CTRL_CR4_GUEST_HOST_MASK);
+
+  append_write(out, VMCS_CTRL_CR0_GUEST_HOST_MASK, cr0_mask);
+  append_write(out, VMCS_CTRL_CR4_GUEST_HOST_MASK, cr4_mask);
+  append_write(out, VMCS_CTRL_CR0_READ_SHADOW,
+    (vmcs12_get(vmcs, VMCS_CTRL_CR0_READ_SHADOW) & cr0_mask12) |
+    (vmcs12_get(vmcs, VMCS_GUEST_CR0) & ~cr0_mask12));
+  append_write(out, VMCS_CTRL_CR4_READ_SHADOW,
+    (vmcs12_get(vmcs, VMCS_CTRL_CR4_READ_SHADOW) & cr4_mask12) |
+    (vmcs12_get(vmcs, VMCS_GUEST_CR4) & ~cr4_mask12));
+
+  // the real CR0/CR4 values need to respect our fixed bits
+  append_write(out, VMCS_GUEST_CR0,
+    (vmcs12_get(vmcs, VMCS_GUEST_CR0) | l0.cr0_fixed0) & l0.cr0_fixed1);
+  append_write(out, VMCS_GUEST_CR4,
+    (vmcs12_get(vmcs, VMCS_GUEST_CR4) | l0.cr4_fixed0) & l0.cr4_fixed1);
+
+  append_copy(out, vmcs, VMCS_CTRL_CR3_TARGET_COUNT);
+  append_copy(out, vmcs, VMCS_CTRL_CR3_TARGET_VALUE_0);
+  append_copy(out, vmcs, VMCS_CTRL_CR3_TARGET_VALUE_1);
+  append_copy(out, vmcs, VMCS_CTRL_CR3_TARGET_VALUE_2);
+  append_copy(out, vmcs, VMCS_CTRL_CR3_TARGET_VALUE_3);
+
+  append_copy(out, vmcs, VMCS_CTRL_EXCEPTION_BITMAP);
+  append_copy(out, vmcs, VMCS_CTRL_PAGEFAULT_ERROR_CODE_MASK);
+  append_copy(out, vmcs, VMCS_CTRL_PAGEFAULT_ERROR_CODE_MATCH);
+
+  // event injection
+  append_copy(out, vmcs, VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD);
+  append_copy(out, vmcs, VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE);
+  append_copy(out, vmcs, VMCS_CTRL_VMENTRY_INSTRUCTION_LENGTH);
+
+  // L1 MSR lists are processed in software
+  append_write(out, VMCS_CTRL_VMEXIT_MSR_STORE_COUNT, 0);
+  append_write(out, VMCS_CTRL_VMEXIT_MSR_LOAD_COUNT,  0);
+  append_write(out, VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT, 0);
+}
+
+// update vmcs12 after a nested vm-exit (exit_state contains the values of
+// vmcs02_exit_fields) and build the field writes that load L1 host state
+// into vmcs01
+void reflect_vmcs12_exit(vmcs12& vmcs, vmcs12 const& exit_state,
+    nested_l0_state const& l0, vmcs_write_list& out) {
+  out.count = 0;
+
+  vmx_vmexit_reason reason;
+  reason.flags = static_cast<uint32_t>(vmcs12_get(exit_state, VMCS_EXIT_REASON));
+
+  ia32_vmx_exit_ctls_register exit12;
+  exit12.flags = vmcs12_get(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+
+  // 3.27.2
+  if (reason.vm_entry_failure) {
+    // guest state isn't saved if the vm-entry failed
+    vmcs12_set(vmcs, VMCS_EXIT_REASON, reason.flags);
+    vmcs12_set(vmcs, VMCS_EXIT_QUALIFICATION,
+      vmcs12_get(exit_state, VMCS_EXIT_QUALIFICATION));
+  } else {
+    for (size_t i = 0; i < vmcs02_exit_field_count; ++i) {
+      auto const field = vmcs02_exit_fields[i];
+
+      if (get_vmcs_field_type(field) == vmcs_field_type_control)
+        continue;
+
+      // 3.27.3.1
+      if ((field == VMCS_GUEST_PAT   && !exit12.save_ia32_pat) ||
+          (field == VMCS_GUEST_EFER  && !exit12.save_ia32_efer) ||
+          (field == VMCS_GUEST_DR7   && !exit12.save_debug_controls) ||
+          (field == VMCS_GUEST_DEBUGCTL && !exit12.save_debug_controls))
+        continue;
+
+      vmcs12_set(vmcs, field, vmcs12_get(exit_state, field));
+    }
+
+    // CR0/CR4 bits that are owned by L1 are read from the L1 read shadow
+    auto const cr0_mask12 = vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK);
+    auto const cr4_mask12 = vmcs12_get(vmcs, VMCS_CTRL_CR4_GUEST_HOST_MASK);
+    auto const cr0_l0mask = l0.cr0_fixed0 | ~l0.cr0_fixed1;
+    auto const cr4_l0mask = l0.cr4_fixed0 | ~l0.cr4_fixed1;
+
+    // bits that we forced (but L1 doesn't own) come from the read shadow
+    // that was used for L2
+    auto const cr0_shadow02 = vmcs12_get(exit_state, VMCS_CTRL_CR0_READ_SHADOW);
+    auto const cr4_shadow02 = vmcs12_get(exit_state, VMCS_CTRL_CR4_READ_SHADOW);
+    auto const cr0_forced = cr0_l0mask & ~cr0_mask12;
+    auto const cr4_forced = cr4_l0mask & ~cr4_mask12;
+
+    vmcs12_set(vmcs, VMCS_GUEST_CR0,
+      (vmcs12_get(exit_state, VMCS_GUEST_CR0) & ~cr0_forced) | (cr0_shadow02 & cr0_forced));
+    vmcs12_set(vmcs, VMCS_GUEST_CR4,
+      (vmcs12_get(exit_state, VMCS_GUEST_CR4) & ~cr4_forced) | (cr4_shadow02 & cr4_forced));
+  }
+
+  // 3.27.2.5
+  vmcs12_set(vmcs, VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD,
+    vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD) & ~(1ull << 31));
+
+  // 3.28.5 (the rest of the host state is loaded by our caller)
+  auto const host_cr0 = vmcs12_get(vmcs, VMCS_HOST_CR0);
+  auto const host_cr4 = vmcs12_get(vmcs, VMCS_HOST_CR4);
+
+  append_write(out, VMCS_GUEST_CR0, (host_cr0 | l0.cr0_fixed0) & l0.cr0_fixed1);
+  append_write(out, VMCS_GUEST_CR4, (host_cr4 | l0.cr4_fixed0) & l0.cr4_fixed1);
+  append_write(out, VMCS_CTRL_CR0_READ_SHADOW, host_cr0);
+  append_write(out, VMCS_CTRL_CR4_READ_SHADOW, host_cr4);
+
+  // the HOST_* fields map directly onto GUEST_* fields in vmcs01
+  append_write(out, VMCS_GUEST_CR3, vmcs12_get(vmcs, VMCS_HOST_CR3));
+  append_write(out, VMCS_GUEST_RSP, vmcs12_get(vmcs, VMCS_HOST_RSP));
+  append_write(out, VMCS_GUEST_RIP, vmcs12_get(vmcs, VMCS_HOST_RIP));
+  append_write(out, VMCS_GUEST_RFLAGS, 1ull << 1);
+  append_write(out, VMCS_GUEST_DR7, 0x400);
+  append_write(out, VMCS_GUEST_DEBUGCTL, 0);
+
+  append_write(out, VMCS_GUEST_SYSENTER_CS,  vmcs12_get(vmcs, VMCS_HOST_SYSENTER_CS));
+  append_write(out, VMCS_GUEST_SYSENTER_ESP, vmcs12_get(vmcs, VMCS_HOST_SYSENTER_ESP));
+  append_write(out, VMCS_GUEST_SYSENTER_EIP, vmcs12_get(vmcs, VMCS_HOST_SYSENTER_EIP));
+
+  if (exit12.load_ia32_pat)
+    append_write(out, VMCS_GUEST_PAT, vmcs12_get(vmcs, VMCS_HOST_PAT));
+
+  if (exit12.load_ia32_perf_global_ctrl)
+    append_write(out, VMCS_GUEST_PERF_GLOBAL_CTRL,
+      vmcs12_get(vmcs, VMCS_HOST_PERF_GLOBAL_CTRL));
+
+  // 3.28.5.2
+  struct {
+    uint32_t selector, base, limit, access_rights;
+    uint32_t host_selector, host_base;
+    uint32_t code_ar;
+  } const segments[] = {
+    { VMCS_GUEST_ES_SELECTOR, VMCS_GUEST_ES_BASE, VMCS_GUEST_ES_LIMIT,
+      VMCS_GUEST_ES_ACCESS_RIGHTS, VMCS_HOST_ES_SELECTOR, 0,                 0xC093 },
+    { VMCS_GUEST_CS_SELECTOR, VMCS_GUEST_CS_BASE, VMCS_GUEST_CS_LIMIT,
+      VMCS_GUEST_CS_ACCESS_RIGHTS, VMCS_HOST_CS_SELECTOR, 0,                 0xA09B },
+    { VMCS_GUEST_SS_SELECTOR, VMCS_GUEST_SS_BASE, VMCS_GUEST_SS_LIMIT,
+      VMCS_GUEST_SS_ACCESS_RIGHTS, VMCS_HOST_SS_SELECTOR, 0,                 0xC093 },
+    { VMCS_GUEST_DS_SELECTOR, VMCS_GUEST_DS_BASE, VMCS_GUEST_DS_LIMIT,
+      VMCS_GUEST_DS_ACCESS_RIGHTS, VMCS_HOST_DS_SELECTOR, 0,                 0xC093 },
+    { VMCS_GUEST_FS_SELECTOR, VMCS_GUEST_FS_BASE, VMCS_GUEST_FS_LIMIT,
+      VMCS_GUEST_FS_ACCESS_RIGHTS, VMCS_HOST_FS_SELECTOR, VMCS_HOST_FS_BASE, 0xC093 },
+    { VMCS_GUEST_GS_SELECTOR, VMCS_GUEST_GS_BASE, VMCS_GUEST_GS_LIMIT,
+      VMCS_GUEST_GS_ACCESS_RIGHTS, VMCS_HOST_GS_SELECTOR, VMCS_HOST_GS_BASE, 0xC093 }
+  };
+
+  for (auto const& seg : segments) {
+    auto const selector = vmcs12_get(vmcs, seg.host_selector);
+
+    append_write(out, seg.selector, selector);
+    append_write(out, seg.base, seg.host_base ? vmcs12_get(vmcs, seg.host_base) : 0);
+    append_write(out, seg.limit, 0xFFFFFFFF);
+
+    // data segments with a null selector are unusable (SS is always usable)
+    append_write(out, seg.access_rights, (selector == 0 &&
+      seg.selector != VMCS_GUEST_CS_SELECTOR && seg.selector != VMCS_GUEST_SS_SELECTOR)
+      ? 0x10000 : seg.code_ar);
+  }
+
+  append_write(out, VMCS_GUEST_TR_SELECTOR, vmcs12_get(vmcs, VMCS_HOST_TR_SELECTOR));
+  append_write(out, VMCS_GUEST_TR_BASE, vmcs12_get(vmcs, VMCS_HOST_TR_BASE));
+  append_write(out, VMCS_GUEST_TR_LIMIT, 0x67);
+  append_write(out, VMCS_GUEST_TR_ACCESS_RIGHTS, 0x8B);
+
+  append_write(out, VMCS_GUEST_LDTR_SELECTOR, 0);
+  append_write(out, VMCS_GUEST_LDTR_ACCESS_RIGHTS, 0x10000);
+
+  append_write(out, VMCS_GUEST_GDTR_BASE, vmcs12_get(vmcs, VMCS_HOST_GDTR_BASE));
+  append_write(out, VMCS_GUEST_GDTR_LIMIT, 0xFFFF);
+  append_write(out, VMCS_GUEST_IDTR_BASE, vmcs12_get(vmcs, VMCS_HOST_IDTR_BASE));
+  append_write(out, VMCS_GUEST_IDTR_LIMIT, 0xFFFF);
+
+  // 3.28.5.3, 3.28.5.4
+  append_write(out, VMCS_GUEST_INTERRUPTIBILITY_STATE, 0);
+  append_write(out, VMCS_GUEST_ACTIVITY_STATE, 0);
+  append_write(out, VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS, 0);
+}
+
+// check whether an MSR access is intercepted by an MSR bitmap
+static bool msr_bitmap_intercepts(uint8_t const* const bitmap,
+    uint32_t const msr, bool const write) {
+  // MSRs outside of these ranges always cause a vm-exit
+  uint32_t offset;
+  if (msr <= 0x1FFF)
+    offset = 0;
+  else if (msr >= 0xC0000000 && msr <= 0xC0001FFF)
+    offset = 0x400;
+  else
+    return true;
+
+  if (write)
+    offset += 0x800;
+
+  auto const idx = msr & 0x1FFF;
+  return bitmap[offset + idx / 8] & (1 << (idx % 8));
+}
+
+// whether an L2 vm-exit should be reflected to L1 (as opposed to being
+// handled by us)
+bool should_reflect_vm_exit(vmcs12 const& vmcs, nested_exit_info const& info) {
+  // 3.27.1
+  if (info.reason.vm_entry_failure)
+    return true;
+
+  ia32_vmx_pinbased_ctls_register pin12;
+  pin12.flags = vmcs12_get(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS);
+
+  ia32_vmx_procbased_ctls_register proc12;
+  proc12.flags = vmcs12_get(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  switch (info.reason.basic_exit_reason) {
+  case VMX_EXIT_REASON_EXCEPTION_OR_NMI: {
+    vmexit_interrupt_information interrupt_info;
+    interrupt_info.flags = info.interruption_info;
+
+    // exceptions only cause vm-exits if they're in the vmcs12 bitmap
+    if (interrupt_info.interruption_type != non_maskable_interrupt)
+      return true;
+
+    return pin12.nmi_exiting;
+  }
+  case VMX_EXIT_REASON_NMI_WINDOW:
+    return proc12.nmi_window_exiting;
+  case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED:
+    // the preemption timer is never exposed to L1
+    return false;
+  case VMX_EXIT_REASON_EXECUTE_RDMSR:
+  case VMX_EXIT_REASON_EXECUTE_WRMSR:
+    if (!proc12.use_msr_bitmaps || !info.msr_bitmap)
+      return true;
+
+    return msr_bitmap_intercepts(info.msr_bitmap, info.msr,
+      info.reason.basic_exit_reason == VMX_EXIT_REASON_EXECUTE_WRMSR);
+  case VMX_EXIT_REASON_EPT_VIOLATION:
+  case VMX_EXIT_REASON_EPT_MISCONFIGURATION:
+    // EPT02 is EPT01, since L1 can't use EPT
+    return false;
+  case VMX_EXIT_REASON_MOV_CR: {
+    vmx_exit_qualification_mov_cr qualification;
+    qualification.flags = info.qualification;
+
+    switch (qualification.access_type) {
+    case VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR:
+      switch (qualification.control_register) {
+      case VMX_EXIT_QUALIFICATION_REGISTER_CR0:
+        return ((info.cr_value ^ vmcs12_get(vmcs, VMCS_CTRL_CR0_READ_SHADOW)) &
+          vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK)) != 0;
+      case VMX_EXIT_QUALIFICATION_REGISTER_CR4:
+        return ((info.cr_value ^ vmcs12_get(vmcs, VMCS_CTRL_CR4_READ_SHADOW)) &
+          vmcs12_get(vmcs, VMCS_CTRL_CR4_GUEST_HOST_MASK)) != 0;
+      case VMX_EXIT_QUALIFICATION_REGISTER_CR3: {
+        if (!proc12.cr3_load_exiting)
+          return false;
+
+        // 3.25.1.3
+        auto const count = vmcs12_get(vmcs, VMCS_CTRL_CR3_TARGET_COUNT);
+        for (uint64_t i = 0; i < count && i < 4; ++i) {
+          if (vmcs12_get(vmcs, VMCS_CTRL_CR3_TARGET_VALUE_0 + i * 2) == info.cr_value)
+            return false;
+        }
+
+        return true;
+      }
+      case VMX_EXIT_QUALIFICATION_REGISTER_CR8:
+        return proc12.cr8_load_exiting;
+      }
+      return true;
+    case VMX_EXIT_QUALIFICATION_ACCESS_MOV_FROM_CR:
+      if (qualification.control_register == VMX_EXIT_QUALIFICATION_REGISTER_CR3)
+        return proc12.cr3_store_exiting;
+      if (qualification.control_register == VMX_EXIT_QUALIFICATION_REGISTER_CR8)
+        return proc12.cr8_store_exiting;
+      return true;
+    case VMX_EXIT_QUALIFICATION_ACCESS_CLTS: {
+      // 3.25.1.3
+      auto const mask   = vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK);
+      auto const shadow = vmcs12_get(vmcs, VMCS_CTRL_CR0_READ_SHADOW);
+      return (mask & shadow & CR0_TASK_SWITCHED_FLAG) != 0;
+    }
+    case VMX_EXIT_QUALIFICATION_ACCESS_LMSW: {
+      // 3.25.1.3
+      auto const mask   = vmcs12_get(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK);
+      auto const shadow = vmcs12_get(vmcs, VMCS_CTRL_CR0_READ_SHADOW);
+      auto const value  = qualification.lmsw_source_data;
+
+      // bits 0-3 are reflected if they would change an L1-owned bit, and
+      // PE can only be set by LMSW (not cleared)
+      if ((mask & 0b1110) & (value ^ shadow))
+        return true;
+
+      return (mask & 1) && !(shadow & 1) && (value & 1);
+    }
+    }
+
+    return true;
+  }
+  default:
+    // everything else (including every VMX instruction) is handled by L1
+    return true;
+  }
+}
+
+} // namespace hv
+
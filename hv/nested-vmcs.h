@@ -0,0 +1,193 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Platform-independent parts of nested VMX: the software VMCS (vmcs12)
+// that L1 uses for its L2 guest, and the logic that merges it with our
+// own controls. Nothing in here touches hardware, so it can be compiled
+// and tested in user mode.
+//
+
+namespace hv {
+
+// number of VMCS fields that are supported in a vmcs12
+inline constexpr size_t vmcs12_field_count = 132;
+
+// VM-instruction error numbers (3.30.4)
+enum vm_instruction_error : uint32_t {
+  vm_instruction_error_none                      = 0,
+  vm_instruction_error_vmclear_invalid_address   = 2,
+  vm_instruction_error_vmclear_vmxon_pointer     = 3,
+  vm_instruction_error_vmlaunch_non_clear        = 4,
+  vm_instruction_error_vmresume_non_launched     = 5,
+  vm_instruction_error_entry_invalid_control     = 7,
+  vm_instruction_error_entry_invalid_host_state  = 8,
+  vm_instruction_error_vmptrld_invalid_address   = 9,
+  vm_instruction_error_vmptrld_vmxon_pointer     = 10,
+  vm_instruction_error_vmptrld_incorrect_rev     = 11,
+  vm_instruction_error_unsupported_field         = 12,
+  vm_instruction_error_vmwrite_read_only_field   = 13,
+  vm_instruction_error_vmxon_in_root             = 15,
+  vm_instruction_error_entry_blocked_by_mov_ss   = 26,
+  vm_instruction_error_invalid_invept_invvpid    = 28
+};
+
+// the "width" part of a VMCS field encoding (3.24.11.2)
+enum vmcs_field_width : uint8_t {
+  vmcs_field_width_16      = 0,
+  vmcs_field_width_64      = 1,
+  vmcs_field_width_32      = 2,
+  vmcs_field_width_natural = 3
+};
+
+// the "type" part of a VMCS field encoding (3.24.11.2)
+enum vmcs_field_type : uint8_t {
+  vmcs_field_type_control   = 0,
+  vmcs_field_type_exit_info = 1,
+  vmcs_field_type_guest     = 2,
+  vmcs_field_type_host      = 3
+};
+
+inline constexpr vmcs_field_width get_vmcs_field_width(uint64_t const field) {
+  return static_cast<vmcs_field_width>((field >> 13) & 0b11);
+}
+
+inline constexpr vmcs_field_type get_vmcs_field_type(uint64_t const field) {
+  return static_cast<vmcs_field_type>((field >> 10) & 0b11);
+}
+
+// software VMCS that is stored in L1 memory (in the region that L1 passes
+// to VMPTRLD). the layout is our own--only the revision ID is architectural.
+struct vmcs12 {
+  uint32_t revision_id;
+  uint32_t abort_indicator;
+
+  // whether VMLAUNCH has been executed (cleared by VMCLEAR)
+  uint32_t launched;
+  uint32_t _reserved;
+
+  // indexed by find_vmcs12_field()
+  uint64_t fields[vmcs12_field_count];
+};
+
+static_assert(sizeof(vmcs12) <= 0x1000);
+
+// every supported field, sorted by encoding
+extern uint32_t const vmcs12_fields[vmcs12_field_count];
+
+// get the index of a field in vmcs12::fields, or -1 if the field isn't supported
+int find_vmcs12_field(uint64_t field);
+
+// read a vmcs12 field (returns false if the field isn't supported)
+bool vmcs12_read(vmcs12 const& vmcs, uint64_t field, uint64_t& value);
+
+// write to a vmcs12 field (returns false if the field isn't supported).
+// this doesn't check whether the field is read-only.
+bool vmcs12_write(vmcs12& vmcs, uint64_t field, uint64_t value);
+
+// read a vmcs12 field that is known to be supported
+uint64_t vmcs12_get(vmcs12 const& vmcs, uint64_t field);
+
+// write to a vmcs12 field that is known to be supported
+void vmcs12_set(vmcs12& vmcs, uint64_t field, uint64_t value);
+
+// filter a VMX capability MSR so that L1 only sees the features that
+// nested VMX can actually emulate
+uint64_t filter_nested_vmx_msr(uint32_t msr, uint64_t value);
+
+// L0 state that is needed to build a vmcs02
+struct nested_l0_state {
+  // VMX capability MSRs (allowed 0-settings in the low 32 bits and
+  // allowed 1-settings in the high 32 bits)
+  uint64_t pin_based_cap;
+  uint64_t proc_based_cap;
+  uint64_t proc_based2_cap;
+  uint64_t exit_cap;
+  uint64_t entry_cap;
+
+  // reserved bits in CR0/CR4
+  uint64_t cr0_fixed0;
+  uint64_t cr0_fixed1;
+  uint64_t cr4_fixed0;
+  uint64_t cr4_fixed1;
+
+  // MAXPHYSADDR
+  uint64_t max_phys_addr;
+
+  // the TSC offset that is applied to L1
+  uint64_t tsc_offset;
+
+  // the EPT pointer that is used for L1
+  uint64_t eptp;
+
+  // physical address of the merged MSR bitmap
+  uint64_t msr_bitmap;
+
+  // VPID that is used for every L2 guest
+  uint16_t vpid;
+
+  // current L1 values for state that vmcs02 always loads on vm-entry
+  uint64_t efer;
+  uint64_t pat;
+  uint64_t debugctl;
+  uint64_t dr7;
+  uint64_t perf_global_ctrl;
+};
+
+// a single VMCS write
+struct vmcs_field_value {
+  uint32_t field;
+  uint64_t value;
+};
+
+// maximum number of writes that are needed to build a vmcs02 or to
+// load the L1 host state after a nested vm-exit
+inline constexpr size_t max_vmcs_writes = 128;
+
+struct vmcs_write_list {
+  size_t count;
+  vmcs_field_value writes[max_vmcs_writes];
+};
+
+// check the vmcs12 controls and host-state area before a nested vm-entry.
+// returns the VM-instruction error, or vm_instruction_error_none.
+vm_instruction_error check_vmcs12(vmcs12 const& vmcs, nested_l0_state const& l0);
+
+// build the field writes for vmcs02 (controls and guest state)
+void merge_vmcs02(vmcs12 const& vmcs, nested_l0_state const& l0, vmcs_write_list& out);
+
+// fields that need to be copied from vmcs02 into vmcs12 on a nested vm-exit
+extern uint32_t const vmcs02_exit_fields[];
+extern size_t const vmcs02_exit_field_count;
+
+// update vmcs12 after a nested vm-exit (exit_state contains the values of
+// vmcs02_exit_fields) and build the field writes that load L1 host state
+// into vmcs01
+void reflect_vmcs12_exit(vmcs12& vmcs, vmcs12 const& exit_state,
+  nested_l0_state const& l0, vmcs_write_list& out);
+
+// information about an L2 vm-exit that is needed to decide who handles it
+struct nested_exit_info {
+  vmx_vmexit_reason reason;
+  uint64_t qualification;
+
+  // VM-exit interruption information (exceptions and NMIs)
+  uint32_t interruption_info;
+
+  // RDMSR/WRMSR
+  uint32_t msr;
+
+  // source operand of MOV to CR
+  uint64_t cr_value;
+
+  // L1 MSR bitmap (null if the address is invalid)
+  uint8_t const* msr_bitmap;
+};
+
+// whether an L2 vm-exit should be reflected to L1 (as opposed to being
+// handled by us)
+bool should_reflect_vm_exit(vmcs12 const& vmcs, nested_exit_info const& info);
+
+} // namespace hv
+
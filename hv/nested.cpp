@@ -0,0 +1,1020 @@
+#include "nested.h"
+#include "exception-routines.h"
+#include "exit-dispatch.h"
+#include "page-tables.h"
+#include "vcpu.h"
+#include "vmx.h"
+#include "mm.h"
+
+namespace hv {
+
+// TODO: move to ia32?
+// VM-exit instruction-information field for VMX instructions (3.27.2.5)
+union vmx_instruction_info {
+  uint32_t flags;
+
+  struct {
+    uint32_t scaling       : 2;
+    uint32_t _reserved1    : 1;
+    uint32_t reg1          : 4;
+    uint32_t address_size  : 3;
+    uint32_t register_operand : 1;
+    uint32_t _reserved2    : 4;
+    uint32_t segment       : 3;
+    uint32_t index_reg     : 4;
+    uint32_t index_invalid : 1;
+    uint32_t base_reg      : 4;
+    uint32_t base_invalid  : 1;
+    uint32_t reg2          : 4;
+  };
+};
+
+static_assert(sizeof(vmx_instruction_info) == 4);
+
+// get a pointer to L1 physical memory (L1 physical addresses are the same
+// as host physical addresses), or null if the range isn't mapped
+static uint8_t* get_l1_phys_ptr(uint64_t const address, uint64_t const size) {
+  constexpr uint64_t limit = host_physical_memory_pd_count << 30;
+
+  if (address >= limit || size > limit - address)
+    return nullptr;
+
+  return host_physical_memory_base + address;
+}
+
+// check whether a VMXON/VMCS pointer is valid (3.30.3)
+static bool is_valid_vmx_pointer(vcpu const* const cpu, uint64_t const address) {
+  return (address & 0xFFF) == 0 && !(address >> cpu->cached.max_phys_addr) &&
+    get_l1_phys_ptr(address, sizeof(vmcs12));
+}
+
+// calculate the linear address of a VMX instruction memory operand (3.27.2.5)
+static uint64_t get_vmx_operand_address(vcpu const* const cpu,
+    vmx_instruction_info const info) {
+  // the displacement is stored in the exit qualification
+  auto address = vmx_vmread(VMCS_EXIT_QUALIFICATION);
+
+  if (!info.base_invalid)
+    address += read_guest_gpr(cpu->ctx, info.base_reg);
+
+  if (!info.index_invalid)
+    address += read_guest_gpr(cpu->ctx, info.index_reg) << info.scaling;
+
+  // 16-bit or 32-bit address size
+  if (info.address_size == 0)
+    address &= 0xFFFF;
+  else if (info.address_size == 1)
+    address &= 0xFFFF'FFFF;
+
+  vmx_segment_access_rights cs;
+  cs.flags = static_cast<uint32_t>(vmx_vmread(VMCS_GUEST_CS_ACCESS_RIGHTS));
+
+  // segment bases are ignored in 64-bit mode (except for FS and GS)
+  if (!cs.long_mode || info.segment >= 4)
+    address += vmx_vmread(VMCS_GUEST_ES_BASE + info.segment * 2);
+
+  return address;
+}
+
+// copy between guest virtual memory (in the current address space) and a
+// hypervisor buffer. a #PF is injected into the guest if this fails.
+static bool copy_guest_memory(vcpu* const cpu, uint64_t const address,
+    void* const buffer, size_t const size, bool const write) {
+  size_t bytes_copied = 0;
+
+  while (bytes_copied < size) {
+    auto const gva = reinterpret_cast<uint8_t*>(address + bytes_copied);
+
+    size_t remaining = 0;
+    auto const hva = gva2hva(gva, &remaining, &cpu->exit_capture);
+
+    if (!hva) {
+      cpu->ctx->cr2 = reinterpret_cast<uint64_t>(gva);
+
+      page_fault_exception error;
+      error.flags            = 0;
+      error.present          = 0;
+      error.write            = write;
+      error.user_mode_access = (current_guest_cpl() == 3);
+
+      inject_hw_exception(page_fault, error.flags);
+      return false;
+    }
+
+    auto const curr_size = min(remaining, size - bytes_copied);
+    auto const curr_buffer = static_cast<uint8_t*>(buffer) + bytes_copied;
+
+    host_exception_info e;
+    if (write)
+      memcpy_safe(e, hva, curr_buffer, curr_size);
+    else
+      memcpy_safe(e, curr_buffer, hva, curr_size);
+
+    if (e.exception_occurred) {
+      inject_hw_exception(general_protection, 0);
+      return false;
+    }
+
+    bytes_copied += curr_size;
+  }
+
+  return true;
+}
+
+// read the memory operand of a VMX instruction
+static bool read_vmx_operand(vcpu* const cpu, void* const buffer, size_t const size) {
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  return copy_guest_memory(cpu, get_vmx_operand_address(cpu, info), buffer, size, false);
+}
+
+// 3.30.2
+static void vmx_succeed() {
+  rflags rflags;
+  rflags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+  rflags.carry_flag           = 0;
+  rflags.parity_flag          = 0;
+  rflags.auxiliary_carry_flag = 0;
+  rflags.zero_flag            = 0;
+  rflags.sign_flag            = 0;
+  rflags.overflow_flag        = 0;
+  vmx_vmwrite(VMCS_GUEST_RFLAGS, rflags.flags);
+
+  skip_instruction();
+}
+
+// 3.30.2
+static void vmx_fail_invalid() {
+  rflags rflags;
+  rflags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+  rflags.carry_flag           = 1;
+  rflags.parity_flag          = 0;
+  rflags.auxiliary_carry_flag = 0;
+  rflags.zero_flag            = 0;
+  rflags.sign_flag            = 0;
+  rflags.overflow_flag        = 0;
+  vmx_vmwrite(VMCS_GUEST_RFLAGS, rflags.flags);
+
+  skip_instruction();
+}
+
+// write to a vmcs12 field and to the shadow VMCS (if the field is shadowed)
+static void write_vmcs12_field(vcpu* const cpu, uint64_t const field, uint64_t const value) {
+  auto& nested = cpu->nested;
+
+  vmcs12_set(nested.cached_vmcs12, field, value);
+
+  auto const idx = find_vmcs12_field(field);
+  if (idx < 0 || !nested.shadowed[idx])
+    return;
+
+  vmx_vmptrld(nested.shadow_vmcs_phys);
+  vmx_vmwrite(field, value);
+  vmx_vmptrld(nested.vmcs01_phys);
+}
+
+// VMfailValid if there is a current VMCS, VMfailInvalid otherwise (3.30.2)
+static void vmx_fail(vcpu* const cpu, vm_instruction_error const error) {
+  if (cpu->nested.current_vmcs12 == ~0ull) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  write_vmcs12_field(cpu, VMCS_VM_INSTRUCTION_ERROR, error);
+
+  rflags rflags;
+  rflags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+  rflags.carry_flag           = 0;
+  rflags.parity_flag          = 0;
+  rflags.auxiliary_carry_flag = 0;
+  rflags.zero_flag            = 1;
+  rflags.sign_flag            = 0;
+  rflags.overflow_flag        = 0;
+  vmx_vmwrite(VMCS_GUEST_RFLAGS, rflags.flags);
+
+  skip_instruction();
+}
+
+// checks that are common to every VMX instruction other than VMXON. returns
+// false if an exception was injected.
+static bool check_vmx_operation(vcpu* const cpu) {
+  if (!cpu->nested.vmxon) {
+    inject_hw_exception(invalid_opcode);
+    return false;
+  }
+
+  if (current_guest_cpl() != 0) {
+    inject_hw_exception(general_protection, 0);
+    return false;
+  }
+
+  return true;
+}
+
+// copy the shadowed fields from the shadow VMCS into the cached vmcs12
+static void sync_shadow_to_cache(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  if (!nested.vmcs_shadowing || nested.current_vmcs12 == ~0ull)
+    return;
+
+  vmx_vmptrld(nested.shadow_vmcs_phys);
+
+  for (size_t i = 0; i < vmcs12_field_count; ++i) {
+    if (nested.shadowed[i])
+      nested.cached_vmcs12.fields[i] = vmx_vmread(vmcs12_fields[i]);
+  }
+
+  vmx_vmptrld(nested.vmcs01_phys);
+}
+
+// copy the shadowed fields from the cached vmcs12 into the shadow VMCS
+static void sync_cache_to_shadow(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  if (!nested.vmcs_shadowing || nested.current_vmcs12 == ~0ull)
+    return;
+
+  vmx_vmptrld(nested.shadow_vmcs_phys);
+
+  for (size_t i = 0; i < vmcs12_field_count; ++i) {
+    if (nested.shadowed[i])
+      vmx_vmwrite(vmcs12_fields[i], nested.cached_vmcs12.fields[i]);
+  }
+
+  vmx_vmptrld(nested.vmcs01_phys);
+}
+
+// enable VMCS shadowing in vmcs01 while L1 has a current VMCS. VMREAD and
+// VMWRITE always cause vm-exits otherwise.
+static void update_vmcs_link(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  auto const enable = nested.vmcs_shadowing && nested.current_vmcs12 != ~0ull;
+
+  auto ctrl = read_ctrl_proc_based2();
+  ctrl.vmcs_shadowing = enable;
+  write_ctrl_proc_based2(ctrl);
+
+  vmx_vmwrite(VMCS_GUEST_VMCS_LINK_POINTER, enable ? nested.shadow_vmcs_phys : ~0ull);
+}
+
+// write the cached vmcs12 back into L1 memory and make it non-current
+static void flush_current_vmcs12(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  if (nested.current_vmcs12 == ~0ull)
+    return;
+
+  sync_shadow_to_cache(cpu);
+
+  host_exception_info e;
+  memcpy_safe(e, get_l1_phys_ptr(nested.current_vmcs12, sizeof(vmcs12)),
+    &nested.cached_vmcs12, sizeof(vmcs12));
+
+  nested.current_vmcs12 = ~0ull;
+  update_vmcs_link(cpu);
+}
+
+// fill in the L0 state that changes between nested vm-entries
+static void update_l0_state(vcpu* const cpu) {
+  auto& l0 = cpu->nested.l0;
+
+  l0.tsc_offset       = cpu->tsc_offset;
+  l0.efer             = __readmsr(IA32_EFER);
+  l0.pat              = vmx_vmread(VMCS_GUEST_PAT);
+  l0.debugctl         = vmx_vmread(VMCS_GUEST_DEBUGCTL);
+  l0.dr7              = vmx_vmread(VMCS_GUEST_DR7);
+  l0.perf_global_ctrl = cpu->msr_exit_store_count > 0
+    ? cpu->msr_exit_store.perf_global_ctrl.msr_data
+    : vmx_vmread(VMCS_GUEST_PERF_GLOBAL_CTRL);
+}
+
+// process an L1 vm-entry/vm-exit MSR list. returns the number of entries
+// that were successfully processed.
+static uint32_t process_l1_msr_list(uint64_t const address,
+    uint32_t const count, bool const store) {
+  auto const entries = reinterpret_cast<vmx_msr_entry*>(
+    get_l1_phys_ptr(address, count * sizeof(vmx_msr_entry)));
+
+  if (!entries)
+    return 0;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    auto& entry = entries[i];
+
+    // 3.26.4, 3.27.4
+    if (entry._reserved != 0 || entry.msr_idx == IA32_FS_BASE ||
+        entry.msr_idx == IA32_GS_BASE || (entry.msr_idx >> 8) == 0x8)
+      return i;
+
+    host_exception_info e;
+
+    if (store)
+      entry.msr_data = rdmsr_safe(e, entry.msr_idx);
+    else
+      wrmsr_safe(e, entry.msr_idx, entry.msr_data);
+
+    if (e.exception_occurred)
+      return i;
+  }
+
+  return count;
+}
+
+// read the vmcs02 fields that are needed for a nested vm-exit
+static void read_vmcs02_exit_state(vmcs12& exit_state) {
+  for (size_t i = 0; i < vmcs02_exit_field_count; ++i)
+    vmcs12_set(exit_state, vmcs02_exit_fields[i], vmx_vmread(vmcs02_exit_fields[i]));
+}
+
+// perform a nested vm-exit: save the L2 state into vmcs12 and load the L1
+// host state into vmcs01 (which becomes the current VMCS)
+static void nested_vm_exit(vcpu* const cpu, vmcs12 const& exit_state) {
+  auto& nested = cpu->nested;
+  auto& vmcs   = nested.cached_vmcs12;
+
+  if (nested.in_l2) {
+    vmx_vmptrld(nested.vmcs01_phys);
+    nested.in_l2 = false;
+  }
+
+  reflect_vmcs12_exit(vmcs, exit_state, nested.l0, nested.writes);
+
+  for (size_t i = 0; i < nested.writes.count; ++i)
+    vmx_vmwrite(nested.writes.writes[i].field, nested.writes.writes[i].value);
+
+  ia32_vmx_exit_ctls_register exit_ctrl;
+  exit_ctrl.flags = vmcs12_get(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+
+  // 3.27.4
+  process_l1_msr_list(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS),
+    static_cast<uint32_t>(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_STORE_COUNT)), true);
+
+  // IA32_EFER isn't part of vmcs01, so it needs to be loaded manually. we
+  // can't change LME/LMA since we're running with paging enabled.
+  auto efer = exit_ctrl.load_ia32_efer ? vmcs12_get(vmcs, VMCS_HOST_EFER) : nested.l1_efer;
+  efer = (efer & ~(IA32_EFER_IA32E_MODE_ENABLE_FLAG | IA32_EFER_IA32E_MODE_ACTIVE_FLAG)) |
+    (__readmsr(IA32_EFER) & (IA32_EFER_IA32E_MODE_ENABLE_FLAG | IA32_EFER_IA32E_MODE_ACTIVE_FLAG));
+  __writemsr(IA32_EFER, efer);
+
+  // hide_vm_exit_overhead() loads PERF_GLOBAL_CTRL from the MSR store area
+  if (exit_ctrl.load_ia32_perf_global_ctrl)
+    cpu->msr_exit_store.perf_global_ctrl.msr_data = vmcs12_get(vmcs, VMCS_HOST_PERF_GLOBAL_CTRL);
+
+  // 3.28.6 (failures should cause a VMX abort, but we just ignore them)
+  process_l1_msr_list(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_LOAD_ADDRESS),
+    static_cast<uint32_t>(vmcs12_get(vmcs, VMCS_CTRL_VMEXIT_MSR_LOAD_COUNT)), false);
+
+  sync_cache_to_shadow(cpu);
+}
+
+// build the merged MSR bitmap for vmcs02
+static void merge_msr_bitmap(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  ia32_vmx_procbased_ctls_register proc12;
+  proc12.flags = vmcs12_get(nested.cached_vmcs12, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  auto const dst = reinterpret_cast<uint64_t*>(&nested.msr_bitmap02);
+  auto const l0  = reinterpret_cast<uint64_t const*>(&cpu->msr_bitmap);
+  auto const l1  = reinterpret_cast<uint64_t const*>(proc12.use_msr_bitmaps ?
+    get_l1_phys_ptr(vmcs12_get(nested.cached_vmcs12, VMCS_CTRL_MSR_BITMAP_ADDRESS), 0x1000) : nullptr);
+
+  // every MSR exits if L1 doesn't use MSR bitmaps
+  for (size_t i = 0; i < sizeof(vmx_msr_bitmap) / 8; ++i)
+    dst[i] = l0[i] | (l1 ? l1[i] : ~0ull);
+}
+
+// emulate VMLAUNCH or VMRESUME
+static void emulate_nested_vm_entry(vcpu* const cpu, bool const launch) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  auto& nested = cpu->nested;
+  auto& vmcs   = nested.cached_vmcs12;
+
+  if (nested.current_vmcs12 == ~0ull) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  if (read_interruptibility_state().blocking_by_mov_ss) {
+    vmx_fail(cpu, vm_instruction_error_entry_blocked_by_mov_ss);
+    return;
+  }
+
+  sync_shadow_to_cache(cpu);
+
+  if (launch && vmcs.launched) {
+    vmx_fail(cpu, vm_instruction_error_vmlaunch_non_clear);
+    return;
+  }
+
+  if (!launch && !vmcs.launched) {
+    vmx_fail(cpu, vm_instruction_error_vmresume_non_launched);
+    return;
+  }
+
+  // our EPT hooks (this includes syscall tracing) and counted functions
+  // are handled as if L1 was running: the VMCALL at a traced syscall entry
+  // would be reflected into L1, and call counting compares L1 addresses
+  // against the L2 RIP. refuse the entry instead of breaking them.
+  if (cpu->ept.hooks.active_list_head || cpu->call_counter.function_count > 0) {
+    vmx_fail(cpu, vm_instruction_error_entry_invalid_control);
+    return;
+  }
+
+  update_l0_state(cpu);
+
+  if (auto const error = check_vmcs12(vmcs, nested.l0)) {
+    vmx_fail(cpu, error);
+    return;
+  }
+
+  // L1 continues at the host RIP after the next nested vm-exit, so there
+  // is no need to skip the instruction
+  nested.l1_efer = nested.l0.efer;
+
+  // 3.26.4
+  auto const msr_count = static_cast<uint32_t>(
+    vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT));
+  auto const msr_loaded = process_l1_msr_list(
+    vmcs12_get(vmcs, VMCS_CTRL_VMENTRY_MSR_LOAD_ADDRESS), msr_count, false);
+
+  if (msr_loaded != msr_count) {
+    vmx_vmexit_reason reason;
+    reason.flags             = 0;
+    reason.basic_exit_reason = VMX_EXIT_REASON_ERROR_MSR_LOAD;
+    reason.vm_entry_failure  = 1;
+
+    // 3.26.4 (the exit qualification is the index of the failing entry + 1)
+    vmcs12_set(nested.exit_state, VMCS_EXIT_REASON, reason.flags);
+    vmcs12_set(nested.exit_state, VMCS_EXIT_QUALIFICATION, msr_loaded + 1);
+
+    nested_vm_exit(cpu, nested.exit_state);
+    return;
+  }
+
+  merge_msr_bitmap(cpu);
+  merge_vmcs02(vmcs, nested.l0, nested.writes);
+
+  // vmcs02 is rebuilt from scratch on every nested vm-entry, which means
+  // that the first entry after this needs VMLAUNCH (see handle_vm_exit())
+  vmx_vmclear(nested.vmcs02_phys);
+  vmx_vmptrld(nested.vmcs02_phys);
+  nested.vmcs02_launched = false;
+  nested.nmi_window02    = false;
+
+  for (size_t i = 0; i < nested.host_state.count; ++i)
+    vmx_vmwrite(nested.host_state.writes[i].field, nested.host_state.writes[i].value);
+
+  for (size_t i = 0; i < nested.writes.count; ++i)
+    vmx_vmwrite(nested.writes.writes[i].field, nested.writes.writes[i].value);
+
+  ia32_vmx_procbased_ctls_register proc12;
+  proc12.flags = vmcs12_get(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  ia32_vmx_procbased_ctls2_register proc2_12;
+  proc2_12.flags = proc12.activate_secondary_controls ?
+    vmcs12_get(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS) : 0;
+
+  // every L2 guest shares the same VPID, so the TLB needs to be flushed
+  // whenever L1 switches between VPIDs (or doesn't use VPIDs at all)
+  auto const vpid12 = static_cast<uint16_t>(proc2_12.enable_vpid ?
+    vmcs12_get(vmcs, VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER) : 0);
+
+  if (vpid12 == 0 || vpid12 != nested.last_vpid12) {
+    invvpid_descriptor desc;
+    desc.linear_address = 0;
+    desc.reserved1      = 0;
+    desc.reserved2      = 0;
+    desc.vpid           = nested_guest_vpid;
+    vmx_invvpid(invvpid_single_context, desc);
+  }
+
+  nested.last_vpid12 = vpid12;
+
+  vmcs.launched = 1;
+  nested.in_l2  = true;
+}
+
+// initialize nested VMX for the current VCPU (vmcs01 must be the current VMCS)
+void prepare_nested_vmx(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  nested.vmcs01_phys       = MmGetPhysicalAddress(&cpu->vmcs).QuadPart;
+  nested.shadow_vmcs_phys  = MmGetPhysicalAddress(&nested.shadow_vmcs).QuadPart;
+  nested.vmcs02_phys       = MmGetPhysicalAddress(&nested.vmcs02).QuadPart;
+  nested.msr_bitmap02_phys = MmGetPhysicalAddress(&nested.msr_bitmap02).QuadPart;
+  nested.current_vmcs12    = ~0ull;
+
+  ia32_vmx_basic_register vmx_basic;
+  vmx_basic.flags = __readmsr(IA32_VMX_BASIC);
+
+  // 3.24.2
+  nested.shadow_vmcs.revision_id           = vmx_basic.vmcs_revision_id;
+  nested.shadow_vmcs.shadow_vmcs_indicator = 1;
+  nested.vmcs02.revision_id                = vmx_basic.vmcs_revision_id;
+  nested.vmcs02.shadow_vmcs_indicator      = 0;
+
+  ia32_vmx_procbased_ctls2_register proc2_allowed1;
+  proc2_allowed1.flags = __readmsr(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+  // every VMREAD/VMWRITE causes a vm-exit unless the field is shadowed
+  memset(nested.vmread_bitmap,  0xFF, sizeof(nested.vmread_bitmap));
+  memset(nested.vmwrite_bitmap, 0xFF, sizeof(nested.vmwrite_bitmap));
+
+  nested.vmcs_shadowing = proc2_allowed1.vmcs_shadowing &&
+    vmx_vmclear(nested.shadow_vmcs_phys) && vmx_vmptrld(nested.shadow_vmcs_phys);
+
+  if (nested.vmcs_shadowing) {
+    // 3.24.6.15
+    // a field can be shadowed if the CPU lets us write to it (read-only
+    // fields can only be written if IA32_VMX_MISC[29] is set)
+    for (size_t i = 0; i < vmcs12_field_count; ++i) {
+      auto const field = vmcs12_fields[i];
+
+      nested.shadowed[i] = (__vmx_vmwrite(field, 0) == 0);
+
+      if (!nested.shadowed[i])
+        continue;
+
+      nested.vmread_bitmap[(field & 0x7FFF) / 8] &= ~(1 << (field % 8));
+
+      // L1 can never write to read-only fields
+      if (get_vmcs_field_type(field) != vmcs_field_type_exit_info)
+        nested.vmwrite_bitmap[(field & 0x7FFF) / 8] &= ~(1 << (field % 8));
+    }
+
+    vmx_vmptrld(nested.vmcs01_phys);
+
+    vmx_vmwrite(VMCS_CTRL_VMREAD_BITMAP_ADDRESS,
+      MmGetPhysicalAddress(&nested.vmread_bitmap).QuadPart);
+    vmx_vmwrite(VMCS_CTRL_VMWRITE_BITMAP_ADDRESS,
+      MmGetPhysicalAddress(&nested.vmwrite_bitmap).QuadPart);
+  }
+
+  update_vmcs_link(cpu);
+
+  // our host-state area is shared between vmcs01 and vmcs02, except that
+  // vmcs02 also loads IA32_EFER on vm-exit
+  nested.host_state.count = 0;
+  for (auto const field : vmcs12_fields) {
+    if (get_vmcs_field_type(field) != vmcs_field_type_host)
+      continue;
+
+    auto const value = (field == VMCS_HOST_EFER) ? __readmsr(IA32_EFER) : vmx_vmread(field);
+    nested.host_state.writes[nested.host_state.count++] = { field, value };
+  }
+
+  auto& l0 = nested.l0;
+
+  auto const true_ctls = vmx_basic.vmx_controls;
+  l0.pin_based_cap   = filter_nested_vmx_msr(IA32_VMX_PINBASED_CTLS,
+    __readmsr(true_ctls ? IA32_VMX_TRUE_PINBASED_CTLS : IA32_VMX_PINBASED_CTLS));
+  l0.proc_based_cap  = filter_nested_vmx_msr(IA32_VMX_PROCBASED_CTLS,
+    __readmsr(true_ctls ? IA32_VMX_TRUE_PROCBASED_CTLS : IA32_VMX_PROCBASED_CTLS));
+  l0.proc_based2_cap = filter_nested_vmx_msr(IA32_VMX_PROCBASED_CTLS2,
+    __readmsr(IA32_VMX_PROCBASED_CTLS2));
+  l0.exit_cap        = filter_nested_vmx_msr(IA32_VMX_EXIT_CTLS,
+    __readmsr(true_ctls ? IA32_VMX_TRUE_EXIT_CTLS : IA32_VMX_EXIT_CTLS));
+  l0.entry_cap       = filter_nested_vmx_msr(IA32_VMX_ENTRY_CTLS,
+    __readmsr(true_ctls ? IA32_VMX_TRUE_ENTRY_CTLS : IA32_VMX_ENTRY_CTLS));
+
+  l0.cr0_fixed0    = cpu->cached.vmx_cr0_fixed0;
+  l0.cr0_fixed1    = cpu->cached.vmx_cr0_fixed1;
+  l0.cr4_fixed0    = cpu->cached.vmx_cr4_fixed0;
+  l0.cr4_fixed1    = cpu->cached.vmx_cr4_fixed1;
+  l0.max_phys_addr = cpu->cached.max_phys_addr;
+  l0.eptp          = vmx_vmread(VMCS_CTRL_EPT_POINTER);
+  l0.msr_bitmap    = nested.msr_bitmap02_phys;
+  l0.vpid          = nested_guest_vpid;
+}
+
+// request (or stop requesting) an NMI-window vm-exit in vmcs02 for queued
+// NMIs. NMI-window vm-exits that L1 requested itself are left alone, and
+// are reflected by should_reflect_vm_exit().
+static void set_nmi_window02(vcpu* const cpu, bool const enabled) {
+  auto& nested = cpu->nested;
+
+  if (nested.nmi_window02 == enabled)
+    return;
+
+  ia32_vmx_procbased_ctls_register proc12;
+  proc12.flags = vmcs12_get(nested.cached_vmcs12,
+    VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.nmi_window_exiting = enabled || proc12.nmi_window_exiting;
+  write_ctrl_proc_based(ctrl);
+
+  nested.nmi_window02 = enabled;
+}
+
+// called for every vm-exit that occurs while L2 is running. returns true if
+// the vm-exit was reflected into L1 (and vmcs01 is the current VMCS again).
+bool handle_l2_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto& nested = cpu->nested;
+  auto const& vmcs = nested.cached_vmcs12;
+
+  nested_exit_info info;
+  info.reason            = reason;
+  info.qualification     = vmx_vmread(VMCS_EXIT_QUALIFICATION);
+  info.interruption_info = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INTERRUPTION_INFORMATION));
+  info.msr               = cpu->ctx->ecx;
+  info.cr_value          = 0;
+  info.msr_bitmap        = get_l1_phys_ptr(vmcs12_get(vmcs, VMCS_CTRL_MSR_BITMAP_ADDRESS), 0x1000);
+
+  if (reason.basic_exit_reason == VMX_EXIT_REASON_MOV_CR) {
+    vmx_exit_qualification_mov_cr qualification;
+    qualification.flags = info.qualification;
+    info.cr_value = read_guest_gpr(cpu->ctx, qualification.general_purpose_register);
+  }
+
+  if (should_reflect_vm_exit(vmcs, info)) {
+    read_vmcs02_exit_state(nested.exit_state);
+    nested_vm_exit(cpu, nested.exit_state);
+    return true;
+  }
+
+  // the vm-exit was caused by one of our controls, so handle it on vmcs02
+  dispatch_vm_exit(cpu, reason);
+
+  // our CR3 emulation flushes the L1 VPID, not the L2 one
+  if (reason.basic_exit_reason == VMX_EXIT_REASON_MOV_CR) {
+    invvpid_descriptor desc;
+    desc.linear_address = 0;
+    desc.reserved1      = 0;
+    desc.reserved2      = 0;
+    desc.vpid           = nested_guest_vpid;
+    vmx_invvpid(invvpid_single_context_retaining_globals, desc);
+  }
+
+  if (cpu->queued_nmis == 0) {
+    set_nmi_window02(cpu, false);
+    return false;
+  }
+
+  vmentry_interrupt_information pending_event;
+  pending_event.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
+
+  vmexit_interrupt_information idt_vectoring;
+  idt_vectoring.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_IDT_VECTORING_INFORMATION));
+
+  ia32_vmx_pinbased_ctls_register pin12;
+  pin12.flags = vmcs12_get(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS);
+
+  // the pin-based controls of vmcs02 are L1's, so NMI-window exiting can
+  // only be used if L1 uses virtual NMIs. otherwise, NMIs are retried on
+  // the next L2 vm-exit if they can't be delivered now.
+  if (pending_event.valid || idt_vectoring.valid) {
+    set_nmi_window02(cpu, pin12.virtual_nmi);
+    return false;
+  }
+
+  set_nmi_window02(cpu, false);
+
+  // reflect the NMI as a vm-exit if L1 intercepts NMIs
+  if (pin12.nmi_exiting) {
+    --cpu->queued_nmis;
+
+    read_vmcs02_exit_state(nested.exit_state);
+
+    vmx_vmexit_reason nmi_reason;
+    nmi_reason.flags             = 0;
+    nmi_reason.basic_exit_reason = VMX_EXIT_REASON_EXCEPTION_OR_NMI;
+
+    vmexit_interrupt_information nmi_info;
+    nmi_info.flags             = 0;
+    nmi_info.vector            = nmi;
+    nmi_info.interruption_type = non_maskable_interrupt;
+    nmi_info.valid             = 1;
+
+    vmcs12_set(nested.exit_state, VMCS_EXIT_REASON, nmi_reason.flags);
+    vmcs12_set(nested.exit_state, VMCS_EXIT_QUALIFICATION, 0);
+    vmcs12_set(nested.exit_state, VMCS_VMEXIT_INTERRUPTION_INFORMATION, nmi_info.flags);
+    vmcs12_set(nested.exit_state, VMCS_VMEXIT_INSTRUCTION_LENGTH, 0);
+
+    nested_vm_exit(cpu, nested.exit_state);
+    return true;
+  }
+
+  auto const state = read_interruptibility_state();
+
+  if (!state.blocking_by_nmi && !state.blocking_by_mov_ss && !state.blocking_by_sti) {
+    --cpu->queued_nmis;
+    inject_nmi();
+  }
+
+  return false;
+}
+
+// RDMSR handler for the VMX capability MSRs
+bool read_nested_vmx_msr(vcpu*, uint32_t const msr, uint64_t& value) {
+  host_exception_info e;
+  value = rdmsr_safe(e, msr);
+
+  if (e.exception_occurred)
+    return false;
+
+  value = filter_nested_vmx_msr(msr, value);
+  return true;
+}
+
+void emulate_nested_vmxon(vcpu* const cpu) {
+  auto& nested = cpu->nested;
+
+  // 3.30.3
+  if (!read_effective_guest_cr4().vmx_enable) {
+    inject_hw_exception(invalid_opcode);
+    return;
+  }
+
+  if (current_guest_cpl() != 0) {
+    inject_hw_exception(general_protection, 0);
+    return;
+  }
+
+  if (nested.vmxon) {
+    vmx_fail(cpu, vm_instruction_error_vmxon_in_root);
+    return;
+  }
+
+  // the guest needs to satisfy the same CR0/CR4 restrictions that we do
+  auto const cr0 = read_effective_guest_cr0().flags;
+  auto const cr4 = read_effective_guest_cr4().flags;
+
+  if ((cr0 & cpu->cached.vmx_cr0_fixed0) != cpu->cached.vmx_cr0_fixed0 ||
+      (cr0 & ~cpu->cached.vmx_cr0_fixed1) ||
+      (cr4 & cpu->cached.vmx_cr4_fixed0) != cpu->cached.vmx_cr4_fixed0 ||
+      (cr4 & ~cpu->cached.vmx_cr4_fixed1)) {
+    inject_hw_exception(general_protection, 0);
+    return;
+  }
+
+  uint64_t vmxon_ptr = 0;
+  if (!read_vmx_operand(cpu, &vmxon_ptr, sizeof(vmxon_ptr)))
+    return;
+
+  if (!is_valid_vmx_pointer(cpu, vmxon_ptr)) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  ia32_vmx_basic_register vmx_basic;
+  vmx_basic.flags = __readmsr(IA32_VMX_BASIC);
+
+  // the revision ID is the only architectural part of the VMXON region
+  if (*reinterpret_cast<uint32_t const*>(get_l1_phys_ptr(vmxon_ptr, 4))
+      != vmx_basic.vmcs_revision_id) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  nested.vmxon          = true;
+  nested.vmxon_ptr      = vmxon_ptr;
+  nested.current_vmcs12 = ~0ull;
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmxoff(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  flush_current_vmcs12(cpu);
+  cpu->nested.vmxon = false;
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmclear(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  auto& nested = cpu->nested;
+
+  uint64_t vmcs_ptr = 0;
+  if (!read_vmx_operand(cpu, &vmcs_ptr, sizeof(vmcs_ptr)))
+    return;
+
+  if (!is_valid_vmx_pointer(cpu, vmcs_ptr)) {
+    vmx_fail(cpu, vm_instruction_error_vmclear_invalid_address);
+    return;
+  }
+
+  if (vmcs_ptr == nested.vmxon_ptr) {
+    vmx_fail(cpu, vm_instruction_error_vmclear_vmxon_pointer);
+    return;
+  }
+
+  if (vmcs_ptr == nested.current_vmcs12) {
+    nested.cached_vmcs12.launched = 0;
+    flush_current_vmcs12(cpu);
+  } else {
+    // only the launch state needs to be initialized
+    reinterpret_cast<vmcs12*>(get_l1_phys_ptr(vmcs_ptr, sizeof(vmcs12)))->launched = 0;
+  }
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmptrld(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  auto& nested = cpu->nested;
+
+  uint64_t vmcs_ptr = 0;
+  if (!read_vmx_operand(cpu, &vmcs_ptr, sizeof(vmcs_ptr)))
+    return;
+
+  if (!is_valid_vmx_pointer(cpu, vmcs_ptr)) {
+    vmx_fail(cpu, vm_instruction_error_vmptrld_invalid_address);
+    return;
+  }
+
+  if (vmcs_ptr == nested.vmxon_ptr) {
+    vmx_fail(cpu, vm_instruction_error_vmptrld_vmxon_pointer);
+    return;
+  }
+
+  auto const region = reinterpret_cast<vmcs12 const*>(
+    get_l1_phys_ptr(vmcs_ptr, sizeof(vmcs12)));
+
+  ia32_vmx_basic_register vmx_basic;
+  vmx_basic.flags = __readmsr(IA32_VMX_BASIC);
+
+  // shadow VMCSs aren't supported (bit 31 is the shadow-VMCS indicator)
+  if (region->revision_id != vmx_basic.vmcs_revision_id) {
+    vmx_fail(cpu, vm_instruction_error_vmptrld_incorrect_rev);
+    return;
+  }
+
+  if (vmcs_ptr != nested.current_vmcs12) {
+    flush_current_vmcs12(cpu);
+
+    host_exception_info e;
+    memcpy_safe(e, &nested.cached_vmcs12, region, sizeof(vmcs12));
+
+    nested.current_vmcs12 = vmcs_ptr;
+
+    sync_cache_to_shadow(cpu);
+    update_vmcs_link(cpu);
+  }
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmptrst(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  auto vmcs_ptr = cpu->nested.current_vmcs12;
+  if (!copy_guest_memory(cpu, get_vmx_operand_address(cpu, info),
+      &vmcs_ptr, sizeof(vmcs_ptr), true))
+    return;
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmread(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  auto& nested = cpu->nested;
+
+  if (nested.current_vmcs12 == ~0ull) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  // fields that cause vm-exits aren't in the shadow VMCS, so the cached
+  // vmcs12 is always up-to-date for them
+  uint64_t value = 0;
+  if (!vmcs12_read(nested.cached_vmcs12, read_guest_gpr(cpu->ctx, info.reg2), value)) {
+    vmx_fail(cpu, vm_instruction_error_unsupported_field);
+    return;
+  }
+
+  if (info.register_operand)
+    write_guest_gpr(cpu->ctx, info.reg1, value);
+  else if (!copy_guest_memory(cpu, get_vmx_operand_address(cpu, info),
+      &value, sizeof(value), true))
+    return;
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmwrite(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  auto& nested = cpu->nested;
+
+  if (nested.current_vmcs12 == ~0ull) {
+    vmx_fail_invalid();
+    return;
+  }
+
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  uint64_t value = 0;
+  if (info.register_operand)
+    value = read_guest_gpr(cpu->ctx, info.reg1);
+  else if (!read_vmx_operand(cpu, &value, sizeof(value)))
+    return;
+
+  auto const field = read_guest_gpr(cpu->ctx, info.reg2);
+
+  if (find_vmcs12_field(field) < 0) {
+    vmx_fail(cpu, vm_instruction_error_unsupported_field);
+    return;
+  }
+
+  if (get_vmcs_field_type(field) == vmcs_field_type_exit_info) {
+    vmx_fail(cpu, vm_instruction_error_vmwrite_read_only_field);
+    return;
+  }
+
+  vmcs12_set(nested.cached_vmcs12, field, value);
+
+  vmx_succeed();
+}
+
+void emulate_nested_vmlaunch(vcpu* const cpu) {
+  emulate_nested_vm_entry(cpu, true);
+}
+
+void emulate_nested_vmresume(vcpu* const cpu) {
+  emulate_nested_vm_entry(cpu, false);
+}
+
+void emulate_nested_invept(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  auto const type = read_guest_gpr(cpu->ctx, info.reg2);
+
+  invept_descriptor desc;
+  if (!read_vmx_operand(cpu, &desc, sizeof(desc)))
+    return;
+
+  if (type != invept_single_context && type != invept_all_context) {
+    vmx_fail(cpu, vm_instruction_error_invalid_invept_invvpid);
+    return;
+  }
+
+  // L1 can't use EPT (see filter_nested_vmx_msr()), so there is nothing
+  // to invalidate. flush EPT01 anyways, since that is what L2 runs on.
+  vmx_invept(invept_all_context, {});
+
+  vmx_succeed();
+}
+
+void emulate_nested_invvpid(vcpu* const cpu) {
+  if (!check_vmx_operation(cpu))
+    return;
+
+  vmx_instruction_info info;
+  info.flags = static_cast<uint32_t>(vmx_vmread(VMCS_VMEXIT_INSTRUCTION_INFO));
+
+  auto const type = read_guest_gpr(cpu->ctx, info.reg2);
+
+  invvpid_descriptor desc;
+  if (!read_vmx_operand(cpu, &desc, sizeof(desc)))
+    return;
+
+  if (type > invvpid_single_context_retaining_globals ||
+      (type != invvpid_all_context && desc.vpid == 0)) {
+    vmx_fail(cpu, vm_instruction_error_invalid_invept_invvpid);
+    return;
+  }
+
+  // every L2 VPID is mapped to the same VPID
+  desc.vpid = nested_guest_vpid;
+
+  if (type == invvpid_individual_address)
+    vmx_invvpid(invvpid_individual_address, desc);
+  else
+    vmx_invvpid(invvpid_single_context, desc);
+
+  vmx_succeed();
+}
+
+} // namespace hv
+
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "nested-vmcs.h"
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// nested VMX is still experimental, so it is disabled by default. when it
+// is disabled, the guest is told that VMX has been disabled by the BIOS.
+inline constexpr bool nested_vmx_enabled = false;
+
+// VPID that is used for every L2 guest
+inline constexpr uint16_t nested_guest_vpid = 2;
+
+struct vcpu_nested_data {
+  // shadow VMCS that L1 can access directly with VMREAD/VMWRITE
+  alignas(0x1000) vmcs shadow_vmcs;
+
+  // VMCS that is used while L2 is running
+  alignas(0x1000) vmcs vmcs02;
+
+  // L0 MSR bitmap combined with the L1 MSR bitmap
+  alignas(0x1000) vmx_msr_bitmap msr_bitmap02;
+
+  // VMREAD/VMWRITE bitmaps (a set bit causes a vm-exit)
+  alignas(0x1000) uint8_t vmread_bitmap[0x1000];
+  alignas(0x1000) uint8_t vmwrite_bitmap[0x1000];
+
+  // cached copy of the current vmcs12. fields that are in the shadow VMCS
+  // are only synced into this copy when we need them.
+  vmcs12 cached_vmcs12;
+
+  // physical addresses of the structures above
+  uint64_t vmcs01_phys;
+  uint64_t shadow_vmcs_phys;
+  uint64_t vmcs02_phys;
+  uint64_t msr_bitmap02_phys;
+
+  // whether the CPU supports VMCS shadowing
+  bool vmcs_shadowing;
+
+  // whether L1 is in VMX operation (i.e. it executed VMXON)
+  bool vmxon;
+
+  // whether L2 is currently running (vmcs02 is the current VMCS)
+  bool in_l2;
+
+  // whether vmcs02 has been launched since it was last cleared
+  bool vmcs02_launched;
+
+  // whether we requested an NMI-window vm-exit in vmcs02 for queued NMIs
+  bool nmi_window02;
+
+  // the VMXON pointer that L1 used
+  uint64_t vmxon_ptr;
+
+  // L1 physical address of the current vmcs12 (or ~0 if there isn't one)
+  uint64_t current_vmcs12;
+
+  // whether a vmcs12 field is stored in the shadow VMCS
+  bool shadowed[vmcs12_field_count];
+
+  // L0 state that is used to build vmcs02 (the capabilities are filtered
+  // the same way as the capability MSRs that L1 sees)
+  nested_l0_state l0;
+
+  // our host-state area (this is the same for vmcs01 and vmcs02)
+  vmcs_write_list host_state;
+
+  // scratch space for building vmcs02 or loading L1 host state
+  vmcs_write_list writes;
+
+  // scratch space for the vmcs02 state after an L2 vm-exit
+  struct vmcs12 exit_state;
+
+  // L1 IA32_EFER right before the last nested vm-entry
+  uint64_t l1_efer;
+
+  // the vmcs12 VPID that was used on the last nested vm-entry
+  uint16_t last_vpid12;
+};
+
+// initialize nested VMX for the current VCPU (vmcs01 must be the current VMCS)
+void prepare_nested_vmx(vcpu* cpu);
+
+// called for every vm-exit that occurs while L2 is running. returns true if
+// the vm-exit was reflected into L1 (and vmcs01 is the current VMCS again).
+bool handle_l2_vm_exit(vcpu* cpu, vmx_vmexit_reason reason);
+
+// RDMSR handler for the VMX capability MSRs
+bool read_nested_vmx_msr(vcpu* cpu, uint32_t msr, uint64_t& value);
+
+void emulate_nested_vmxon(vcpu* cpu);
+
+void emulate_nested_vmxoff(vcpu* cpu);
+
+void emulate_nested_vmclear(vcpu* cpu);
+
+void emulate_nested_vmptrld(vcpu* cpu);
+
+void emulate_nested_vmptrst(vcpu* cpu);
+
+void emulate_nested_vmread(vcpu* cpu);
+
+void emulate_nested_vmwrite(vcpu* cpu);
+
+void emulate_nested_vmlaunch(vcpu* cpu);
+
+void emulate_nested_vmresume(vcpu* cpu);
+
+void emulate_nested_invept(vcpu* cpu);
+
+void emulate_nested_invvpid(vcpu* cpu);
+
+} // namespace hv
+
@@ -0,0 +1,109 @@
+#include "notify.h"
+#include "hv.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// request that the consumer is notified on the current VCPU
+void request_notification(vcpu* const cpu) {
+  if (!ghv.notification_vector)
+    return;
+
+  ++cpu->notification.requested;
+  cpu->notification.pending = true;
+}
+
+// enable or disable the vm-exits that retry a held notification: an
+// interrupt-window exit once the guest accepts interrupts, or a CR8-load
+// exit once the guest lowers its TPR
+static void set_retry_exiting(bool const interrupt_window, bool const cr8_load) {
+  auto ctrl = read_ctrl_proc_based();
+
+  if (ctrl.interrupt_window_exiting == interrupt_window &&
+      ctrl.cr8_load_exiting == cr8_load)
+    return;
+
+  ctrl.interrupt_window_exiting = interrupt_window;
+  ctrl.cr8_load_exiting         = cr8_load;
+  write_ctrl_proc_based(ctrl);
+}
+
+// inject a pending notification if the guest can currently accept an
+// external interrupt, or request an interrupt-window exit otherwise
+void deliver_notification(vcpu* const cpu) {
+  auto& notification = cpu->notification;
+
+  if (!notification.pending)
+    return;
+
+  auto const vector = ghv.notification_vector;
+
+  // the consumer went away
+  if (!vector) {
+    notification.pending = false;
+    set_retry_exiting(false, false);
+    return;
+  }
+
+  // the interrupt would be delivered before the single-stepped instruction.
+  // the monitor trap flag vm-exit comes right after, so just wait for it.
+  if (cpu->call_counter.stepping_pte)
+    return;
+
+  vmentry_interrupt_information pending_event;
+  pending_event.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
+
+  vmexit_interrupt_information idt_vectoring;
+  idt_vectoring.flags = static_cast<uint32_t>(
+    vmx_vmread(VMCS_IDT_VECTORING_INFORMATION));
+
+  rflags guest_rflags;
+  guest_rflags.flags = vmx_vmread(VMCS_GUEST_RFLAGS);
+
+  auto const state = read_interruptibility_state();
+
+  // 3.26.3.1.5
+  // external interrupts can only be injected if there isn't another event
+  // being injected and if the guest isn't blocking interrupts
+  if (pending_event.valid                ||
+      idt_vectoring.valid                ||
+      !guest_rflags.interrupt_enable_flag ||
+      state.blocking_by_mov_ss           ||
+      state.blocking_by_sti) {
+    // retry as soon as the guest can accept interrupts
+    set_retry_exiting(true, false);
+    return;
+  }
+
+  // the interrupt is injected past the local APIC, so the TPR needs to be
+  // checked here (CR8 isn't switched on vm-exits, so this is the guest's).
+  // an interrupt-window exit would fire right away, so wait for the guest
+  // to lower its TPR instead.
+  if ((vector >> 4) <= __readcr8()) {
+    set_retry_exiting(false, true);
+    return;
+  }
+
+  inject_interrupt(vector);
+
+  notification.pending = false;
+  ++notification.injected;
+
+  set_retry_exiting(false, false);
+}
+
+// inject the specified vector whenever a ring reaches its watermark
+// (0 disables notifications)
+bool register_notification_vector(uint8_t const vector) {
+  // vectors 1-31 are reserved for exceptions
+  if (vector != 0 && vector < 32)
+    return false;
+
+  ghv.notification_vector = vector;
+  return true;
+}
+
+} // namespace hv
+
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Notifications from the hypervisor to a guest consumer. Instead of polling,
+// a consumer registers an interrupt vector (with the
+// register_notification_vector hypercall), and the hypervisor injects it
+// as an external interrupt whenever one of the rings fills up to its
+// watermark. Notifications are coalesced per VCPU: at most one is pending
+// at a time, no matter how many rings crossed their watermark.
+//
+// The injected interrupt doesn't go through the local APIC, so the
+// consumer's handler must not signal an EOI. It is still held back while
+// the guest's TPR masks its priority class.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// rings request a notification once they are this full (as a fraction)
+inline constexpr uint64_t notification_watermark_divisor = 2;
+
+struct vcpu_notification_data {
+  // a notification still needs to be injected
+  bool pending;
+
+  // number of notifications that were requested and actually injected
+  // (the difference is the number that were coalesced)
+  uint64_t requested;
+  uint64_t injected;
+};
+
+// request that the consumer is notified on the current VCPU
+void request_notification(vcpu* cpu);
+
+// request a notification if a ring's fill level just crossed its watermark
+inline void check_ring_watermark(vcpu* const cpu,
+    uint64_t const fill_before, uint64_t const fill_after, uint64_t const capacity) {
+  auto const watermark = capacity / notification_watermark_divisor;
+
+  if (fill_before < watermark && fill_after >= watermark)
+    request_notification(cpu);
+}
+
+// inject a pending notification if the guest can currently accept an
+// external interrupt, or request an interrupt-window exit otherwise
+void deliver_notification(vcpu* cpu);
+
+// inject the specified vector whenever a ring reaches its watermark
+// (0 disables notifications)
+bool register_notification_vector(uint8_t vector);
+
+} // namespace hv
+
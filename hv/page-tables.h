@@ -10,10 +10,19 @@ inline constexpr size_t host_physical_memory_pd_count = 64;
 // physical memory is directly mapped to this pml4 entry
 inline constexpr uint64_t host_physical_memory_pml4_idx = 255;
 
+#ifndef HV_PORTABLE
+
 // directly access physical memory by using [base + offset]
 inline uint8_t* const host_physical_memory_base = reinterpret_cast<uint8_t*>(
   host_physical_memory_pml4_idx << (9 + 9 + 9 + 12));
 
+#else
+
+// points to the physical memory image (see create_physical_memory_image())
+inline uint8_t* host_physical_memory_base = nullptr;
+
+#endif
+
 struct host_page_tables {
   // array of PML4 entries that point to a PDPT
   alignas(0x1000) pml4e_64 pml4[512];
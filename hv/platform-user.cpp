@@ -0,0 +1,431 @@
+#include "platform.h"
+#include "page-tables.h"
+#include "arch.h"
+#include "exception-routines.h"
+#include "interrupt-handlers.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+// user-mode implementation of the platform layer (see platform.h). this file
+// is only part of the portable build and is never compiled into the driver.
+
+namespace hv {
+
+simulated_processor simulated_cpu;
+
+// whether DbgPrint() output is written to stderr
+static bool debug_print_enabled = true;
+
+// the physical memory image
+static size_t physical_memory_size      = 0;
+static size_t physical_memory_allocated = 0;
+
+// simulated MSRs (unknown MSRs read as 0, but raise #GP in the *_safe()
+// routines)
+struct simulated_msr {
+  uint32_t msr;
+  uint64_t value;
+};
+
+static constexpr size_t max_simulated_msrs = 256;
+static simulated_msr simulated_msrs[max_simulated_msrs];
+static size_t simulated_msr_count = 0;
+
+// get a simulated MSR, or nullptr if it was never set
+static simulated_msr* find_simulated_msr(uint32_t const msr) {
+  for (size_t i = 0; i < simulated_msr_count; ++i) {
+    if (simulated_msrs[i].msr == msr)
+      return &simulated_msrs[i];
+  }
+
+  return nullptr;
+}
+
+// whether an MSR can be accessed with RDMSR/WRMSR without a #GP
+static bool is_simulated_msr_present(uint32_t const msr) {
+  return msr == IA32_FS_BASE || msr == IA32_GS_BASE || find_simulated_msr(msr);
+}
+
+// raise a #GP in one of the *_safe() routines
+static void raise_general_protection(host_exception_info& e) {
+  e.exception_occurred = true;
+  e.vector             = general_protection;
+  e.error              = 0;
+}
+
+// allocate a zeroed image of guest physical memory that
+// host_physical_memory_base points to
+bool create_physical_memory_image(size_t const size) {
+  destroy_physical_memory_image();
+
+  // physical memory is only ever allocated in whole pages
+  auto const aligned_size = (size + 0xFFF) & ~0xFFFull;
+
+  auto const base = mmap(nullptr, aligned_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (base == MAP_FAILED)
+    return false;
+
+  host_physical_memory_base = static_cast<uint8_t*>(base);
+  physical_memory_size      = aligned_size;
+  physical_memory_allocated = 0;
+
+  return true;
+}
+
+// free the physical memory image
+void destroy_physical_memory_image() {
+  if (!host_physical_memory_base)
+    return;
+
+  munmap(host_physical_memory_base, physical_memory_size);
+
+  host_physical_memory_base = nullptr;
+  physical_memory_size      = 0;
+  physical_memory_allocated = 0;
+}
+
+// size of the physical memory image, in bytes
+size_t physical_memory_image_size() {
+  return physical_memory_size;
+}
+
+// allocate zeroed, page-aligned memory from the end of the physical memory
+// image (for structures that are referenced by physical address, such as
+// paging structures). returns nullptr if the image is full.
+void* allocate_physical_pages(size_t const count) {
+  if (count * 0x1000 > physical_memory_size - physical_memory_allocated)
+    return nullptr;
+
+  physical_memory_allocated += count * 0x1000;
+
+  auto const address = host_physical_memory_base
+    + physical_memory_size - physical_memory_allocated;
+
+  memset(address, 0, count * 0x1000);
+
+  return address;
+}
+
+// set the value that is returned when reading the specified MSR
+void set_simulated_msr(uint32_t const msr, uint64_t const value) {
+  if (auto const entry = find_simulated_msr(msr)) {
+    entry->value = value;
+    return;
+  }
+
+  if (simulated_msr_count >= max_simulated_msrs)
+    return;
+
+  simulated_msrs[simulated_msr_count++] = { msr, value };
+}
+
+// write DbgPrint() output to stderr (the default) or discard it
+void enable_debug_print(bool const enabled) {
+  debug_print_enabled = enabled;
+}
+
+// arch.asm
+
+static segment_selector make_selector(uint16_t const value) {
+  segment_selector selector;
+  selector.flags = value;
+  return selector;
+}
+
+segment_selector read_cs()   { return make_selector(simulated_cpu.cs);   }
+segment_selector read_ss()   { return make_selector(simulated_cpu.ss);   }
+segment_selector read_ds()   { return make_selector(simulated_cpu.ds);   }
+segment_selector read_es()   { return make_selector(simulated_cpu.es);   }
+segment_selector read_fs()   { return make_selector(simulated_cpu.fs);   }
+segment_selector read_gs()   { return make_selector(simulated_cpu.gs);   }
+segment_selector read_tr()   { return make_selector(simulated_cpu.tr);   }
+segment_selector read_ldtr() { return make_selector(simulated_cpu.ldtr); }
+
+void write_ds(uint16_t const selector)   { simulated_cpu.ds   = selector; }
+void write_es(uint16_t const selector)   { simulated_cpu.es   = selector; }
+void write_fs(uint16_t const selector)   { simulated_cpu.fs   = selector; }
+void write_gs(uint16_t const selector)   { simulated_cpu.gs   = selector; }
+void write_tr(uint16_t const selector)   { simulated_cpu.tr   = selector; }
+void write_ldtr(uint16_t const selector) { simulated_cpu.ldtr = selector; }
+
+// exception-routines.asm
+
+// memcpy with exception handling
+void memcpy_safe(host_exception_info& e, void* const dst, void const* const src, size_t const size) {
+  e.exception_occurred = false;
+  memcpy(dst, src, size);
+}
+
+// xsetbv with exception handling
+void xsetbv_safe(host_exception_info& e, uint32_t const idx, uint64_t const value) {
+  e.exception_occurred = false;
+
+  // only XCR0 exists, and x87 state can't be disabled
+  if (idx != 0 || !(value & 1)) {
+    raise_general_protection(e);
+    return;
+  }
+
+  simulated_cpu.xcr0 = value;
+}
+
+// wrmsr with exception handling
+void wrmsr_safe(host_exception_info& e, uint32_t const msr, uint64_t const value) {
+  e.exception_occurred = false;
+
+  // MSRs that were never set don't exist
+  if (!is_simulated_msr_present(msr)) {
+    raise_general_protection(e);
+    return;
+  }
+
+  __writemsr(msr, value);
+}
+
+// rdmsr with exception handling
+uint64_t rdmsr_safe(host_exception_info& e, uint32_t const msr) {
+  e.exception_occurred = false;
+
+  // MSRs that were never set don't exist
+  if (!is_simulated_msr_present(msr)) {
+    raise_general_protection(e);
+    return 0;
+  }
+
+  return __readmsr(msr);
+}
+
+// interrupt-handlers.asm (host interrupts never happen in the portable build)
+
+void interrupt_handler_0()  {}
+void interrupt_handler_1()  {}
+void interrupt_handler_2()  {}
+void interrupt_handler_3()  {}
+void interrupt_handler_4()  {}
+void interrupt_handler_5()  {}
+void interrupt_handler_6()  {}
+void interrupt_handler_7()  {}
+void interrupt_handler_8()  {}
+void interrupt_handler_10() {}
+void interrupt_handler_11() {}
+void interrupt_handler_12() {}
+void interrupt_handler_13() {}
+void interrupt_handler_14() {}
+void interrupt_handler_16() {}
+void interrupt_handler_17() {}
+void interrupt_handler_18() {}
+void interrupt_handler_19() {}
+void interrupt_handler_20() {}
+void interrupt_handler_30() {}
+
+} // namespace hv
+
+using namespace hv;
+
+// translate an address inside of the physical memory image into the
+// physical address that it represents
+PHYSICAL_ADDRESS MmGetPhysicalAddress(void* const address) {
+  auto const offset = static_cast<uint8_t*>(address) - host_physical_memory_base;
+
+  PHYSICAL_ADDRESS physical_address;
+  physical_address.QuadPart = (offset >= 0 && static_cast<size_t>(offset)
+    < physical_memory_image_size()) ? offset : 0;
+
+  return physical_address;
+}
+
+// translate a physical address inside of the physical memory image into
+// the address that it is mapped at
+void* MmGetVirtualForPhysical(PHYSICAL_ADDRESS const address) {
+  if (address.QuadPart < 0 || static_cast<size_t>(address.QuadPart)
+      >= physical_memory_image_size())
+    return nullptr;
+
+  return host_physical_memory_base + address.QuadPart;
+}
+
+unsigned long DbgPrint(char const* const format, ...) {
+  if (!debug_print_enabled)
+    return 0;
+
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+
+  return 0;
+}
+
+NTSTATUS RtlStringCbPrintfA(char* const dest, size_t const size, char const* const format, ...) {
+  va_list args;
+  va_start(args, format);
+  auto const length = vsnprintf(dest, size, format, args);
+  va_end(args);
+
+  // STATUS_BUFFER_OVERFLOW
+  if (length < 0 || static_cast<size_t>(length) >= size)
+    return static_cast<NTSTATUS>(0x80000005);
+
+  return 0;
+}
+
+KIRQL KeGetCurrentIrql() {
+  return PASSIVE_LEVEL;
+}
+
+KAFFINITY KeSetSystemAffinityThreadEx(KAFFINITY) {
+  return 1;
+}
+
+void KeRevertToUserAffinityThreadEx(KAFFINITY) {}
+
+unsigned long KeGetCurrentProcessorIndex() {
+  return 0;
+}
+
+void __cpuid(int info[4], int const function) {
+  __cpuidex(info, function, 0);
+}
+
+void __cpuidex(int info[4], int const function, int const subfunction) {
+  asm volatile("cpuid"
+    : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3])
+    : "a"(function), "c"(subfunction));
+
+  // CPUID.01H:ECX.VMX
+  if (function == 1)
+    info[2] |= 1 << 5;
+}
+
+uint64_t __rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+// the simulated processor doesn't have any counters that are counting
+uint64_t __readpmc(unsigned long) {
+  return 0;
+}
+
+void _mm_lfence() {
+  asm volatile("lfence" : : : "memory");
+}
+
+// MSR reads return the values that were set with set_simulated_msr()
+uint64_t __readmsr(unsigned long const msr) {
+  if (msr == IA32_FS_BASE)
+    return simulated_cpu.fs_base;
+  if (msr == IA32_GS_BASE)
+    return simulated_cpu.gs_base;
+
+  auto const entry = find_simulated_msr(msr);
+  return entry ? entry->value : 0;
+}
+
+void __writemsr(unsigned long const msr, uint64_t const value) {
+  if (msr == IA32_FS_BASE)
+    simulated_cpu.fs_base = value;
+  else if (msr == IA32_GS_BASE)
+    simulated_cpu.gs_base = value;
+  else
+    set_simulated_msr(msr, value);
+}
+
+uint64_t __readcr0() { return simulated_cpu.cr0; }
+uint64_t __readcr3() { return simulated_cpu.cr3; }
+uint64_t __readcr4() { return simulated_cpu.cr4; }
+uint64_t __readcr8() { return simulated_cpu.cr8; }
+
+void __writecr0(uint64_t const value) { simulated_cpu.cr0 = value; }
+void __writecr3(uint64_t const value) { simulated_cpu.cr3 = value; }
+void __writecr4(uint64_t const value) { simulated_cpu.cr4 = value; }
+void __writecr8(uint64_t const value) { simulated_cpu.cr8 = value; }
+
+uint64_t __readdr(unsigned int const index) {
+  return simulated_cpu.dr[index & 7];
+}
+
+void __writedr(unsigned int const index, uint64_t const value) {
+  simulated_cpu.dr[index & 7] = value;
+}
+
+uint64_t __readeflags() {
+  return simulated_cpu.rflags;
+}
+
+void _disable() {
+  simulated_cpu.rflags &= ~RFLAGS_INTERRUPT_ENABLE_FLAG;
+}
+
+void _enable() {
+  simulated_cpu.rflags |= RFLAGS_INTERRUPT_ENABLE_FLAG;
+}
+
+void _sgdt(segment_descriptor_register_64* const gdtr) {
+  *gdtr = simulated_cpu.gdtr;
+}
+
+void _lgdt(segment_descriptor_register_64* const gdtr) {
+  simulated_cpu.gdtr = *gdtr;
+}
+
+void __sidt(void* const idtr) {
+  memcpy(idtr, &simulated_cpu.idtr, sizeof(simulated_cpu.idtr));
+}
+
+void __lidt(void* const idtr) {
+  memcpy(&simulated_cpu.idtr, idtr, sizeof(simulated_cpu.idtr));
+}
+
+// LSL on the simulated GDT
+unsigned long __segmentlimit(unsigned long const selector) {
+  auto const s = make_selector(static_cast<uint16_t>(selector));
+
+  if (!s.index || s.table)
+    return 0;
+
+  auto const descriptor = reinterpret_cast<segment_descriptor_32 const*>(
+    simulated_cpu.gdtr.base_address) + s.index;
+
+  unsigned long limit = descriptor->segment_limit_low |
+    (descriptor->segment_limit_high << 16);
+
+  // 4KB granularity
+  if (descriptor->granularity)
+    limit = (limit << 12) | 0xFFF;
+
+  return limit;
+}
+
+uint64_t _readfsbase_u64() {
+  return simulated_cpu.fs_base;
+}
+
+void _writefsbase_u64(uint64_t const value) {
+  simulated_cpu.fs_base = value;
+}
+
+void _writegsbase_u64(uint64_t const value) {
+  simulated_cpu.gs_base = value;
+}
+
+uint64_t _xgetbv(unsigned int const index) {
+  return (index == 0) ? simulated_cpu.xcr0 : 0;
+}
+
+void _xsetbv(unsigned int const index, uint64_t const value) {
+  if (index == 0)
+    simulated_cpu.xcr0 = value;
+}
+
+// the guest and the host share the real extended state, so there is
+// nothing that needs to be saved or restored
+void _xsave64(void*, uint64_t) {}
+void _xsaveopt64(void*, uint64_t) {}
+void _xrstor64(void const*, uint64_t) {}
+void _mm_setcsr(unsigned int) {}
+
@@ -0,0 +1,212 @@
+#pragma once
+
+// the driver is built with MSVC and the WDK. the rest of hv (everything but
+// the driver entry and the code that virtualizes every processor, see
+// CMakeLists.txt) is also built as a regular user-mode library with
+// HV_PORTABLE defined, in which case the kernel routines and intrinsics that
+// it uses are provided by platform-user.cpp, and VMX operation is simulated
+// by vmx-sim.cpp and simulator.cpp.
+
+#ifndef HV_PORTABLE
+
+#include <ntddk.h>
+#include <intrin.h>
+
+#else
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <ia32.hpp>
+
+// kernel types that are part of shared structures
+
+using NTSTATUS  = long;
+using LONG64    = int64_t;
+using KIRQL     = uint8_t;
+using KAFFINITY = uint64_t;
+using HANDLE    = void*;
+
+using PMDL      = struct _MDL*;
+using PKPCR     = struct _KPCR*;
+using PETHREAD  = struct _KTHREAD*;
+using PEPROCESS = struct _KPROCESS*;
+
+struct KEVENT {
+  uint64_t reserved[3];
+};
+
+struct FAST_MUTEX {
+  uint64_t reserved[7];
+};
+
+union PHYSICAL_ADDRESS {
+  int64_t QuadPart;
+};
+
+struct LIST_ENTRY {
+  LIST_ENTRY* Flink;
+  LIST_ENTRY* Blink;
+};
+
+#define MAXULONG64 (~static_cast<uint64_t>(0))
+
+#define PASSIVE_LEVEL  0
+#define APC_LEVEL      1
+#define DISPATCH_LEVEL 2
+
+#define NT_ASSERT(expression) assert(expression)
+#define NT_SUCCESS(status) (static_cast<NTSTATUS>(status) >= 0)
+
+// the min()/max() macros from ntdef.h (as functions, since macros with these
+// names break the C++ standard library). both arguments are converted to
+// their common type first, so that min(2, size) doesn't compare a signed
+// and an unsigned value.
+template <typename T, typename U>
+constexpr auto min(T const a, U const b) {
+  using common = std::common_type_t<T, U>;
+  return (static_cast<common>(a) < static_cast<common>(b))
+    ? static_cast<common>(a) : static_cast<common>(b);
+}
+
+template <typename T, typename U>
+constexpr auto max(T const a, U const b) {
+  using common = std::common_type_t<T, U>;
+  return (static_cast<common>(a) > static_cast<common>(b))
+    ? static_cast<common>(a) : static_cast<common>(b);
+}
+
+// kernel routines. the portable build simulates a single processor that is
+// always running at PASSIVE_LEVEL.
+
+unsigned long DbgPrint(char const* format, ...);
+NTSTATUS RtlStringCbPrintfA(char* dest, size_t size, char const* format, ...);
+KIRQL KeGetCurrentIrql();
+KAFFINITY KeSetSystemAffinityThreadEx(KAFFINITY affinity);
+void KeRevertToUserAffinityThreadEx(KAFFINITY affinity);
+unsigned long KeGetCurrentProcessorIndex();
+
+// translate an address inside of the physical memory image into the
+// physical address that it represents (and back)
+PHYSICAL_ADDRESS MmGetPhysicalAddress(void* address);
+void* MmGetVirtualForPhysical(PHYSICAL_ADDRESS address);
+
+// intrinsics that access privileged processor state operate on the
+// simulated processor (see simulated_cpu) instead. CPUID and RDTSC are
+// executed natively.
+
+void __cpuid(int info[4], int function);
+void __cpuidex(int info[4], int function, int subfunction);
+uint64_t __rdtsc();
+uint64_t __readpmc(unsigned long counter);
+void _mm_lfence();
+
+// MSR reads return the values that were set with set_simulated_msr()
+uint64_t __readmsr(unsigned long msr);
+void __writemsr(unsigned long msr, uint64_t value);
+
+uint64_t __readcr0();
+uint64_t __readcr3();
+uint64_t __readcr4();
+uint64_t __readcr8();
+void __writecr0(uint64_t value);
+void __writecr3(uint64_t value);
+void __writecr4(uint64_t value);
+void __writecr8(uint64_t value);
+uint64_t __readdr(unsigned int index);
+void __writedr(unsigned int index, uint64_t value);
+uint64_t __readeflags();
+void _disable();
+void _enable();
+
+void __sidt(void* idtr);
+void __lidt(void* idtr);
+unsigned long __segmentlimit(unsigned long selector);
+
+uint64_t _readfsbase_u64();
+void _writefsbase_u64(uint64_t value);
+void _writegsbase_u64(uint64_t value);
+
+uint64_t _xgetbv(unsigned int index);
+void _xsetbv(unsigned int index, uint64_t value);
+void _xsave64(void* area, uint64_t mask);
+void _xsaveopt64(void* area, uint64_t mask);
+void _xrstor64(void const* area, uint64_t mask);
+void _mm_setcsr(unsigned int value);
+
+inline LONG64 InterlockedOr64(LONG64 volatile* const target, LONG64 const value) {
+  return __atomic_fetch_or(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedAnd64(LONG64 volatile* const target, LONG64 const value) {
+  return __atomic_fetch_and(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline unsigned char _BitScanReverse64(unsigned long* const index, uint64_t const mask) {
+  if (!mask)
+    return 0;
+
+  *index = 63 - __builtin_clzll(mask);
+  return 1;
+}
+
+inline void _ReadWriteBarrier() { asm volatile("" : : : "memory"); }
+inline void _ReadBarrier() { asm volatile("" : : : "memory"); }
+inline void _WriteBarrier() { asm volatile("" : : : "memory"); }
+
+// VMX instructions operate on the simulated VMCS (see vmx-sim.h)
+unsigned char __vmx_on(uint64_t* vmxon_phys_addr);
+void __vmx_off();
+unsigned char __vmx_vmclear(uint64_t* vmcs_phys_addr);
+unsigned char __vmx_vmptrld(uint64_t* vmcs_phys_addr);
+unsigned char __vmx_vmread(size_t field, size_t* value);
+unsigned char __vmx_vmwrite(size_t field, size_t value);
+
+namespace hv {
+
+// privileged state of the simulated processor
+struct simulated_processor {
+  uint64_t cr0;
+  uint64_t cr3;
+  uint64_t cr4;
+  uint64_t cr8;
+  uint64_t dr[8];
+  uint64_t xcr0;
+  uint64_t rflags;
+  uint64_t fs_base;
+  uint64_t gs_base;
+  segment_descriptor_register_64 gdtr;
+  segment_descriptor_register_64 idtr;
+  uint16_t cs, ss, ds, es, fs, gs, tr, ldtr;
+};
+
+extern simulated_processor simulated_cpu;
+
+// allocate a zeroed image of guest physical memory that
+// host_physical_memory_base points to
+bool create_physical_memory_image(size_t size);
+
+// free the physical memory image
+void destroy_physical_memory_image();
+
+// size of the physical memory image, in bytes
+size_t physical_memory_image_size();
+
+// allocate zeroed, page-aligned memory from the end of the physical memory
+// image (for structures that are referenced by physical address, such as
+// paging structures). returns nullptr if the image is full.
+void* allocate_physical_pages(size_t count);
+
+// set the value that is returned when reading the specified MSR
+void set_simulated_msr(uint32_t msr, uint64_t value);
+
+// write DbgPrint() output to stderr (the default) or discard it
+void enable_debug_print(bool enabled);
+
+} // namespace hv
+
+#endif
+
@@ -0,0 +1,276 @@
+#include "pmu.h"
+#include "exception-routines.h"
+#include "timing.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// TODO: move to ia32?
+// IA32_PERFEVTSELx bits
+inline constexpr uint64_t perfevtsel_usr_flag  = 1ull << 16;
+inline constexpr uint64_t perfevtsel_os_flag   = 1ull << 17;
+inline constexpr uint64_t perfevtsel_edge_flag = 1ull << 18;
+inline constexpr uint64_t perfevtsel_en_flag   = 1ull << 22;
+inline constexpr uint64_t perfevtsel_inv_flag  = 1ull << 23;
+inline constexpr uint64_t perfevtsel_cmask     = 0xFFull << 24;
+
+// event select and unit mask of every exit_pmc_event (18.2.1.2, 19.2)
+static constexpr uint64_t exit_pmc_event_selects[exit_pmc_count] = {
+  0x00C0, // INST_RETIRED.ANY_P
+  0x412E, // LONGEST_LAT_CACHE.MISS
+  0x0108  // DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK
+};
+
+// TODO: move to ia32?
+// IA32_PERF_CAPABILITIES.FW_WRITE
+inline constexpr uint64_t perf_capabilities_full_width_write = 1ull << 13;
+
+// the architectural event that a general-purpose counter is programmed with
+static pmu_event get_gp_counter_event(uint64_t const perfevtsel) {
+  // the counter doesn't count raw event occurrences
+  if (perfevtsel & (perfevtsel_edge_flag | perfevtsel_inv_flag | perfevtsel_cmask))
+    return pmu_event_none;
+
+  // event select and unit mask (18.2.1.2)
+  switch (perfevtsel & 0xFFFF) {
+  case 0x00C0: return pmu_event_instructions;
+  case 0x003C: return pmu_event_core_cycles;
+  case 0x013C: return pmu_event_ref_cycles;
+  default:     return pmu_event_none;
+  }
+}
+
+// the overhead of a vm-exit for the specified event
+static uint64_t get_event_overhead(vm_exit_overhead const& overhead, pmu_event const event) {
+  switch (event) {
+  case pmu_event_instructions: return overhead.instructions;
+  case pmu_event_core_cycles:  return overhead.core_cycles;
+  case pmu_event_ref_cycles:   return overhead.ref_tsc;
+  default:                     return 0;
+  }
+}
+
+// rebuild the list of counters that need to be compensated
+static void update_compensated_counters(vcpu_pmu_data& pmu) {
+  pmu.compensated_count = 0;
+
+  // fixed counters always count the same event
+  static constexpr pmu_event fixed_counter_events[max_fixed_counters] = {
+    pmu_event_instructions,
+    pmu_event_core_cycles,
+    pmu_event_ref_cycles
+  };
+
+  for (uint32_t i = 0; i < pmu.fixed_counter_count; ++i) {
+    // 4 control bits for every fixed counter (18.2.2.1)
+    auto const ctrl = (pmu.fixed_ctr_ctrl >> (i * 4)) & 0b11;
+    if (!ctrl)
+      continue;
+
+    auto& c = pmu.compensated[pmu.compensated_count++];
+    c.msr              = IA32_FIXED_CTR0 + i;
+    c.event            = fixed_counter_events[i];
+    c.os               = ctrl & 0b01;
+    c.usr              = ctrl & 0b10;
+    c.global_ctrl_mask = 1ull << (32 + i);
+  }
+
+  // general-purpose counters can only be compensated with full-width writes
+  if (!pmu.gp_counter_write_msr)
+    return;
+
+  // reserved counters never count guest events
+  auto const gp_counter_count = pmu.exit_pmc_profiling ?
+    pmu.exit_pmc_first_counter : pmu.gp_counter_count;
+
+  for (uint32_t i = 0; i < gp_counter_count; ++i) {
+    auto const sel = pmu.perfevtsel[i];
+    if (!(sel & perfevtsel_en_flag) || !(sel & (perfevtsel_os_flag | perfevtsel_usr_flag)))
+      continue;
+
+    auto const event = get_gp_counter_event(sel);
+    if (event == pmu_event_none)
+      continue;
+
+    auto& c = pmu.compensated[pmu.compensated_count++];
+    c.msr              = pmu.gp_counter_write_msr + i;
+    c.event            = event;
+    c.os               = sel & perfevtsel_os_flag;
+    c.usr              = sel & perfevtsel_usr_flag;
+    c.global_ctrl_mask = 1ull << i;
+  }
+}
+
+// initialize the PMU state by reading the current counter configuration
+void prepare_pmu(vcpu* const cpu) {
+  auto& pmu = cpu->pmu;
+
+  cpuid_eax_0a cpuid_0a;
+  __cpuid(reinterpret_cast<int*>(&cpuid_0a), 0x0A);
+
+  // 18.2.1.1
+  auto const version  = cpuid_0a.eax.flags & 0xFF;
+  auto const gp_count = (cpuid_0a.eax.flags >> 8) & 0xFF;
+  auto const gp_width = (cpuid_0a.eax.flags >> 16) & 0xFF;
+
+  // 18.2.2.1
+  auto const fixed_count = (version >= 2) ? (cpuid_0a.edx.flags & 0x1F) : 0;
+  auto const fixed_width = (cpuid_0a.edx.flags >> 5) & 0xFF;
+
+  pmu.gp_counter_count    = min(gp_count, max_gp_counters);
+  pmu.fixed_counter_count = min(fixed_count, max_fixed_counters);
+  pmu.gp_counter_mask     = (gp_width >= 64) ? ~0ull : (1ull << gp_width) - 1;
+  pmu.fixed_counter_mask  = (fixed_width >= 64) ? ~0ull : (1ull << fixed_width) - 1;
+
+  // IA32_PERF_CAPABILITIES is only available if PDCM is supported
+  pmu.gp_counter_write_msr = 0;
+  if (cpu->cached.cpuid_01.cpuid_feature_information_ecx.perfmon_and_debug_capability &&
+      (__readmsr(IA32_PERF_CAPABILITIES) & perf_capabilities_full_width_write))
+    pmu.gp_counter_write_msr = IA32_A_PMC0;
+
+  refresh_pmu_config(cpu);
+}
+
+// read the counter configuration MSRs into the cache (used when switching
+// from an exit profile that doesn't intercept them)
+void refresh_pmu_config(vcpu* const cpu) {
+  auto& pmu = cpu->pmu;
+
+  pmu.fixed_ctr_ctrl = (pmu.fixed_counter_count > 0) ? __readmsr(IA32_FIXED_CTR_CTRL) : 0;
+
+  for (uint32_t i = 0; i < pmu.gp_counter_count; ++i)
+    pmu.perfevtsel[i] = __readmsr(IA32_PERFEVTSEL0 + i);
+
+  update_compensated_counters(pmu);
+}
+
+// WRMSR handler for IA32_FIXED_CTR_CTRL and IA32_PERFEVTSELx
+bool write_pmu_config(vcpu* const cpu, uint32_t const msr, uint64_t const value) {
+  auto& pmu = cpu->pmu;
+
+  // counters that are reserved for vm-exit profiling keep their host
+  // configuration (the guest value is applied once they're given back)
+  auto const reserved = pmu.exit_pmc_profiling &&
+    msr - IA32_PERFEVTSEL0 >= pmu.exit_pmc_first_counter &&
+    msr - IA32_PERFEVTSEL0 < pmu.gp_counter_count;
+
+  if (!reserved) {
+    host_exception_info e;
+    wrmsr_safe(e, msr, value);
+
+    if (e.exception_occurred)
+      return false;
+  }
+
+  if (msr == IA32_FIXED_CTR_CTRL)
+    pmu.fixed_ctr_ctrl = value;
+  else if (msr - IA32_PERFEVTSEL0 < pmu.gp_counter_count)
+    pmu.perfevtsel[msr - IA32_PERFEVTSEL0] = value;
+
+  update_compensated_counters(pmu);
+
+  return true;
+}
+
+// reserve the last general-purpose counters for counting host events across
+// every vm-exit (these counters can't be used by the guest in the meantime)
+bool set_exit_pmc_profiling(vcpu* const cpu, bool const enabled) {
+  auto& pmu = cpu->pmu;
+
+  if (enabled == pmu.exit_pmc_profiling)
+    return true;
+
+  if (enabled && pmu.gp_counter_count < exit_pmc_count)
+    return false;
+
+  pmu.exit_pmc_first_counter = pmu.gp_counter_count - exit_pmc_count;
+
+  uint64_t host_perf_global_ctrl = 0;
+
+  for (uint32_t i = 0; i < exit_pmc_count; ++i) {
+    auto const counter = pmu.exit_pmc_first_counter + i;
+
+    if (enabled) {
+      // the counters are only enabled in root-mode (through the host
+      // PERF_GLOBAL_CTRL), so they can count in every ring
+      __writemsr(IA32_PERFEVTSEL0 + counter, exit_pmc_event_selects[i]
+        | perfevtsel_usr_flag | perfevtsel_os_flag | perfevtsel_en_flag);
+      host_perf_global_ctrl |= 1ull << counter;
+    }
+    else {
+      // give the counter back to the guest
+      __writemsr(IA32_PERFEVTSEL0 + counter, pmu.perfevtsel[counter]);
+    }
+  }
+
+  // PERF_GLOBAL_CTRL is loaded from this field on every vm-exit
+  vmx_vmwrite(VMCS_HOST_PERF_GLOBAL_CTRL, host_perf_global_ctrl);
+
+  pmu.exit_pmc_profiling = enabled;
+  update_compensated_counters(pmu);
+
+  return true;
+}
+
+// read the host counters at the start of a vm-exit
+void start_exit_pmc_sample(vcpu* const cpu) {
+  auto& pmu = cpu->pmu;
+
+  if (!pmu.exit_pmc_profiling)
+    return;
+
+  for (uint32_t i = 0; i < exit_pmc_count; ++i)
+    pmu.exit_pmc_start[i] = __readpmc(pmu.exit_pmc_first_counter + i);
+}
+
+// add the host counter deltas to the statistics of the exit reason
+void end_exit_pmc_sample(vcpu* const cpu, vmx_vmexit_reason const reason) {
+  auto const& pmu = cpu->pmu;
+
+  if (!pmu.exit_pmc_profiling || reason.basic_exit_reason >= vm_exit_reason_count)
+    return;
+
+  auto& sum = cpu->exit_stats->pmc_sum[reason.basic_exit_reason];
+
+  for (uint32_t i = 0; i < exit_pmc_count; ++i) {
+    auto const end = __readpmc(pmu.exit_pmc_first_counter + i);
+    sum[i] += (end - pmu.exit_pmc_start[i]) & pmu.gp_counter_mask;
+  }
+
+  ++cpu->exit_stats->pmc_samples[reason.basic_exit_reason];
+}
+
+// subtract the root-mode part of the vm-exit overhead from every enabled
+// counter. the calibrated overhead already excludes the native cost of the
+// exiting instruction (see set_vm_exit_overhead()), so a virtualized CPUID
+// still retires one instruction and takes as many cycles as it would natively.
+void compensate_pmu_counters(vcpu* const cpu,
+    vm_exit_overhead const& overhead, uint64_t const perf_global_ctrl) {
+  auto const& pmu = cpu->pmu;
+
+  if (pmu.compensated_count == 0)
+    return;
+
+  // OS counts CPL 0, USR counts CPL 1-3
+  auto const kernel_mode = (current_guest_cpl() == 0);
+
+  for (uint32_t i = 0; i < pmu.compensated_count; ++i) {
+    auto const& c = pmu.compensated[i];
+
+    if (!(perf_global_ctrl & c.global_ctrl_mask) || !(kernel_mode ? c.os : c.usr))
+      continue;
+
+    auto const value = get_event_overhead(overhead, c.event);
+    if (!value)
+      continue;
+
+    auto const mask = (c.msr >= IA32_FIXED_CTR0 && c.msr < IA32_FIXED_CTR0 + max_fixed_counters)
+      ? pmu.fixed_counter_mask : pmu.gp_counter_mask;
+
+    __writemsr(c.msr, (__readmsr(c.msr) - value) & mask);
+  }
+}
+
+} // namespace hv
+
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+struct vm_exit_overhead;
+
+// maximum number of general-purpose performance counters that are tracked
+inline constexpr uint32_t max_gp_counters = 8;
+
+// maximum number of fixed-function performance counters that are tracked
+inline constexpr uint32_t max_fixed_counters = 3;
+
+// host events that are counted across handle_vm_exit() when vm-exit PMC
+// profiling is enabled (see set_exit_pmc_profiling())
+enum exit_pmc_event : uint8_t {
+  // INST_RETIRED.ANY
+  exit_pmc_instructions = 0,
+
+  // LONGEST_LAT_CACHE.MISS
+  exit_pmc_llc_misses,
+
+  // DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK
+  exit_pmc_dtlb_misses,
+
+  exit_pmc_count
+};
+
+// performance monitoring events that vm-exit overhead is calibrated for
+enum pmu_event : uint8_t {
+  // any other event (which isn't compensated)
+  pmu_event_none = 0,
+
+  // INST_RETIRED.ANY
+  pmu_event_instructions,
+
+  // CPU_CLK_UNHALTED.CORE
+  pmu_event_core_cycles,
+
+  // CPU_CLK_UNHALTED.REF_TSC
+  pmu_event_ref_cycles
+};
+
+// a counter that needs to be compensated on vm-exits
+struct pmu_compensated_counter {
+  // the MSR that is used to write to the counter
+  uint32_t msr;
+
+  pmu_event event;
+
+  // whether the counter counts in ring-0 and in rings 1-3
+  bool os;
+  bool usr;
+
+  // the enable bit for this counter in IA32_PERF_GLOBAL_CTRL
+  uint64_t global_ctrl_mask;
+};
+
+struct vcpu_pmu_data {
+  // CPUID 0x0A
+  uint32_t gp_counter_count;
+  uint32_t fixed_counter_count;
+  uint64_t gp_counter_mask;
+  uint64_t fixed_counter_mask;
+
+  // IA32_A_PMC0 if full-width writes are supported, 0 otherwise
+  uint32_t gp_counter_write_msr;
+
+  // cached guest counter configuration (updated on MSR-write exits)
+  uint64_t fixed_ctr_ctrl;
+  uint64_t perfevtsel[max_gp_counters];
+
+  // counters that are configured to count an event that we compensate
+  uint32_t compensated_count;
+  pmu_compensated_counter compensated[max_fixed_counters + max_gp_counters];
+
+  // whether the last exit_pmc_count general-purpose counters are reserved
+  // for profiling vm-exits
+  bool exit_pmc_profiling;
+  uint32_t exit_pmc_first_counter;
+
+  // counter values at the start of the current vm-exit
+  uint64_t exit_pmc_start[exit_pmc_count];
+};
+
+// initialize the PMU state by reading the current counter configuration
+void prepare_pmu(vcpu* cpu);
+
+// read the counter configuration MSRs into the cache (used when switching
+// from an exit profile that doesn't intercept them)
+void refresh_pmu_config(vcpu* cpu);
+
+// WRMSR handler for IA32_FIXED_CTR_CTRL and IA32_PERFEVTSELx
+bool write_pmu_config(vcpu* cpu, uint32_t msr, uint64_t value);
+
+// reserve the last general-purpose counters for counting host events across
+// every vm-exit (these counters can't be used by the guest in the meantime)
+bool set_exit_pmc_profiling(vcpu* cpu, bool enabled);
+
+// read the host counters at the start of a vm-exit
+void start_exit_pmc_sample(vcpu* cpu);
+
+// add the host counter deltas to the statistics of the exit reason
+void end_exit_pmc_sample(vcpu* cpu, vmx_vmexit_reason reason);
+
+// subtract the root-mode part of the vm-exit overhead from every enabled
+// counter (the exiting instruction still counts as much as it would natively)
+void compensate_pmu_counters(vcpu* cpu,
+  vm_exit_overhead const& overhead, uint64_t perf_global_ctrl);
+
+} // namespace hv
+
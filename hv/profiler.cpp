@@ -0,0 +1,198 @@
+#include "profiler.h"
+#include "introspection.h"
+#include "hv.h"
+#include "mm.h"
+#include "vcpu.h"
+
+namespace hv {
+
+// read a qword of guest memory through the guest page tables
+static bool read_guest_qword(vcpu* const cpu, cr3 const guest_cr3,
+    uint64_t const address, uint64_t& value) {
+  size_t offset_to_next_page = 0;
+  auto const hva = gva2hva(guest_cr3, reinterpret_cast<void*>(address),
+    &offset_to_next_page, &cpu->exit_capture);
+
+  if (!hva || offset_to_next_page < 8)
+    return false;
+
+  value = *static_cast<uint64_t*>(hva);
+  return true;
+}
+
+// walk the RBP chain of the guest. this only produces useful stacks for
+// code that is compiled with frame pointers--unwinding through .pdata
+// isn't feasible in root-mode.
+static uint8_t walk_guest_stack(vcpu* const cpu, cr3 const guest_cr3,
+    uint64_t (&frames)[max_sample_stack_depth]) {
+  auto rbp = cpu->ctx->rbp;
+  uint8_t count = 0;
+
+  while (count < max_sample_stack_depth && rbp && !(rbp & 7)) {
+    uint64_t next_rbp, return_address;
+
+    // [RBP] is the caller's RBP and [RBP+8] is the return address
+    if (!read_guest_qword(cpu, guest_cr3, rbp, next_rbp) ||
+        !read_guest_qword(cpu, guest_cr3, rbp + 8, return_address) || !return_address)
+      break;
+
+    frames[count++] = return_address;
+
+    // the stack grows down, so caller frames are always at higher addresses
+    if (next_rbp <= rbp || next_rbp - rbp > max_stack_frame_size)
+      break;
+
+    rbp = next_rbp;
+  }
+
+  return count;
+}
+
+// lower the preemption timer so that it fires at the next sample deadline
+// (this is called right before every vm-entry)
+void arm_sampling_timer(vcpu* const cpu) {
+  auto const interval = ghv.sampling_interval;
+  if (!interval)
+    return;
+
+  auto& profiler = cpu->profiler;
+  auto const now = __rdtsc();
+
+  // sampling was just enabled
+  if (!profiler.next_sample_tsc)
+    profiler.next_sample_tsc = now + interval;
+
+  auto const remaining = (profiler.next_sample_tsc > now)
+    ? (profiler.next_sample_tsc - now) : 0;
+
+  // the preemption timer counts down at a rate proportional to the TSC
+  auto const ticks = max(2,
+    remaining >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+
+  cpu->preemption_timer = min(cpu->preemption_timer, ticks);
+}
+
+// take a sample if the sampling deadline has passed (this is called on
+// VMX-preemption timer vm-exits)
+void take_profiler_sample(vcpu* const cpu) {
+  auto const interval = ghv.sampling_interval;
+  auto& profiler = cpu->profiler;
+
+  if (!interval) {
+    profiler.next_sample_tsc = 0;
+    return;
+  }
+
+  auto const now = __rdtsc();
+
+  // the timer was armed for some other reason (see hide_vm_exit_overhead())
+  if (now < profiler.next_sample_tsc)
+    return;
+
+  profiler.next_sample_tsc = now + interval;
+
+  auto& ring = *profiler.ring;
+
+  if (ring.head - ring.tail >= sample_ring_count) {
+    ++ring.dropped;
+    return;
+  }
+
+  cr3 guest_cr3;
+  guest_cr3.flags = vmx_vmread(VMCS_GUEST_CR3);
+
+  auto& sample = ring.samples[ring.head & (sample_ring_count - 1)];
+  sample.tsc         = now;
+  sample.rip         = vmx_vmread(VMCS_GUEST_RIP);
+  sample.cr3         = guest_cr3.flags;
+  sample.cpl         = static_cast<uint8_t>(current_guest_cpl());
+  sample.vcpu_index  = static_cast<uint16_t>(cpu - ghv.vcpus);
+  sample.frame_count = walk_guest_stack(cpu, guest_cr3, sample.frames);
+
+  // EPROCESS::UniqueProcessId
+  auto const process = reinterpret_cast<uint8_t*>(current_guest_eprocess());
+  sample.pid = process ? *reinterpret_cast<uint64_t*>(
+    process + ghv.eprocess_unique_process_id_offset) : 0;
+
+  // the sample needs to be visible before the consumer sees the new head
+  _WriteBarrier();
+  ring.head = ring.head + 1;
+
+  auto const fill = ring.head - ring.tail;
+  check_ring_watermark(cpu, fill - 1, fill, sample_ring_count);
+}
+
+// read the next sample from a sample ring (returns false if it is empty)
+bool read_profiler_sample(vcpu_sample_ring& ring, profiler_sample& sample) {
+  auto const tail = ring.tail;
+
+  if (tail == ring.head)
+    return false;
+
+  // make sure the sample isn't read before the head
+  _ReadBarrier();
+
+  sample = ring.samples[tail & (sample_ring_count - 1)];
+
+  // the producer can reuse the sample once it has been copied
+  _ReadWriteBarrier();
+  ring.tail = tail + 1;
+
+  return true;
+}
+
+// sample every VCPU once every interval TSC ticks (0 disables sampling)
+void set_sampling_interval(uint64_t const interval) {
+  ghv.sampling_interval = interval;
+}
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's sample ring and append the samples to a file (which
+// is created if it doesn't exist). returns the number of samples written.
+uint64_t write_profiler_samples(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!ghv.sample_rings)
+    return 0;
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, FILE_APPEND_DATA | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the profiler sample file.\n");
+    return 0;
+  }
+
+  uint64_t count = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    profiler_sample sample;
+
+    while (read_profiler_sample(ghv.sample_rings[i], sample)) {
+      if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+          &sample, sizeof(sample), nullptr, nullptr)))
+        break;
+
+      ++count;
+    }
+  }
+
+  ZwClose(file);
+
+  return count;
+}
+
+#endif
+
+} // namespace hv
+
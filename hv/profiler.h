@@ -0,0 +1,90 @@
+#pragma once
+
+#include <ia32.hpp>
+
+namespace hv {
+
+struct vcpu;
+
+// maximum number of return addresses in a sample's call stack
+inline constexpr uint32_t max_sample_stack_depth = 27;
+
+// number of samples in a sample ring (must be a power of two)
+inline constexpr uint32_t sample_ring_count = 256;
+
+static_assert((sample_ring_count & (sample_ring_count - 1)) == 0);
+
+// RBP-chain frames that are further apart than this end the stack walk
+inline constexpr uint64_t max_stack_frame_size = 0x10000;
+
+// sampling is disabled until a client sets an interval with the
+// set_sampling_interval hypercall
+inline constexpr uint64_t default_sampling_interval = 0;
+
+// file that the samples are written to by the device
+inline constexpr wchar_t const* profiler_sample_path =
+  L"\\SystemRoot\\hv-samples.bin";
+
+// the guest state at the time that the sampling timer fired
+struct profiler_sample {
+  uint64_t tsc;
+  uint64_t rip;
+  uint64_t cr3;
+  uint64_t pid;
+  uint8_t cpl;
+  uint8_t frame_count;
+  uint16_t vcpu_index;
+  uint32_t _reserved;
+
+  // return addresses (innermost first)
+  uint64_t frames[max_sample_stack_depth];
+};
+
+static_assert(sizeof(profiler_sample) == 256);
+
+// single-producer (the VCPU in root mode), single-consumer sample ring
+struct vcpu_sample_ring {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of samples that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  alignas(64) profiler_sample samples[sample_ring_count];
+};
+
+struct vcpu_profiler_data {
+  // sample ring (this lives in ghv.sample_rings)
+  vcpu_sample_ring* ring;
+
+  // TSC value that the next sample should be taken at
+  uint64_t next_sample_tsc;
+};
+
+// lower the preemption timer so that it fires at the next sample deadline
+// (this is called right before every vm-entry)
+void arm_sampling_timer(vcpu* cpu);
+
+// take a sample if the sampling deadline has passed (this is called on
+// VMX-preemption timer vm-exits)
+void take_profiler_sample(vcpu* cpu);
+
+// read the next sample from a sample ring (returns false if it is empty)
+bool read_profiler_sample(vcpu_sample_ring& ring, profiler_sample& sample);
+
+// sample every VCPU once every interval TSC ticks (0 disables sampling)
+void set_sampling_interval(uint64_t interval);
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's sample ring and append the samples to a file (which
+// is created if it doesn't exist). returns the number of samples written.
+uint64_t write_profiler_samples(wchar_t const* path);
+
+#endif
+
+} // namespace hv
+
@@ -0,0 +1,378 @@
+#include "simulator.h"
+#include "platform.h"
+#include "page-tables.h"
+#include "vmx-sim.h"
+#include "vcpu.h"
+#include "hv.h"
+
+// the simulated machine for the portable build (see simulator.h). this file
+// is never compiled into the driver.
+
+namespace hv {
+
+// the driver defines this in hv.cpp, which isn't part of the portable build
+hypervisor ghv;
+
+// defined in vcpu.cpp
+bool handle_vm_exit(guest_context* ctx);
+
+// guest registers that aren't stored in the VMCS
+static guest_context simulated_guest_ctx;
+
+// the event that was injected on the last simulated vm-entry
+static vmentry_interrupt_information last_injection;
+
+// the guest GDT, TSS, and IDT. these are only ever accessed through their
+// base addresses (e.g. by __segmentlimit() or when copying the guest IDT),
+// so they don't need to be inside of the physical memory image.
+static uint64_t simulated_gdt[11];
+static uint8_t  simulated_tss[0x68];
+static uint8_t  simulated_idt[0x1000];
+
+// allocate zeroed memory in the physical memory image
+static void* allocate_simulated(size_t const size) {
+  return allocate_physical_pages((size + 0xFFF) / 0x1000);
+}
+
+// the physical address of an address inside of the physical memory image
+static uint64_t simulated_phys(void* const address) {
+  return MmGetPhysicalAddress(address).QuadPart;
+}
+
+// identity-map the physical memory image with 2MB pages
+static uint64_t build_guest_page_tables() {
+  auto const pml4 = static_cast<pml4e_64*>(allocate_physical_pages(1));
+  auto const pdpt = static_cast<pdpte_64*>(allocate_physical_pages(1));
+
+  pml4[0].present           = 1;
+  pml4[0].write             = 1;
+  pml4[0].supervisor        = 1;
+  pml4[0].page_frame_number = simulated_phys(pdpt) >> 12;
+
+  auto const memory_size = physical_memory_image_size();
+  auto const pd_count    = (memory_size + (1ull << 30) - 1) >> 30;
+
+  for (uint64_t i = 0; i < pd_count; ++i) {
+    auto const pd = static_cast<pde_2mb_64*>(allocate_physical_pages(1));
+
+    pdpt[i].present           = 1;
+    pdpt[i].write             = 1;
+    pdpt[i].supervisor        = 1;
+    pdpt[i].page_frame_number = simulated_phys(pd) >> 12;
+
+    for (uint64_t j = 0; j < 512 && ((i << 9) + j) * 0x200000 < memory_size; ++j) {
+      pd[j].present           = 1;
+      pd[j].write             = 1;
+      pd[j].supervisor        = 1;
+      pd[j].large_page        = 1;
+      pd[j].page_frame_number = (i << 9) + j;
+    }
+  }
+
+  return simulated_phys(pml4);
+}
+
+// a GDT that looks like the one that windows uses
+static void build_guest_gdt() {
+  auto const tss = reinterpret_cast<uint64_t>(simulated_tss);
+
+  memset(simulated_gdt, 0, sizeof(simulated_gdt));
+  simulated_gdt[2]  = 0x00209B0000000000; // 0x10: ring-0 code (64-bit)
+  simulated_gdt[3]  = 0x00CF93000000FFFF; // 0x18: ring-0 data
+  simulated_gdt[4]  = 0x00CFFB000000FFFF; // 0x20: ring-3 code (32-bit)
+  simulated_gdt[5]  = 0x00CFF3000000FFFF; // 0x28: ring-3 data
+  simulated_gdt[6]  = 0x0020FB0000000000; // 0x30: ring-3 code (64-bit)
+  simulated_gdt[10] = 0x0040F30000003C00; // 0x50: ring-3 TEB (32-bit)
+
+  // 0x40: busy 64-bit TSS
+  simulated_gdt[8] = (sizeof(simulated_tss) - 1) | ((tss & 0xFFFFFF) << 16) |
+    (0x8Bull << 40) | (((tss >> 24) & 0xFF) << 56);
+  simulated_gdt[9] = tss >> 32;
+
+  simulated_cpu.gdtr.base_address = reinterpret_cast<uint64_t>(simulated_gdt);
+  simulated_cpu.gdtr.limit        = sizeof(simulated_gdt) - 1;
+  simulated_cpu.idtr.base_address = reinterpret_cast<uint64_t>(simulated_idt);
+  simulated_cpu.idtr.limit        = sizeof(simulated_idt) - 1;
+
+  simulated_cpu.cs   = 0x10;
+  simulated_cpu.ss   = 0x18;
+  simulated_cpu.ds   = 0x2B;
+  simulated_cpu.es   = 0x2B;
+  simulated_cpu.fs   = 0x53;
+  simulated_cpu.gs   = 0x2B;
+  simulated_cpu.tr   = 0x40;
+  simulated_cpu.ldtr = 0;
+}
+
+// VMX capabilities of the simulated processor
+static void set_simulated_vmx_msrs() {
+  // lock bit and VMX outside of SMX
+  set_simulated_msr(IA32_FEATURE_CONTROL, 0b101);
+
+  // revision 1, 4KB VMCS, write-back, INS/OUTS info, true controls
+  set_simulated_msr(IA32_VMX_BASIC, 1 | (0x1000ull << 32) |
+    (6ull << 50) | (1ull << 54) | (1ull << 55));
+
+  static constexpr uint32_t control_msrs[] = {
+    IA32_VMX_PINBASED_CTLS, IA32_VMX_PROCBASED_CTLS, IA32_VMX_EXIT_CTLS,
+    IA32_VMX_ENTRY_CTLS, IA32_VMX_PROCBASED_CTLS2, IA32_VMX_TRUE_PINBASED_CTLS,
+    IA32_VMX_TRUE_PROCBASED_CTLS, IA32_VMX_TRUE_EXIT_CTLS, IA32_VMX_TRUE_ENTRY_CTLS
+  };
+
+  // every control can be 0 or 1
+  for (auto const msr : control_msrs)
+    set_simulated_msr(msr, 0xFFFF'FFFF'0000'0000);
+
+  // preemption timer rate of 5, LMA is stored, every activity state, 4 CR3
+  // targets. VMWRITE to the vm-exit information fields is NOT supported, so
+  // that writes to read-only fields are caught.
+  set_simulated_msr(IA32_VMX_MISC, 5 | (1 << 5) | (0b111 << 6) | (4 << 16));
+
+  // PE, NE, and PG are fixed to 1. VMXE is fixed to 1.
+  set_simulated_msr(IA32_VMX_CR0_FIXED0, 0x8000'0021);
+  set_simulated_msr(IA32_VMX_CR0_FIXED1, 0xFFFF'FFFF);
+  set_simulated_msr(IA32_VMX_CR4_FIXED0, CR4_VMX_ENABLE_FLAG);
+  set_simulated_msr(IA32_VMX_CR4_FIXED1, 0x00FF'FFFF);
+
+  // execute-only, 4-level walks, UC/WB, 2MB/1GB pages, INVEPT and INVVPID
+  // with every type, accessed and dirty flags
+  set_simulated_msr(IA32_VMX_EPT_VPID_CAP, 0x00000F01'06734141);
+
+  set_simulated_msr(IA32_VMX_VMFUNC, 0);
+}
+
+// architectural MSRs that are read or written by hv
+static void set_simulated_arch_msrs() {
+  // every memory range is write-back
+  set_simulated_msr(IA32_MTRR_CAPABILITIES, 0);
+  set_simulated_msr(IA32_MTRR_DEF_TYPE, (1 << 11) | MEMORY_TYPE_WRITE_BACK);
+
+  set_simulated_msr(IA32_PAT, 0x0007'0406'0007'0406);
+  set_simulated_msr(IA32_EFER, 0xD01);
+  set_simulated_msr(IA32_DEBUGCTL, 0);
+  set_simulated_msr(IA32_SYSENTER_CS, 0);
+  set_simulated_msr(IA32_SYSENTER_ESP, 0);
+  set_simulated_msr(IA32_SYSENTER_EIP, 0);
+  set_simulated_msr(IA32_STAR, 0);
+  set_simulated_msr(IA32_LSTAR, 0);
+  set_simulated_msr(IA32_CSTAR, 0);
+  set_simulated_msr(IA32_FMASK, 0);
+  set_simulated_msr(IA32_KERNEL_GS_BASE, 0);
+  set_simulated_msr(IA32_TSC_AUX, 0);
+  set_simulated_msr(IA32_PERF_CAPABILITIES, 0);
+  set_simulated_msr(IA32_PERF_GLOBAL_CTRL, 0);
+  set_simulated_msr(IA32_FIXED_CTR_CTRL, 0);
+  set_simulated_msr(IA32_MPERF, 0);
+  set_simulated_msr(IA32_APERF, 0);
+}
+
+// reset the simulated processor to the state that windows runs in
+static void reset_simulated_processor() {
+  memset(&simulated_cpu, 0, sizeof(simulated_cpu));
+
+  simulated_cpu.cr0    = 0x8005'0033;
+  simulated_cpu.cr4    = 0x0035'06F8 & ~CR4_VMX_ENABLE_FLAG;
+  simulated_cpu.cr3    = build_guest_page_tables();
+  simulated_cpu.xcr0   = 0b11;
+  simulated_cpu.rflags = 0x202;
+  simulated_cpu.dr[6]  = 0xFFFF'0FF0;
+  simulated_cpu.dr[7]  = 0x400;
+
+  build_guest_gdt();
+}
+
+// allocate the hypervisor and its VCPU (like create() in hv.cpp)
+static bool create_simulated_hypervisor() {
+  memset(&ghv, 0, sizeof(ghv));
+
+  ghv.vcpu_count = 1;
+  ghv.vcpus = static_cast<vcpu*>(allocate_simulated(sizeof(vcpu)));
+  ghv.exit_stats = static_cast<vcpu_exit_stats*>(allocate_simulated(sizeof(vcpu_exit_stats)));
+  ghv.log_rings = static_cast<vcpu_log_ring*>(allocate_simulated(sizeof(vcpu_log_ring)));
+  ghv.sample_rings = static_cast<vcpu_sample_ring*>(allocate_simulated(sizeof(vcpu_sample_ring)));
+  ghv.syscall_rings = static_cast<vcpu_syscall_ring*>(allocate_simulated(sizeof(vcpu_syscall_ring)));
+  ghv.cr3_rings = static_cast<vcpu_cr3_ring*>(allocate_simulated(sizeof(vcpu_cr3_ring)));
+  ghv.exit_capture_rings = static_cast<vcpu_exit_capture_ring*>(
+    allocate_simulated(sizeof(vcpu_exit_capture_ring)));
+
+  if (!ghv.vcpus || !ghv.exit_stats || !ghv.log_rings || !ghv.sample_rings ||
+      !ghv.syscall_rings || !ghv.cr3_rings || !ghv.exit_capture_rings) {
+    DbgPrint("[hv] Failed to allocate the simulated hypervisor.\n");
+    return false;
+  }
+
+  ghv.vcpus->exit_stats            = ghv.exit_stats;
+  ghv.vcpus->log_ring              = ghv.log_rings;
+  ghv.vcpus->profiler.ring         = ghv.sample_rings;
+  ghv.vcpus->syscall_trace.ring    = ghv.syscall_rings;
+  ghv.vcpus->cr3_telemetry.ring    = ghv.cr3_rings;
+  ghv.vcpus->exit_capture.ring     = ghv.exit_capture_rings;
+
+  ghv.current_exit_profile = default_exit_profile;
+  ghv.tail_latency_budget  = default_tail_latency_budget;
+  ghv.runtime_log_level    = default_log_level;
+  ghv.sampling_interval    = default_sampling_interval;
+
+  ghv.exit_traces = static_cast<vcpu_exit_trace*>(
+    allocate_simulated(sizeof(vcpu_exit_trace)));
+  ghv.exit_trace_readers = static_cast<exit_trace_reader*>(
+    allocate_simulated(sizeof(exit_trace_reader)));
+
+  if (!ghv.exit_traces || !ghv.exit_trace_readers) {
+    DbgPrint("[hv] Failed to allocate the simulated VM-exit trace ring.\n");
+    return false;
+  }
+
+  // the first record is always a sync record
+  ghv.exit_traces->enabled = exit_tracing_default;
+  ghv.exit_traces->sync    = true;
+  ghv.vcpus->exit_trace    = ghv.exit_traces;
+
+  init_exit_trace_reader(*ghv.exit_trace_readers, ghv.exit_traces);
+
+  // the same offsets that find_offsets() hardcodes
+  ghv.kprocess_directory_table_base_offset = 0x28;
+  ghv.kpcr_pcrb_offset                     = 0x180;
+  ghv.kprcb_current_thread_offset          = 0x8;
+  ghv.kapc_state_process_offset            = 0x20;
+
+  ghv.system_cr3.flags = simulated_cpu.cr3;
+
+  prepare_host_page_tables();
+
+  return true;
+}
+
+// create the simulated machine and virtualize its processor
+bool start_simulated_hypervisor(size_t const physical_memory_size) {
+  // a single guest PDPT identity-maps up to 512GB
+  if (physical_memory_size > (512ull << 30))
+    return false;
+
+  if (!create_physical_memory_image(physical_memory_size))
+    return false;
+
+  reset_simulated_vmx();
+  set_simulated_vmx_msrs();
+  set_simulated_arch_msrs();
+  reset_simulated_processor();
+
+  memset(&simulated_guest_ctx, 0, sizeof(simulated_guest_ctx));
+  last_injection.flags = 0;
+
+  if (!create_simulated_hypervisor())
+    return false;
+
+  // vmcs.cpp, the exit profile, and the initial ping/calibration vmcalls
+  // all run exactly like they do on real hardware
+  if (!virtualize_cpu(ghv.vcpus)) {
+    stop_simulated_hypervisor();
+    return false;
+  }
+
+  return true;
+}
+
+// devirtualize the simulated processor and free the machine
+void stop_simulated_hypervisor() {
+  if (ghv.vcpus && read_simulated_vmcs(VMCS_HOST_FS_BASE)) {
+    hypercall_input input = {};
+    input.code = hypercall_unload;
+    input.key  = hypercall_key;
+    vmx_vmcall(input);
+  }
+
+  reset_simulated_vmx();
+  destroy_physical_memory_image();
+  memset(&ghv, 0, sizeof(ghv));
+}
+
+// the VCPU of the simulated processor
+vcpu* simulated_vcpu() {
+  return ghv.vcpus;
+}
+
+// the guest general-purpose registers (RSP, RIP, and RFLAGS are in the VMCS)
+guest_context& simulated_guest_context() {
+  return simulated_guest_ctx;
+}
+
+// cause a vm-exit on the simulated processor and call handle_vm_exit().
+// returns false if the processor was devirtualized by the exit.
+bool simulate_vm_exit(simulated_vm_exit const& exit) {
+  vmx_vmexit_reason reason;
+  reason.flags             = 0;
+  reason.basic_exit_reason = exit.reason;
+
+  // 28.2
+  write_simulated_vmcs(VMCS_EXIT_REASON,                    reason.flags);
+  write_simulated_vmcs(VMCS_EXIT_QUALIFICATION,             exit.qualification);
+  write_simulated_vmcs(VMCS_EXIT_GUEST_LINEAR_ADDRESS,      exit.guest_linear_address);
+  write_simulated_vmcs(VMCS_GUEST_PHYSICAL_ADDRESS,         exit.guest_physical_address);
+  write_simulated_vmcs(VMCS_VMEXIT_INSTRUCTION_LENGTH,      exit.instruction_length);
+  write_simulated_vmcs(VMCS_VMEXIT_INSTRUCTION_INFO,        exit.instruction_info);
+  write_simulated_vmcs(VMCS_VMEXIT_INTERRUPTION_INFORMATION, exit.interruption_info);
+  write_simulated_vmcs(VMCS_VMEXIT_INTERRUPTION_ERROR_CODE, exit.interruption_error_code);
+
+  // 28.5: load the host state
+  simulated_cpu.fs_base = read_simulated_vmcs(VMCS_HOST_FS_BASE);
+  simulated_cpu.gs_base = read_simulated_vmcs(VMCS_HOST_GS_BASE);
+
+  if (handle_vm_exit(&simulated_guest_ctx)) {
+    // the guest state was already restored by handle_vm_exit()
+    last_injection.flags = 0;
+    return false;
+  }
+
+  // 27.3: load the guest state
+  simulated_cpu.fs_base = read_simulated_vmcs(VMCS_GUEST_FS_BASE);
+  simulated_cpu.gs_base = read_simulated_vmcs(VMCS_GUEST_GS_BASE);
+
+  // 27.6: the injected event is delivered, and the valid bit is cleared
+  last_injection.flags = static_cast<uint32_t>(
+    read_simulated_vmcs(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
+  write_simulated_vmcs(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, 0);
+
+  return true;
+}
+
+// the event that was injected on the last simulated vm-entry (the valid bit
+// is clear if nothing was injected)
+vmentry_interrupt_information last_injected_event() {
+  return last_injection;
+}
+
+// vm-launch.asm (the guest continues right after this call)
+bool vm_launch() {
+  write_simulated_vmcs(VMCS_GUEST_RSP, 0);
+  write_simulated_vmcs(VMCS_GUEST_RIP, 0);
+  return true;
+}
+
+// vm-exit.asm (never executed, only its address is written to the VMCS)
+void vm_exit() {}
+
+// VMCALL instruction (vmx.asm)
+uint64_t vmx_vmcall(hypercall_input& input) {
+  auto& ctx = simulated_guest_ctx;
+
+  static_assert(sizeof(input) == 7 * sizeof(uint64_t));
+  memcpy(&ctx.rax, &input, sizeof(uint64_t));
+
+  ctx.rcx = input.args[0];
+  ctx.rdx = input.args[1];
+  ctx.r8  = input.args[2];
+  ctx.r9  = input.args[3];
+  ctx.r10 = input.args[4];
+  ctx.r11 = input.args[5];
+
+  simulated_vm_exit exit = {};
+  exit.reason             = VMX_EXIT_REASON_EXECUTE_VMCALL;
+  exit.instruction_length = 3;
+  simulate_vm_exit(exit);
+
+  return ctx.rax;
+}
+
+} // namespace hv
+
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "guest-context.h"
+
+#include <ia32.hpp>
+
+// a simulated machine with a single processor that hv is loaded on in the
+// portable build. virtualize_cpu() and the vm-exit handlers run unmodified
+// on top of the software VMCS (see vmx-sim.h), the physical memory image,
+// and the simulated processor state (see platform.h).
+
+namespace hv {
+
+struct vcpu;
+
+// default size of the simulated physical memory (which the guest
+// identity-maps)
+inline constexpr size_t simulated_physical_memory_size = 256 * 0x100000;
+
+// vm-exit information that the processor writes to the VMCS (28.2)
+struct simulated_vm_exit {
+  // basic exit reason
+  uint16_t reason;
+
+  uint64_t qualification;
+  uint64_t guest_linear_address;
+  uint64_t guest_physical_address;
+
+  uint32_t instruction_length;
+  uint32_t instruction_info;
+
+  // VM-exit interruption information and error code
+  uint32_t interruption_info;
+  uint32_t interruption_error_code;
+};
+
+// create the simulated machine and virtualize its processor. the hypervisor
+// is allocated at the end of physical memory (see allocate_physical_pages()).
+bool start_simulated_hypervisor(
+  size_t physical_memory_size = simulated_physical_memory_size);
+
+// devirtualize the simulated processor and free the machine
+void stop_simulated_hypervisor();
+
+// the VCPU of the simulated processor
+vcpu* simulated_vcpu();
+
+// the guest general-purpose registers (RSP, RIP, and RFLAGS are in the VMCS)
+guest_context& simulated_guest_context();
+
+// cause a vm-exit on the simulated processor and call handle_vm_exit().
+// returns false if the processor was devirtualized by the exit.
+bool simulate_vm_exit(simulated_vm_exit const& exit);
+
+// the event that was injected on the last simulated vm-entry (the valid bit
+// is clear if nothing was injected)
+vmentry_interrupt_information last_injected_event();
+
+} // namespace hv
+
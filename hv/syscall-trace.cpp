@@ -0,0 +1,284 @@
+#include "syscall-trace.h"
+#include "hv.h"
+#include "mm.h"
+#include "vcpu.h"
+#include "vmx.h"
+
+namespace hv {
+
+// the first instruction of the syscall entry point, and what replaces it
+static constexpr uint8_t swapgs_bytes[] = { 0x0F, 0x01, 0xF8 };
+static constexpr uint8_t vmcall_bytes[] = { 0x0F, 0x01, 0xC1 };
+
+static_assert(sizeof(swapgs_bytes) == sizeof(vmcall_bytes));
+
+// called on every syscall entry (in root-mode)
+static void record_syscall(vcpu* const cpu) {
+  auto& trace  = cpu->syscall_trace;
+  auto& config = ghv.syscall_trace;
+  auto const ctx = cpu->ctx;
+
+  auto const number = ctx->rax;
+
+  if (config.filter_enabled && (number >= syscall_filter_size ||
+      !(config.filter[number / 64] & (1ull << (number % 64)))))
+    return;
+
+  auto const cr3 = vmx_vmread(VMCS_GUEST_CR3);
+
+  if (config.cr3 && (config.cr3 & ~0xFFFull) != (cr3 & ~0xFFFull))
+    return;
+
+  auto const sample_rate = config.sample_rate;
+  if (sample_rate > 1 && (trace.syscall_count++ % sample_rate) != 0)
+    return;
+
+  auto& ring = *trace.ring;
+
+  if (ring.head - ring.tail >= syscall_ring_record_count) {
+    ++ring.dropped;
+    return;
+  }
+
+  auto& record = ring.records[ring.head & (syscall_ring_record_count - 1)];
+  record.tsc     = __rdtsc();
+  record.cr3     = cr3;
+  record.number  = number;
+  record.args[0] = ctx->r10;
+  record.args[1] = ctx->rdx;
+  record.args[2] = ctx->r8;
+  record.args[3] = ctx->r9;
+
+  // the record needs to be visible before the consumer sees the new head
+  _WriteBarrier();
+  ring.head = ring.head + 1;
+
+  auto const fill = ring.head - ring.tail;
+  check_ring_watermark(cpu, fill - 1, fill, syscall_ring_record_count);
+}
+
+// start tracing every syscall that goes through IA32_LSTAR on the current VCPU
+bool enable_syscall_tracing(vcpu* const cpu) {
+  auto& trace = cpu->syscall_trace;
+
+  if (trace.entry)
+    return true;
+
+  // the syscall entry point (IA32_LSTAR isn't switched on vm-exits)
+  auto const entry  = __readmsr(IA32_LSTAR);
+  auto const offset = entry & 0xFFF;
+
+  // the VMCALL needs to fit in the same page
+  if (offset > 0x1000 - sizeof(vmcall_bytes))
+    return false;
+
+  auto const hva = static_cast<uint8_t*>(gva2hva(
+    reinterpret_cast<void*>(entry), nullptr, &cpu->exit_capture));
+  if (!hva)
+    return false;
+
+  // only SWAPGS is emulated
+  if (memcmp(hva, swapgs_bytes, sizeof(swapgs_bytes)) != 0)
+    return false;
+
+  auto const orig_pfn = static_cast<uint64_t>(hva - host_physical_memory_base) >> 12;
+
+  // the page is already hooked
+  if (find_ept_hook(cpu->ept, orig_pfn))
+    return false;
+
+  // the call counter also changes the execute access of its pages
+  if (page_has_counted_functions(cpu, orig_pfn))
+    return false;
+
+  if (!trace.exec_page) {
+    trace.exec_page = allocate_ept_free_page(cpu->ept, &trace.exec_pfn);
+    if (!trace.exec_page)
+      return false;
+  }
+
+  memcpy(trace.exec_page, hva - offset, 0x1000);
+  memcpy(trace.exec_page + offset, vmcall_bytes, sizeof(vmcall_bytes));
+
+  if (!install_ept_hook(cpu->ept, orig_pfn, trace.exec_pfn))
+    return false;
+
+  trace.entry    = entry;
+  trace.orig_pfn = orig_pfn;
+
+  return true;
+}
+
+// stop tracing syscalls on the current VCPU
+void disable_syscall_tracing(vcpu* const cpu) {
+  auto& trace = cpu->syscall_trace;
+
+  if (!trace.entry)
+    return;
+
+  remove_ept_hook(cpu->ept, trace.orig_pfn);
+  trace.entry = 0;
+}
+
+// handle a VMCALL vm-exit that might have been caused by the syscall entry
+// point (returns false if it wasn't)
+bool handle_syscall_entry(vcpu* const cpu) {
+  auto const entry = cpu->syscall_trace.entry;
+
+  if (!entry || vmx_vmread(VMCS_GUEST_RIP) != entry)
+    return false;
+
+  record_syscall(cpu);
+
+  // emulate the SWAPGS that the VMCALL replaced (IA32_KERNEL_GS_BASE isn't
+  // switched on vm-exits either)
+  auto const gs_base = vmx_vmread(VMCS_GUEST_GS_BASE);
+  vmx_vmwrite(VMCS_GUEST_GS_BASE, __readmsr(IA32_KERNEL_GS_BASE));
+  __writemsr(IA32_KERNEL_GS_BASE, gs_base);
+
+  skip_instruction();
+
+  return true;
+}
+
+// read the next record from a syscall ring (returns false if it is empty)
+bool read_syscall_record(vcpu_syscall_ring& ring, syscall_record& record) {
+  auto const tail = ring.tail;
+
+  if (tail == ring.head)
+    return false;
+
+  // make sure the record isn't read before the head
+  _ReadBarrier();
+
+  record = ring.records[tail & (syscall_ring_record_count - 1)];
+
+  // the producer can reuse the record once it has been copied
+  _ReadWriteBarrier();
+  ring.tail = tail + 1;
+
+  return true;
+}
+
+// enable or disable syscall tracing on every VCPU
+static bool set_syscall_tracing(bool const enabled) {
+  // we need to be running at an IRQL below DISPATCH_LEVEL so
+  // that KeSetSystemAffinityThreadEx takes effect immediately
+  NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+  bool success = true;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    hypercall_input input;
+    input.code    = hypercall_set_syscall_tracing;
+    input.key     = hypercall_key;
+    input.args[0] = enabled;
+    success &= (vmx_vmcall(input) != 0);
+
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+  }
+
+  return success;
+}
+
+// start tracing syscalls on every VCPU
+bool start_syscall_tracing() {
+  return set_syscall_tracing(true);
+}
+
+// stop tracing syscalls on every VCPU
+void stop_syscall_tracing() {
+  set_syscall_tracing(false);
+}
+
+// only record one out of every rate syscalls
+void set_syscall_sample_rate(uint64_t const rate) {
+  ghv.syscall_trace.sample_rate = rate;
+}
+
+// only record syscalls that are made by the specified address space
+// (0 records syscalls from every address space)
+void set_syscall_cr3_filter(uint64_t const cr3) {
+  ghv.syscall_trace.cr3 = cr3;
+}
+
+// record or ignore a specific syscall number. once any syscall is added
+// to the filter, every syscall that isn't in the filter is ignored.
+void set_syscall_filter(uint32_t const number, bool const record) {
+  if (number >= syscall_filter_size)
+    return;
+
+  auto& config = ghv.syscall_trace;
+  auto const mask = 1ull << (number % 64);
+
+  if (record)
+    InterlockedOr64(reinterpret_cast<LONG64 volatile*>(&config.filter[number / 64]), mask);
+  else
+    InterlockedAnd64(reinterpret_cast<LONG64 volatile*>(&config.filter[number / 64]), ~mask);
+
+  config.filter_enabled = true;
+}
+
+// record every syscall number again
+void clear_syscall_filter() {
+  auto& config = ghv.syscall_trace;
+
+  config.filter_enabled = false;
+
+  for (auto& bits : config.filter)
+    bits = 0;
+}
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's syscall ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of records written.
+uint64_t write_syscall_trace(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!ghv.syscall_rings)
+    return 0;
+
+  UNICODE_STRING name;
+  RtlInitUnicodeString(&name, path);
+
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, &name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE file;
+  IO_STATUS_BLOCK io_status;
+
+  if (!NT_SUCCESS(ZwCreateFile(&file, FILE_APPEND_DATA | SYNCHRONIZE, &attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT, nullptr, 0))) {
+    DbgPrint("[hv] Failed to open the syscall trace file.\n");
+    return 0;
+  }
+
+  uint64_t count = 0;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    syscall_record record;
+
+    while (read_syscall_record(ghv.syscall_rings[i], record)) {
+      if (!NT_SUCCESS(ZwWriteFile(file, nullptr, nullptr, nullptr, &io_status,
+          &record, sizeof(record), nullptr, nullptr)))
+        break;
+
+      ++count;
+    }
+  }
+
+  ZwClose(file);
+
+  return count;
+}
+
+#endif
+
+} // namespace hv
+
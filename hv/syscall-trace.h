@@ -0,0 +1,131 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Syscall tracing hooks the page that IA32_LSTAR points to with an EPT hook.
+// The executable page is a copy of the original page, except that the SWAPGS
+// at the syscall entry point is replaced with a VMCALL (both are 3 bytes).
+// Every syscall causes a single VMCALL vm-exit, where the syscall is recorded
+// and the SWAPGS is emulated. The rest of the page executes without exits.
+//
+
+namespace hv {
+
+struct vcpu;
+
+// number of records in a syscall ring (must be a power of two)
+inline constexpr uint32_t syscall_ring_record_count = 1024;
+
+static_assert((syscall_ring_record_count & (syscall_ring_record_count - 1)) == 0);
+
+// number of syscall numbers that can be filtered (ntoskrnl and win32k)
+inline constexpr uint32_t syscall_filter_size = 0x2000;
+
+// file that the syscall records are written to by the device
+inline constexpr wchar_t const* syscall_trace_path =
+  L"\\SystemRoot\\hv-syscalls.bin";
+
+struct syscall_record {
+  uint64_t tsc;
+  uint64_t cr3;
+  uint64_t number;
+
+  // R10, RDX, R8, and R9 (the syscall ABI uses R10 instead of RCX)
+  uint64_t args[4];
+
+  uint64_t _reserved;
+};
+
+static_assert(sizeof(syscall_record) == 64);
+
+// single-producer (the VCPU in root mode), single-consumer syscall ring
+struct vcpu_syscall_ring {
+  // written by the producer
+  alignas(64) uint64_t volatile head;
+
+  // number of records that were dropped because the ring was full
+  uint64_t volatile dropped;
+
+  // written by the consumer
+  alignas(64) uint64_t volatile tail;
+
+  alignas(64) syscall_record records[syscall_ring_record_count];
+};
+
+struct vcpu_syscall_trace_data {
+  // syscall ring (this lives in ghv.syscall_rings)
+  vcpu_syscall_ring* ring;
+
+  // number of syscalls that passed the filters (used for sampling)
+  uint64_t syscall_count;
+
+  // the syscall entry point that is being traced (0 if tracing is disabled)
+  uint64_t entry;
+
+  // physical page that contains the entry point
+  uint64_t orig_pfn;
+
+  // the EPT hook's executable page (taken from the EPT free pages the first
+  // time that tracing is enabled, and reused after that)
+  uint8_t* exec_page;
+  uint64_t exec_pfn;
+};
+
+// tracing settings that are shared between every VCPU
+struct syscall_trace_config {
+  // only record one out of every sample_rate syscalls (0 or 1 records all)
+  uint64_t volatile sample_rate;
+
+  // only record syscalls that are made by this address space (0 for all)
+  uint64_t volatile cr3;
+
+  // only record syscalls whose bit is set (if filter_enabled is set)
+  bool volatile filter_enabled;
+  uint64_t volatile filter[syscall_filter_size / 64];
+};
+
+// start tracing every syscall that goes through IA32_LSTAR on the current VCPU
+// (the entry point needs to start with SWAPGS)
+bool enable_syscall_tracing(vcpu* cpu);
+
+// stop tracing syscalls on the current VCPU
+void disable_syscall_tracing(vcpu* cpu);
+
+// handle a VMCALL vm-exit that might have been caused by the syscall entry
+// point (returns false if it wasn't)
+bool handle_syscall_entry(vcpu* cpu);
+
+// read the next record from a syscall ring (returns false if it is empty)
+bool read_syscall_record(vcpu_syscall_ring& ring, syscall_record& record);
+
+// start tracing syscalls on every VCPU
+bool start_syscall_tracing();
+
+// stop tracing syscalls on every VCPU
+void stop_syscall_tracing();
+
+// only record one out of every rate syscalls
+void set_syscall_sample_rate(uint64_t rate);
+
+// only record syscalls that are made by the specified address space
+// (0 records syscalls from every address space)
+void set_syscall_cr3_filter(uint64_t cr3);
+
+// record or ignore a specific syscall number. once any syscall is added
+// to the filter, every syscall that isn't in the filter is ignored.
+void set_syscall_filter(uint32_t number, bool record);
+
+// record every syscall number again
+void clear_syscall_filter();
+
+#ifndef HV_PORTABLE
+
+// drain every VCPU's syscall ring and append the records to a file (which
+// is created if it doesn't exist). returns the number of records written.
+uint64_t write_syscall_trace(wchar_t const* path);
+
+#endif
+
+} // namespace hv
+
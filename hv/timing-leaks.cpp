@@ -0,0 +1,363 @@
+#include "timing-leaks.h"
+#include "benchmark.h"
+#include "hv.h"
+#include "timing.h"
+
+#include <ntstrsafe.h>
+
+namespace hv {
+
+// counters that the probes are timed with
+static uint64_t read_tsc()     { return __rdtsc(); }
+static uint64_t read_mperf()   { return __readmsr(IA32_MPERF); }
+static uint64_t read_ref_tsc() { return __readmsr(IA32_FIXED_CTR2); }
+
+// instructions that cause a vm-exit
+static void execute_cpuid() {
+  int regs[4];
+  __cpuid(regs, 0);
+}
+static void execute_rdmsr() {
+  // this is intercepted by every exit profile (see msr-policy.cpp)
+  __readmsr(IA32_FEATURE_CONTROL);
+}
+static void execute_xsetbv() {
+  _xsetbv(0, _xgetbv(0));
+}
+static void execute_vmcall() {
+  hypercall_input input;
+  input.code = hypercall_ping;
+  input.key  = hypercall_key;
+  vmx_vmcall(input);
+}
+static void execute_nothing() {}
+
+struct timing_probe_exit {
+  char const* name;
+
+  // executed once the system is virtualized, and natively
+  void(*execute)();
+  void(*execute_native)();
+
+  // XSETBV causes a #UD if CR4.OSXSAVE is clear
+  bool requires_xsave;
+};
+
+static constexpr timing_probe_exit probe_exits[] = {
+  { "cpuid",  execute_cpuid,  execute_cpuid,   false },
+  { "rdmsr",  execute_rdmsr,  execute_rdmsr,   false },
+  { "xsetbv", execute_xsetbv, execute_xsetbv,  true  },
+
+  // VMCALL causes a #UD natively
+  { "vmcall", execute_vmcall, execute_nothing, false }
+};
+
+enum timing_probe_kind : uint8_t {
+  // a single exit
+  timing_probe_single,
+
+  // timing_probe_burst_length back-to-back exits
+  timing_probe_burst,
+
+  // APERF/MPERF ratio across back-to-back exits (in parts per million)
+  timing_probe_aperf_mperf_ratio
+};
+
+struct timing_probe_counter {
+  char const* name;
+  timing_probe_kind kind;
+  uint64_t(*read_counter)();
+};
+
+static constexpr timing_probe_counter probe_counters[] = {
+  { "tsc",             timing_probe_single,            read_tsc },
+  { "mperf",           timing_probe_single,            read_mperf },
+  { "ref_tsc",         timing_probe_single,            read_ref_tsc },
+  { "tsc_burst",       timing_probe_burst,             read_tsc },
+  { "aperf_mperf_ppm", timing_probe_aperf_mperf_ratio, nullptr }
+};
+
+static constexpr size_t probe_exit_count    = sizeof(probe_exits) / sizeof(probe_exits[0]);
+static constexpr size_t probe_counter_count = sizeof(probe_counters) / sizeof(probe_counters[0]);
+
+// every exit type with every counter, followed by the cross-core probe
+static constexpr size_t probe_count      = probe_exit_count * probe_counter_count + 1;
+static constexpr size_t cross_core_probe = probe_count - 1;
+
+// the samples are sorted as unsigned integers, so the cross-core samples
+// (which can be negative) are biased in a way that preserves their order
+static constexpr uint64_t signed_sample_bias = 1ull << 63;
+
+// samples of the probe that is currently running
+static uint64_t samples[timing_leak_samples];
+
+// native median of every probe on every processor
+static int64_t* native_medians        = nullptr;
+static unsigned long native_cpu_count = 0;
+
+// processors that are compared by the cross-core probe. processor #0 sends
+// a request, the target executes a CPUID and responds with its TSC.
+struct cross_core_exchange {
+  unsigned long target;
+
+  alignas(64) uint64_t volatile request;
+  alignas(64) uint64_t volatile response;
+  uint64_t volatile target_tsc;
+};
+
+static cross_core_exchange exchange;
+
+// take every sample of a probe (the fixed counters must be enabled and
+// interrupts must be disabled)
+static void take_samples(timing_probe_counter const& counter, void(* const execute)()) {
+  for (auto& sample : samples) {
+    if (counter.kind == timing_probe_aperf_mperf_ratio) {
+      _mm_lfence();
+      auto const aperf = __readmsr(IA32_APERF);
+      auto const mperf = __readmsr(IA32_MPERF);
+      _mm_lfence();
+
+      for (int i = 0; i < timing_probe_burst_length; ++i)
+        execute();
+
+      _mm_lfence();
+      auto const aperf_delta = __readmsr(IA32_APERF) - aperf;
+      auto const mperf_delta = __readmsr(IA32_MPERF) - mperf;
+      _mm_lfence();
+
+      sample = mperf_delta ? (aperf_delta * 1'000'000 / mperf_delta) : 0;
+      continue;
+    }
+
+    auto const count = (counter.kind == timing_probe_burst) ? timing_probe_burst_length : 1;
+
+    _mm_lfence();
+    auto start = counter.read_counter();
+    _mm_lfence();
+
+    _mm_lfence();
+    auto end = counter.read_counter();
+    _mm_lfence();
+
+    auto const timing_overhead = (end - start);
+
+    _mm_lfence();
+    start = counter.read_counter();
+    _mm_lfence();
+
+    for (int i = 0; i < count; ++i)
+      execute();
+
+    _mm_lfence();
+    end = counter.read_counter();
+    _mm_lfence();
+
+    sample = (end - start > timing_overhead) ? (end - start - timing_overhead) : 0;
+  }
+}
+
+// run a probe on the current processor and sort its samples. returns
+// false if the probe isn't supported.
+static bool run_probe(size_t const probe, bool const native) {
+  auto const& exit    = probe_exits[probe / probe_counter_count];
+  auto const& counter = probe_counters[probe % probe_counter_count];
+
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+
+  if (exit.requires_xsave && !curr_cr4.os_xsave)
+    return false;
+
+  _disable();
+  auto const fixed_state = enable_fixed_counters();
+
+  take_samples(counter, native ? exit.execute_native : exit.execute);
+
+  restore_fixed_counters(fixed_state);
+  _enable();
+
+  sort_timing_samples(samples, timing_leak_samples);
+  return true;
+}
+
+// both processors of the cross-core probe run this at the same time
+static ULONG_PTR cross_core_ipi_callback(ULONG_PTR) {
+  auto const index = KeGetCurrentProcessorNumberEx(nullptr);
+
+  if (index == 0) {
+    for (auto& sample : samples) {
+      auto const round = exchange.request + 1;
+
+      _mm_lfence();
+      auto const start = __rdtsc();
+      _mm_lfence();
+
+      exchange.request = round;
+
+      while (exchange.response != round)
+        _mm_pause();
+
+      _mm_lfence();
+      auto const end = __rdtsc();
+      _mm_lfence();
+
+      // the target's TSC relative to the middle of the round-trip
+      sample = exchange.target_tsc - (start + (end - start) / 2) + signed_sample_bias;
+    }
+  } else if (index == exchange.target) {
+    for (size_t i = 0; i < timing_leak_samples; ++i) {
+      auto const round = exchange.response + 1;
+
+      while (exchange.request != round)
+        _mm_pause();
+
+      execute_cpuid();
+
+      _mm_lfence();
+      exchange.target_tsc = __rdtsc();
+      _mm_lfence();
+
+      exchange.response = round;
+    }
+  }
+
+  return 0;
+}
+
+// compare the TSC of a processor against processor #0 and sort the samples
+static void run_cross_core_probe(unsigned long const target) {
+  exchange.target = target;
+  KeIpiGenericCall(cross_core_ipi_callback, 0);
+
+  sort_timing_samples(samples, timing_leak_samples);
+}
+
+// the value of a sorted sample
+static int64_t sample_value(size_t const probe, size_t const index) {
+  auto const sample = samples[index];
+  return static_cast<int64_t>((probe == cross_core_probe) ? (sample - signed_sample_bias) : sample);
+}
+
+// measure the native timings of every probe on every processor (this
+// must be called before the system is virtualized)
+bool measure_native_timings() {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  native_cpu_count = KeQueryActiveProcessorCount(nullptr);
+  native_medians   = static_cast<int64_t*>(ExAllocatePoolWithTag(NonPagedPoolNx,
+    sizeof(int64_t) * probe_count * native_cpu_count, 'fr0g'));
+
+  if (!native_medians) {
+    DbgPrint("[hv] Failed to allocate the native timings.\n");
+    return false;
+  }
+
+  memset(native_medians, 0, sizeof(int64_t) * probe_count * native_cpu_count);
+
+  for (unsigned long i = 0; i < native_cpu_count; ++i) {
+    auto const medians = native_medians + i * probe_count;
+
+    // restrict execution to the specified cpu
+    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    for (size_t probe = 0; probe < cross_core_probe; ++probe) {
+      if (run_probe(probe, true))
+        medians[probe] = sample_value(probe, timing_leak_samples / 2);
+    }
+
+    KeLowerIrql(irql);
+    KeRevertToUserAffinityThreadEx(orig_affinity);
+
+    if (i > 0) {
+      run_cross_core_probe(i);
+      medians[cross_core_probe] = sample_value(cross_core_probe, timing_leak_samples / 2);
+    }
+  }
+
+  return true;
+}
+
+// the residuals of the sorted samples against the native median
+static benchmark_result get_residuals(size_t const probe,
+    char const* const name, int64_t const native_median) {
+  benchmark_result result;
+  result.name  = name;
+  result.bytes = 0;
+  result.min   = sample_value(probe, 0) - native_median;
+  result.p50   = sample_value(probe, timing_leak_samples * 50 / 100) - native_median;
+  result.p90   = sample_value(probe, timing_leak_samples * 90 / 100) - native_median;
+  result.p99   = sample_value(probe, timing_leak_samples * 99 / 100) - native_median;
+  result.max   = sample_value(probe, timing_leak_samples - 1) - native_median;
+  return result;
+}
+
+// run every probe on every processor and write the residuals to a file.
+// the native timings must have been measured first. returns false if the
+// results couldn't be written.
+bool run_timing_leak_probes(wchar_t const* const path) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  if (!native_medians)
+    return false;
+
+  auto const report = open_benchmark_report(path);
+  if (!report) {
+    ExFreePoolWithTag(native_medians, 'fr0g');
+    native_medians = nullptr;
+    return false;
+  }
+
+  auto success = true;
+
+  for (unsigned long i = 0; i < native_cpu_count && success; ++i) {
+    auto const medians = native_medians + i * probe_count;
+
+    for (size_t probe = 0; probe < cross_core_probe && success; ++probe) {
+      // restrict execution to the specified cpu
+      auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+
+      // keep the calibration thread from changing the overhead mid-probe
+      KIRQL irql;
+      KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+      auto const supported = run_probe(probe, false);
+
+      KeLowerIrql(irql);
+      KeRevertToUserAffinityThreadEx(orig_affinity);
+
+      if (!supported)
+        continue;
+
+      char name[64];
+      RtlStringCbPrintfA(name, sizeof(name), "%s_%s",
+        probe_exits[probe / probe_counter_count].name,
+        probe_counters[probe % probe_counter_count].name);
+
+      success = write_benchmark_result(report,
+        get_residuals(probe, name, medians[probe]), i, timing_leak_samples);
+    }
+
+    if (i > 0 && success) {
+      run_cross_core_probe(i);
+
+      success = write_benchmark_result(report, get_residuals(cross_core_probe,
+        "cpuid_cross_core_tsc", medians[cross_core_probe]), i, timing_leak_samples);
+    }
+  }
+
+  close_benchmark_report(report);
+
+  ExFreePoolWithTag(native_medians, 'fr0g');
+  native_medians = nullptr;
+
+  if (!success)
+    DbgPrint("[hv] Failed to write the timing leak residuals.\n");
+
+  return success;
+}
+
+} // namespace hv
+
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ia32.hpp>
+
+//
+// Guest-side probes of how much vm-exit overhead leaks through
+// hide_vm_exit_overhead(). Every probe is timed natively (before the system
+// is virtualized) and again once the hypervisor is running, with overhead
+// compensation active (the exit profile needs to conceal timing, see
+// exit-profile.h). The probes are timed with RDTSC, IA32_MPERF, and
+// CPU_CLK_UNHALTED.REF_TSC, around:
+//
+//   - a single CPUID, RDMSR, XSETBV, or VMCALL
+//   - timing_probe_burst_length of them back-to-back
+//   - the APERF/MPERF ratio across such a burst (in parts per million)
+//   - a CPUID on another processor, whose TSC is compared against
+//     processor #0 (cross_core_tsc)
+//
+// The report uses the same format as the benchmark report (see
+// benchmark.h), but every value is a residual: the virtualized sample minus
+// the native median. A VMCALL can't be executed natively (#UD), so its
+// residual is everything that the guest can see. Use
+// "tools/bench-diff.py --absolute" to compare two reports.
+//
+
+namespace hv {
+
+// measure the native timings before virtualizing the system, and run the
+// probes once it is virtualized
+inline constexpr bool timing_leak_probes_enabled = false;
+
+// file that the residuals are written to
+inline constexpr wchar_t const* timing_leak_results_path =
+  L"\\SystemRoot\\hv-timing-leaks.csv";
+
+// number of samples that are taken for every probe on every processor
+inline constexpr size_t timing_leak_samples = 512;
+
+// number of back-to-back exits in the burst probes
+inline constexpr int timing_probe_burst_length = 16;
+
+// measure the native timings of every probe on every processor (this
+// must be called before the system is virtualized)
+bool measure_native_timings();
+
+// run every probe on every processor and write the residuals to a file.
+// the native timings must have been measured first. returns false if the
+// results couldn't be written.
+bool run_timing_leak_probes(wchar_t const* path);
+
+} // namespace hv
+
@@ -1,13 +1,69 @@
 #include "timing.h"
 #include "vcpu.h"
 #include "vmx.h"
+#include "hypercalls.h"
+#include "pmu.h"
 
+#ifndef HV_PORTABLE
 #include <ntdef.h>
+#endif
 
 namespace hv {
 
+// only modify the vm-entry MSR load count if it actually changed
+static void set_msr_entry_load_count(vcpu* const cpu, uint32_t const count) {
+  if (cpu->msr_entry_load_count == count)
+    return;
+
+  cpu->msr_entry_load_count = count;
+  vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT, count);
+}
+
+// get the overhead class of a vm-exit
+vm_exit_overhead_class get_vm_exit_overhead_class(vmx_vmexit_reason const reason) {
+  switch (reason.basic_exit_reason) {
+  case VMX_EXIT_REASON_EXECUTE_CPUID:  return overhead_class_cpuid;
+  case VMX_EXIT_REASON_EXECUTE_RDMSR:  return overhead_class_msr;
+  case VMX_EXIT_REASON_EXECUTE_WRMSR:  return overhead_class_msr;
+  case VMX_EXIT_REASON_EXECUTE_XSETBV: return overhead_class_xsetbv;
+  case VMX_EXIT_REASON_MOV_CR:         return overhead_class_mov_cr;
+  default:                             return overhead_class_default;
+  }
+}
+
+// arm the preemption timer after a hidden vm-exit, but only if it is
+// actually useful. when hidden vm-exits are back-to-back, the timer keeps
+// getting pushed back and only fires once the burst is over (which is
+// exactly when the TSC should be resynced). when they're sparse, the timer
+// would fire after nearly every single one of them, so the TSC is allowed
+// to drift a little and is only resynced once the drift gets too large.
+static void arm_preemption_timer(vcpu* const cpu) {
+  auto const now = __rdtsc();
+  auto const interval = min(now - cpu->last_hidden_exit_tsc, 1ull << 40);
+  cpu->last_hidden_exit_tsc = now;
+
+  // exponential moving average (alpha = 1/8)
+  cpu->hidden_exit_interval = cpu->hidden_exit_interval
+    - cpu->hidden_exit_interval / 8 + interval / 8;
+
+  // the TSC offset only ever decreases between resyncs
+  auto const drift = 0 - cpu->tsc_offset;
+
+  if (cpu->hidden_exit_interval < back_to_back_exit_interval ||
+      drift >= max_unsynced_tsc_drift) {
+    cpu->preemption_timer = max(2,
+      preemption_timer_window >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+    return;
+  }
+
+  // soft disable the VMX preemption timer
+  cpu->preemption_timer = ~0ull;
+
+  ++cpu->profile_stats[cpu->current_exit_profile].preemption_exits_avoided;
+}
+
 // try to hide the vm-exit overhead from being detected through timings
-void hide_vm_exit_overhead(vcpu* const cpu) {
+void hide_vm_exit_overhead(vcpu* const cpu, vmx_vmexit_reason const reason) {
   //
   // Guest APERF/MPERF values are stored/restored on vm-entry and vm-exit,
   // however, there appears to be a small, yet constant, overhead that occurs
@@ -16,202 +72,294 @@ void hide_vm_exit_overhead(vcpu* const cpu) {
   // for this, hiding vm-exit overhead would be sooooo much easier and cleaner,
   // but whatever.
   //
+  // Because of this, the MSR lists are only used when they're needed: the
+  // vm-entry load list is dropped for vm-exits that aren't being hidden, and
+  // profiles that don't conceal timing drop the vm-exit store list as well.
+  //
 
-  ia32_perf_global_ctrl_register perf_global_ctrl;
-  perf_global_ctrl.flags = cpu->msr_exit_store.perf_global_ctrl.msr_data;
-
-  // make sure the CPU loads the previously stored guest state on vm-entry
-  cpu->msr_entry_load.aperf.msr_data     = cpu->msr_exit_store.aperf.msr_data;
-  cpu->msr_entry_load.mperf.msr_data     = cpu->msr_exit_store.mperf.msr_data;
-  vmx_vmwrite(VMCS_GUEST_PERF_GLOBAL_CTRL, perf_global_ctrl.flags);
-
-  // account for the constant overhead associated with loading/storing MSRs
-  cpu->msr_entry_load.aperf.msr_data -= cpu->vm_exit_mperf_overhead;
-  cpu->msr_entry_load.mperf.msr_data -= cpu->vm_exit_mperf_overhead;
-
-  // account for the constant overhead associated with loading/storing MSRs
-  if (perf_global_ctrl.en_fixed_ctrn & (1ull << 2)) {
-    auto const cpl = current_guest_cpl();
-
-    ia32_fixed_ctr_ctrl_register fixed_ctr_ctrl;
-    fixed_ctr_ctrl.flags = __readmsr(IA32_FIXED_CTR_CTRL);
+  // make sure the CPU loads the previously stored guest state on vm-entry.
+  // if the store area isn't used, the CPU saved it in the VMCS for us.
+  if (cpu->msr_exit_store_count > 0)
+    vmx_vmwrite(VMCS_GUEST_PERF_GLOBAL_CTRL, cpu->msr_exit_store.perf_global_ctrl.msr_data);
 
-    // this also needs to be done for many other PMCs, but whatever
-    if ((cpl == 0 && fixed_ctr_ctrl.en2_os) || (cpl == 3 && fixed_ctr_ctrl.en2_usr))
-      __writemsr(IA32_FIXED_CTR2, __readmsr(IA32_FIXED_CTR2) - cpu->vm_exit_ref_tsc_overhead);
-  }
+  // the overhead is measured without being compensated while calibrating
+  static constexpr vm_exit_overhead no_overhead = {};
+  auto const& overhead = cpu->calibrating_overhead ? no_overhead :
+    cpu->exit_overhead[get_vm_exit_overhead_class(reason)];
 
   // this usually occurs for vm-exits that are unlikely to be reliably timed,
   // such as when an exception occurs or if the preemption timer fired
-  if (!cpu->hide_vm_exit_overhead || cpu->vm_exit_tsc_overhead > 10000) {
+  if (!cpu->conceal_timing || !cpu->hide_vm_exit_overhead ||
+      overhead.tsc > preemption_timer_window) {
     // this is our chance to resync the TSC
     cpu->tsc_offset = 0;
 
     // soft disable the VMX preemption timer
     cpu->preemption_timer = ~0ull;
 
+    // APERF/MPERF are resynced as well by simply not restoring them
+    set_msr_entry_load_count(cpu, 0);
+
     return;
   }
 
-  // set the preemption timer to cause an exit after 10000 guest TSC ticks have passed
-  cpu->preemption_timer = max(2,
-    10000 >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
+  set_msr_entry_load_count(cpu, sizeof(cpu->msr_entry_load) / 16);
+
+  ia32_perf_global_ctrl_register perf_global_ctrl;
+  perf_global_ctrl.flags = cpu->msr_exit_store.perf_global_ctrl.msr_data;
+
+  // make sure the CPU loads the previously stored guest state on vm-entry
+  cpu->msr_entry_load.aperf.msr_data = cpu->msr_exit_store.aperf.msr_data;
+  cpu->msr_entry_load.mperf.msr_data = cpu->msr_exit_store.mperf.msr_data;
+
+  // account for the constant overhead associated with loading/storing MSRs
+  cpu->msr_entry_load.aperf.msr_data -= overhead.mperf;
+  cpu->msr_entry_load.mperf.msr_data -= overhead.mperf;
+
+  // account for the constant overhead associated with loading/storing MSRs
+  compensate_pmu_counters(cpu, overhead, perf_global_ctrl.flags);
 
   // use TSC offsetting to hide from timing attacks that use the TSC
-  cpu->tsc_offset -= cpu->vm_exit_tsc_overhead;
+  cpu->tsc_offset -= overhead.tsc;
+
+  arm_preemption_timer(cpu);
 }
 
-// measure the overhead of a vm-exit (RDTSC)
-uint64_t measure_vm_exit_tsc_overhead() {
-  _disable();
+// counters that vm-exit overhead is measured with
+static uint64_t read_tsc()          { return __rdtsc(); }
+static uint64_t read_mperf()        { return __readmsr(IA32_MPERF); }
+static uint64_t read_instructions() { return __readmsr(IA32_FIXED_CTR0); }
+static uint64_t read_core_cycles()  { return __readmsr(IA32_FIXED_CTR1); }
+static uint64_t read_ref_tsc()      { return __readmsr(IA32_FIXED_CTR2); }
 
+// instructions that cause a vm-exit
+static void execute_vmcall() {
   hypercall_input hv_input;
   hv_input.code = hypercall_ping;
   hv_input.key  = hypercall_key;
+  vmx_vmcall(hv_input);
+}
+static void execute_cpuid() {
+  int regs[4];
+  __cpuid(regs, 0);
+}
+static void execute_rdmsr() {
+  // this is intercepted by every exit profile (see msr-policy.cpp)
+  __readmsr(IA32_FEATURE_CONTROL);
+}
+static void execute_xsetbv() {
+  _xsetbv(0, _xgetbv(0));
+}
+static void execute_mov_from_cr3() {
+  // this only causes a vm-exit if the exit profile intercepts CR3 accesses
+  __readcr3();
+}
 
-  uint64_t lowest = ~0ull;
+// sort timing samples in ascending order (there are only a few hundred)
+void sort_timing_samples(uint64_t* const samples, size_t const count) {
+  for (size_t i = 1; i < count; ++i) {
+    auto const value = samples[i];
 
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
+    auto j = i;
+    for (; j > 0 && samples[j - 1] > value; --j)
+      samples[j] = samples[j - 1];
+
+    samples[j] = value;
+  }
+}
+
+// measure the overhead of a vm-exit with a single counter. interrupts must
+// be disabled. instead of the minimum, a low percentile (1/16) of many
+// samples is used: it isn't thrown off by a single unusually fast sample,
+// and samples that were inflated by cache misses or SMIs are ignored. the
+// tradeoff is that the few exits that are faster than this (~6%) appear
+// to take slightly less time than they would natively, while the rest
+// still leak a few ticks.
+template <uint64_t(*ReadCounter)(), void(*ExecuteInstruction)()>
+static uint64_t measure_overhead() {
+  uint64_t samples[overhead_calibration_samples];
+
+  for (auto& sample : samples) {
     _mm_lfence();
-    auto start = __rdtsc();
+    auto start = ReadCounter();
     _mm_lfence();
 
     _mm_lfence();
-    auto end = __rdtsc();
+    auto end = ReadCounter();
     _mm_lfence();
 
     auto const timing_overhead = (end - start);
 
     _mm_lfence();
-    start = __rdtsc();
+    start = ReadCounter();
     _mm_lfence();
 
-    vmx_vmcall(hv_input);
+    ExecuteInstruction();
 
     _mm_lfence();
-    end = __rdtsc();
+    end = ReadCounter();
     _mm_lfence();
 
     auto const vm_exit_overhead = (end - start);
-    auto const adjusted = (vm_exit_overhead - timing_overhead);
 
-    if (adjusted < lowest)
-      lowest = adjusted;
+    sample = (vm_exit_overhead > timing_overhead)
+      ? (vm_exit_overhead - timing_overhead) : 0;
   }
 
-  _enable();
-  return lowest;
+  sort_timing_samples(samples, overhead_calibration_samples);
+  return samples[overhead_calibration_samples / 16];
 }
 
-// measure the overhead of a vm-exit (CPU_CLK_UNHALTED.REF_TSC)
-uint64_t measure_vm_exit_ref_tsc_overhead() {
-  _disable();
-
-  hypercall_input hv_input;
-  hv_input.code = hypercall_ping;
-  hv_input.key  = hypercall_key;
-
-  ia32_fixed_ctr_ctrl_register curr_fixed_ctr_ctrl;
-  curr_fixed_ctr_ctrl.flags = __readmsr(IA32_FIXED_CTR_CTRL);
-
-  ia32_perf_global_ctrl_register curr_perf_global_ctrl;
-  curr_perf_global_ctrl.flags = __readmsr(IA32_PERF_GLOBAL_CTRL);
-
-  // enable fixed counter #2
-  auto new_fixed_ctr_ctrl = curr_fixed_ctr_ctrl;
+// enable fixed counters #0, #1, and #2 in ring-0
+fixed_counter_state enable_fixed_counters() {
+  fixed_counter_state state;
+  state.fixed_ctr_ctrl.flags   = __readmsr(IA32_FIXED_CTR_CTRL);
+  state.perf_global_ctrl.flags = __readmsr(IA32_PERF_GLOBAL_CTRL);
+
+  auto new_fixed_ctr_ctrl = state.fixed_ctr_ctrl;
+  new_fixed_ctr_ctrl.en0_os      = 1;
+  new_fixed_ctr_ctrl.en0_usr     = 0;
+  new_fixed_ctr_ctrl.en0_pmi     = 0;
+  new_fixed_ctr_ctrl.any_thread0 = 0;
+  new_fixed_ctr_ctrl.en1_os      = 1;
+  new_fixed_ctr_ctrl.en1_usr     = 0;
+  new_fixed_ctr_ctrl.en1_pmi     = 0;
+  new_fixed_ctr_ctrl.any_thread1 = 0;
   new_fixed_ctr_ctrl.en2_os      = 1;
   new_fixed_ctr_ctrl.en2_usr     = 0;
   new_fixed_ctr_ctrl.en2_pmi     = 0;
   new_fixed_ctr_ctrl.any_thread2 = 0;
   __writemsr(IA32_FIXED_CTR_CTRL, new_fixed_ctr_ctrl.flags);
 
-  // enable fixed counter #2
-  auto new_perf_global_ctrl = curr_perf_global_ctrl;
-  new_perf_global_ctrl.en_fixed_ctrn |= (1ull << 2);
+  auto new_perf_global_ctrl = state.perf_global_ctrl;
+  new_perf_global_ctrl.en_fixed_ctrn |= 0b111;
   __writemsr(IA32_PERF_GLOBAL_CTRL, new_perf_global_ctrl.flags);
 
-  uint64_t lowest = ~0ull;
-
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
-    _mm_lfence();
-    auto start = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
-
-    _mm_lfence();
-    auto end = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
-
-    auto const timing_overhead = (end - start);
-
-    _mm_lfence();
-    start = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+  return state;
+}
 
-    vmx_vmcall(hv_input);
+// restore the fixed counters to their original state
+void restore_fixed_counters(fixed_counter_state const& state) {
+  __writemsr(IA32_PERF_GLOBAL_CTRL, state.perf_global_ctrl.flags);
+  __writemsr(IA32_FIXED_CTR_CTRL, state.fixed_ctr_ctrl.flags);
+}
 
-    _mm_lfence();
-    end = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+// measure the overhead of a vm-exit with a single counter. interrupts are
+// only disabled (and the fixed counters only enabled) while the samples of
+// this counter are taken, so that they are never held off for more than
+// overhead_calibration_samples vm-exits at a time.
+template <uint64_t(*ReadCounter)(), void(*ExecuteInstruction)()>
+static uint64_t measure_overhead_window() {
+  _disable();
+  auto const fixed_state = enable_fixed_counters();
 
-    auto const vm_exit_overhead = (end - start);
-    auto const adjusted = (vm_exit_overhead - timing_overhead);
+  auto const overhead = measure_overhead<ReadCounter, ExecuteInstruction>();
 
-    if (adjusted < lowest)
-      lowest = adjusted;
-  }
+  restore_fixed_counters(fixed_state);
+  _enable();
 
-  // restore MSRs
-  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl.flags);
-  __writemsr(IA32_FIXED_CTR_CTRL, curr_fixed_ctr_ctrl.flags);
+  return overhead;
+}
 
-  _enable();
-  return lowest;
+// measure the overhead of an exit type with every counter
+template <void(*ExecuteInstruction)()>
+static vm_exit_overhead measure_overhead_class() {
+  vm_exit_overhead overhead;
+  overhead.tsc          = measure_overhead_window<read_tsc,          ExecuteInstruction>();
+  overhead.mperf        = measure_overhead_window<read_mperf,        ExecuteInstruction>();
+  overhead.instructions = measure_overhead_window<read_instructions, ExecuteInstruction>();
+  overhead.core_cycles  = measure_overhead_window<read_core_cycles,  ExecuteInstruction>();
+  overhead.ref_tsc      = measure_overhead_window<read_ref_tsc,      ExecuteInstruction>();
+  return overhead;
 }
 
-// measure the overhead of a vm-exit (IA32_MPERF)
-uint64_t measure_vm_exit_mperf_overhead() {
-  _disable();
+// measure the overhead of every exit type on the current processor
+void measure_vm_exit_overhead(vm_exit_overhead (&overhead)[overhead_class_count]) {
+  auto const vmcall = measure_overhead_class<execute_vmcall>();
 
-  hypercall_input hv_input;
-  hv_input.code = hypercall_ping;
-  hv_input.key  = hypercall_key;
+  overhead[overhead_class_default] = vmcall;
+  overhead[overhead_class_cpuid]   = measure_overhead_class<execute_cpuid>();
+  overhead[overhead_class_msr]     = measure_overhead_class<execute_rdmsr>();
 
-  uint64_t lowest = ~0ull;
+  // XSETBV causes a #UD if CR4.OSXSAVE is clear
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+  overhead[overhead_class_xsetbv] = curr_cr4.os_xsave ?
+    measure_overhead_class<execute_xsetbv>() : vmcall;
 
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
-    _mm_lfence();
-    auto start = __readmsr(IA32_MPERF);
-    _mm_lfence();
-
-    _mm_lfence();
-    auto end = __readmsr(IA32_MPERF);
-    _mm_lfence();
+  // CR accesses are approximated by MOV from CR3. if that didn't cause a
+  // vm-exit, the default overhead is the best guess that we have.
+  auto const mov_cr = measure_overhead_class<execute_mov_from_cr3>();
+  overhead[overhead_class_mov_cr] = (mov_cr.tsc * 2 < vmcall.tsc) ? vmcall : mov_cr;
+}
 
-    auto const timing_overhead = (end - start);
+// measure the native cost of the instruction behind every exit type. this
+// must be called before the current processor is virtualized.
+void measure_native_overhead(vm_exit_overhead (&overhead)[overhead_class_count]) {
+  // VMCALL causes a #UD natively, and every other exit type that falls
+  // into the default class has no single native cost
+  overhead[overhead_class_default] = {};
+  overhead[overhead_class_cpuid]   = measure_overhead_class<execute_cpuid>();
+  overhead[overhead_class_msr]     = measure_overhead_class<execute_rdmsr>();
+  overhead[overhead_class_mov_cr]  = measure_overhead_class<execute_mov_from_cr3>();
+
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+  overhead[overhead_class_xsetbv] = curr_cr4.os_xsave ?
+    measure_overhead_class<execute_xsetbv>() : vm_exit_overhead{};
+}
 
-    _mm_lfence();
-    start = __readmsr(IA32_MPERF);
-    _mm_lfence();
+// measure the overhead of every exit type on the current processor and
+// pass it to the hypervisor
+void calibrate_vm_exit_overhead() {
+  hypercall_input input;
+  input.key = hypercall_key;
+
+  // the current overhead isn't compensated while we're measuring
+  input.code    = hypercall_set_overhead_calibration;
+  input.args[0] = 1;
+  vmx_vmcall(input);
+
+  vm_exit_overhead overhead[overhead_class_count];
+  measure_vm_exit_overhead(overhead);
+
+  for (int i = 0; i < overhead_class_count; ++i) {
+    input.code    = hypercall_set_vm_exit_overhead;
+    input.args[0] = i;
+    input.args[1] = overhead[i].tsc;
+    input.args[2] = overhead[i].mperf;
+    input.args[3] = overhead[i].instructions;
+    input.args[4] = overhead[i].core_cycles;
+    input.args[5] = overhead[i].ref_tsc;
+    vmx_vmcall(input);
+  }
 
-    vmx_vmcall(hv_input);
+  input.code    = hypercall_set_overhead_calibration;
+  input.args[0] = 0;
+  vmx_vmcall(input);
+}
 
-    _mm_lfence();
-    end = __readmsr(IA32_MPERF);
-    _mm_lfence();
+// measure the overhead of a vm-exit (RDTSC)
+uint64_t measure_vm_exit_tsc_overhead() {
+  _disable();
+  auto const overhead = measure_overhead<read_tsc, execute_vmcall>();
+  _enable();
 
-    auto const vm_exit_overhead = (end - start);
-    auto const adjusted = (vm_exit_overhead - timing_overhead);
+  return overhead;
+}
 
-    if (adjusted < lowest)
-      lowest = adjusted;
-  }
+// measure the overhead of a vm-exit (CPU_CLK_UNHALTED.REF_TSC)
+uint64_t measure_vm_exit_ref_tsc_overhead() {
+  return measure_overhead_window<read_ref_tsc, execute_vmcall>();
+}
 
+// measure the overhead of a vm-exit (IA32_MPERF)
+uint64_t measure_vm_exit_mperf_overhead() {
+  _disable();
+  auto const overhead = measure_overhead<read_mperf, execute_vmcall>();
   _enable();
-  return lowest;
+
+  return overhead;
 }
 
 } // namespace hv
-
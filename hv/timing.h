@@ -6,8 +6,77 @@ namespace hv {
 
 struct vcpu;
 
+// exit types that have their own calibrated overhead
+enum vm_exit_overhead_class : uint8_t {
+  // VMCALL (also used for every vm-exit that isn't calibrated separately)
+  overhead_class_default = 0,
+  overhead_class_cpuid,
+  overhead_class_msr,
+  overhead_class_xsetbv,
+  overhead_class_mov_cr,
+
+  overhead_class_count
+};
+
+// the overhead of a single exit type, for every counter that is compensated
+struct vm_exit_overhead {
+  uint64_t tsc;
+  uint64_t mperf;
+
+  // fixed performance counters (these are used for the matching
+  // architectural events on the general-purpose counters as well)
+  uint64_t instructions;
+  uint64_t core_cycles;
+  uint64_t ref_tsc;
+};
+
+// number of samples that are taken for every exit type and counter
+inline constexpr int overhead_calibration_samples = 256;
+
+// number of guest TSC ticks without a vm-exit before the preemption timer
+// fires and the TSC is resynced
+inline constexpr uint64_t preemption_timer_window = 10000;
+
+// hidden vm-exits that are, on average, closer together than this are
+// considered to be back-to-back
+inline constexpr uint64_t back_to_back_exit_interval = 4 * preemption_timer_window;
+
+// the preemption timer is always armed once the guest TSC has fallen this
+// many ticks behind the real TSC
+inline constexpr uint64_t max_unsynced_tsc_drift = 100'000;
+
+// get the overhead class of a vm-exit
+vm_exit_overhead_class get_vm_exit_overhead_class(vmx_vmexit_reason reason);
+
 // try to hide the vm-exit overhead from being detected through timings
-void hide_vm_exit_overhead(vcpu* cpu);
+void hide_vm_exit_overhead(vcpu* cpu, vmx_vmexit_reason reason);
+
+// fixed counter state before the fixed counters were enabled
+struct fixed_counter_state {
+  ia32_fixed_ctr_ctrl_register fixed_ctr_ctrl;
+  ia32_perf_global_ctrl_register perf_global_ctrl;
+};
+
+// enable fixed counters #0, #1, and #2 in ring-0
+fixed_counter_state enable_fixed_counters();
+
+// restore the fixed counters to their original state
+void restore_fixed_counters(fixed_counter_state const& state);
+
+// sort timing samples in ascending order (there are only a few hundred)
+void sort_timing_samples(uint64_t* samples, size_t count);
+
+// measure the overhead of every exit type on the current processor
+void measure_vm_exit_overhead(vm_exit_overhead (&overhead)[overhead_class_count]);
+
+// measure the native cost of the instruction behind every exit type. this
+// must be called before the current processor is virtualized.
+void measure_native_overhead(vm_exit_overhead (&overhead)[overhead_class_count]);
+
+// measure the overhead of every exit type on the current processor and
+// pass it to the hypervisor (which only compensates for the difference
+// between this and the native cost)
+void calibrate_vm_exit_overhead();
 
 // measure the overhead of a vm-exit (RDTSC)
 uint64_t measure_vm_exit_tsc_overhead();
@@ -5,8 +5,10 @@
 #include "vmx.h"
 #include "vmcs.h"
 #include "timing.h"
+#include "msr-policy.h"
 #include "trap-frame.h"
 #include "exit-handlers.h"
+#include "exit-dispatch.h"
 #include "exception-routines.h"
 
 namespace hv {
@@ -34,16 +36,34 @@ static void cache_cpu_data(vcpu_cached_data& cached) {
   cached.xcr0_unsupported_mask = ~((static_cast<uint64_t>(
     cpuid_0d.edx.flags) << 32) | cpuid_0d.eax.flags);
 
+  // size of the XSAVE area if every supported feature is enabled in XCR0
+  cached.xsave_area_size = cpuid_0d.ecx.flags;
+
+  int cpuid_0d_01[4];
+  __cpuidex(cpuid_0d_01, 0x0D, 0x01);
+
+  // CPUID.(EAX=0DH,ECX=1):EAX[0]
+  cached.xsaveopt_supported = cpuid_0d_01[0] & 1;
+
   cached.feature_control.flags = __readmsr(IA32_FEATURE_CONTROL);
   cached.vmx_misc.flags        = __readmsr(IA32_VMX_MISC);
 
+  ia32_vmx_basic_register vmx_basic;
+  vmx_basic.flags = __readmsr(IA32_VMX_BASIC);
+
+  // read the "true" capability msr if it is supported
+  cached.vmx_exit_ctrl_allowed1 = static_cast<uint32_t>(__readmsr(
+    vmx_basic.vmx_controls ? IA32_VMX_TRUE_EXIT_CTLS : IA32_VMX_EXIT_CTLS) >> 32);
+
   __cpuid(reinterpret_cast<int*>(&cached.cpuid_01), 0x01);
 
-  // create a fake guest FEATURE_CONTROL MSR that has VMX and SMX disabled
+  // create a fake guest FEATURE_CONTROL MSR that has SMX (and VMX, unless
+  // nested VMX is enabled) disabled
   cached.guest_feature_control                               = cached.feature_control;
   cached.guest_feature_control.lock_bit                      = 1;
   cached.guest_feature_control.enable_vmx_inside_smx         = 0;
-  cached.guest_feature_control.enable_vmx_outside_smx        = 0;
+  cached.guest_feature_control.enable_vmx_outside_smx        = nested_vmx_enabled &&
+    cached.feature_control.enable_vmx_outside_smx;
   cached.guest_feature_control.senter_local_function_enables = 0;
   cached.guest_feature_control.senter_global_enable          = 0;
 }
@@ -134,36 +154,9 @@ static bool load_vmcs_pointer(vmcs& vmcs_region) {
   return true;
 }
 
-// enable vm-exits for MTRR MSR writes
-static void enable_mtrr_exiting(vcpu* const cpu) {
-  ia32_mtrr_capabilities_register mtrr_cap;
-  mtrr_cap.flags = __readmsr(IA32_MTRR_CAPABILITIES);
-
-  enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_DEF_TYPE, true);
-
-  // enable exiting for fixed-range MTRRs
-  if (mtrr_cap.fixed_range_supported) {
-    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_FIX64K_00000, true);
-    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_FIX16K_80000, true);
-    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_FIX16K_A0000, true);
-
-    for (uint32_t i = 0; i < 8; ++i)
-      enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_FIX4K_C0000 + i, true);
-  }
-
-  // enable exiting for variable-range MTRRs
-  for (uint32_t i = 0; i < mtrr_cap.variable_range_count; ++i) {
-    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_PHYSBASE0 + i * 2, true);
-    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_MTRR_PHYSMASK0 + i * 2, true);
-  }
-}
-
 // initialize external structures that are not included in the VMCS
 static void prepare_external_structures(vcpu* const cpu) {
-  memset(&cpu->msr_bitmap, 0, sizeof(cpu->msr_bitmap));
-  enable_exit_for_msr_read(cpu->msr_bitmap, IA32_FEATURE_CONTROL, true);
-
-  enable_mtrr_exiting(cpu);
+  prepare_msr_bitmap(cpu->msr_bitmap, exit_profile_minimal);
 
   // we don't care about anything that's in the TSS
   memset(&cpu->host_tss, 0, sizeof(cpu->host_tss));
@@ -174,42 +167,16 @@ static void prepare_external_structures(vcpu* const cpu) {
   prepare_ept(cpu->ept);
 }
 
-// call the appropriate exit-handler for this vm-exit
-static void dispatch_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
-  switch (reason.basic_exit_reason) {
-  case VMX_EXIT_REASON_EXCEPTION_OR_NMI:             handle_exception_or_nmi(cpu); break;
-  case VMX_EXIT_REASON_EXECUTE_GETSEC:               emulate_getsec(cpu);          break;
-  case VMX_EXIT_REASON_EXECUTE_INVD:                 emulate_invd(cpu);            break;
-  case VMX_EXIT_REASON_NMI_WINDOW:                   handle_nmi_window(cpu);       break;
-  case VMX_EXIT_REASON_EXECUTE_CPUID:                emulate_cpuid(cpu);           break;
-  case VMX_EXIT_REASON_MOV_CR:                       handle_mov_cr(cpu);           break;
-  case VMX_EXIT_REASON_EXECUTE_RDMSR:                emulate_rdmsr(cpu);           break;
-  case VMX_EXIT_REASON_EXECUTE_WRMSR:                emulate_wrmsr(cpu);           break;
-  case VMX_EXIT_REASON_EXECUTE_XSETBV:               emulate_xsetbv(cpu);          break;
-  case VMX_EXIT_REASON_EXECUTE_VMXON:                emulate_vmxon(cpu);           break;
-  case VMX_EXIT_REASON_EXECUTE_VMCALL:               emulate_vmcall(cpu);          break;
-  case VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED: handle_vmx_preemption(cpu);   break;
-  case VMX_EXIT_REASON_EPT_VIOLATION:                handle_ept_violation(cpu);    break;
-  // VMX instructions (except for VMXON and VMCALL)
-  case VMX_EXIT_REASON_EXECUTE_INVEPT:
-  case VMX_EXIT_REASON_EXECUTE_INVVPID:
-  case VMX_EXIT_REASON_EXECUTE_VMCLEAR:
-  case VMX_EXIT_REASON_EXECUTE_VMLAUNCH:
-  case VMX_EXIT_REASON_EXECUTE_VMPTRLD:
-  case VMX_EXIT_REASON_EXECUTE_VMPTRST:
-  case VMX_EXIT_REASON_EXECUTE_VMREAD:
-  case VMX_EXIT_REASON_EXECUTE_VMRESUME:
-  case VMX_EXIT_REASON_EXECUTE_VMWRITE:
-  case VMX_EXIT_REASON_EXECUTE_VMXOFF:
-  case VMX_EXIT_REASON_EXECUTE_VMFUNC:               handle_vmx_instruction(cpu);  break;
-  }
-}
-
 // called for every vm-exit
 bool handle_vm_exit(guest_context* const ctx) {
+  auto const start_tsc = __rdtsc();
+
   // get the current vcpu
   auto const cpu = reinterpret_cast<vcpu*>(_readfsbase_u64());
   cpu->ctx = ctx;
+  ctx->vmlaunch = 0;
+
+  start_exit_pmc_sample(cpu);
 
   vmx_vmexit_reason reason;
   reason.flags = static_cast<uint32_t>(vmx_vmread(VMCS_EXIT_REASON));
@@ -218,7 +185,34 @@ bool handle_vm_exit(guest_context* const ctx) {
   cpu->hide_vm_exit_overhead = false;
   cpu->stop_virtualization   = false;
 
-  dispatch_vm_exit(cpu, reason);
+  // vm-exits that occur while L2 is running are either reflected into L1
+  // (which makes vmcs01 current again) or handled directly on vmcs02
+  auto reflected = false;
+  if (nested_vmx_enabled && cpu->nested.in_l2) {
+    reflected = handle_l2_vm_exit(cpu, reason);
+
+    if (!reflected) {
+      cpu->ctx = nullptr;
+      return false;
+    }
+  }
+
+  // lazily switch to the requested exit profile
+  if (cpu->current_exit_profile != ghv.current_exit_profile)
+    apply_exit_profile(cpu, ghv.current_exit_profile);
+
+  ++cpu->profile_stats[cpu->current_exit_profile].exits;
+
+  if (!reflected)
+    dispatch_vm_exit(cpu, reason);
+
+  // L1 just entered L2, so vmcs02 is the current VMCS
+  if (nested_vmx_enabled && cpu->nested.in_l2) {
+    ctx->vmlaunch = !cpu->nested.vmcs02_launched;
+    cpu->nested.vmcs02_launched = true;
+    cpu->ctx = nullptr;
+    return false;
+  }
 
   // restore guest state. the assembly code is responsible for restoring
   // RIP, CS, RFLAGS, RSP, SS, CR0, CR4, as well as the usual fields in
@@ -239,7 +233,9 @@ bool handle_vm_exit(guest_context* const ctx) {
     __writemsr(IA32_SYSENTER_EIP,     vmx_vmread(VMCS_GUEST_SYSENTER_EIP));
     __writemsr(IA32_PAT,              vmx_vmread(VMCS_GUEST_PAT));
     __writemsr(IA32_DEBUGCTL,         vmx_vmread(VMCS_GUEST_DEBUGCTL));
-    __writemsr(IA32_PERF_GLOBAL_CTRL, cpu->msr_exit_store.perf_global_ctrl.msr_data);
+    __writemsr(IA32_PERF_GLOBAL_CTRL, cpu->msr_exit_store_count > 0
+      ? cpu->msr_exit_store.perf_global_ctrl.msr_data
+      : vmx_vmread(VMCS_GUEST_PERF_GLOBAL_CTRL));
 
     // CR3
     __writecr3(vmx_vmread(VMCS_GUEST_CR3));
@@ -278,12 +274,24 @@ bool handle_vm_exit(guest_context* const ctx) {
     return true;
   }
 
-  hide_vm_exit_overhead(cpu);
+  hide_vm_exit_overhead(cpu, reason);
+
+  // the sampling profiler piggybacks on the preemption timer
+  arm_sampling_timer(cpu);
+
+  // try to inject queued NMIs on this vm-entry
+  deliver_queued_nmis(cpu);
+
+  // NMIs take priority, so this is only injected if no NMI was
+  deliver_notification(cpu);
 
   // sync the vmcs state with the vcpu state
   vmx_vmwrite(VMCS_CTRL_TSC_OFFSET, cpu->tsc_offset);
   vmx_vmwrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, cpu->preemption_timer);
 
+  end_exit_pmc_sample(cpu, reason);
+  record_vm_exit_latency(cpu, reason, start_tsc);
+
   cpu->ctx = nullptr;
 
   return false;
@@ -294,13 +302,14 @@ void handle_host_interrupt(trap_frame* const frame) {
   switch (frame->vector) {
   // host NMIs
   case nmi: {
-    auto ctrl = read_ctrl_proc_based();
-    ctrl.nmi_window_exiting = 1;
-    write_ctrl_proc_based(ctrl);
-
     auto const cpu = reinterpret_cast<vcpu*>(_readfsbase_u64());
     ++cpu->queued_nmis;
 
+    // we might be past the point where deliver_queued_nmis() is called
+    // (queued NMIs are delivered on the next L2 vm-exit while L2 is running)
+    if (!cpu->nested.in_l2)
+      request_nmi_window(cpu);
+
     break;
   }
   // host exceptions
@@ -328,12 +337,41 @@ void handle_host_interrupt(trap_frame* const frame) {
 // virtualize the specified cpu. this assumes that execution is already
 // restricted to the desired logical proocessor.
 bool virtualize_cpu(vcpu* const cpu) {
+  // these are allocated by create() and need to survive the memset
+  auto const exit_stats   = cpu->exit_stats;
+  auto const exit_trace   = cpu->exit_trace;
+  auto const log_ring     = cpu->log_ring;
+  auto const sample_ring  = cpu->profiler.ring;
+  auto const syscall_ring = cpu->syscall_trace.ring;
+  auto const cr3_ring     = cpu->cr3_telemetry.ring;
+  auto const capture_ring = cpu->exit_capture.ring;
+
   memset(cpu, 0, sizeof(*cpu));
 
+  cpu->exit_stats         = exit_stats;
+  cpu->exit_trace         = exit_trace;
+  cpu->log_ring           = log_ring;
+  cpu->profiler.ring      = sample_ring;
+  cpu->syscall_trace.ring = syscall_ring;
+  cpu->cr3_telemetry.ring = cr3_ring;
+  cpu->exit_capture.ring  = capture_ring;
+
   cache_cpu_data(cpu->cached);
 
   DbgPrint("[hv] Cached VCPU data.\n");
 
+  measure_native_overhead(cpu->native_overhead);
+
+  DbgPrint("[hv] Measured native instruction timings.\n");
+
+  // the XSAVE area only needs to fit if a handler saves the extended state
+  if (handlers_use_extended_state() &&
+      cpu->cached.xsave_area_size > max_xsave_area_size) {
+    DbgPrint("[hv] XSAVE area is too large (0x%X bytes).\n",
+      cpu->cached.xsave_area_size);
+    return false;
+  }
+
   if (!enable_vmx_operation(cpu)) {
     DbgPrint("[hv] Failed to enable VMX operation.\n");
     return false;
@@ -366,14 +404,31 @@ bool virtualize_cpu(vcpu* const cpu) {
 
   DbgPrint("[hv] Wrote VMCS fields.\n");
 
+  cpu->exit_profile_start_tsc = __rdtsc();
+  apply_exit_profile(cpu, ghv.current_exit_profile);
+
+  DbgPrint("[hv] Applied exit profile %u.\n", ghv.current_exit_profile);
+
+  prepare_pmu(cpu);
+
+  DbgPrint("[hv] Prepared PMU compensation (%u GP counters, %u fixed counters).\n",
+    cpu->pmu.gp_counter_count, cpu->pmu.fixed_counter_count);
+
+  if (nested_vmx_enabled) {
+    prepare_nested_vmx(cpu);
+
+    DbgPrint("[hv] Prepared nested VMX (VMCS shadowing = %i).\n",
+      cpu->nested.vmcs_shadowing);
+  }
+
   // TODO: should these fields really be set here? lol
   cpu->ctx                       = nullptr;
   cpu->queued_nmis               = 0;
   cpu->tsc_offset                = 0;
   cpu->preemption_timer          = 0;
-  cpu->vm_exit_tsc_overhead      = 0;
-  cpu->vm_exit_mperf_overhead    = 0;
-  cpu->vm_exit_ref_tsc_overhead  = 0;
+  cpu->last_hidden_exit_tsc      = 0;
+  cpu->hidden_exit_interval      = 0;
+  cpu->calibrating_overhead      = false;
 
   if (!vm_launch()) {
     DbgPrint("[hv] VMLAUNCH failed. Instruction error = %lli.\n",
@@ -393,16 +448,14 @@ bool virtualize_cpu(vcpu* const cpu) {
   if (vmx_vmcall(input) == hypervisor_signature)
     DbgPrint("[hv] Successfully pinged the hypervisor.\n");
 
-  cpu->vm_exit_tsc_overhead      = measure_vm_exit_tsc_overhead();
-  cpu->vm_exit_mperf_overhead    = measure_vm_exit_mperf_overhead();
-  cpu->vm_exit_ref_tsc_overhead  = measure_vm_exit_ref_tsc_overhead();
+  calibrate_vm_exit_overhead();
 
-  DbgPrint("[hv] Measured VM-exit overhead (TSC = %zi).\n",
-    cpu->vm_exit_tsc_overhead);
-  DbgPrint("[hv] Measured VM-exit overhead (MPERF = %zi).\n",
-    cpu->vm_exit_mperf_overhead);
-  DbgPrint("[hv] Measured VM-exit overhead (CPU_CLK_UNHALTED.REF_TSC = %zi).\n",
-    cpu->vm_exit_ref_tsc_overhead);
+  for (int i = 0; i < overhead_class_count; ++i) {
+    auto const& overhead = cpu->exit_overhead[i];
+    DbgPrint("[hv] Measured VM-exit overhead #%i (TSC = %zi, MPERF = %zi, "
+      "INST_RETIRED.ANY = %zi, CPU_CLK_UNHALTED.CORE = %zi, CPU_CLK_UNHALTED.REF_TSC = %zi).\n",
+      i, overhead.tsc, overhead.mperf, overhead.instructions, overhead.core_cycles, overhead.ref_tsc);
+  }
 
   return true;
 }
@@ -1,7 +1,22 @@
 #pragma once
 
 #include "guest-context.h"
+#include "call-counter.h"
+#include "cr3-telemetry.h"
+#include "exit-capture.h"
+#include "exit-profile.h"
+#include "exit-sites.h"
+#include "exit-dispatch.h"
+#include "exit-stats.h"
+#include "exit-trace.h"
+#include "logger.h"
 #include "page-tables.h"
+#include "nested.h"
+#include "notify.h"
+#include "pmu.h"
+#include "profiler.h"
+#include "syscall-trace.h"
+#include "timing.h"
 #include "gdt.h"
 #include "idt.h"
 #include "ept.h"
@@ -15,6 +30,9 @@ inline constexpr size_t host_stack_size = 0x6000;
 // guest virtual-processor identifier
 inline constexpr uint16_t guest_vpid = 1;
 
+// size of the buffer that is used to save the guest extended state
+inline constexpr size_t max_xsave_area_size = 0x3000;
+
 struct vcpu_cached_data {
   // maximum number of bits in a physical address (MAXPHYSADDR)
   uint64_t max_phys_addr;
@@ -28,6 +46,12 @@ struct vcpu_cached_data {
   // mask of unsupported processor state components for XCR0
   uint64_t xcr0_unsupported_mask;
 
+  // size of the XSAVE area for every state component supported in XCR0
+  uint32_t xsave_area_size;
+
+  // whether XSAVEOPT is supported
+  bool xsaveopt_supported;
+
   // IA32_FEATURE_CONTROL
   ia32_feature_control_register feature_control;
   ia32_feature_control_register guest_feature_control;
@@ -35,6 +59,9 @@ struct vcpu_cached_data {
   // IA32_VMX_MISC
   ia32_vmx_misc_register vmx_misc;
 
+  // allowed 1-settings for the vm-exit controls
+  uint32_t vmx_exit_ctrl_allowed1;
+
   // CPUID 0x01
   cpuid_eax_01 cpuid_01;
 };
@@ -77,6 +104,14 @@ struct vcpu {
     vmx_msr_entry mperf;
   } msr_entry_load;
 
+  // number of entries that are currently used in the MSR store/load areas
+  uint32_t msr_exit_store_count;
+  uint32_t msr_entry_load_count;
+
+  // guest extended state (x87, SSE, AVX, etc) that is saved while
+  // running handlers that use vector registers
+  alignas(0x40) uint8_t guest_xsave_area[max_xsave_area_size];
+
   // cached values that are assumed to NEVER change
   vcpu_cached_data cached;
 
@@ -86,22 +121,89 @@ struct vcpu {
   // the number of NMIs that need to be delivered
   uint32_t volatile queued_nmis;
 
+  // whether NMIs are passed directly to the guest (no NMI exiting)
+  bool nmi_passthrough;
+
+  // NMI passthrough is temporarily suspended while NMIs are queued
+  bool volatile nmi_passthrough_suspended;
+
   // current TSC offset
   uint64_t tsc_offset;
 
   // current preemption timer
   uint64_t preemption_timer;
 
-  // the overhead caused by world-transitions
-  uint64_t vm_exit_tsc_overhead;
-  uint64_t vm_exit_mperf_overhead;
-  uint64_t vm_exit_ref_tsc_overhead;
+  // TSC value of the last hidden vm-exit
+  uint64_t last_hidden_exit_tsc;
+
+  // average number of TSC ticks between hidden vm-exits
+  uint64_t hidden_exit_interval;
+
+  // the overhead caused by world-transitions, for every exit type
+  vm_exit_overhead exit_overhead[overhead_class_count];
+
+  // the native cost of the instruction behind every exit type, which the
+  // guest still expects to see (measured before virtualizing)
+  vm_exit_overhead native_overhead[overhead_class_count];
+
+  // guest performance counter configuration
+  vcpu_pmu_data pmu;
+
+  // whether the overhead is being calibrated (it isn't compensated until
+  // the calibration is finished)
+  bool calibrating_overhead;
 
   // whether to use TSC offsetting for the current vm-exit--false by default
   bool hide_vm_exit_overhead;
 
+  // whether the current exit profile tries to conceal vm-exit overhead
+  bool conceal_timing;
+
   // whether to devirtualize the current VCPU
   bool stop_virtualization;
+
+  // the exit profile that is currently applied to this VCPU
+  exit_profile current_exit_profile;
+
+  // TSC value when the current exit profile was applied
+  uint64_t exit_profile_start_tsc;
+
+  // vm-exit statistics for every exit profile
+  exit_profile_stats profile_stats[exit_profile_count];
+
+  // vm-exit statistics (these live in ghv.exit_stats so that they can be
+  // mapped into clients)
+  vcpu_exit_stats* exit_stats;
+
+  // vm-exit trace ring (this lives in ghv.exit_traces)
+  vcpu_exit_trace* exit_trace;
+
+  // vm-exit capture for offline replay
+  vcpu_exit_capture_data exit_capture;
+
+  // root-mode log ring (this lives in ghv.log_rings)
+  vcpu_log_ring* log_ring;
+
+  // sampling profiler state
+  vcpu_profiler_data profiler;
+
+  // exact function call counting
+  vcpu_call_counter_data call_counter;
+
+  // syscall tracing (built on top of call counting)
+  vcpu_syscall_trace_data syscall_trace;
+
+  // CR3-load telemetry
+  vcpu_cr3_telemetry_data cr3_telemetry;
+
+  // vm-exit counts for every (exit reason, guest RIP)
+  vcpu_exit_site_table exit_sites;
+
+  // ring watermark notifications
+  vcpu_notification_data notification;
+
+  // nested VMX state
+  vcpu_nested_data nested;
 };
 
 // virtualize the specified cpu. this assumes that execution is already
@@ -30,6 +30,7 @@ guest_context struct
   $dr2 qword ?
   $dr3 qword ?
   $dr6 qword ?
+  $vmlaunch qword ?
 guest_context ends
 
 extern ?handle_vm_exit@hv@@YA_NQEAUguest_context@1@@Z : proc
@@ -123,9 +124,19 @@ extern ?handle_vm_exit@hv@@YA_NQEAUguest_context@1@@Z : proc
   mov r15, guest_context.$r15[rsp]
   jnz stop_virtualization
 
+  ; a freshly cleared vmcs02 (nested VMX) needs to be launched instead
+  cmp guest_context.$vmlaunch[rsp], 0
+  jnz launch_vmcs
+
   ; if handle_exit returned false, perform a vm-enter as usual
   vmresume
 
+  ; a failed vm-entry falls through with VM_INSTRUCTION_ERROR intact
+  jmp stop_virtualization
+
+launch_vmcs:
+  vmlaunch
+
 stop_virtualization:
   ; we'll be dirtying these registers in order to setup the
   ; stack so we need to store and restore them before we can use them.
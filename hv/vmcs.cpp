@@ -24,10 +24,6 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   // 3.24.6.2
   ia32_vmx_procbased_ctls_register proc_based_ctrl;
   proc_based_ctrl.flags                       = 0;
-#ifndef NDEBUG
-  proc_based_ctrl.cr3_load_exiting            = 1;
-  proc_based_ctrl.cr3_store_exiting           = 1;
-#endif
   proc_based_ctrl.use_msr_bitmaps             = 1;
   proc_based_ctrl.use_tsc_offsetting          = 1;
   proc_based_ctrl.activate_secondary_controls = 1;
@@ -79,17 +75,12 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   vmx_vmwrite(VMCS_CTRL_TSC_OFFSET, 0);
 
   // 3.24.6.6
-#ifdef NDEBUG
-  // only vm-exit when guest tries to change a reserved bit
+  // only vm-exit when guest tries to change a reserved bit. CR3 exiting and
+  // the CR0/CR4 masks are changed later on by apply_exit_profile().
   vmx_vmwrite(VMCS_CTRL_CR0_GUEST_HOST_MASK,
     cpu->cached.vmx_cr0_fixed0 | ~cpu->cached.vmx_cr0_fixed1);
   vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK,
     cpu->cached.vmx_cr4_fixed0 | ~cpu->cached.vmx_cr4_fixed1);
-#else
-  // vm-exit on every CR0/CR4 modification
-  vmx_vmwrite(VMCS_CTRL_CR0_GUEST_HOST_MASK, 0xFFFFFFFF'FFFFFFFF);
-  vmx_vmwrite(VMCS_CTRL_CR4_GUEST_HOST_MASK, 0xFFFFFFFF'FFFFFFFF);
-#endif
   vmx_vmwrite(VMCS_CTRL_CR0_READ_SHADOW, __readcr0());
   vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, __readcr4() & ~CR4_VMX_ENABLE_FLAG);
 
@@ -118,8 +109,8 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   cpu->msr_exit_store.perf_global_ctrl.msr_idx = IA32_PERF_GLOBAL_CTRL;
   cpu->msr_exit_store.aperf.msr_idx            = IA32_APERF;
   cpu->msr_exit_store.mperf.msr_idx            = IA32_MPERF;
-  vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_COUNT,
-    sizeof(cpu->msr_exit_store) / 16);
+  cpu->msr_exit_store_count = sizeof(cpu->msr_exit_store) / 16;
+  vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_COUNT, cpu->msr_exit_store_count);
   vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS,
     MmGetPhysicalAddress(&cpu->msr_exit_store).QuadPart);
 
@@ -130,8 +121,8 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   // 3.24.8.2
   cpu->msr_entry_load.aperf.msr_idx = IA32_APERF;
   cpu->msr_entry_load.mperf.msr_idx = IA32_MPERF;
-  vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT,
-    sizeof(cpu->msr_entry_load) / 16);
+  cpu->msr_entry_load_count = sizeof(cpu->msr_entry_load) / 16;
+  vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT, cpu->msr_entry_load_count);
   vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_ADDRESS,
     MmGetPhysicalAddress(&cpu->msr_entry_load).QuadPart);
 
@@ -0,0 +1,326 @@
+#include "vmx-sim.h"
+#include "nested-vmcs.h"
+#include "platform.h"
+#include "vmx.h"
+
+// software VMCS for the portable build (see vmx-sim.h). this file is never
+// compiled into the driver.
+
+namespace hv {
+
+// TODO: move to ia32?
+// IA32_VMX_MISC[29] (VMWRITE to vm-exit information fields)
+static constexpr uint64_t vmx_misc_vmwrite_exit_info = 1ull << 29;
+
+// VMCS fields are grouped by width and type (B.1). every group is stored in
+// its own array of slots, which are indexed by the field index.
+static constexpr size_t max_vmcs_group_size = 64;
+static constexpr size_t vmcs_slot_count     = 16 * max_vmcs_group_size;
+
+// number of fields in every group, indexed by [width][type] (B.1-B.4)
+static constexpr uint8_t vmcs_group_sizes[4][4] = {
+  // control, vm-exit information, guest-state, host-state
+  { 0x04, 0x00, 0x0A, 0x07 }, // 16-bit
+  { 0x23, 0x01, 0x0D, 0x04 }, // 64-bit
+  { 0x12, 0x08, 0x18, 0x01 }, // 32-bit
+  { 0x08, 0x06, 0x17, 0x0F }  // natural-width
+};
+
+struct simulated_vmcs {
+  // physical address of the VMCS region (0 if this entry is unused)
+  uint64_t phys_addr;
+
+  uint64_t fields[vmcs_slot_count];
+};
+
+static simulated_vmcs vmcs_regions[max_simulated_vmcs_count];
+
+// the VMCS that was loaded with VMPTRLD (null if there isn't one)
+static simulated_vmcs* current_vmcs = nullptr;
+
+// whether the read-only fields can be written (cached on VMXON)
+static bool vmwrite_exit_info_supported = false;
+
+static simulated_vmx_counters counters;
+static uint64_t field_reads[vmcs_slot_count];
+static uint64_t field_writes[vmcs_slot_count];
+
+// ring of the most recent invalidations
+static simulated_invalidation invalidations[max_simulated_invalidations];
+static uint64_t invalidation_count = 0;
+
+// get the slot of a VMCS field, or -1 if the field isn't supported
+static int vmcs_field_slot(uint64_t const field) {
+  // bits 63:15 and bit 12 are reserved
+  if (field & ~0x6FFFull)
+    return -1;
+
+  auto const high  = field & 1;
+  auto const index = (field >> 1) & 0x1FF;
+  auto const type  = get_vmcs_field_type(field);
+  auto const width = get_vmcs_field_width(field);
+
+  // only 64-bit fields can be accessed in two halves
+  if (high && width != vmcs_field_width_64)
+    return -1;
+
+  if (index >= vmcs_group_sizes[width][type])
+    return -1;
+
+  return static_cast<int>((width * 4 + type) * max_vmcs_group_size + index);
+}
+
+// read a field in a supported slot (24.11.2)
+static uint64_t read_vmcs_slot(int const slot, uint64_t const field) {
+  auto const value = current_vmcs->fields[slot];
+
+  switch (get_vmcs_field_width(field)) {
+  case vmcs_field_width_16: return value & 0xFFFF;
+  case vmcs_field_width_32: return value & 0xFFFF'FFFF;
+  case vmcs_field_width_64: return (field & 1) ? (value >> 32) : value;
+  default:                     return value;
+  }
+}
+
+// write a field in a supported slot (24.11.2)
+static void write_vmcs_slot(int const slot, uint64_t const field, uint64_t const value) {
+  auto& stored = current_vmcs->fields[slot];
+
+  switch (get_vmcs_field_width(field)) {
+  case vmcs_field_width_16: stored = value & 0xFFFF; break;
+  case vmcs_field_width_32: stored = value & 0xFFFF'FFFF; break;
+  case vmcs_field_width_64:
+    stored = (field & 1) ? ((stored & 0xFFFF'FFFF) | (value << 32)) : value;
+    break;
+  default: stored = value; break;
+  }
+}
+
+// VMfailValid (31.2)
+static unsigned char vm_fail_valid(vm_instruction_error const error) {
+  write_vmcs_slot(vmcs_field_slot(VMCS_VM_INSTRUCTION_ERROR),
+    VMCS_VM_INSTRUCTION_ERROR, error);
+  return 1;
+}
+
+// VMfail (31.2)
+static unsigned char vm_fail(vm_instruction_error const error) {
+  if (!current_vmcs)
+    return 2;
+
+  return vm_fail_valid(error);
+}
+
+// find the VMCS that is stored at the specified physical address, or
+// take an unused entry for it
+static simulated_vmcs* find_vmcs_region(uint64_t const phys_addr) {
+  simulated_vmcs* unused = nullptr;
+
+  for (auto& region : vmcs_regions) {
+    if (region.phys_addr == phys_addr)
+      return &region;
+
+    if (!unused && !region.phys_addr)
+      unused = &region;
+  }
+
+  if (unused) {
+    memset(unused, 0, sizeof(*unused));
+    unused->phys_addr = phys_addr;
+  }
+
+  return unused;
+}
+
+// whether a VMCS region address is page-aligned and inside of the
+// physical memory image (address 0 is used to mark unused entries)
+static bool is_valid_vmcs_address(uint64_t const phys_addr) {
+  return phys_addr && !(phys_addr & 0xFFF) &&
+    phys_addr < physical_memory_image_size();
+}
+
+// forget every VMCS and reset the counters (the VMCS regions need to be
+// VMCLEARed again before they can be used)
+void reset_simulated_vmx() {
+  memset(vmcs_regions, 0, sizeof(vmcs_regions));
+  current_vmcs = nullptr;
+  reset_simulated_vmx_counters();
+}
+
+// read a field of the current VMCS without any checks
+uint64_t read_simulated_vmcs(uint64_t const field) {
+  auto const slot = vmcs_field_slot(field);
+  if (!current_vmcs || slot < 0)
+    return 0;
+
+  return read_vmcs_slot(slot, field);
+}
+
+// write a field of the current VMCS without any checks (this is how the
+// processor fills out the read-only vm-exit information fields)
+void write_simulated_vmcs(uint64_t const field, uint64_t const value) {
+  auto const slot = vmcs_field_slot(field);
+  if (!current_vmcs || slot < 0)
+    return;
+
+  write_vmcs_slot(slot, field, value);
+}
+
+// VMX instructions that were executed since the last reset
+simulated_vmx_counters const& read_simulated_vmx_counters() {
+  return counters;
+}
+
+// number of VMREADs and VMWRITEs of a single field since the last reset
+uint64_t simulated_vmcs_reads(uint64_t const field) {
+  auto const slot = vmcs_field_slot(field);
+  return (slot < 0) ? 0 : field_reads[slot];
+}
+
+uint64_t simulated_vmcs_writes(uint64_t const field) {
+  auto const slot = vmcs_field_slot(field);
+  return (slot < 0) ? 0 : field_writes[slot];
+}
+
+// reset the VMX instruction counters and the invalidation log
+void reset_simulated_vmx_counters() {
+  memset(&counters, 0, sizeof(counters));
+  memset(field_reads, 0, sizeof(field_reads));
+  memset(field_writes, 0, sizeof(field_writes));
+  invalidation_count = 0;
+}
+
+// get the most recent INVEPT/INVVPID executions (oldest first). returns the
+// number of invalidations that were written to the array.
+size_t read_simulated_invalidations(
+    simulated_invalidation (&out)[max_simulated_invalidations]) {
+  auto const count = min(invalidation_count, max_simulated_invalidations);
+  auto const first = invalidation_count - count;
+
+  for (size_t i = 0; i < count; ++i)
+    out[i] = invalidations[(first + i) % max_simulated_invalidations];
+
+  return count;
+}
+
+// INVEPT instruction
+void vmx_invept(invept_type const type, invept_descriptor const& desc) {
+  ++counters.invepts;
+
+  auto& inv = invalidations[invalidation_count++ % max_simulated_invalidations];
+  inv.instruction = VMX_EXIT_REASON_EXECUTE_INVEPT;
+  inv.vpid        = 0;
+  inv.type        = type;
+  inv.address     = desc.ept_pointer;
+}
+
+// INVVPID instruction
+void vmx_invvpid(invvpid_type const type, invvpid_descriptor const& desc) {
+  ++counters.invvpids;
+
+  auto& inv = invalidations[invalidation_count++ % max_simulated_invalidations];
+  inv.instruction = VMX_EXIT_REASON_EXECUTE_INVVPID;
+  inv.vpid        = static_cast<uint16_t>(desc.vpid);
+  inv.type        = type;
+  inv.address     = desc.linear_address;
+}
+
+} // namespace hv
+
+using namespace hv;
+
+unsigned char __vmx_on(uint64_t* const vmxon_phys_addr) {
+  if (!is_valid_vmcs_address(*vmxon_phys_addr))
+    return 2;
+
+  vmwrite_exit_info_supported = __readmsr(IA32_VMX_MISC) & vmx_misc_vmwrite_exit_info;
+  current_vmcs = nullptr;
+
+  return 0;
+}
+
+void __vmx_off() {
+  current_vmcs = nullptr;
+}
+
+unsigned char __vmx_vmclear(uint64_t* const vmcs_phys_addr) {
+  ++counters.vmclears;
+
+  if (!is_valid_vmcs_address(*vmcs_phys_addr))
+    return vm_fail(vm_instruction_error_vmclear_invalid_address);
+
+  auto const region = find_vmcs_region(*vmcs_phys_addr);
+  if (!region)
+    return vm_fail(vm_instruction_error_vmclear_invalid_address);
+
+  // the launch state is clear, and the data is written back to the region
+  // (which we just pretend is zeroed)
+  memset(region->fields, 0, sizeof(region->fields));
+
+  if (region == current_vmcs)
+    current_vmcs = nullptr;
+
+  return 0;
+}
+
+unsigned char __vmx_vmptrld(uint64_t* const vmcs_phys_addr) {
+  ++counters.vmptrlds;
+
+  if (!is_valid_vmcs_address(*vmcs_phys_addr))
+    return vm_fail(vm_instruction_error_vmptrld_invalid_address);
+
+  auto const region = find_vmcs_region(*vmcs_phys_addr);
+  if (!region)
+    return vm_fail(vm_instruction_error_vmptrld_invalid_address);
+
+  current_vmcs = region;
+
+  return 0;
+}
+
+unsigned char __vmx_vmread(size_t const field, size_t* const value) {
+  ++counters.vmreads;
+
+  if (!current_vmcs) {
+    ++counters.failed_vmreads;
+    return 2;
+  }
+
+  auto const slot = vmcs_field_slot(field);
+  if (slot < 0) {
+    ++counters.failed_vmreads;
+    return vm_fail_valid(vm_instruction_error_unsupported_field);
+  }
+
+  ++field_reads[slot];
+  *value = read_vmcs_slot(slot, field);
+
+  return 0;
+}
+
+unsigned char __vmx_vmwrite(size_t const field, size_t const value) {
+  ++counters.vmwrites;
+
+  if (!current_vmcs) {
+    ++counters.failed_vmwrites;
+    return 2;
+  }
+
+  auto const slot = vmcs_field_slot(field);
+  if (slot < 0) {
+    ++counters.failed_vmwrites;
+    return vm_fail_valid(vm_instruction_error_unsupported_field);
+  }
+
+  if (get_vmcs_field_type(field) == vmcs_field_type_exit_info &&
+      !vmwrite_exit_info_supported) {
+    ++counters.failed_vmwrites;
+    return vm_fail_valid(vm_instruction_error_vmwrite_read_only_field);
+  }
+
+  ++field_writes[slot];
+  write_vmcs_slot(slot, field, value);
+
+  return 0;
+}
+
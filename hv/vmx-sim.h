@@ -0,0 +1,70 @@
+#pragma once
+
+#include <ia32.hpp>
+
+// a software VMCS that backs the __vmx_* intrinsics in the portable build
+// (see platform.h). fields are stored by encoding, and VMREAD/VMWRITE fail
+// the same way that they would on hardware: with VMfailValid and an error
+// number in the VM-instruction error field.
+
+namespace hv {
+
+// number of VMCS regions that can be used at the same time (vmcs01, vmcs02,
+// and the shadow VMCS if nested VMX is enabled)
+inline constexpr size_t max_simulated_vmcs_count = 4;
+
+// number of INVEPT/INVVPID executions that are remembered
+inline constexpr size_t max_simulated_invalidations = 64;
+
+// an INVEPT or INVVPID that was executed
+struct simulated_invalidation {
+  // VMX_EXIT_REASON_EXECUTE_INVEPT or VMX_EXIT_REASON_EXECUTE_INVVPID
+  uint16_t instruction;
+  uint16_t vpid;
+
+  uint64_t type;
+
+  // EPTP for INVEPT, linear address for INVVPID
+  uint64_t address;
+};
+
+// VMX instructions that were executed since the last reset
+struct simulated_vmx_counters {
+  uint64_t vmreads;
+  uint64_t vmwrites;
+  uint64_t failed_vmreads;
+  uint64_t failed_vmwrites;
+  uint64_t vmclears;
+  uint64_t vmptrlds;
+  uint64_t invepts;
+  uint64_t invvpids;
+};
+
+// forget every VMCS and reset the counters (the VMCS regions need to be
+// VMCLEARed again before they can be used)
+void reset_simulated_vmx();
+
+// read a field of the current VMCS without any checks
+uint64_t read_simulated_vmcs(uint64_t field);
+
+// write a field of the current VMCS without any checks (this is how the
+// processor fills out the read-only vm-exit information fields)
+void write_simulated_vmcs(uint64_t field, uint64_t value);
+
+// VMX instructions that were executed since the last reset
+simulated_vmx_counters const& read_simulated_vmx_counters();
+
+// number of VMREADs and VMWRITEs of a single field since the last reset
+uint64_t simulated_vmcs_reads(uint64_t field);
+uint64_t simulated_vmcs_writes(uint64_t field);
+
+// reset the VMX instruction counters and the invalidation log
+void reset_simulated_vmx_counters();
+
+// get the most recent INVEPT/INVVPID executions (oldest first). returns the
+// number of invalidations that were written to the array.
+size_t read_simulated_invalidations(
+  simulated_invalidation (&invalidations)[max_simulated_invalidations]);
+
+} // namespace hv
+
@@ -13,6 +13,10 @@ struct vmx_msr_entry {
   uint64_t msr_data;
 };
 
+// TODO: move to ia32?
+// "save IA32_PERF_GLOBAL_CTRL" vm-exit control
+inline constexpr uint64_t vmx_exit_ctrl_save_ia32_perf_global_ctrl = 1ull << 30;
+
 // INVEPT instruction
 void vmx_invept(invept_type type, invept_descriptor const& desc);
 
@@ -114,6 +118,9 @@ void skip_instruction();
 // inject a non-maskable interrupt into the guest
 void inject_nmi();
 
+// inject an external interrupt into the guest
+void inject_interrupt(uint8_t vector);
+
 // inject a vectored exception into the guest
 void inject_hw_exception(uint32_t vector);
 
@@ -276,6 +276,17 @@ inline void inject_nmi() {
   vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt_info.flags);
 }
 
+// inject an external interrupt into the guest
+inline void inject_interrupt(uint8_t const vector) {
+  vmentry_interrupt_information interrupt_info;
+  interrupt_info.flags              = 0;
+  interrupt_info.vector             = vector;
+  interrupt_info.interruption_type  = external_interrupt;
+  interrupt_info.deliver_error_code = 0;
+  interrupt_info.valid              = 1;
+  vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt_info.flags);
+}
+
 // inject a vectored exception into the guest
 inline void inject_hw_exception(uint32_t const vector) {
   vmentry_interrupt_information interrupt_info;
@@ -302,27 +313,47 @@ inline void inject_hw_exception(uint32_t const vector, uint32_t const error) {
 // enable/disable vm-exits when the guest tries to read the specified MSR
 inline void enable_exit_for_msr_read(vmx_msr_bitmap& bitmap,
     uint32_t const msr, bool const enable_exiting) {
-  auto const bit = static_cast<uint8_t>(enable_exiting ? 1 : 0);
+  uint8_t* byte = nullptr;
 
   if (msr <= MSR_ID_LOW_MAX)
-    // set the bit in the low bitmap
-    bitmap.rdmsr_low[msr / 8] = (bit << (msr & 0b0111));
+    // the bit is in the low bitmap
+    byte = &bitmap.rdmsr_low[msr / 8];
   else if (msr >= MSR_ID_HIGH_MIN && msr <= MSR_ID_HIGH_MAX)
-    // set the bit in the high bitmap
-    bitmap.rdmsr_high[(msr - MSR_ID_HIGH_MIN) / 8] = (bit << (msr & 0b0111));
+    // the bit is in the high bitmap
+    byte = &bitmap.rdmsr_high[(msr - MSR_ID_HIGH_MIN) / 8];
+  else
+    return;
+
+  // only modify the bit for this MSR (and not the neighbouring ones)
+  auto const bit = static_cast<uint8_t>(1 << (msr & 0b0111));
+
+  if (enable_exiting)
+    *byte |= bit;
+  else
+    *byte &= ~bit;
 }
 
 // enable/disable vm-exits when the guest tries to write to the specified MSR
 inline void enable_exit_for_msr_write(vmx_msr_bitmap& bitmap,
     uint32_t const msr, bool const enable_exiting) {
-  auto const bit = static_cast<uint8_t>(enable_exiting ? 1 : 0);
+  uint8_t* byte = nullptr;
 
   if (msr <= MSR_ID_LOW_MAX)
-    // set the bit in the low bitmap
-    bitmap.wrmsr_low[msr / 8] = (bit << (msr & 0b0111));
+    // the bit is in the low bitmap
+    byte = &bitmap.wrmsr_low[msr / 8];
   else if (msr >= MSR_ID_HIGH_MIN && msr <= MSR_ID_HIGH_MAX)
-    // set the bit in the high bitmap
-    bitmap.wrmsr_high[(msr - MSR_ID_HIGH_MIN) / 8] = (bit << (msr & 0b0111));
+    // the bit is in the high bitmap
+    byte = &bitmap.wrmsr_high[(msr - MSR_ID_HIGH_MIN) / 8];
+  else
+    return;
+
+  // only modify the bit for this MSR (and not the neighbouring ones)
+  auto const bit = static_cast<uint8_t>(1 << (msr & 0b0111));
+
+  if (enable_exiting)
+    *byte |= bit;
+  else
+    *byte &= ~bit;
 }
 
 } // namespace hv
@@ -0,0 +1,887 @@
+#include "test.h"
+
+#include "../hv/cr3-telemetry.h"
+#include "../hv/ept.h"
+#include "../hv/mm.h"
+#include "../hv/mtrr.h"
+#include "../hv/nested-vmcs.h"
+#include "../hv/page-tables.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// unit tests for the portable core: MTRR typing, guest page walks on
+// synthetic page tables, EPT splitting, EPT hook lookup, and nested VMX
+// (vmcs12 checks, vmcs02 merging, and which L2 vm-exits are reflected)
+
+using namespace hv;
+
+// size of the simulated physical memory image
+static constexpr size_t physical_memory_size = 64 * 0x100000;
+
+// the same MTRR layout as bench/core-bench.cpp: WB by default, with a few
+// UC holes, a WT range and a WC framebuffer (default type is UC)
+static void setup_simulated_mtrrs() {
+  static constexpr struct {
+    uint64_t base;
+    uint64_t size;
+    uint8_t type;
+  } ranges[] = {
+    { 0x0000'0000, 0x8000'0000, MEMORY_TYPE_WRITE_BACK      },
+    { 0x8000'0000, 0x4000'0000, MEMORY_TYPE_WRITE_BACK      },
+    { 0xC000'0000, 0x4000'0000, MEMORY_TYPE_UNCACHEABLE     },
+    { 0xA000'0000, 0x1000'0000, MEMORY_TYPE_WRITE_COMBINING },
+    { 0x0FE0'0000, 0x0020'0000, MEMORY_TYPE_UNCACHEABLE     },
+    { 0x1000'0000, 0x0400'0000, MEMORY_TYPE_WRITE_THROUGH   },
+  };
+
+  static constexpr size_t range_count = sizeof(ranges) / sizeof(ranges[0]);
+
+  ia32_mtrr_capabilities_register cap;
+  cap.flags                 = 0;
+  cap.variable_range_count  = 10;
+  cap.fixed_range_supported = 1;
+  set_simulated_msr(IA32_MTRR_CAPABILITIES, cap.flags);
+
+  ia32_mtrr_def_type_register def_type;
+  def_type.flags                   = 0;
+  def_type.default_memory_type     = MEMORY_TYPE_UNCACHEABLE;
+  def_type.fixed_range_mtrr_enable = 1;
+  def_type.mtrr_enable             = 1;
+  set_simulated_msr(IA32_MTRR_DEF_TYPE, def_type.flags);
+
+  for (uint32_t i = 0; i < cap.variable_range_count; ++i) {
+    ia32_mtrr_physbase_register base;
+    ia32_mtrr_physmask_register mask;
+    base.flags = 0;
+    mask.flags = 0;
+
+    if (i < range_count) {
+      // 36-bit physical addresses
+      base.type              = ranges[i].type;
+      base.page_frame_number = ranges[i].base >> 12;
+      mask.valid             = 1;
+      mask.page_frame_number = (~(ranges[i].size - 1) & 0xF'FFFF'FFFF) >> 12;
+    }
+
+    set_simulated_msr(IA32_MTRR_PHYSBASE0 + i * 2, base.flags);
+    set_simulated_msr(IA32_MTRR_PHYSMASK0 + i * 2, mask.flags);
+  }
+}
+
+// the physical address of an address inside of the physical memory image
+static uint64_t physical_address(void* const address) {
+  return MmGetPhysicalAddress(address).QuadPart;
+}
+
+HV_TEST(mtrr_variable_ranges) {
+  auto const mtrrs = read_mtrr_data();
+  HV_CHECK_EQ(mtrrs.var_count, 6);
+
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0010'0000, 0x1000), MEMORY_TYPE_WRITE_BACK);
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x8000'0000, 0x1000), MEMORY_TYPE_WRITE_BACK);
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0xC000'0000, 0x1000), MEMORY_TYPE_UNCACHEABLE);
+
+  // not covered by any range
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x1'0000'0000, 0x1000), MEMORY_TYPE_UNCACHEABLE);
+}
+
+HV_TEST(mtrr_overlapping_ranges) {
+  auto const mtrrs = read_mtrr_data();
+
+  // UC takes precedence over WB
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0FE0'0000, 0x1000), MEMORY_TYPE_UNCACHEABLE);
+
+  // WT takes precedence over WB
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x1000'0000, 0x1000), MEMORY_TYPE_WRITE_THROUGH);
+
+  // WC over WB is undefined, but the lower type is used
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0xA000'0000, 0x1000), MEMORY_TYPE_WRITE_COMBINING);
+}
+
+HV_TEST(mtrr_ranges_and_alignment) {
+  auto const mtrrs = read_mtrr_data();
+
+  // a 2MB page that is entirely WB, and one that contains the UC hole
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0FC0'0000, 0x200000), MEMORY_TYPE_WRITE_BACK);
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0FE0'0000, 0x200000), MEMORY_TYPE_UNCACHEABLE);
+
+  // a range that crosses from WT into WB uses the worse type
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x13E0'0000, 0x400000), MEMORY_TYPE_WRITE_THROUGH);
+
+  // unaligned addresses are rounded down, and sizes up, to whole pages
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0FE0'0FFF, 1), MEMORY_TYPE_UNCACHEABLE);
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0FDF'F000, 0x1001), MEMORY_TYPE_UNCACHEABLE);
+}
+
+HV_TEST(mtrr_fixed_and_disabled) {
+  auto mtrrs = read_mtrr_data();
+
+  // the fixed-range MTRRs aren't implemented and are treated as UC
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0000'0000, 0x1000), MEMORY_TYPE_UNCACHEABLE);
+
+  mtrrs.def_type.fixed_range_mtrr_enable = 0;
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0000'0000, 0x1000), MEMORY_TYPE_WRITE_BACK);
+
+  mtrrs.def_type.mtrr_enable = 0;
+  HV_CHECK_EQ(calc_mtrr_mem_type(mtrrs, 0x0010'0000, 0x1000), MEMORY_TYPE_UNCACHEABLE);
+}
+
+// the EPT paging structures, which are allocated inside of the image once
+static vcpu_ept_data* create_ept() {
+  static vcpu_ept_data* ept = nullptr;
+
+  if (!ept) {
+    ept = static_cast<vcpu_ept_data*>(
+      allocate_physical_pages((sizeof(vcpu_ept_data) + 0xFFF) / 0x1000));
+
+    if (!ept) {
+      fprintf(stderr, "physical memory image is too small\n");
+      exit(1);
+    }
+  }
+
+  prepare_ept(*ept);
+  return ept;
+}
+
+HV_TEST(ept_identity_map) {
+  auto const ept = create_ept();
+
+  auto const& pde = ept->pds_2mb[1][3];
+  HV_CHECK(pde.large_page);
+  HV_CHECK_EQ(pde.page_frame_number, (1 << 9) + 3);
+  HV_CHECK_EQ(pde.memory_type, MEMORY_TYPE_WRITE_BACK);
+
+  // the UC hole at 0x0FE00000
+  HV_CHECK_EQ(ept->pds_2mb[0][0x7F].memory_type, MEMORY_TYPE_UNCACHEABLE);
+
+  // PTEs only exist once the PDE is split
+  HV_CHECK(!get_ept_pte(*ept, 0x4020'0000));
+}
+
+HV_TEST(split_ept_pde_copies_attributes) {
+  auto const ept = create_ept();
+
+  auto const pde_2mb = &ept->pds_2mb[0][0x80];
+  pde_2mb->write_access = 0;
+
+  split_ept_pde(*ept, pde_2mb);
+
+  HV_CHECK(!pde_2mb->large_page);
+  HV_CHECK_EQ(ept->num_used_free_pages, 1);
+
+  auto const pde = reinterpret_cast<ept_pde*>(pde_2mb);
+  HV_CHECK_EQ(pde->page_frame_number, ept->free_page_pfns[0]);
+  HV_CHECK(pde->read_access && pde->write_access && pde->execute_access);
+
+  // every PTE maps its 4KB of the original 2MB page
+  auto const pt = reinterpret_cast<ept_pte*>(&ept->free_pages[0]);
+  for (size_t i = 0; i < 512; ++i) {
+    HV_CHECK_EQ(pt[i].page_frame_number, (0x80ull << 9) + i);
+    HV_CHECK_EQ(pt[i].memory_type, MEMORY_TYPE_WRITE_THROUGH);
+    HV_CHECK(pt[i].read_access && !pt[i].write_access && pt[i].execute_access);
+  }
+
+  HV_CHECK(get_ept_pte(*ept, 0x1012'3456) == &pt[0x123]);
+
+  // splitting it again doesn't allocate another PT
+  split_ept_pde(*ept, pde_2mb);
+  HV_CHECK_EQ(ept->num_used_free_pages, 1);
+}
+
+HV_TEST(split_ept_pde_out_of_pages) {
+  auto const ept = create_ept();
+
+  for (size_t i = 0; i < ept_free_page_count; ++i) {
+    split_ept_pde(*ept, &ept->pds_2mb[2][i]);
+    HV_CHECK(!ept->pds_2mb[2][i].large_page);
+  }
+
+  // no free pages are left, so the PDE stays a 2MB page
+  split_ept_pde(*ept, &ept->pds_2mb[2][ept_free_page_count]);
+  HV_CHECK(ept->pds_2mb[2][ept_free_page_count].large_page);
+  HV_CHECK(!get_ept_pte(*ept, (2ull << 30) + (ept_free_page_count << 21), true));
+}
+
+HV_TEST(ept_hook_lookup) {
+  auto const ept = create_ept();
+
+  HV_CHECK(!find_ept_hook(*ept, 0x1234));
+
+  HV_CHECK(install_ept_hook(*ept, 0x1234, 0x5678));
+  HV_CHECK(install_ept_hook(*ept, 0x1235, 0x5679));
+
+  auto const hook = find_ept_hook(*ept, 0x1234);
+  HV_CHECK(hook);
+  if (hook)
+    HV_CHECK_EQ(hook->exec_pfn, 0x5678);
+
+  // instruction fetches from the hooked page cause an EPT violation
+  HV_CHECK(!get_ept_pte(*ept, 0x1234ull << 12)->execute_access);
+  HV_CHECK(get_ept_pte(*ept, 0x1236ull << 12)->execute_access);
+
+  remove_ept_hook(*ept, 0x1234);
+  HV_CHECK(!find_ept_hook(*ept, 0x1234));
+  HV_CHECK(find_ept_hook(*ept, 0x1235));
+  HV_CHECK(get_ept_pte(*ept, 0x1234ull << 12)->execute_access);
+
+  // removing a hook that doesn't exist does nothing
+  remove_ept_hook(*ept, 0x1234);
+  HV_CHECK(find_ept_hook(*ept, 0x1235));
+}
+
+HV_TEST(ept_hook_capacity) {
+  auto const ept = create_ept();
+
+  for (uint64_t pfn = 0; pfn < vcpu_ept_hooks::capacity; ++pfn)
+    HV_CHECK(install_ept_hook(*ept, pfn, 0x200 + pfn));
+
+  // every node is in use
+  HV_CHECK(!install_ept_hook(*ept, vcpu_ept_hooks::capacity, 0x300));
+
+  for (uint64_t pfn = 0; pfn < vcpu_ept_hooks::capacity; ++pfn) {
+    auto const hook = find_ept_hook(*ept, pfn);
+    HV_CHECK(hook && hook->exec_pfn == 0x200 + pfn);
+  }
+
+  // a removed node can be reused
+  remove_ept_hook(*ept, 7);
+  HV_CHECK(install_ept_hook(*ept, 0x100, 0x300));
+  HV_CHECK(find_ept_hook(*ept, 0x100));
+}
+
+// the guest page tables, which are built inside of the image once:
+//   [0,          1GB)       -> 1GB page at physical address 0
+//   [1GB,        1GB + 2MB) -> 2MB page at physical address 0x200000
+//   [1GB + 2MB,  1GB + 4MB) -> 4KB pages at physical addresses 0x1000..
+static cr3 build_guest_page_tables() {
+  static cr3 guest_cr3 = {};
+
+  if (guest_cr3.flags)
+    return guest_cr3;
+
+  auto const pml4 = static_cast<pml4e_64*>(allocate_physical_pages(1));
+  auto const pdpt = static_cast<pdpte_64*>(allocate_physical_pages(1));
+  auto const pd   = static_cast<pde_64*>(allocate_physical_pages(1));
+  auto const pt   = static_cast<pte_64*>(allocate_physical_pages(1));
+
+  pml4[0].present           = 1;
+  pml4[0].write             = 1;
+  pml4[0].page_frame_number = physical_address(pdpt) >> 12;
+
+  pdpte_1gb_64 pdpte_1gb;
+  pdpte_1gb.flags             = 0;
+  pdpte_1gb.present           = 1;
+  pdpte_1gb.write             = 1;
+  pdpte_1gb.large_page        = 1;
+  pdpte_1gb.page_frame_number = 0;
+  pdpt[0].flags = pdpte_1gb.flags;
+
+  pdpt[1].present           = 1;
+  pdpt[1].write             = 1;
+  pdpt[1].page_frame_number = physical_address(pd) >> 12;
+
+  pde_2mb_64 pde_2mb;
+  pde_2mb.flags             = 0;
+  pde_2mb.present           = 1;
+  pde_2mb.write             = 1;
+  pde_2mb.large_page        = 1;
+  pde_2mb.page_frame_number = 1;
+  pd[0].flags = pde_2mb.flags;
+
+  pd[1].present           = 1;
+  pd[1].write             = 1;
+  pd[1].page_frame_number = physical_address(pt) >> 12;
+
+  // every other PTE is present
+  for (uint64_t i = 0; i < 512; i += 2) {
+    pt[i].present           = 1;
+    pt[i].write             = 1;
+    pt[i].page_frame_number = i + 1;
+  }
+
+  guest_cr3.address_of_page_directory = physical_address(pml4) >> 12;
+
+  return guest_cr3;
+}
+
+// translate a GVA with gva2hva() and return the physical address that it
+// maps to (or ~0 if it isn't mapped)
+static uint64_t translate(uint64_t const gva, size_t* const offset_to_next_page = nullptr) {
+  auto const hva = static_cast<uint8_t*>(gva2hva(build_guest_page_tables(),
+    reinterpret_cast<void*>(gva), offset_to_next_page));
+
+  if (!hva)
+    return ~0ull;
+
+  return hva - host_physical_memory_base;
+}
+
+HV_TEST(gva2hva_4kb_page) {
+  size_t offset_to_next_page;
+
+  HV_CHECK_EQ(translate(0x4020'0123, &offset_to_next_page), 0x1123);
+  HV_CHECK_EQ(offset_to_next_page, 0x1000 - 0x123);
+
+  HV_CHECK_EQ(translate(0x4020'4FFF, &offset_to_next_page), 0x5FFF);
+  HV_CHECK_EQ(offset_to_next_page, 1);
+
+  // not present
+  HV_CHECK_EQ(translate(0x4020'1000, &offset_to_next_page), ~0ull);
+  HV_CHECK_EQ(offset_to_next_page, 0);
+}
+
+HV_TEST(gva2hva_2mb_page) {
+  size_t offset_to_next_page;
+
+  HV_CHECK_EQ(translate(0x4000'0000, &offset_to_next_page), 0x20'0000);
+  HV_CHECK_EQ(offset_to_next_page, 0x20'0000);
+
+  HV_CHECK_EQ(translate(0x4000'0ABC, &offset_to_next_page), 0x20'0ABC);
+  HV_CHECK_EQ(offset_to_next_page, 0x20'0000 - 0xABC);
+
+  // the PT index is part of the offset into a 2MB page
+  HV_CHECK_EQ(translate(0x4012'3456, &offset_to_next_page), 0x32'3456);
+  HV_CHECK_EQ(offset_to_next_page, 0x20'0000 - 0x12'3456);
+}
+
+HV_TEST(gva2hva_1gb_page) {
+  size_t offset_to_next_page;
+
+  HV_CHECK_EQ(translate(0x0000'0000, &offset_to_next_page), 0);
+  HV_CHECK_EQ(offset_to_next_page, 0x4000'0000);
+
+  HV_CHECK_EQ(translate(0x0000'0DEF, &offset_to_next_page), 0xDEF);
+  HV_CHECK_EQ(offset_to_next_page, 0x4000'0000 - 0xDEF);
+
+  // the PD and PT indices are part of the offset into a 1GB page
+  HV_CHECK_EQ(translate(0x1234'5678, &offset_to_next_page), 0x1234'5678);
+  HV_CHECK_EQ(offset_to_next_page, 0x4000'0000 - 0x1234'5678);
+}
+
+HV_TEST(gva2hva_not_present) {
+  // PML4E, PDPTE and PDE that aren't present
+  HV_CHECK_EQ(translate(0x0000'8000'0000'0000), ~0ull);
+  HV_CHECK_EQ(translate(0x0000'0000'8000'0000), ~0ull);
+  HV_CHECK_EQ(translate(0x0000'0000'4040'0000), ~0ull);
+}
+
+// L0 state for the nested VMX tests: every control can be 0 or 1, and
+// the CR0/CR4 fixed bits are the usual ones (PE, NE, PG, and VMXE)
+static nested_l0_state nested_l0() {
+  nested_l0_state l0 = {};
+  l0.pin_based_cap   = 0xFFFFFFFF'00000000;
+  l0.proc_based_cap  = 0xFFFFFFFF'00000000;
+  l0.proc_based2_cap = 0xFFFFFFFF'00000000;
+  l0.exit_cap        = 0xFFFFFFFF'00000000;
+  l0.entry_cap       = 0xFFFFFFFF'00000000;
+  l0.cr0_fixed0      = 0x8000'0021;
+  l0.cr0_fixed1      = 0xFFFF'FFFF;
+  l0.cr4_fixed0      = 0x2000;
+  l0.cr4_fixed1      = 0x3F'FFFF;
+  l0.max_phys_addr   = 39;
+  l0.tsc_offset      = 0x1000;
+  l0.eptp            = 0x5000'001E;
+  l0.msr_bitmap      = 0x6000;
+  l0.vpid            = 2;
+  return l0;
+}
+
+// a vmcs12 that passes check_vmcs12(): no optional controls, and the host
+// state of a 64-bit hypervisor
+static vmcs12& nested_vmcs12() {
+  static vmcs12 vmcs;
+  vmcs = {};
+
+  ia32_vmx_exit_ctls_register exit;
+  exit.flags                   = 0;
+  exit.host_address_space_size = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS, exit.flags);
+
+  vmcs12_set(vmcs, VMCS_HOST_CR0, 0x8005'0033);
+  vmcs12_set(vmcs, VMCS_HOST_CR4, 0x2'26F8);
+  vmcs12_set(vmcs, VMCS_HOST_CS_SELECTOR, 0x10);
+  vmcs12_set(vmcs, VMCS_HOST_SS_SELECTOR, 0x18);
+  vmcs12_set(vmcs, VMCS_HOST_TR_SELECTOR, 0x40);
+
+  return vmcs;
+}
+
+// the value that a vmcs02 write list leaves in a field (or ~0 if it doesn't
+// write to it). guest-state fields can be written more than once.
+static uint64_t vmcs02_value(vmcs_write_list const& list, uint32_t const field) {
+  uint64_t value = ~0ull;
+
+  for (size_t i = 0; i < list.count; ++i) {
+    if (list.writes[i].field == field)
+      value = list.writes[i].value;
+  }
+
+  return value;
+}
+
+// an L2 vm-exit with the specified basic exit reason
+static nested_exit_info nested_exit(uint16_t const basic_exit_reason) {
+  nested_exit_info info = {};
+  info.reason.basic_exit_reason = basic_exit_reason;
+  return info;
+}
+
+HV_TEST(nested_check_vmcs12_valid) {
+  auto const l0 = nested_l0();
+  auto& vmcs = nested_vmcs12();
+
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_none);
+
+  // virtual NMIs with NMI-window exiting, EPT, and VPIDs
+  ia32_vmx_pinbased_ctls_register pin;
+  pin.flags       = 0;
+  pin.nmi_exiting = 1;
+  pin.virtual_nmi = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, pin.flags);
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags                       = 0;
+  proc.nmi_window_exiting          = 1;
+  proc.activate_secondary_controls = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+
+  ia32_vmx_procbased_ctls2_register proc2;
+  proc2.flags       = 0;
+  proc2.enable_ept  = 1;
+  proc2.enable_vpid = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc2.flags);
+  vmcs12_set(vmcs, VMCS_CTRL_EPT_POINTER, 0x7000'001E);
+  vmcs12_set(vmcs, VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER, 1);
+
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_none);
+}
+
+HV_TEST(nested_check_vmcs12_controls) {
+  auto l0 = nested_l0();
+  auto& vmcs = nested_vmcs12();
+
+  ia32_vmx_pinbased_ctls_register pin;
+  pin.flags       = 0;
+  pin.virtual_nmi = 1;
+
+  // virtual NMIs need NMI exiting
+  vmcs12_set(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, pin.flags);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  // NMI-window exiting needs virtual NMIs
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags              = 0;
+  proc.nmi_window_exiting = 1;
+
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  // a control that isn't allowed by the capability MSRs
+  l0.proc_based_cap &= ~(proc.flags << 32);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+  l0 = nested_l0();
+
+  // more than 4 CR3-target values
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_CTRL_CR3_TARGET_COUNT, 5);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  ia32_vmx_procbased_ctls2_register proc2;
+  proc2.flags = 0;
+
+  proc.flags                       = 0;
+  proc.activate_secondary_controls = 1;
+
+  // an EPT pointer with a 5-level page walk, an unsupported memory type,
+  // or an address above MAXPHYSADDR
+  proc2.enable_ept = 1;
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+  vmcs12_set(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc2.flags);
+
+  vmcs12_set(vmcs, VMCS_CTRL_EPT_POINTER, 0x7000'0026);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+  vmcs12_set(vmcs, VMCS_CTRL_EPT_POINTER, 0x7000'001C);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+  vmcs12_set(vmcs, VMCS_CTRL_EPT_POINTER, 0x100'0000'001E);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  // unrestricted guest without EPT
+  proc2.enable_ept         = 0;
+  proc2.unrestricted_guest = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc2.flags);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  // VPID 0 is reserved for L1
+  proc2.unrestricted_guest = 0;
+  proc2.enable_vpid        = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc2.flags);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  // too many MSRs, or a misaligned MSR list
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT, 513);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS, 0x1008);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_control);
+}
+
+HV_TEST(nested_check_vmcs12_host_state) {
+  auto const l0 = nested_l0();
+  auto& vmcs = nested_vmcs12();
+
+  // L1 has to return to 64-bit mode
+  vmcs12_set(vmcs, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS, 0);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+
+  // CR0.PG and CR4.VMXE are fixed to 1
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_HOST_CR0, 0x0005'0033);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_HOST_CR4, 0x0'06F8);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+
+  // the CS and TR selectors can't be null
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_HOST_TR_SELECTOR, 0);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+
+  // RPL and TI have to be 0 in every host selector
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_HOST_SS_SELECTOR, 0x1B);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+
+  vmcs = nested_vmcs12();
+  vmcs12_set(vmcs, VMCS_HOST_FS_SELECTOR, 0x34);
+  HV_CHECK_EQ(check_vmcs12(vmcs, l0), vm_instruction_error_entry_invalid_host_state);
+}
+
+HV_TEST(nested_merge_vmcs02_controls) {
+  auto const l0 = nested_l0();
+  auto& vmcs = nested_vmcs12();
+
+  static vmcs_write_list writes;
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags              = 0;
+  proc.use_tsc_offsetting = 1;
+  proc.hlt_exiting        = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+  vmcs12_set(vmcs, VMCS_CTRL_TSC_OFFSET, 0x20);
+
+  merge_vmcs02(vmcs, l0, writes);
+
+  // L1 controls are kept, and the ones that we need are forced on
+  ia32_vmx_procbased_ctls_register proc02;
+  proc02.flags = vmcs02_value(writes, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+  HV_CHECK(proc02.hlt_exiting);
+  HV_CHECK(proc02.use_tsc_offsetting);
+  HV_CHECK(proc02.use_msr_bitmaps);
+  HV_CHECK(proc02.activate_secondary_controls);
+
+  ia32_vmx_procbased_ctls2_register proc2_02;
+  proc2_02.flags = vmcs02_value(writes, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+  HV_CHECK(proc2_02.enable_ept);
+  HV_CHECK(proc2_02.enable_vpid);
+
+  ia32_vmx_exit_ctls_register exit02;
+  exit02.flags = vmcs02_value(writes, VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+  HV_CHECK(exit02.host_address_space_size);
+  HV_CHECK(exit02.load_ia32_efer);
+
+  // L0 resources are used instead of L1 ones, and TSC offsets are additive
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_EPT_POINTER), l0.eptp);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER), l0.vpid);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_MSR_BITMAP_ADDRESS), l0.msr_bitmap);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_TSC_OFFSET), l0.tsc_offset + 0x20);
+
+  // L1 MSR lists are processed in software
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT), 0);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_VMEXIT_MSR_STORE_COUNT), 0);
+
+  // L2 always runs on EPT01, even if L1 tries to use EPT
+  proc.activate_secondary_controls = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+
+  ia32_vmx_procbased_ctls2_register proc2;
+  proc2.flags      = 0;
+  proc2.enable_ept = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc2.flags);
+  vmcs12_set(vmcs, VMCS_CTRL_EPT_POINTER, 0x7000'001E);
+
+  merge_vmcs02(vmcs, l0, writes);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_EPT_POINTER), l0.eptp);
+  HV_CHECK(writes.count <= max_vmcs_writes);
+}
+
+HV_TEST(nested_vmx_msrs_hide_ept) {
+  ia32_vmx_procbased_ctls2_register proc2;
+  proc2.flags = filter_nested_vmx_msr(IA32_VMX_PROCBASED_CTLS2,
+    0xFFFFFFFF'00000000) >> 32;
+
+  // EPT (and unrestricted guest, which needs it) would bypass EPT01
+  HV_CHECK(!proc2.enable_ept);
+  HV_CHECK(!proc2.unrestricted_guest);
+  HV_CHECK(proc2.enable_vpid);
+
+  // only the INVVPID capabilities are left
+  HV_CHECK_EQ(filter_nested_vmx_msr(IA32_VMX_EPT_VPID_CAP, 0x00000F01'06734141),
+    0x00000F01'00000000);
+
+  // vmcs02 still uses EPT and VPIDs, even though L1 can't
+  auto l0 = nested_l0();
+  l0.proc_based2_cap = proc2.flags << 32;
+
+  static vmcs_write_list writes;
+  merge_vmcs02(nested_vmcs12(), l0, writes);
+
+  ia32_vmx_procbased_ctls2_register proc2_02;
+  proc2_02.flags = vmcs02_value(writes, VMCS_CTRL_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+  HV_CHECK(proc2_02.enable_ept);
+  HV_CHECK(proc2_02.enable_vpid);
+}
+
+HV_TEST(nested_merge_vmcs02_cr0) {
+  auto const l0 = nested_l0();
+  auto& vmcs = nested_vmcs12();
+
+  static vmcs_write_list writes;
+
+  // L1 owns CR0.TS and runs L2 with a shadowed CR0.MP
+  vmcs12_set(vmcs, VMCS_GUEST_CR0, 0x8000'0031);
+  vmcs12_set(vmcs, VMCS_CTRL_CR0_GUEST_HOST_MASK, 0xA);
+  vmcs12_set(vmcs, VMCS_CTRL_CR0_READ_SHADOW, 0x2);
+
+  merge_vmcs02(vmcs, l0, writes);
+
+  // our fixed bits are always owned by us
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_CR0_GUEST_HOST_MASK), 0xFFFF'FFFF'8000'002B);
+
+  // L2 sees the L1 shadow for L1-owned bits, and the real value otherwise
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_CTRL_CR0_READ_SHADOW), 0x8000'0033);
+
+  // the real value respects our fixed bits (NE is forced on)
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_GUEST_CR0), 0x8000'0031);
+
+  vmcs12_set(vmcs, VMCS_GUEST_CR0, 0x8000'0011);
+  merge_vmcs02(vmcs, l0, writes);
+  HV_CHECK_EQ(vmcs02_value(writes, VMCS_GUEST_CR0), 0x8000'0031);
+}
+
+HV_TEST(nested_reflect_nmi) {
+  auto& vmcs = nested_vmcs12();
+
+  vmexit_interrupt_information nmi_info;
+  nmi_info.flags             = 0;
+  nmi_info.vector            = 2;
+  nmi_info.interruption_type = non_maskable_interrupt;
+  nmi_info.valid             = 1;
+
+  auto info = nested_exit(VMX_EXIT_REASON_EXCEPTION_OR_NMI);
+  info.interruption_info = nmi_info.flags;
+
+  // NMIs are only reflected if L1 intercepts them
+  HV_CHECK(!should_reflect_vm_exit(vmcs, info));
+
+  ia32_vmx_pinbased_ctls_register pin;
+  pin.flags       = 0;
+  pin.nmi_exiting = 1;
+  pin.virtual_nmi = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PIN_BASED_VM_EXECUTION_CONTROLS, pin.flags);
+  HV_CHECK(should_reflect_vm_exit(vmcs, info));
+
+  // NMI-window vm-exits are handled by us unless L1 requested them
+  auto const window = nested_exit(VMX_EXIT_REASON_NMI_WINDOW);
+  HV_CHECK(!should_reflect_vm_exit(vmcs, window));
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags              = 0;
+  proc.nmi_window_exiting = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+  HV_CHECK(should_reflect_vm_exit(vmcs, window));
+
+  // exceptions are only intercepted by us if L1 intercepts them
+  vmexit_interrupt_information ud_info;
+  ud_info.flags             = 0;
+  ud_info.vector            = 6;
+  ud_info.interruption_type = hardware_exception;
+  ud_info.valid             = 1;
+
+  info.interruption_info = ud_info.flags;
+  HV_CHECK(should_reflect_vm_exit(vmcs, info));
+}
+
+HV_TEST(nested_reflect_msr_access) {
+  auto& vmcs = nested_vmcs12();
+
+  static uint8_t msr_bitmap[0x1000];
+
+  // IA32_LSTAR writes are intercepted by L1
+  msr_bitmap[0xC00 + 0x82 / 8] |= 1 << (0x82 % 8);
+
+  auto rdmsr = nested_exit(VMX_EXIT_REASON_EXECUTE_RDMSR);
+  auto wrmsr = nested_exit(VMX_EXIT_REASON_EXECUTE_WRMSR);
+  rdmsr.msr        = wrmsr.msr        = IA32_LSTAR;
+  rdmsr.msr_bitmap = wrmsr.msr_bitmap = msr_bitmap;
+
+  // every MSR access is reflected without MSR bitmaps
+  HV_CHECK(should_reflect_vm_exit(vmcs, rdmsr));
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags           = 0;
+  proc.use_msr_bitmaps = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+
+  HV_CHECK(!should_reflect_vm_exit(vmcs, rdmsr));
+  HV_CHECK(should_reflect_vm_exit(vmcs, wrmsr));
+
+  // MSRs outside of the bitmap ranges, and unreadable bitmaps
+  rdmsr.msr = 0x4000'0000;
+  HV_CHECK(should_reflect_vm_exit(vmcs, rdmsr));
+
+  rdmsr.msr        = IA32_LSTAR;
+  rdmsr.msr_bitmap = nullptr;
+  HV_CHECK(should_reflect_vm_exit(vmcs, rdmsr));
+}
+
+HV_TEST(nested_reflect_mov_to_cr3) {
+  auto& vmcs = nested_vmcs12();
+
+  vmx_exit_qualification_mov_cr qualification;
+  qualification.flags            = 0;
+  qualification.control_register = VMX_EXIT_QUALIFICATION_REGISTER_CR3;
+  qualification.access_type      = VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR;
+
+  auto info = nested_exit(VMX_EXIT_REASON_MOV_CR);
+  info.qualification = qualification.flags;
+  info.cr_value      = 0x1234'5000;
+
+  // our CR3-load exiting is invisible to L1
+  HV_CHECK(!should_reflect_vm_exit(vmcs, info));
+
+  ia32_vmx_procbased_ctls_register proc;
+  proc.flags            = 0;
+  proc.cr3_load_exiting = 1;
+  vmcs12_set(vmcs, VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, proc.flags);
+  HV_CHECK(should_reflect_vm_exit(vmcs, info));
+
+  // CR3-target values don't cause vm-exits, but only the first count are used
+  vmcs12_set(vmcs, VMCS_CTRL_CR3_TARGET_VALUE_1, 0x1234'5000);
+  vmcs12_set(vmcs, VMCS_CTRL_CR3_TARGET_COUNT, 1);
+  HV_CHECK(should_reflect_vm_exit(vmcs, info));
+
+  vmcs12_set(vmcs, VMCS_CTRL_CR3_TARGET_COUNT, 2);
+  HV_CHECK(!should_reflect_vm_exit(vmcs, info));
+}
+
+HV_TEST(nested_reflect_other_exits) {
+  auto& vmcs = nested_vmcs12();
+
+  // the preemption timer is never exposed to L1
+  HV_CHECK(!should_reflect_vm_exit(vmcs,
+    nested_exit(VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED)));
+
+  // EPT vm-exits are ours, since L1 can't use EPT
+  HV_CHECK(!should_reflect_vm_exit(vmcs, nested_exit(VMX_EXIT_REASON_EPT_VIOLATION)));
+  HV_CHECK(!should_reflect_vm_exit(vmcs, nested_exit(VMX_EXIT_REASON_EPT_MISCONFIGURATION)));
+
+  // failed vm-entries and VMX instructions always go to L1
+  auto entry_failure = nested_exit(VMX_EXIT_REASON_ERROR_INVALID_GUEST_STATE);
+  entry_failure.reason.vm_entry_failure = 1;
+  HV_CHECK(should_reflect_vm_exit(vmcs, entry_failure));
+  HV_CHECK(should_reflect_vm_exit(vmcs, nested_exit(VMX_EXIT_REASON_EXECUTE_VMREAD)));
+  HV_CHECK(should_reflect_vm_exit(vmcs, nested_exit(VMX_EXIT_REASON_EXECUTE_CPUID)));
+}
+
+HV_TEST(cr3_hot_set_counts_loads) {
+  vcpu_cr3_telemetry_data telemetry = {};
+
+  // a tracked value is counted in place
+  count_cr3_load(telemetry, 0x1000);
+  count_cr3_load(telemetry, 0x1000);
+  HV_CHECK_EQ(telemetry.candidates[0].cr3, 0x1000);
+  HV_CHECK_EQ(telemetry.candidates[0].count, 2);
+
+  for (uint32_t i = 1; i < cr3_hot_set_candidate_count; ++i) {
+    for (uint32_t j = 0; j < 3; ++j)
+      count_cr3_load(telemetry, 0x1000 + i * 0x1000);
+  }
+
+  // an untracked value replaces the least frequent candidate and inherits
+  // its count
+  count_cr3_load(telemetry, 0xFF000);
+  HV_CHECK_EQ(telemetry.candidates[0].cr3, 0xFF000);
+  HV_CHECK_EQ(telemetry.candidates[0].count, 3);
+}
+
+HV_TEST(cr3_hot_set_picks_the_most_frequent) {
+  vcpu_cr3_telemetry_data telemetry = {};
+
+  for (uint32_t i = 0; i < 6; ++i) {
+    for (uint32_t j = 0; j <= i * 2; ++j)
+      count_cr3_load(telemetry, 0x1000 + i * 0x1000);
+  }
+
+  // the hardware limit is lower than max_cr3_target_count
+  update_cr3_hot_set(telemetry, 3);
+  HV_CHECK_EQ(telemetry.target_count, 3);
+  HV_CHECK_EQ(telemetry.targets[0], 0x6000);
+  HV_CHECK_EQ(telemetry.targets[1], 0x5000);
+  HV_CHECK_EQ(telemetry.targets[2], 0x4000);
+
+  // the counts are aged
+  HV_CHECK_EQ(telemetry.candidates[5].count, 5);
+  HV_CHECK_EQ(telemetry.candidates[0].count, 0);
+
+  // values that were never loaded aren't picked
+  update_cr3_hot_set(telemetry, max_cr3_target_count);
+  HV_CHECK_EQ(telemetry.target_count, 4);
+  update_cr3_hot_set(telemetry, max_cr3_target_count);
+  update_cr3_hot_set(telemetry, max_cr3_target_count);
+  update_cr3_hot_set(telemetry, max_cr3_target_count);
+  HV_CHECK_EQ(telemetry.target_count, 0);
+}
+
+HV_TEST(cr3_load_flags_hidden_switches) {
+  vcpu_cr3_telemetry_data telemetry = {};
+  telemetry.last_cr3 = 0x1000;
+
+  // the old CR3 is the last recorded new CR3 (ignoring the no-flush bit)
+  HV_CHECK_EQ(track_cr3_load(telemetry, 0x1000, 0x2000 | (1ull << 63)), 0);
+  HV_CHECK_EQ(track_cr3_load(telemetry, 0x2000, 0x3000), 0);
+  HV_CHECK_EQ(telemetry.last_cr3, 0x3000);
+
+  // the guest loaded a CR3-target value without a vm-exit, which is
+  // counted so that it stays in the hot set
+  telemetry.targets[0]   = 0x4000 | (1ull << 63);
+  telemetry.target_count = 1;
+
+  HV_CHECK_EQ(track_cr3_load(telemetry, 0x4000, 0x3000), cr3_load_hidden_switch_flag);
+
+  uint64_t target_count = 0;
+  for (auto const& entry : telemetry.candidates) {
+    if (entry.cr3 == telemetry.targets[0])
+      target_count = entry.count;
+  }
+
+  HV_CHECK_EQ(target_count, 1);
+}
+
+// set up the simulated machine before any test runs
+static struct core_tests_setup {
+  core_tests_setup() {
+    if (!create_physical_memory_image(physical_memory_size)) {
+      fprintf(stderr, "failed to allocate the physical memory image\n");
+      exit(1);
+    }
+
+    setup_simulated_mtrrs();
+  }
+} setup;
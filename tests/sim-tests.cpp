@@ -0,0 +1,636 @@
+#include "test.h"
+
+#include "../hv/hv.h"
+#include "../hv/hypercalls.h"
+#include "../hv/logger.h"
+#include "../hv/pmu.h"
+#include "../hv/ept.h"
+#include "../hv/simulator.h"
+#include "../hv/vcpu.h"
+#include "../hv/vmx-sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// unit tests for the vm-exit handlers: every test virtualizes a fresh
+// simulated machine, causes vm-exits with handle_vm_exit(), and checks
+// what the handlers wrote to the simulated VMCS and the guest registers
+
+using namespace hv;
+
+// guest RIP of the instruction that causes every vm-exit
+static constexpr uint64_t exit_rip = 0x1000;
+
+// virtualize the simulated processor for the duration of a test
+struct simulated_machine {
+  simulated_machine() {
+    enable_debug_print(false);
+
+    if (!start_simulated_hypervisor()) {
+      fprintf(stderr, "failed to start the simulated hypervisor\n");
+      exit(1);
+    }
+  }
+
+  ~simulated_machine() {
+    stop_simulated_hypervisor();
+  }
+};
+
+// cause an instruction vm-exit at exit_rip. returns false if the processor
+// was devirtualized by the exit.
+static bool instruction_exit(uint16_t const reason,
+    uint32_t const length, uint64_t const qualification = 0) {
+  write_simulated_vmcs(VMCS_GUEST_RIP, exit_rip);
+
+  simulated_vm_exit exit = {};
+  exit.reason             = reason;
+  exit.instruction_length = length;
+  exit.qualification      = qualification;
+  return simulate_vm_exit(exit);
+}
+
+// the vector of the exception that was injected on the last vm-entry, or
+// ~0 if nothing was injected
+static uint32_t injected_vector() {
+  auto const event = last_injected_event();
+  return event.valid ? event.vector : ~0u;
+}
+
+// MOV to CRn from RAX
+static uint64_t mov_to_cr_qualification(uint64_t const cr) {
+  vmx_exit_qualification_mov_cr qualification;
+  qualification.flags                    = 0;
+  qualification.control_register         = cr;
+  qualification.access_type              = VMX_EXIT_QUALIFICATION_ACCESS_MOV_TO_CR;
+  qualification.general_purpose_register = 0;
+  return qualification.flags;
+}
+
+// set up a VMCALL with the hypercall key
+static void setup_hypercall(hypercall_code const code) {
+  auto& ctx = simulated_guest_context();
+  ctx.rax = code | (hypercall_key << 8);
+}
+
+HV_TEST(cpuid_is_emulated) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  ctx.rax = 0;
+  ctx.rcx = 0;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+
+  int regs[4];
+  __cpuidex(regs, 0, 0);
+
+  HV_CHECK_EQ(ctx.eax, static_cast<uint32_t>(regs[0]));
+  HV_CHECK_EQ(ctx.ebx, static_cast<uint32_t>(regs[1]));
+  HV_CHECK_EQ(ctx.ecx, static_cast<uint32_t>(regs[2]));
+  HV_CHECK_EQ(ctx.edx, static_cast<uint32_t>(regs[3]));
+
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 2);
+  HV_CHECK_EQ(injected_vector(), ~0u);
+}
+
+HV_TEST(rdmsr_feature_control_is_shadowed) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  ctx.rcx = IA32_FEATURE_CONTROL;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_RDMSR, 2));
+
+  ia32_feature_control_register feature_control;
+  feature_control.flags = (ctx.rdx << 32) | ctx.eax;
+
+  HV_CHECK(feature_control.lock_bit);
+  HV_CHECK(!feature_control.enable_vmx_inside_smx);
+  HV_CHECK_EQ(feature_control.flags, simulated_vcpu()->cached.guest_feature_control.flags);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 2);
+}
+
+HV_TEST(rdmsr_invalid_msr_injects_gp) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  ctx.rcx = 0x1337;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_RDMSR, 2));
+
+  // faults don't advance RIP
+  HV_CHECK_EQ(injected_vector(), general_protection);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip);
+}
+
+HV_TEST(mov_to_cr0_updates_shadow_and_guest_cr0) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+  auto const cpu = simulated_vcpu();
+
+  // clear CR0.WP (ET is always set)
+  cr0 new_cr0;
+  new_cr0.flags            = read_simulated_vmcs(VMCS_CTRL_CR0_READ_SHADOW);
+  new_cr0.write_protect    = 0;
+  new_cr0.extension_type   = 0;
+  ctx.rax = new_cr0.flags;
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_MOV_CR, 3,
+    mov_to_cr_qualification(VMX_EXIT_QUALIFICATION_REGISTER_CR0)));
+
+  new_cr0.extension_type = 1;
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_CTRL_CR0_READ_SHADOW), new_cr0.flags);
+
+  // the real CR0 has the VMX fixed bits applied
+  cr0 guest_cr0;
+  guest_cr0.flags = read_simulated_vmcs(VMCS_GUEST_CR0);
+  HV_CHECK_EQ(guest_cr0.flags & cpu->cached.vmx_cr0_fixed0, cpu->cached.vmx_cr0_fixed0);
+  HV_CHECK(!guest_cr0.write_protect);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 3);
+}
+
+HV_TEST(mov_to_cr0_invalid_injects_gp) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  auto const shadow = read_simulated_vmcs(VMCS_CTRL_CR0_READ_SHADOW);
+
+  // CR0.PG without CR0.PE
+  cr0 new_cr0;
+  new_cr0.flags             = shadow;
+  new_cr0.protection_enable = 0;
+  ctx.rax = new_cr0.flags;
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_MOV_CR, 3,
+    mov_to_cr_qualification(VMX_EXIT_QUALIFICATION_REGISTER_CR0)));
+
+  HV_CHECK_EQ(injected_vector(), general_protection);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_CTRL_CR0_READ_SHADOW), shadow);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip);
+}
+
+HV_TEST(mov_to_cr3_flushes_the_guest_tlb) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  ctx.rax = 0x1AD000;
+  reset_simulated_vmx_counters();
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_MOV_CR, 3,
+    mov_to_cr_qualification(VMX_EXIT_QUALIFICATION_REGISTER_CR3)));
+
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_CR3), 0x1AD000);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 3);
+
+  simulated_invalidation invalidations[max_simulated_invalidations];
+  HV_CHECK_EQ(read_simulated_invalidations(invalidations), 1);
+  HV_CHECK_EQ(invalidations[0].instruction, VMX_EXIT_REASON_EXECUTE_INVVPID);
+  HV_CHECK_EQ(invalidations[0].type, invvpid_single_context_retaining_globals);
+  HV_CHECK_EQ(invalidations[0].vpid, guest_vpid);
+}
+
+HV_TEST(xsetbv_invalid_xcr0_injects_gp) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  // XCR0.X87 must be set
+  ctx.rcx = 0;
+  ctx.rax = 0b10;
+  ctx.rdx = 0;
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_XSETBV, 3));
+
+  HV_CHECK_EQ(injected_vector(), general_protection);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip);
+}
+
+HV_TEST(vmxon_injects_ud_or_gp) {
+  simulated_machine machine;
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMXON, 4));
+
+  // VMX is either hidden from the guest or locked off in FEATURE_CONTROL
+  auto const vector = injected_vector();
+  HV_CHECK(vector == invalid_opcode || vector == general_protection);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip);
+}
+
+HV_TEST(vmcall_ping) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  setup_hypercall(hypercall_ping);
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  HV_CHECK_EQ(ctx.rax, hypervisor_signature);
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 3);
+}
+
+HV_TEST(vmcall_without_key_injects_ud) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  ctx.rax = hypercall_ping;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  HV_CHECK_EQ(injected_vector(), invalid_opcode);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip);
+}
+
+HV_TEST(vmcall_unload_devirtualizes) {
+  simulated_machine machine;
+
+  setup_hypercall(hypercall_unload);
+  HV_CHECK(!instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+}
+
+HV_TEST(exit_overhead_excludes_the_native_cost) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  auto& native = cpu->native_overhead[overhead_class_cpuid];
+  native              = {};
+  native.tsc          = 100;
+  native.instructions = 1;
+  native.core_cycles  = 300;
+
+  // a virtualized CPUID that took 1200 TSC ticks and 90 instructions
+  setup_hypercall(hypercall_set_vm_exit_overhead);
+  ctx.rcx = overhead_class_cpuid;
+  ctx.rdx = 1200;
+  ctx.r8  = 50;
+  ctx.r9  = 90;
+  ctx.r10 = 200;
+  ctx.r11 = 40;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  // the guest still sees CPUID take as long as it does natively
+  auto const& overhead = cpu->exit_overhead[overhead_class_cpuid];
+  HV_CHECK_EQ(overhead.tsc, 1100);
+  HV_CHECK_EQ(overhead.mperf, 50);
+  HV_CHECK_EQ(overhead.instructions, 89);
+  HV_CHECK_EQ(overhead.core_cycles, 0);
+  HV_CHECK_EQ(overhead.ref_tsc, 40);
+}
+
+HV_TEST(pmu_compensation_keeps_the_native_instruction) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  // fixed counter #0 (instructions retired) counts in ring-0
+  cpu->pmu.fixed_counter_count = 1;
+  cpu->pmu.fixed_counter_mask  = (1ull << 48) - 1;
+  set_simulated_msr(IA32_FIXED_CTR0, 1000);
+  HV_CHECK(write_pmu_config(cpu, IA32_FIXED_CTR_CTRL, 0b01));
+
+  // CPUID retires 1 instruction natively, and 90 while virtualized
+  cpu->native_overhead[overhead_class_cpuid] = {};
+  cpu->native_overhead[overhead_class_cpuid].instructions = 1;
+
+  setup_hypercall(hypercall_set_vm_exit_overhead);
+  ctx.rcx = overhead_class_cpuid;
+  ctx.rdx = ctx.r8 = ctx.r10 = ctx.r11 = 0;
+  ctx.r9  = 90;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  ia32_perf_global_ctrl_register perf_global_ctrl;
+  perf_global_ctrl.flags         = 0;
+  perf_global_ctrl.en_fixed_ctrn = 0b1;
+
+  // only the instructions that were retired in root-mode are removed
+  compensate_pmu_counters(cpu, cpu->exit_overhead[overhead_class_cpuid],
+    perf_global_ctrl.flags);
+  HV_CHECK_EQ(__readmsr(IA32_FIXED_CTR0), 1000 - 89);
+}
+
+HV_TEST(wrmsr_lstar_is_logged_and_written) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+  auto const ring = simulated_vcpu()->log_ring;
+
+  auto const head = ring->head;
+
+  ctx.rcx = IA32_LSTAR;
+  ctx.rax = 0x1234'5678;
+  ctx.rdx = 0xFFFF'F800;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_WRMSR, 2));
+
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK_EQ(__readmsr(IA32_LSTAR), 0xFFFF'F800'1234'5678);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), exit_rip + 2);
+
+  // the write is logged with the value and the RIP of the WRMSR
+  HV_CHECK_EQ(ring->head, head + 1);
+
+  auto const& record = ring->records[head % log_ring_record_count];
+  HV_CHECK_EQ(record.arg_count, 3);
+  HV_CHECK_EQ(record.args[0], IA32_LSTAR);
+  HV_CHECK_EQ(record.args[1], 0xFFFF'F800'1234'5678);
+  HV_CHECK_EQ(record.args[2], exit_rip);
+}
+
+HV_TEST(queued_nmi_is_injected) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  ++cpu->queued_nmis;
+
+  ctx.rax = 0;
+  ctx.rcx = 0;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+
+  HV_CHECK_EQ(injected_vector(), nmi);
+  HV_CHECK_EQ(last_injected_event().interruption_type, non_maskable_interrupt);
+  HV_CHECK_EQ(cpu->queued_nmis, 0);
+}
+
+HV_TEST(queued_nmi_waits_for_call_counter_step) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  // single-step an instruction on a counted page, like
+  // handle_call_counter_violation() does
+  auto const pte = get_ept_pte(cpu->ept, 0x1000, true);
+  HV_CHECK(pte);
+  if (!pte)
+    return;
+
+  cpu->call_counter.stepping_pte      = pte;
+  cpu->call_counter.stepping_function = nullptr;
+
+  ++cpu->queued_nmis;
+
+  ctx.rax = 0;
+  ctx.rcx = 0;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+
+  // nothing is injected, and no NMI-window vm-exit is requested
+  ia32_vmx_procbased_ctls_register ctrl;
+  ctrl.flags = read_simulated_vmcs(VMCS_CTRL_PROCESSOR_BASED_VM_EXECUTION_CONTROLS);
+
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK(!ctrl.nmi_window_exiting);
+  HV_CHECK_EQ(cpu->queued_nmis, 1);
+
+  // the NMI is injected once the instruction was stepped
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_MONITOR_TRAP_FLAG, 0));
+
+  HV_CHECK(!cpu->call_counter.stepping_pte);
+  HV_CHECK_EQ(injected_vector(), nmi);
+  HV_CHECK_EQ(cpu->queued_nmis, 0);
+}
+
+HV_TEST(syscall_entry_is_traced_with_a_single_vmcall) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  // a syscall entry point that starts with SWAPGS (the guest identity-maps
+  // physical memory, so the physical address is also the virtual address)
+  auto const page = static_cast<uint8_t*>(allocate_physical_pages(1));
+  auto const page_pa = MmGetPhysicalAddress(page).QuadPart;
+  auto const entry = page_pa + 0x100;
+
+  page[0x100] = 0x0F;
+  page[0x101] = 0x01;
+  page[0x102] = 0xF8;
+
+  set_simulated_msr(IA32_LSTAR, entry);
+
+  HV_CHECK(enable_syscall_tracing(cpu));
+  HV_CHECK(find_ept_hook(cpu->ept, page_pa >> 12));
+
+  // the executable page only differs in the entry instruction
+  auto const exec_page = cpu->syscall_trace.exec_page;
+  HV_CHECK_EQ(exec_page[0x102], 0xC1);
+  HV_CHECK_EQ(exec_page[0x103], page[0x103]);
+  HV_CHECK_EQ(page[0x102], 0xF8);
+
+  // the first instruction fetch switches to the executable page
+  vmx_exit_qualification_ept_violation fetch;
+  fetch.flags                 = 0;
+  fetch.execute_access        = 1;
+  fetch.caused_by_translation = 1;
+
+  simulated_vm_exit exit = {};
+  exit.reason                 = VMX_EXIT_REASON_EPT_VIOLATION;
+  exit.qualification          = fetch.flags;
+  exit.guest_physical_address = entry;
+  HV_CHECK(simulate_vm_exit(exit));
+
+  HV_CHECK_EQ(get_ept_pte(cpu->ept, entry)->page_frame_number, cpu->syscall_trace.exec_pfn);
+
+  // the syscall itself
+  write_simulated_vmcs(VMCS_GUEST_RIP, entry);
+  write_simulated_vmcs(VMCS_GUEST_GS_BASE, 0x1111'0000);
+  set_simulated_msr(IA32_KERNEL_GS_BASE, 0xFFFF'F800'2222'0000);
+
+  auto const ring = cpu->syscall_trace.ring;
+  auto const head = ring->head;
+
+  ctx.rax = 0x55;
+  ctx.r10 = 1;
+  ctx.rdx = 2;
+  ctx.r8  = 3;
+  ctx.r9  = 4;
+
+  exit = {};
+  exit.reason             = VMX_EXIT_REASON_EXECUTE_VMCALL;
+  exit.instruction_length = 3;
+  HV_CHECK(simulate_vm_exit(exit));
+
+  // the SWAPGS was emulated instead of a #UD being injected
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_RIP), entry + 3);
+  HV_CHECK_EQ(read_simulated_vmcs(VMCS_GUEST_GS_BASE), 0xFFFF'F800'2222'0000);
+  HV_CHECK_EQ(__readmsr(IA32_KERNEL_GS_BASE), 0x1111'0000);
+
+  HV_CHECK_EQ(ring->head, head + 1);
+
+  auto const& record = ring->records[head % syscall_ring_record_count];
+  HV_CHECK_EQ(record.number, 0x55);
+  HV_CHECK_EQ(record.args[0], 1);
+  HV_CHECK_EQ(record.args[3], 4);
+
+  // the original page is executable again
+  disable_syscall_tracing(cpu);
+
+  auto const pte = get_ept_pte(cpu->ept, entry);
+  HV_CHECK(!find_ept_hook(cpu->ept, page_pa >> 12));
+  HV_CHECK_EQ(pte->page_frame_number, page_pa >> 12);
+  HV_CHECK(pte->execute_access);
+}
+
+HV_TEST(syscall_tracing_needs_swapgs_at_the_entry) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+
+  auto const page = static_cast<uint8_t*>(allocate_physical_pages(1));
+  auto const page_pa = MmGetPhysicalAddress(page).QuadPart;
+
+  // a VMCALL couldn't emulate this instruction
+  page[0] = 0x90;
+
+  set_simulated_msr(IA32_LSTAR, page_pa);
+
+  HV_CHECK(!enable_syscall_tracing(cpu));
+  HV_CHECK(!find_ept_hook(cpu->ept, page_pa >> 12));
+}
+
+HV_TEST(exit_trace_decoding_continues_across_drains) {
+  simulated_machine machine;
+  auto& reader = ghv.exit_trace_readers[0];
+
+  setup_hypercall(hypercall_set_exit_tracing);
+  simulated_guest_context().rcx = 1;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  // whatever was traced before tracing was (re)enabled
+  exit_trace_record record;
+  swap_exit_trace_buffers(reader);
+  while (read_exit_trace_record(reader, record)) {}
+
+  // the first batch starts with a sync record
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+  HV_CHECK(swap_exit_trace_buffers(reader) > 0);
+  HV_CHECK(read_exit_trace_record(reader, record));
+  HV_CHECK(!read_exit_trace_record(reader, record));
+
+  // the RIP is read after the handler skipped the instruction
+  HV_CHECK_EQ(record.reason, VMX_EXIT_REASON_EXECUTE_CPUID);
+  HV_CHECK_EQ(record.rip, exit_rip + 2);
+
+  auto const first_tsc = record.tsc;
+
+  // the second batch is encoded against the last record of the first one
+  write_simulated_vmcs(VMCS_GUEST_RIP, exit_rip + 0x100);
+
+  simulated_vm_exit exit = {};
+  exit.reason             = VMX_EXIT_REASON_EXECUTE_CPUID;
+  exit.instruction_length = 2;
+  HV_CHECK(simulate_vm_exit(exit));
+
+  HV_CHECK(swap_exit_trace_buffers(reader) > 0);
+  HV_CHECK(read_exit_trace_record(reader, record));
+
+  HV_CHECK_EQ(record.rip, exit_rip + 0x102);
+  HV_CHECK(record.tsc > first_tsc);
+  HV_CHECK(record.tsc <= __rdtsc());
+}
+
+HV_TEST(sampling_interval_is_set_with_a_hypercall) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+  auto const ring = cpu->profiler.ring;
+
+  // the KPCR, KTHREAD, and EPROCESS that the sample reads the PID from (at
+  // the offsets that the simulated hypervisor uses)
+  uint64_t process[1] = { 4 };
+  uint64_t thread[8]  = {};
+  uint64_t kpcr[0x40] = {};
+
+  thread[0x20 / 8] = reinterpret_cast<uint64_t>(process);
+  kpcr[0x188 / 8]  = reinterpret_cast<uint64_t>(thread);
+  write_simulated_vmcs(VMCS_GUEST_GS_BASE, reinterpret_cast<uint64_t>(kpcr));
+
+  // sampling is disabled by default
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, 0));
+  HV_CHECK_EQ(ring->head, 0);
+
+  // the vm-entry after the hypercall arms the sampling timer
+  setup_hypercall(hypercall_set_sampling_interval);
+  ctx.rcx = 1;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+  HV_CHECK_EQ(ghv.sampling_interval, 1);
+  HV_CHECK(cpu->profiler.next_sample_tsc != 0);
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, 0));
+  HV_CHECK_EQ(ring->head, 1);
+
+  profiler_sample sample;
+  HV_CHECK(read_profiler_sample(*ring, sample));
+  HV_CHECK_EQ(sample.rip, exit_rip);
+  HV_CHECK_EQ(sample.pid, 4);
+  HV_CHECK_EQ(sample.vcpu_index, 0);
+}
+
+HV_TEST(ept_hook_is_rejected_on_counted_pages) {
+  simulated_machine machine;
+  auto const cpu = simulated_vcpu();
+  auto& ctx = simulated_guest_context();
+
+  auto const pages = static_cast<uint8_t*>(allocate_physical_pages(2));
+  auto const page_pa = MmGetPhysicalAddress(pages).QuadPart;
+
+  HV_CHECK(add_counted_function(cpu, page_pa + 0x10, false));
+
+  setup_hypercall(hypercall_install_ept_hook);
+  ctx.rcx = page_pa;
+  ctx.rdx = page_pa + 0x1000;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+
+  // the page is still owned by the call counter
+  HV_CHECK_EQ(ctx.rax, 0);
+  HV_CHECK(!find_ept_hook(cpu->ept, page_pa >> 12));
+  HV_CHECK(!get_ept_pte(cpu->ept, page_pa)->execute_access);
+}
+
+HV_TEST(notification_waits_for_the_guest_to_accept_it) {
+  simulated_machine machine;
+  auto& ctx = simulated_guest_context();
+
+  static constexpr uint8_t vector = 0x41;
+
+  // exception vectors can't be registered
+  setup_hypercall(hypercall_register_notification_vector);
+  ctx.rcx = 0x10;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+  HV_CHECK_EQ(ctx.rax, 0);
+
+  setup_hypercall(hypercall_register_notification_vector);
+  ctx.rcx = vector;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_VMCALL, 3));
+  HV_CHECK_EQ(ctx.rax, 1);
+  HV_CHECK_EQ(ghv.notification_vector, vector);
+
+  rflags guest_rflags;
+  guest_rflags.flags                 = 0;
+  guest_rflags.read_as_1             = 1;
+  guest_rflags.interrupt_enable_flag = 0;
+  write_simulated_vmcs(VMCS_GUEST_RFLAGS, guest_rflags.flags);
+
+  // interrupts are disabled, so the guest is asked for an interrupt window
+  request_notification(simulated_vcpu());
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK(read_ctrl_proc_based().interrupt_window_exiting);
+
+  guest_rflags.interrupt_enable_flag = 1;
+  write_simulated_vmcs(VMCS_GUEST_RFLAGS, guest_rflags.flags);
+
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_INTERRUPT_WINDOW, 0));
+  HV_CHECK_EQ(injected_vector(), vector);
+  HV_CHECK_EQ(last_injected_event().interruption_type, external_interrupt);
+  HV_CHECK(!read_ctrl_proc_based().interrupt_window_exiting);
+
+  // the TPR masks the vector's priority class. an interrupt window would
+  // open right away, so the notification waits for a MOV to CR8 instead.
+  __writecr8(vector >> 4);
+
+  request_notification(simulated_vcpu());
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_EXECUTE_CPUID, 2));
+  HV_CHECK_EQ(injected_vector(), ~0u);
+  HV_CHECK(!read_ctrl_proc_based().interrupt_window_exiting);
+  HV_CHECK(read_ctrl_proc_based().cr8_load_exiting);
+
+  ctx.rax = (vector >> 4) - 1;
+  HV_CHECK(instruction_exit(VMX_EXIT_REASON_MOV_CR, 4, mov_to_cr_qualification(8)));
+  HV_CHECK_EQ(__readcr8(), (vector >> 4) - 1);
+  HV_CHECK_EQ(injected_vector(), vector);
+  HV_CHECK(!read_ctrl_proc_based().cr8_load_exiting);
+}
@@ -0,0 +1,81 @@
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace hv::test {
+
+struct test {
+  char const* name;
+  test_function function;
+};
+
+// tests are registered by static initializers, so the list can't depend on
+// anything that needs to be constructed itself
+static constexpr size_t max_tests = 256;
+static test tests[max_tests];
+static size_t test_count = 0;
+
+// number of failed checks in the test that is currently running
+static size_t current_failures = 0;
+
+registration::registration(char const* const name, test_function const function) {
+  if (test_count < max_tests)
+    tests[test_count++] = { name, function };
+}
+
+void fail(char const* const file, int const line, char const* const expression) {
+  printf("  %s:%d: check failed: %s\n", file, line, expression);
+  ++current_failures;
+}
+
+void fail_eq(char const* const file, int const line, char const* const expression,
+    uint64_t const actual, uint64_t const expected) {
+  printf("  %s:%d: check failed: %s (0x%llX != 0x%llX)\n", file, line, expression,
+    static_cast<unsigned long long>(actual), static_cast<unsigned long long>(expected));
+  ++current_failures;
+}
+
+static void print_usage(char const* const name) {
+  printf("usage: %s [--filter=<substring>]\n", name);
+}
+
+} // namespace hv::test
+
+using namespace hv::test;
+
+int main(int const argc, char** const argv) {
+  char const* filter = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--filter=", 9) == 0)
+      filter = argv[i] + 9;
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  size_t run = 0, failed = 0;
+
+  for (size_t i = 0; i < test_count; ++i) {
+    auto const& t = tests[i];
+
+    if (filter && !strstr(t.name, filter))
+      continue;
+
+    current_failures = 0;
+    t.function();
+    ++run;
+
+    if (current_failures) {
+      printf("FAIL %s\n", t.name);
+      ++failed;
+    }
+    else
+      printf("ok   %s\n", t.name);
+  }
+
+  printf("%zu/%zu tests passed\n", run - failed, run);
+  return failed ? 1 : 0;
+}
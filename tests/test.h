@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a minimal unit-test harness in the same spirit as bench/bench.h:
+//
+//   HV_TEST(something_works) {
+//     HV_CHECK(something());
+//     HV_CHECK_EQ(something_else(), 42);
+//   }
+//
+// every test is run once, failed checks are reported with their location,
+// and the exit code is 1 if any check failed.
+
+namespace hv::test {
+
+using test_function = void(*)();
+
+// adds a test to the global list (used by HV_TEST)
+struct registration {
+  registration(char const* name, test_function function);
+};
+
+// report a failed check in the current test
+void fail(char const* file, int line, char const* expression);
+
+// report a failed equality check in the current test
+void fail_eq(char const* file, int line, char const* expression,
+  uint64_t actual, uint64_t expected);
+
+} // namespace hv::test
+
+#define HV_TEST(name)                                              \
+  static void name();                                              \
+  static ::hv::test::registration name##_registration(#name, name); \
+  static void name()
+
+#define HV_CHECK(expression)                               \
+  do {                                                     \
+    if (!(expression))                                     \
+      ::hv::test::fail(__FILE__, __LINE__, #expression);   \
+  } while (false)
+
+// both values are compared (and reported) as 64-bit integers
+#define HV_CHECK_EQ(actual, expected)                                      \
+  do {                                                                     \
+    auto const hv_actual_   = static_cast<uint64_t>(actual);               \
+    auto const hv_expected_ = static_cast<uint64_t>(expected);             \
+    if (hv_actual_ != hv_expected_) {                                      \
+      ::hv::test::fail_eq(__FILE__, __LINE__, #actual " == " #expected,    \
+        hv_actual_, hv_expected_);                                         \
+    }                                                                      \
+  } while (false)
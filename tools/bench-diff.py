@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Compare two on-target benchmark reports (see hv/benchmark.h), such as the
+# reports of two different builds on the same machine:
+#
+#   ./bench-diff.py before.csv after.csv
+#   ./bench-diff.py --per-cpu --threshold 5 before.csv after.csv
+#   ./bench-diff.py --absolute --threshold 20 leaks-before.csv leaks-after.csv
+#
+# By default, the results of every processor are combined by taking the median
+# of every column. The exit code is 1 if any p50 or p99 got slower by more
+# than the threshold (in percent). The timing leak residuals (see
+# hv/timing-leaks.h) are close to zero, so they should be compared with
+# --absolute, which reports how much further from zero they moved (and the
+# threshold) in ticks instead.
+#
+
+import argparse
+import csv
+import statistics
+import sys
+
+COLUMNS = ('min', 'p50', 'p90', 'p99', 'max')
+
+
+def read_report(path, per_cpu):
+    rows = {}
+
+    with open(path, newline='') as f:
+        for row in csv.DictReader(f):
+            key = (row['benchmark'], int(row['cpu']) if per_cpu else None)
+            values = {c: int(row[c]) for c in COLUMNS}
+            values['bytes'] = int(row['bytes'])
+            rows.setdefault(key, []).append(values)
+
+    # combine the processors
+    report = {}
+    for key, values in rows.items():
+        combined = {c: statistics.median(v[c] for v in values) for c in COLUMNS}
+        combined['bytes'] = values[0]['bytes']
+        report[key] = combined
+
+    return report
+
+
+def change(old, new, absolute):
+    # residuals leak in either direction
+    if absolute:
+        return abs(new) - abs(old)
+    if old == 0:
+        return 0.0 if new == 0 else float('inf')
+    return (new - old) * 100.0 / old
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare two hv benchmark reports.')
+    parser.add_argument('old', help='baseline report')
+    parser.add_argument('new', help='report to compare against the baseline')
+    parser.add_argument('--per-cpu', action='store_true', help="don't combine the processors")
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='p50/p99 slowdown (in percent) that is reported as a regression')
+    parser.add_argument('--absolute', action='store_true',
+                        help='compare the distance from zero in ticks instead of percent')
+    args = parser.parse_args()
+
+    old = read_report(args.old, args.per_cpu)
+    new = read_report(args.new, args.per_cpu)
+
+    regressions = 0
+
+    unit = '' if args.absolute else '%'
+
+    print(f'{"benchmark":<28} {"p50":>10} {"p50 new":>10} {"delta":>8} '
+          f'{"p99":>10} {"p99 new":>10} {"delta":>8}  throughput (bytes/tick)')
+
+    for key in sorted(old.keys() | new.keys(), key=lambda k: (k[0], k[1] or 0)):
+        name = key[0] if key[1] is None else f'{key[0]}[{key[1]}]'
+
+        if key not in old or key not in new:
+            print(f'{name:<28} only in {"new" if key in new else "old"} report')
+            continue
+
+        o, n = old[key], new[key]
+        p50 = change(o['p50'], n['p50'], args.absolute)
+        p99 = change(o['p99'], n['p99'], args.absolute)
+
+        flag = ''
+        if p50 > args.threshold or p99 > args.threshold:
+            flag = '  REGRESSION'
+            regressions += 1
+
+        throughput = ''
+        if n['bytes'] and o['p50'] and n['p50']:
+            throughput = f'  {o["bytes"] / o["p50"]:.2f} -> {n["bytes"] / n["p50"]:.2f}'
+
+        print(f'{name:<28} {o["p50"]:>10.0f} {n["p50"]:>10.0f} {p50:>+7.1f}{unit} '
+              f'{o["p99"]:>10.0f} {n["p99"]:>10.0f} {p99:>+7.1f}{unit}{throughput}{flag}')
+
+    if regressions:
+        print(f'{regressions} regression(s) above {args.threshold}{unit}', file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
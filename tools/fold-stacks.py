@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Aggregate hv profiler samples (see hv/profiler.h and write_profiler_samples())
+# into folded stacks that can be fed to flamegraph.pl or speedscope:
+#
+#   ./fold-stacks.py samples.bin > samples.folded
+#   ./fold-stacks.py --modules modules.txt --pid 1234 samples.bin
+#
+# modules.txt contains one "<base address> <size> <name>" line per module
+# (addresses in hex) and is used to print addresses as module+offset.
+#
+
+import argparse
+import collections
+import struct
+import sys
+
+# struct profiler_sample
+SAMPLE_FORMAT = '<QQQQBBHI27Q'
+SAMPLE_SIZE = struct.calcsize(SAMPLE_FORMAT)
+
+assert SAMPLE_SIZE == 256
+
+
+def read_samples(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if len(data) % SAMPLE_SIZE:
+        print(f'warning: ignoring {len(data) % SAMPLE_SIZE} trailing bytes', file=sys.stderr)
+
+    for offset in range(0, len(data) - SAMPLE_SIZE + 1, SAMPLE_SIZE):
+        fields = struct.unpack_from(SAMPLE_FORMAT, data, offset)
+        tsc, rip, cr3, pid, cpl, frame_count, vcpu, _ = fields[:8]
+        frames = fields[8:8 + frame_count]
+        yield tsc, rip, cr3, pid, cpl, vcpu, frames
+
+
+def read_modules(path):
+    modules = []
+
+    with open(path) as f:
+        for line in f:
+            parts = line.split(maxsplit=2)
+            if len(parts) != 3 or parts[0].startswith('#'):
+                continue
+            modules.append((int(parts[0], 16), int(parts[1], 16), parts[2].strip()))
+
+    return sorted(modules)
+
+
+def symbolize(address, modules):
+    for base, size, name in modules:
+        if base <= address < base + size:
+            return f'{name}+0x{address - base:x}'
+    return f'0x{address:x}'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Fold hv profiler samples.')
+    parser.add_argument('samples', help='file written by write_profiler_samples()')
+    parser.add_argument('--modules', help='module map used for symbolization')
+    parser.add_argument('--pid', type=int, help='only include samples from this process')
+    parser.add_argument('--kernel-only', action='store_true', help='only include CPL0 samples')
+    parser.add_argument('--no-pid', action='store_true', help="don't prefix stacks with the PID")
+    args = parser.parse_args()
+
+    modules = read_modules(args.modules) if args.modules else []
+    stacks = collections.Counter()
+    total = 0
+
+    for tsc, rip, cr3, pid, cpl, vcpu, frames in read_samples(args.samples):
+        if args.pid is not None and pid != args.pid:
+            continue
+        if args.kernel_only and cpl != 0:
+            continue
+
+        # folded stacks are outermost first
+        names = [symbolize(a, modules) for a in reversed(frames)]
+        names.append(symbolize(rip, modules))
+
+        if not args.no_pid:
+            names.insert(0, f'pid {pid}')
+
+        stacks[';'.join(names)] += 1
+        total += 1
+
+    for stack, count in sorted(stacks.items()):
+        print(f'{stack} {count}')
+
+    print(f'{total} samples, {len(stacks)} unique stacks', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()